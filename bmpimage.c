@@ -260,6 +260,7 @@ bmp_include_image (pdf_ximage *ximage, FILE *fp)
     }
 
     if (flip) {
+      pdf_stream_reserve(stream, rowbytes*info.height);
       for (n = info.height - 1; n >= 0; n--) {
         p = stream_data_ptr + n * rowbytes;
         pdf_add_stream(stream, p, rowbytes);
@@ -37,6 +37,17 @@
 #include <io.h>
 #endif
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define DVI_USE_MMAP 1
+#endif
+
+/* Pages are interpreted ahead in worker threads only from a mapped file. */
+#if defined(HAVE_PTHREAD_H) && defined(DVI_USE_MMAP)
+#include <pthread.h>
+#define DVI_USE_THREADS 1
+#endif
+
 #include "system.h"
 #include "mem.h"
 #include "error.h"
@@ -227,21 +238,35 @@ static double phantom_depth  = 0.0;
 
 #define DVI_PAGE_BUF_CHUNK              0x10000U        /* 64K should be plenty for most pages */
 
-static unsigned char* dvi_page_buffer;
+/* A seekable DVI file is mapped as a whole and dvi_page_buffer points
+ * into the mapping at the start of the current page, so that pages are
+ * decoded in place. Otherwise, e.g. for a pipe from xetex, each page is
+ * read into dvi_page_store during the pre-scan.
+ */
+static const unsigned char *dvi_map = NULL;
+
+static const unsigned char* dvi_page_buffer;
+static unsigned char* dvi_page_store;
 static unsigned int   dvi_page_buf_size;
 static unsigned int   dvi_page_buf_index;
+static int            buffered_page = -1; /* page in dvi_page_buffer */
 
 /* functions to read numbers from the dvi file and store them in dvi_page_buffer */
 static int get_and_buffer_unsigned_byte (FILE *file)
 {
   int ch;
+  if (dvi_map) {
+    if (dvi_page_buf_index >= dvi_page_buf_size)
+      ERROR ("File ended prematurely\n");
+    return dvi_page_buffer[dvi_page_buf_index++];
+  }
   if ((ch = fgetc (file)) < 0)
     ERROR ("File ended prematurely\n");
   if (dvi_page_buf_index >= dvi_page_buf_size) {
     dvi_page_buf_size += DVI_PAGE_BUF_CHUNK;
-    dvi_page_buffer = RENEW(dvi_page_buffer, dvi_page_buf_size, unsigned char);
+    dvi_page_buffer = dvi_page_store = RENEW(dvi_page_store, dvi_page_buf_size, unsigned char);
   }
-  dvi_page_buffer[dvi_page_buf_index++] = ch;
+  dvi_page_store[dvi_page_buf_index++] = ch;
   return ch;
 }
 
@@ -254,11 +279,17 @@ static unsigned int get_and_buffer_unsigned_pair (FILE *file)
 
 static void get_and_buffer_bytes(FILE *file, unsigned int count)
 {
+  if (dvi_map) {
+    if (count > dvi_page_buf_size - dvi_page_buf_index)
+      ERROR ("File ended prematurely\n");
+    dvi_page_buf_index += count;
+    return;
+  }
   if (dvi_page_buf_index + count >= dvi_page_buf_size) {
     dvi_page_buf_size = dvi_page_buf_index + count + DVI_PAGE_BUF_CHUNK;
-    dvi_page_buffer = RENEW(dvi_page_buffer, dvi_page_buf_size, unsigned char);
+    dvi_page_buffer = dvi_page_store = RENEW(dvi_page_store, dvi_page_buf_size, unsigned char);
   }
-  if (fread(dvi_page_buffer + dvi_page_buf_index, 1, count, file) != count)
+  if (fread(dvi_page_store + dvi_page_buf_index, 1, count, file) != count)
     ERROR ("File ended prematurely\n");
   dvi_page_buf_index += count;
 }
@@ -957,6 +988,287 @@ set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
   pdf_dev_set_rule(xpos, ypos, width, height);
 }
 
+/* The specials of a mapped file are indexed once by dvi_init(): where
+ * each one is, which special module takes it, and whether
+ * dvi_scan_specials() has to look at it.  The pre-scan then reads only
+ * those specials and do_xxx() passes the module on to spc_exec_special().
+ * The pre-scan test is a plain keyword match and errs on the side of
+ * scanning; a page that does not parse cleanly is not indexed and goes
+ * through the opcode walk of dvi_scan_specials() as before.
+ */
+#define PAGE_SIZE_SPECIALS  (1 << 0) /* papersize, pdf:pagesize, landscape, dvipdfmx:config */
+#define PAGE_DOC_SPECIALS   (1 << 1) /* pdf:majorversion, pdf:encrypt, pdf:trailerid, ... */
+#define PAGE_NOT_INDEXED    (1 << 2)
+
+#define SPECIALS_ALLOC_SIZE 1024u
+
+struct dvi_special
+{
+  uint32_t      pos;  /* offset of the special's text in the file */
+  uint32_t      size;
+  int           kind; /* spc_classify_special() */
+  int           scan; /* PAGE_SIZE_SPECIALS and PAGE_DOC_SPECIALS */
+};
+
+static struct
+{
+  struct dvi_special *specials;
+  unsigned int        count, max;
+  unsigned int       *first;  /* first special of each page, num_pages + 1 entries */
+  unsigned char      *flags;  /* PAGE_... of each page */
+  unsigned int        cursor; /* next special of the page being processed */
+  unsigned int        end;
+} special_index = {NULL, 0, 0, NULL, NULL, 0, 0};
+
+static int
+special_has_keyword (const unsigned char *p, uint32_t size, const char *keyword)
+{
+  size_t len = strlen(keyword);
+  const unsigned char *endptr = p + size;
+
+  while ((size_t) (endptr - p) >= len) {
+    p = memchr(p, keyword[0], endptr - p - len + 1);
+    if (!p)
+      break;
+    if (!memcmp(p, keyword, len))
+      return 1;
+    p++;
+  }
+
+  return 0;
+}
+
+static int
+classify_prescan_special (const unsigned char *p, uint32_t size)
+{
+  static const char *size_keys[] = {
+    "papersize", "pagesize", "landscape", "config", NULL
+  };
+  static const char *doc_keys[] = {
+    "version", "encrypt", "trailerid", NULL
+  };
+  int i, flags = 0;
+
+  for (i = 0; size_keys[i]; i++) {
+    if (special_has_keyword(p, size, size_keys[i])) {
+      flags |= PAGE_SIZE_SPECIALS;
+      break;
+    }
+  }
+  for (i = 0; doc_keys[i]; i++) {
+    if (special_has_keyword(p, size, doc_keys[i])) {
+      flags |= PAGE_DOC_SPECIALS;
+      break;
+    }
+  }
+
+  return flags;
+}
+
+static int
+add_special (const unsigned char *p, uint32_t size)
+{
+  struct dvi_special *sp;
+
+  if (special_index.count >= special_index.max) {
+    special_index.max += SPECIALS_ALLOC_SIZE;
+    special_index.specials = RENEW(special_index.specials, special_index.max, struct dvi_special);
+  }
+  sp = &special_index.specials[special_index.count++];
+  sp->pos  = (uint32_t) (p - dvi_map);
+  sp->size = size;
+  sp->kind = spc_classify_special((const char *) p, size);
+  sp->scan = classify_prescan_special(p, size);
+
+  return sp->scan;
+}
+
+/* Same opcode walk as dvi_scan_specials(), operands are only skipped. */
+static int
+index_page_specials (const unsigned char *p, const unsigned char *endptr)
+{
+  int flags = 0;
+
+#define PAGE_HAS(n) ((uint32_t) (endptr - p) >= (uint32_t) (n))
+  for (;;) {
+    unsigned char opcode;
+    uint32_t      size, len;
+    int           n;
+
+    if (!PAGE_HAS(1))
+      return PAGE_NOT_INDEXED;
+    opcode = *p++;
+    if (opcode <= SET_CHAR_127 ||
+        (opcode >= FNT_NUM_0 && opcode <= FNT_NUM_63))
+      continue;
+
+    switch (opcode) {
+    case EOP:
+      return flags;
+    case BOP:
+      size = 44;
+      break;
+    case NOP: case PUSH: case POP:
+    case W0: case X0: case Y0: case Z0:
+      size = 0;
+      break;
+    case SET1: case PUT1: case RIGHT1:  case DOWN1:
+    case W1: case X1: case Y1: case Z1: case FNT1:
+      size = 1;
+      break;
+    case SET2: case PUT2: case RIGHT2: case DOWN2:
+    case W2: case X2: case Y2: case Z2: case FNT2:
+      size = 2;
+      break;
+    case SET3: case PUT3: case RIGHT3: case DOWN3:
+    case W3: case X3: case Y3: case Z3: case FNT3:
+      size = 3;
+      break;
+    case SET4: case PUT4: case RIGHT4: case DOWN4:
+    case W4: case X4: case Y4: case Z4: case FNT4:
+      size = 4;
+      break;
+    case SET_RULE: case PUT_RULE:
+      size = 8;
+      break;
+    case XXX1: case XXX2: case XXX3: case XXX4:
+      n = opcode - XXX1 + 1;
+      if (!PAGE_HAS(n))
+        return PAGE_NOT_INDEXED;
+      for (size = 0; n > 0; n--)
+        size = size * 0x100u + *p++;
+      if (!PAGE_HAS(size))
+        return PAGE_NOT_INDEXED;
+      flags |= add_special(p, size);
+      break;
+    case FNT_DEF1: case FNT_DEF2: case FNT_DEF3: case FNT_DEF4:
+      n = opcode - FNT_DEF1 + 1 + 12;
+      if (!PAGE_HAS(n + 2))
+        return PAGE_NOT_INDEXED;
+      size = p[n] + p[n + 1];
+      p   += n + 2;
+      break;
+    case XDV_GLYPHS:
+      if (dpx_conf.compat_mode != dpx_mode_xdv_mode || !PAGE_HAS(6))
+        return PAGE_NOT_INDEXED;
+      size = ((p[4] << 8) | p[5]) * 10;
+      p   += 6;
+      break;
+    case XDV_TEXT_AND_GLYPHS:
+      if (dpx_conf.compat_mode != dpx_mode_xdv_mode || !PAGE_HAS(2))
+        return PAGE_NOT_INDEXED;
+      len = ((p[0] << 8) | p[1]) * 2;
+      p  += 2;
+      if (!PAGE_HAS(len + 6))
+        return PAGE_NOT_INDEXED;
+      p   += len;
+      size = ((p[4] << 8) | p[5]) * 10;
+      p   += 6;
+      break;
+    case XDV_NATIVE_FONT_DEF:
+      if (dpx_conf.compat_mode != dpx_mode_xdv_mode || !PAGE_HAS(11))
+        return PAGE_NOT_INDEXED;
+      len  = (p[8] << 8) | p[9];
+      size = p[10] + 4;
+      if (len & XDV_FLAG_COLORED)
+        size += 4;
+      if (len & XDV_FLAG_EXTEND)
+        size += 4;
+      if (len & XDV_FLAG_SLANT)
+        size += 4;
+      if (len & XDV_FLAG_EMBOLDEN)
+        size += 4;
+      p   += 11;
+      break;
+    case BEGIN_REFLECT:
+    case END_REFLECT:
+      if (dpx_conf.compat_mode != dpx_mode_xdv_mode)
+        return PAGE_NOT_INDEXED;
+      size = 0;
+      break;
+    case PTEXDIR:
+      if (!is_ptex)
+        return PAGE_NOT_INDEXED;
+      size = 1;
+      break;
+    default:
+      /* Let dvi_scan_specials() report it */
+      return PAGE_NOT_INDEXED;
+    }
+    if (!PAGE_HAS(size))
+      return PAGE_NOT_INDEXED;
+    p += size;
+  }
+#undef PAGE_HAS
+}
+
+static void
+index_specials (void)
+{
+  unsigned int i;
+
+  special_index.first = NEW(num_pages + 1, unsigned int);
+  special_index.flags = NEW(num_pages, unsigned char);
+  for (i = 0; i < num_pages; i++) {
+    special_index.first[i] = special_index.count;
+    if (page_loc[i] < 0 || (uint32_t) page_loc[i] >= dvi_file_size)
+      special_index.flags[i] = PAGE_NOT_INDEXED;
+    else
+      special_index.flags[i] = index_page_specials(dvi_map + page_loc[i],
+                                                   dvi_map + dvi_file_size);
+    if (special_index.flags[i] & PAGE_NOT_INDEXED)
+      special_index.count = special_index.first[i];
+  }
+  special_index.first[num_pages] = special_index.count;
+}
+
+static void
+release_special_index (void)
+{
+  if (special_index.specials)
+    RELEASE(special_index.specials);
+  if (special_index.first)
+    RELEASE(special_index.first);
+  if (special_index.flags)
+    RELEASE(special_index.flags);
+  special_index.specials = NULL;
+  special_index.first    = NULL;
+  special_index.flags    = NULL;
+  special_index.count    = special_index.max = 0;
+  special_index.cursor   = special_index.end = 0;
+}
+
+/* Start handing out the indexed specials of page_no to do_xxx() */
+static void
+begin_page_specials (int page_no)
+{
+  special_index.cursor = special_index.end = 0;
+  if (special_index.flags && !(special_index.flags[page_no] & PAGE_NOT_INDEXED)) {
+    special_index.cursor = special_index.first[page_no];
+    special_index.end    = special_index.first[page_no + 1];
+  }
+}
+
+/* Module of a special in the page being processed.  Specials met out of
+ * order, as in reflected segments, are classified again.
+ */
+static int
+page_special_kind (const unsigned char *p, int32_t size)
+{
+  if (special_index.cursor < special_index.end) {
+    uint32_t pos = (uint32_t) (p - dvi_map);
+
+    while (special_index.cursor < special_index.end &&
+           special_index.specials[special_index.cursor].pos < pos)
+      special_index.cursor++;
+    if (special_index.cursor < special_index.end &&
+        special_index.specials[special_index.cursor].pos == pos)
+      return special_index.specials[special_index.cursor++].kind;
+  }
+
+  return spc_classify_special((const char *) p, size);
+}
+
 static void
 calc_rect (pdf_rect *r, spt_t xpos, spt_t ypos, spt_t width, spt_t height, spt_t depth)
 {
@@ -965,8 +1277,8 @@ calc_rect (pdf_rect *r, spt_t xpos, spt_t ypos, spt_t width, spt_t height, spt_t
   pdf_dev_set_rect(r, xpos, ypos, width, height, depth);
 }
 
-void
-dvi_do_special (const void *buffer, int32_t size)
+static void
+do_special (const void *buffer, int32_t size, int kind)
 {
   double      x_user, y_user, mag;
   const char *p;
@@ -981,7 +1293,7 @@ dvi_do_special (const void *buffer, int32_t size)
   y_user = -dvi_state.v * dvi2pts;
   mag    =  dvi_tell_mag();
 
-  if (spc_exec_special(p, size, x_user, y_user, mag, &is_drawable, &rect) < 0) {
+  if (spc_exec_special(p, size, kind, x_user, y_user, mag, &is_drawable, &rect) < 0) {
     if (dpx_conf.verbose_level > 0) {
       dump(p, p + size);
     }
@@ -995,6 +1307,12 @@ dvi_do_special (const void *buffer, int32_t size)
   return;
 }
 
+void
+dvi_do_special (const void *buffer, int32_t size)
+{
+  do_special(buffer, size, spc_classify_special(buffer, size));
+}
+
 double
 dvi_unit_size (void)
 {
@@ -1416,6 +1734,44 @@ void dvi_down (int32_t y)
   }
 }
 
+/* Puts the bytes of the character code ch for a physical font at the
+ * end of wbuf, which holds font->padbytes, and returns their number.
+ */
+static int
+encode_char (struct loaded_font *font, int32_t ch, unsigned char *wbuf)
+{
+  int  n;
+
+  if (ch > 65535) {
+    /* FIXME: uptex specific undocumented */
+    if (!font->is_unicode && tfm_is_jfm(font->tfm_id)) {
+      wbuf[0] = (UTF32toUTF16HS(ch) >> 8) & 0xff;
+      wbuf[1] =  UTF32toUTF16HS(ch)       & 0xff;
+      wbuf[2] = (UTF32toUTF16LS(ch) >> 8) & 0xff;
+      wbuf[3] =  UTF32toUTF16LS(ch)       & 0xff;
+    } else {
+      wbuf[0] = (ch >> 24) & 0xff;
+      wbuf[1] = (ch >> 16) & 0xff;
+      wbuf[2] = (ch >>  8) & 0xff;
+      wbuf[3] =  ch        & 0xff;
+    }
+    n = 4;
+  } else if (ch > 255) {
+    wbuf[2] = (ch >> 8) & 0xff;
+    wbuf[3] =  ch       & 0xff;
+    n = 2;
+  } else if (font->subfont_id >= 0) {
+    uint16_t uch = lookup_sfd_record(font->subfont_id, (unsigned char) ch);
+    wbuf[2] = (uch >> 8) & 0xff;
+    wbuf[3] =  uch       & 0xff;
+    n = 2;
+  } else {
+    wbuf[3] = (unsigned char) ch;
+    n = 1;
+  }
+  return font->minbytes > n ? font->minbytes : n;
+}
+
 /* _FIXME_
  * CMap decoder wants multibyte strings as input but
  * how DVI char codes are converted to multibyte sting
@@ -1427,7 +1783,7 @@ dvi_set (int32_t ch)
   struct loaded_font *font;
   spt_t               width, height, depth;
   unsigned char       wbuf[4];
-  int                 n, cbytes;
+  int                 cbytes;
 
   if (current_font < 0) {
     ERROR("No font selected!");
@@ -1464,34 +1820,7 @@ dvi_set (int32_t ch)
   memcpy(wbuf, font->padbytes, 4);
   switch (font->type) {
   case  PHYSICAL:
-    if (ch > 65535) {
-      /* FIXME: uptex specific undocumented */
-      if (!font->is_unicode && tfm_is_jfm(font->tfm_id)) {
-        wbuf[0] = (UTF32toUTF16HS(ch) >> 8) & 0xff;
-        wbuf[1] =  UTF32toUTF16HS(ch)       & 0xff;
-        wbuf[2] = (UTF32toUTF16LS(ch) >> 8) & 0xff;
-        wbuf[3] =  UTF32toUTF16LS(ch)       & 0xff;
-      } else {
-        wbuf[0] = (ch >> 24) & 0xff;
-        wbuf[1] = (ch >> 16) & 0xff;
-        wbuf[2] = (ch >>  8) & 0xff;
-        wbuf[3] =  ch        & 0xff;
-      }
-      n = 4;
-    } else if (ch > 255) {
-      wbuf[2] = (ch >> 8) & 0xff;
-      wbuf[3] =  ch       & 0xff;
-      n = 2;
-    } else if (font->subfont_id >= 0) {
-      uint16_t uch = lookup_sfd_record(font->subfont_id, (unsigned char) ch);
-      wbuf[2] = (uch >> 8) & 0xff;
-      wbuf[3] =  uch       & 0xff;
-      n = 2;
-    } else {
-      wbuf[3] = (unsigned char) ch;
-      n = 1;
-    }
-    cbytes = font->minbytes > n ? font->minbytes : n;
+    cbytes = encode_char(font, ch, wbuf);
     set_string(dvi_state.h, -dvi_state.v, wbuf + 4 - cbytes, cbytes, width, font->font_id);
     if (dvi_is_tracking_boxes()) {
       pdf_rect rect;
@@ -1533,13 +1862,54 @@ dvi_set (int32_t ch)
 
 }
 
+/* A run of SET_CHAR_0..127 in a one-byte physical font is handed to
+ * the device at once; see pdf_dev_set_string_run().  Anything else is
+ * left to dvi_set().
+ */
+#define DVI_SET_RUN_MAX 256
+
+static void
+do_set_char_run (unsigned char ch)
+{
+  struct loaded_font *font;
+  unsigned char       run[DVI_SET_RUN_MAX];
+  spt_t               widths[DVI_SET_RUN_MAX], width;
+  int                 len = 0;
+
+  if (current_font < 0 || lr_mode != LTYPESETTING ||
+      dvi_state.d != 0 || dvi_is_tracking_boxes()) {
+    dvi_set(ch);
+    return;
+  }
+  font = &loaded_fonts[current_font];
+  if (font->type != PHYSICAL || font->subfont_id >= 0 || font->minbytes != 1) {
+    dvi_set(ch);
+    return;
+  }
+
+  width = 0;
+  for (;;) {
+    run[len]    = ch;
+    widths[len] = sqxfw(font->size, tfm_get_fw_width(font->tfm_id, ch));
+    width      += widths[len++];
+    if (len == DVI_SET_RUN_MAX ||
+        dvi_page_buf_index >= dvi_page_buf_size ||
+        dvi_page_buffer[dvi_page_buf_index] > SET_CHAR_127)
+      break;
+    ch = dvi_page_buffer[dvi_page_buf_index++];
+  }
+  pdf_dev_set_string_run(dvi_state.h - compensation.x, -dvi_state.v - compensation.y,
+                         run, widths, len, font->font_id);
+  dvi_right(width);
+}
+
 void
 dvi_put (int32_t ch)
 {
   struct loaded_font *font;
   spt_t               width, height, depth;
   unsigned char       wbuf[4];
-  int                 n, cbytes;
+  int                 cbytes;
 
   if (current_font < 0) {
     ERROR("No font selected!");
@@ -1555,34 +1925,7 @@ dvi_put (int32_t ch)
     /* Treat a single character as a one byte string and use the
      * string routine.
      */    
-    if (ch > 65535) {
-      /* FIXME: uptex specific undocumented */
-      if (!font->is_unicode && tfm_is_jfm(font->tfm_id)) {
-        wbuf[0] = (UTF32toUTF16HS(ch) >> 8) & 0xff;
-        wbuf[1] =  UTF32toUTF16HS(ch)       & 0xff;
-        wbuf[2] = (UTF32toUTF16LS(ch) >> 8) & 0xff;
-        wbuf[3] =  UTF32toUTF16LS(ch)       & 0xff;
-      } else {
-        wbuf[0] = (ch >> 24) & 0xff;
-        wbuf[1] = (ch >> 16) & 0xff;
-        wbuf[2] = (ch >>  8) & 0xff;
-        wbuf[3] =  ch        & 0xff;
-      }
-      n = 4;
-    } else if (ch > 255) {
-      wbuf[2] = (ch >> 8) & 0xff;
-      wbuf[3] =  ch       & 0xff;
-      n = 2;
-    } else if (font->subfont_id >= 0) {
-      uint16_t uch = lookup_sfd_record(font->subfont_id, (unsigned char) ch);
-      wbuf[2] = (uch >> 8) & 0xff;
-      wbuf[3] =  uch       & 0xff;
-      n = 2;
-    } else {
-      wbuf[3] = (unsigned char) ch;
-      n = 1;
-    }
-    cbytes = font->minbytes > n ? font->minbytes : n;
+    cbytes = encode_char(font, ch, wbuf);
     set_string(dvi_state.h, -dvi_state.v, wbuf + 4 - cbytes, cbytes, width, font->font_id);
     if (dvi_is_tracking_boxes()) {
       pdf_rect rect;
@@ -1778,6 +2121,18 @@ do_fntdef (int32_t tex_id)
   --dvi_page_buf_index;
 }
 
+/* fntdefs stay in a mapped page; skip one, opcode already read */
+static void
+skip_buffered_fntdef (unsigned char opcode)
+{
+  unsigned int len;
+
+  get_and_buffer_bytes(NULL, opcode - FNT_DEF1 + 1 + 12);
+  len  = get_and_buffer_unsigned_byte(NULL);
+  len += get_and_buffer_unsigned_byte(NULL);
+  get_and_buffer_bytes(NULL, len);
+}
+
 void
 dvi_set_font (int font_id)
 {
@@ -1839,8 +2194,11 @@ do_fnt (int32_t tex_id)
 static void
 do_xxx (int32_t size) 
 {
+  const unsigned char *p = dvi_page_buffer + dvi_page_buf_index;
+
   if (lr_mode < SKIMMING)
-    dvi_do_special(dvi_page_buffer + dvi_page_buf_index, size);
+    do_special(p, size, dvi_map ? page_special_kind(p, size)
+                                : spc_classify_special((const char *) p, size));
   dvi_page_buf_index += size;
 }
 
@@ -1979,6 +2337,26 @@ do_native_font_def (int32_t tex_id)
   --dvi_page_buf_index; /* don't buffer the opcode */
 }
 
+static void
+skip_buffered_native_font_def (void)
+{
+  unsigned int flags, len;
+
+  get_and_buffer_bytes(NULL, 4 + 4); /* skip font id and point size */
+  flags = get_and_buffer_unsigned_pair(NULL);
+  len   = get_and_buffer_unsigned_byte(NULL);
+  get_and_buffer_bytes(NULL, len + 4);
+
+  if (flags & XDV_FLAG_COLORED)
+    get_and_buffer_bytes(NULL, 4);
+  if (flags & XDV_FLAG_EXTEND)
+    get_and_buffer_bytes(NULL, 4);
+  if (flags & XDV_FLAG_SLANT)
+    get_and_buffer_bytes(NULL, 4);
+  if (flags & XDV_FLAG_EMBOLDEN)
+    get_and_buffer_bytes(NULL, 4);
+}
+
 static void
 skip_glyphs (void)
 {
@@ -2140,6 +2518,368 @@ check_postamble (void)
   num_pages = 0; /* force loop to terminate */
 }
 
+/*
+ * Pages interpreted ahead in worker threads.
+ *
+ * dvi_prepare_pages() interprets the pages that are to be processed
+ * next, each with a device of its own (see pdf_dev_page_new()). A page
+ * may only set characters in fonts already used on earlier pages, draw
+ * rules and move around; anything else, specials in particular, makes
+ * the worker give up on the page. dvi_do_page() then runs do_bop() as
+ * usual and adds the page the worker has drawn to the document, or
+ * interprets the page itself if the worker gave up or if some state the
+ * worker assumed has been changed by the begin-page hooks.
+ */
+#if defined(DVI_USE_THREADS)
+struct dvi_job
+{
+  int                  page_no;
+  const unsigned char *cur, *end;
+  struct dvi_registers state;
+  struct dvi_registers stack[DVI_STACK_DEPTH_MAX];
+  unsigned             stack_depth;
+  int                  font;
+  int                  marked;   /* push or pop seen */
+  struct spt_coord     compensation;
+  pdf_dev             *dev;
+};
+
+static struct dvi_job *prepared_pages = NULL;
+static int num_prepared_pages = 0, next_prepared_page = 0;
+static int next_job = 0;
+
+#define JOB_HAS(j,n) ((size_t) ((j)->end - (j)->cur) >= (size_t) (n))
+
+static int32_t
+job_get_num (struct dvi_job *job, int n, int is_signed)
+{
+  uint32_t quad = 0, sign = 1u << (8 * n - 1);
+  int      i;
+
+  for (i = 0; i < n; i++)
+    quad = (quad << 8) | *job->cur++;
+  /* Four-byte values are always signed */
+  if ((is_signed || n == 4) && (quad & sign))
+    return -(int32_t) (~quad & (sign - 1)) - 1;
+
+  return (int32_t) quad;
+}
+
+static int
+job_set (struct dvi_job *job, int32_t ch, int move)
+{
+  struct loaded_font *font;
+  spt_t               width;
+  unsigned char       wbuf[4];
+  int                 cbytes;
+
+  if (job->font < 0 || loaded_fonts[job->font].type != PHYSICAL)
+    return -1;
+  font  = &loaded_fonts[job->font];
+  /* Errors can only be raised by the main thread: an invalid char is
+   * left to it, to be reported when the page is interpreted again.
+   */
+  if (!tfm_has_char(font->tfm_id, ch) ||
+      (ch <= 255 && font->subfont_id >= 0 &&
+       !sfd_has_record(font->subfont_id)))
+    return -1;
+  width = tfm_get_fw_width(font->tfm_id, ch);
+  width = sqxfw(font->size, width);
+
+  memcpy(wbuf, font->padbytes, 4);
+  cbytes = encode_char(font, ch, wbuf);
+  pdf_dev_page_set_string(job->dev,
+                          job->state.h - job->compensation.x,
+                          -job->state.v - job->compensation.y,
+                          wbuf + 4 - cbytes, cbytes, width, font->font_id);
+  if (move)
+    job->state.h += width;
+
+  return pdf_dev_page_failed(job->dev) ? -1 : 0;
+}
+
+static int
+job_rule (struct dvi_job *job, int move)
+{
+  int32_t width, height;
+
+  height = job_get_num(job, 4, 1);
+  width  = job_get_num(job, 4, 1);
+  if (width > 0 && height > 0)
+    pdf_dev_page_set_rule(job->dev,
+                          job->state.h - job->compensation.x,
+                          -job->state.v - job->compensation.y,
+                          width, height);
+  if (move)
+    job->state.h += width;
+
+  return pdf_dev_page_failed(job->dev) ? -1 : 0;
+}
+
+static int
+job_fnt (struct dvi_job *job, int32_t tex_id)
+{
+  int  i;
+
+  for (i = 0; i < num_def_fonts; i++) {
+    if (def_fonts[i].tex_id == tex_id)
+      break;
+  }
+  if (i == num_def_fonts || !def_fonts[i].used)
+    return -1;
+  job->font = def_fonts[i].font_id;
+
+  return 0;
+}
+
+static int
+interpret_page (struct dvi_job *job)
+{
+  unsigned char opcode;
+  int           n;
+
+  if (!JOB_HAS(job, 45) || *job->cur != BOP)
+    return -1;
+  job->cur += 45;
+
+  for (;;) {
+    if (!JOB_HAS(job, 1))
+      return -1;
+    opcode = *job->cur++;
+
+    if (opcode <= SET_CHAR_127) {
+      if (job_set(job, opcode, 1) < 0)
+        return -1;
+      continue;
+    }
+    if (opcode >= FNT_NUM_0 && opcode <= FNT_NUM_63) {
+      if (job_fnt(job, opcode - FNT_NUM_0) < 0)
+        return -1;
+      continue;
+    }
+
+    switch (opcode) {
+    case SET1: case SET2: case SET3:
+      n = opcode - SET1 + 1;
+      if (!JOB_HAS(job, n) || job_set(job, job_get_num(job, n, 0), 1) < 0)
+        return -1;
+      break;
+    case PUT1: case PUT2: case PUT3:
+      n = opcode - PUT1 + 1;
+      if (!JOB_HAS(job, n) || job_set(job, job_get_num(job, n, 0), 0) < 0)
+        return -1;
+      break;
+    case SET_RULE: case PUT_RULE:
+      if (!JOB_HAS(job, 8) || job_rule(job, opcode == SET_RULE) < 0)
+        return -1;
+      break;
+
+    case NOP:
+      break;
+    case EOP:
+      return job->stack_depth == 0 ? 0 : -1;
+
+    case PUSH:
+      if (job->stack_depth >= DVI_STACK_DEPTH_MAX)
+        return -1;
+      job->stack[job->stack_depth++] = job->state;
+      job->marked = 1;
+      break;
+    case POP:
+      if (job->stack_depth == 0)
+        return -1;
+      job->state = job->stack[--job->stack_depth];
+      pdf_dev_page_set_dirmode(job->dev, job->state.d);
+      job->marked = 1;
+      break;
+
+    case RIGHT1: case RIGHT2: case RIGHT3: case RIGHT4:
+      n = opcode - RIGHT1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.h += job_get_num(job, n, 1);
+      break;
+    case W0: job->state.h += job->state.w; break;
+    case W1: case W2: case W3: case W4:
+      n = opcode - W1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.w  = job_get_num(job, n, 1);
+      job->state.h += job->state.w;
+      break;
+    case X0: job->state.h += job->state.x; break;
+    case X1: case X2: case X3: case X4:
+      n = opcode - X1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.x  = job_get_num(job, n, 1);
+      job->state.h += job->state.x;
+      break;
+    case DOWN1: case DOWN2: case DOWN3: case DOWN4:
+      n = opcode - DOWN1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.v += job_get_num(job, n, 1);
+      break;
+    case Y0: job->state.v += job->state.y; break;
+    case Y1: case Y2: case Y3: case Y4:
+      n = opcode - Y1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.y  = job_get_num(job, n, 1);
+      job->state.v += job->state.y;
+      break;
+    case Z0: job->state.v += job->state.z; break;
+    case Z1: case Z2: case Z3: case Z4:
+      n = opcode - Z1 + 1;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->state.z  = job_get_num(job, n, 1);
+      job->state.v += job->state.z;
+      break;
+
+    case FNT1: case FNT2: case FNT3: case FNT4:
+      n = opcode - FNT1 + 1;
+      if (!JOB_HAS(job, n) || job_fnt(job, job_get_num(job, n, 0)) < 0)
+        return -1;
+      break;
+    case FNT_DEF1: case FNT_DEF2: case FNT_DEF3: case FNT_DEF4:
+      n = opcode - FNT_DEF1 + 1 + 12;
+      if (!JOB_HAS(job, n + 2))
+        return -1;
+      job->cur += n;
+      n = job->cur[0] + job->cur[1] + 2;
+      if (!JOB_HAS(job, n))
+        return -1;
+      job->cur += n;
+      break;
+
+    default:
+      /* Specials, pTeX and XeTeX extensions, and errors */
+      return -1;
+    }
+  }
+}
+
+static void *
+page_worker (void *arg)
+{
+  pthread_mutex_t *mutex = arg;
+  struct dvi_job  *job;
+
+  for (;;) {
+    pthread_mutex_lock(mutex);
+    job = next_job < num_prepared_pages ? &prepared_pages[next_job++] : NULL;
+    pthread_mutex_unlock(mutex);
+    if (!job)
+      break;
+    if (interpret_page(job) < 0) {
+      pdf_dev_page_release(job->dev);
+      job->dev = NULL;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+release_prepared_pages (void)
+{
+  int  i;
+
+  for (i = 0; i < num_prepared_pages; i++)
+    pdf_dev_page_release(prepared_pages[i].dev);
+  if (prepared_pages)
+    RELEASE(prepared_pages);
+  prepared_pages     = NULL;
+  num_prepared_pages = next_prepared_page = 0;
+}
+
+/* The prepared page for page_no if it is the next one and the
+ * worker has drawn it.
+ */
+static struct dvi_job *
+take_prepared_page (int page_no)
+{
+  struct dvi_job *job;
+
+  if (next_prepared_page >= num_prepared_pages)
+    return NULL;
+  job = &prepared_pages[next_prepared_page++];
+  if (job->page_no != page_no) {
+    /* Pages are not processed in the order given. */
+    release_prepared_pages();
+    return NULL;
+  }
+
+  return job->dev ? job : NULL;
+}
+
+/* Called after do_bop(): returns -1 if the page must be interpreted. */
+static int
+finish_prepared_page (struct dvi_job *job)
+{
+  if (lr_mode != LTYPESETTING || compute_boxes || tagged_depth != -1 ||
+      compensation.x != job->compensation.x ||
+      compensation.y != job->compensation.y)
+    return -1;
+  if (pdf_dev_page_finish(job->dev) < 0)
+    return -1;
+
+  dvi_state    = job->state;
+  current_font = job->font;
+  if (job->marked)
+    marked_depth = 0;
+
+  return 0;
+}
+#endif /* DVI_USE_THREADS */
+
+void
+dvi_prepare_pages (const int *page_nos, int count, int num_threads)
+{
+#if defined(DVI_USE_THREADS)
+  pthread_mutex_t  mutex;
+  pthread_t       *threads;
+  int              i, n;
+
+  release_prepared_pages();
+  if (!dvi_map || num_threads < 1 || count < 1)
+    return;
+
+  prepared_pages = NEW(count, struct dvi_job);
+  for (i = 0; i < count; i++) {
+    struct dvi_job *job = &prepared_pages[i];
+
+    memset(job, 0, sizeof(struct dvi_job));
+    job->page_no = page_nos[i];
+    job->font    = -1;
+    job->compensation = compensation;
+    if (page_nos[i] >= 0 && page_nos[i] < num_pages) {
+      job->cur = dvi_map + page_loc[page_nos[i]];
+      job->end = dvi_map + dvi_file_size;
+      job->dev = pdf_dev_page_new();
+    }
+  }
+  num_prepared_pages = count;
+  next_prepared_page = next_job = 0;
+
+  n = MIN(num_threads, count);
+  threads = NEW(n, pthread_t);
+  pthread_mutex_init(&mutex, NULL);
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&threads[i], NULL, page_worker, &mutex))
+      break;
+  }
+  n = i;
+  page_worker(&mutex); /* in case threads could not be created */
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&mutex);
+  RELEASE(threads);
+#endif /* DVI_USE_THREADS */
+}
+
 /* Most of the work of actually interpreting
  * the dvi file is here.
  */
@@ -2147,6 +2887,9 @@ void
 dvi_do_page (double page_paper_height, double hmargin, double vmargin)
 {
   unsigned char opcode;
+#if defined(DVI_USE_THREADS)
+  struct dvi_job *job;
+#endif
 
   /* before this is called, we have scanned the page for papersize specials
      and the complete DVI data is now in dvi_page_buffer */
@@ -2157,11 +2900,24 @@ dvi_do_page (double page_paper_height, double hmargin, double vmargin)
   dev_origin_y = page_paper_height - vmargin;
 
   dvi_stack_depth = 0;
+  if (dvi_map)
+    begin_page_specials(buffered_page);
+#if defined(DVI_USE_THREADS)
+  job = take_prepared_page(buffered_page);
+  if (job) {
+    get_buffered_unsigned_byte(); /* BOP, checked by the worker */
+    do_bop();
+    if (finish_prepared_page(job) == 0) {
+      do_eop();
+      return;
+    }
+  }
+#endif
   for (;;) {
     opcode = get_buffered_unsigned_byte();
 
     if (opcode <= SET_CHAR_127) {
-      dvi_set(opcode);
+      do_set_char_run(opcode);
       continue;
     }
 
@@ -2268,8 +3024,11 @@ dvi_do_page (double page_paper_height, double hmargin, double vmargin)
         break;
       }
 
-      /* These should not occur - processed during pre-scanning */
+      /* These are processed during pre-scanning, and only left in
+         the page data when it is mapped */
     case FNT_DEF1: case FNT_DEF2: case FNT_DEF3: case FNT_DEF4:
+      if (dvi_map)
+        skip_buffered_fntdef(opcode);
       break;
 
       /* pTeX extension */
@@ -2287,9 +3046,11 @@ dvi_do_page (double page_paper_height, double hmargin, double vmargin)
       need_XeTeX(opcode);
       do_glyphs(1);
       break;
-    /* should not occur - processed during pre-scanning */
+    /* processed during pre-scanning, as FNT_DEF */
     case XDV_NATIVE_FONT_DEF:
       need_XeTeX(opcode);
+      if (dvi_map)
+        skip_buffered_native_font_def();
       break;
     case BEGIN_REFLECT:
       need_XeTeX(opcode);
@@ -2369,11 +3130,24 @@ dvi_init (char *dvi_filename, double mag)
     get_page_info(post_location);
     get_comment();
     get_dvi_fonts(post_location);
+
+#if defined(DVI_USE_MMAP)
+    {
+      void *map = mmap(NULL, dvi_file_size, PROT_READ, MAP_PRIVATE,
+                       fileno(dvi_file), 0);
+      if (map != MAP_FAILED)
+        dvi_map = map;
+    }
+#endif
+    if (dvi_map && num_pages > 0)
+      index_specials();
   }
   clear_state();
 
-  dvi_page_buf_size = DVI_PAGE_BUF_CHUNK;
-  dvi_page_buffer = NEW(dvi_page_buf_size, unsigned char);
+  if (!dvi_map) {
+    dvi_page_buf_size = DVI_PAGE_BUF_CHUNK;
+    dvi_page_buffer = dvi_page_store = NEW(dvi_page_buf_size, unsigned char);
+  }
 
   return dvi2pts;
 }
@@ -2411,6 +3185,7 @@ dvi_close (void)
   if (page_loc)
     RELEASE(page_loc);
   page_loc  = NULL;
+  release_special_index();
   num_pages = 0;
 
   for (i = 0; i < num_loaded_fonts; i++)
@@ -2426,14 +3201,22 @@ dvi_close (void)
   loaded_fonts     = NULL;
   num_loaded_fonts = 0;
 
+#if defined(DVI_USE_THREADS)
+  release_prepared_pages();
+#endif
   vf_close_all_fonts();
   tfm_close_all ();
   
-  if (dvi_page_buffer) {
-    RELEASE(dvi_page_buffer);
-    dvi_page_buffer = NULL;
-    dvi_page_buf_size = 0;
-  }
+  if (dvi_page_store)
+    RELEASE(dvi_page_store);
+  dvi_page_store = NULL;
+#if defined(DVI_USE_MMAP)
+  if (dvi_map)
+    munmap((void *) dvi_map, dvi_file_size);
+#endif
+  dvi_map = NULL;
+  dvi_page_buffer = NULL;
+  dvi_page_buf_size = 0;
 }
 
 /* The following are need to implement virtual fonts
@@ -2745,7 +3528,6 @@ dvi_scan_specials (int page_no,
   FILE          *fp = dvi_file;
   int32_t        offset;
   unsigned char  opcode;
-  static int     buffered_page = -1;
   unsigned int len;
 
   if (page_no == buffered_page || num_pages == 0)
@@ -2759,7 +3541,37 @@ dvi_scan_specials (int page_no,
       ERROR("Invalid page number: %u", page_no);
     offset = page_loc[page_no];
 
-    xseek_absolute (fp, offset, "DVI");
+    if (dvi_map) {
+      int need = PAGE_SIZE_SPECIALS;
+
+      if (offset < 0 || (uint32_t) offset >= dvi_file_size)
+        ERROR("Invalid page location for page %u", page_no);
+      dvi_page_buffer   = dvi_map + offset;
+      dvi_page_buf_size = dvi_file_size - offset;
+      if (majorversion || minorversion || do_enc || has_id)
+        need |= PAGE_DOC_SPECIALS;
+      if (special_index.flags && !(special_index.flags[page_no] & PAGE_NOT_INDEXED)) {
+        unsigned int i;
+
+        if (!(special_index.flags[page_no] & need))
+          return; /* nothing here for scan_special() */
+        for (i = special_index.first[page_no]; i < special_index.first[page_no + 1]; i++) {
+          const struct dvi_special *sp = &special_index.specials[i];
+          const char *buf = (const char *) dvi_map + sp->pos;
+
+          if (!(sp->scan & need))
+            continue;
+          if (scan_special(page_width, page_height, x_offset, y_offset, landscape,
+                           majorversion, minorversion,
+                           do_enc, key_bits, permission, owner_pw, user_pw,
+                           has_id, id1, id2,
+                           buf, sp->size))
+            WARN("Reading special command failed: \"%.*s\"", sp->size, buf);
+        }
+        return;
+      }
+    } else
+      xseek_absolute (fp, offset, "DVI");
   }
   
   while ((opcode = get_and_buffer_unsigned_byte(fp)) != EOP) {
@@ -2777,13 +3589,18 @@ dvi_scan_specials (int page_no,
       case XXX2: size = size * 0x100u + get_and_buffer_unsigned_byte(fp);
       default: break;
       }
-      if (dvi_page_buf_index + size >= dvi_page_buf_size) {
-        dvi_page_buf_size = (dvi_page_buf_index + size + DVI_PAGE_BUF_CHUNK);
-        dvi_page_buffer = RENEW(dvi_page_buffer, dvi_page_buf_size, unsigned char);
+      if (dvi_map) {
+        if (size > dvi_page_buf_size - dvi_page_buf_index)
+          ERROR("Reading DVI file failed!");
+      } else {
+        if (dvi_page_buf_index + size >= dvi_page_buf_size) {
+          dvi_page_buf_size = (dvi_page_buf_index + size + DVI_PAGE_BUF_CHUNK);
+          dvi_page_buffer = dvi_page_store = RENEW(dvi_page_store, dvi_page_buf_size, unsigned char);
+        }
+        if (fread(dvi_page_store + dvi_page_buf_index, sizeof(char), size, fp) != size)
+          ERROR("Reading DVI file failed!");
       }
-#define buf ((char*)(dvi_page_buffer + dvi_page_buf_index))
-      if (fread(buf, sizeof(char), size, fp) != size)
-        ERROR("Reading DVI file failed!");
+#define buf ((const char*)(dvi_page_buffer + dvi_page_buf_index))
       if (scan_special(page_width, page_height, x_offset, y_offset, landscape,
                        majorversion, minorversion,
                        do_enc, key_bits, permission, owner_pw, user_pw,
@@ -2828,7 +3645,10 @@ dvi_scan_specials (int page_no,
       break;
 
     case FNT_DEF1: case FNT_DEF2: case FNT_DEF3: case FNT_DEF4:
-      do_fntdef(get_unsigned_num(fp, opcode-FNT_DEF1));
+      if (dvi_map)
+        skip_buffered_fntdef(opcode);
+      else
+        do_fntdef(get_unsigned_num(fp, opcode-FNT_DEF1));
       break;
     case XDV_GLYPHS:
       need_XeTeX(opcode);
@@ -2846,7 +3666,10 @@ dvi_scan_specials (int page_no,
       break;
     case XDV_NATIVE_FONT_DEF:
       need_XeTeX(opcode);
-      do_native_font_def(get_signed_quad(dvi_file));
+      if (dvi_map)
+        skip_buffered_native_font_def();
+      else
+        do_native_font_def(get_signed_quad(dvi_file));
       break;
     case BEGIN_REFLECT:
     case END_REFLECT:
@@ -2865,7 +3688,8 @@ dvi_scan_specials (int page_no,
       }
       /* else fall through to error case */
     default: /* case PRE: case POST_POST: and others */
-      ERROR("Unexpected opcode %d at pos=0x%x", opcode, tell_position(fp));
+      ERROR("Unexpected opcode %d at pos=0x%x", opcode,
+            dvi_map ? (int) (dvi_page_buffer - dvi_map) + dvi_page_buf_index - 1 : tell_position(fp));
       break;
     }
   }
@@ -76,6 +76,12 @@ extern void  dvi_scan_specials (int page_no,
                                 char *opasswd, char *upasswd, int *has_id, unsigned char *id1, unsigned char *id2);
 extern int   dvi_locate_font   (const char *name, spt_t ptsize);
 
+/* Interpret the pages that dvi_do_page() is called for next, in this
+ * order, in num_threads worker threads. Pages which can't be done this
+ * way are interpreted by dvi_do_page() as usual.
+ */
+extern void  dvi_prepare_pages (const int *page_nos, int count, int num_threads);
+
 /* link or nolink:
  * See dvipdfm (not x) user's manual on pdf:link and pdf:nolink.
  * This is workaround for preventing inclusion of pagenation artifact such as
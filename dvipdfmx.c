@@ -82,11 +82,16 @@ static int    opt_flags = 0;
 #define OPT_PDFDOC_NO_DEST_REMOVE (1 << 4)
 #define OPT_PDFOBJ_NO_PREDICTOR   (1 << 5)
 #define OPT_PDFOBJ_NO_OBJSTM      (1 << 6)
+#define OPT_PDFOBJ_DEDUP          (1 << 7)
+#define OPT_PDFOBJ_LINEARIZE      (1 << 8)
+#define OPT_DVI_PARALLEL_PAGES    (1 << 9)
 
 /* Basic PDF output settings */
 static int    pdf_version_major = 1;
 static int    pdf_version_minor = 5;
 static int    compression_level = 9;
+static int    num_threads       = 0;
+static char  *compression_policy = NULL;
 
 /* PDF document navigation feature settings */
 static double annot_grow_x      = 0.0;
@@ -197,6 +202,7 @@ show_usage (void)
   printf ("  -f filename\tLoad additional font map filename[.map]\n");
   printf ("  -g dimension\tAnnotation \"grow\" amount [0.0in]\n");
   printf ("  -h | --help \tShow this help message and exit\n");
+  printf ("  -j number\tCompress streams using number worker threads [0]\n");
   printf ("  -l \t\tLandscape mode\n");
   printf ("  -m number\tSet additional magnification [1.0]\n");
   printf ("  --mvorigin\tTranslate the origin for MP inclusion\n");
@@ -214,6 +220,9 @@ show_usage (void)
   printf ("  -x dimension\tSet horizontal offset [1.0in]\n");
   printf ("  -y dimension\tSet vertical offset [1.0in]\n");
   printf ("  -z number  \tSet zlib compression level (0-9) [9]\n");
+  printf ("  --compress class=value,...\n");
+  printf ("\t\tSet compression level (0-9) or \"predictor\"/\"nopredictor\"\n");
+  printf ("\t\tfor content, font, image, metadata, or objstm streams\n");
 
   printf ("  -C number\tSpecify miscellaneous option flags [0]:\n");
   printf ("\t\t  0x0001 reserved\n");
@@ -224,6 +233,9 @@ show_usage (void)
   printf ("\t\t  0x0010 Do not optimize PDF destinations.\n");
   printf ("\t\t  0x0020 Do not use predictor filter for Flate compression.\n");
   printf ("\t\t  0x0040 Do not use object stream.\n");
+  printf ("\t\t  0x0080 Merge identical streams and objects.\n");
+  printf ("\t\t  0x0100 Linearize PDF output for fast web view.\n");
+  printf ("\t\t  0x0200 Also interpret pages using the -j worker threads.\n");
   printf ("\t\tPositive values are always ORed with previously given flags.\n");
   printf ("\t\tAnd negative values replace old values.\n");
   printf ("  -D template\tPS->PDF conversion command line template [none]\n");
@@ -413,7 +425,7 @@ compute_id_string (unsigned char *id, const char *producer,
   MD5_final(id, &md5);
 }
 
-static const char *optstrig = ":hD:r:m:g:x:y:o:s:p:clf:i:qtvV:z:d:I:K:P:O:MSC:Ee";
+static const char *optstrig = ":hD:r:m:g:x:y:o:s:p:clf:i:qtvV:z:d:I:K:P:O:MSC:Eej:";
 
 static struct option long_options[] = {
   {"help", 0, 0, 'h'},
@@ -422,6 +434,7 @@ static struct option long_options[] = {
   {"dvipdfm", 0, 0, 132},
   {"mvorigin", 0, 0, 1000},
   {"kpathsea-debug", 1, 0, 133},
+  {"compress", 1, 0, 134},
   {0, 0, 0, 0}
 };
 
@@ -637,6 +650,19 @@ do_args_second_pass (int argc, char *argv[], const char *source, int unsafe)
       compression_level = atoi(optarg);
       break;
 
+    case 134: /* --compress */
+      if (compression_policy)
+        RELEASE(compression_policy);
+      compression_policy = NEW(strlen(optarg)+1, char);
+      strcpy(compression_policy, optarg);
+      break;
+
+    case 'j':
+      num_threads = atoi(optarg);
+      if (num_threads < 0)
+        ERROR("Invalid number of threads specified: %s", optarg);
+      break;
+
     case 'd':
       pdfdecimaldigits = atoi(optarg);
       break;
@@ -716,6 +742,8 @@ cleanup (void)
     RELEASE(page_ranges);
   if (filter_template)
     RELEASE(filter_template);
+  if (compression_policy)
+    RELEASE(compression_policy);
 }
 
 static void
@@ -833,6 +861,32 @@ error_cleanup (void)
   }
 }
 
+/* With -C 0x0200, the pages of a range are interpreted ahead in
+ * batches by worker threads. Workers can only use fonts that earlier
+ * pages have used, so batches start small and grow. Returns the number
+ * of pages (including those beyond the last page of the DVI file) the
+ * batch covers.
+ */
+#define PAGE_BATCH_SIZE 256
+static int
+prepare_dvi_pages (int page_no, int last, int step, int batch_size)
+{
+  int  page_nos[PAGE_BATCH_SIZE];
+  int  num_pages = 0, count = 0;
+
+  for (;;) {
+    count++;
+    if (page_no < dvi_npages())
+      page_nos[num_pages++] = page_no;
+    if (num_pages == batch_size || page_no == last)
+      break;
+    page_no += step;
+  }
+  dvi_prepare_pages(page_nos, num_pages, num_threads);
+
+  return count;
+}
+
 #define SWAP(v1,v2) do {\
    double _tmp = (v1);\
    (v1) = (v2);\
@@ -843,6 +897,7 @@ static void
 do_dvi_pages (void)
 {
   int      page_no, page_count, i, step;
+  int      pages_ahead = 0, batch_size = MIN(num_threads, PAGE_BATCH_SIZE);
   double   page_width, page_height;
   double   init_paper_width, init_paper_height;
   pdf_rect mediabox;
@@ -877,6 +932,14 @@ do_dvi_pages (void)
     step    = (page_ranges[i].first <= page_ranges[i].last) ? 1 : -1;
     page_no = page_ranges[i].first;
     while (dvi_npages()) {
+      if ((opt_flags & OPT_DVI_PARALLEL_PAGES) && num_threads > 0) {
+        if (pages_ahead == 0) {
+          pages_ahead = prepare_dvi_pages(page_no, page_ranges[i].last,
+                                          step, batch_size);
+          batch_size  = MIN(2 * batch_size, MIN(8 * num_threads, PAGE_BATCH_SIZE));
+        }
+        pages_ahead--;
+      }
       if (page_no < dvi_npages()) {
         double w, h, xo, yo;
         int    lm;
@@ -1182,6 +1245,8 @@ main (int argc, char *argv[])
 
   /* PDF object settings */
   settings.object.compression_level = compression_level;
+  settings.object.num_threads       = num_threads;
+  settings.object.compression_policy = compression_policy;
   if (opt_flags & OPT_PDFOBJ_NO_OBJSTM) {
     settings.object.enable_objstm = 0;
   } else {
@@ -1192,6 +1257,8 @@ main (int argc, char *argv[])
   } else {
     settings.object.enable_predictor = 1;
   }
+  settings.object.enable_dedup = (opt_flags & OPT_PDFOBJ_DEDUP) ? 1 : 0;
+  settings.object.enable_linearize = (opt_flags & OPT_PDFOBJ_LINEARIZE) ? 1 : 0;
 
   /* PDF document settings
    * Set default paper size here so that all page's can inherite it.
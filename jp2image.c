@@ -390,6 +390,7 @@ jp2_include_image (pdf_ximage *ximage, FILE *fp)
   /* Read whole file */
   {
     int nb_read;
+    pdf_stream_reserve(stream, file_size(fp));
     rewind(fp);
     while ((nb_read =
         fread(work_buffer, sizeof(char), WORK_BUFFER_SIZE, fp)) > 0)
@@ -907,6 +907,8 @@ JPEG_copy_stream (struct JPEG_info *j_info, pdf_obj *stream, FILE *fp)
     pdf_add_stream((s), work_buffer, nb_read); \
   (l) -= nb_read; \
 }
+  /* The stream is at most as large as the file */
+  pdf_stream_reserve(stream, file_size(fp));
   rewind(fp);
   count      = 0;
   found_SOFn = 0;
@@ -231,6 +231,20 @@ struct dev_unit {
   int    precision;  /* Number of decimal digits (in fractional part) kept. */
 };
 
+/* A page interpreted in a worker thread draws with a device of its
+ * own, see pdf_dev_page_new(). What would go to the document is kept
+ * here until pdf_dev_page_finish() adds it to the current page.
+ */
+struct dev_page {
+  char   *content;
+  size_t  length, capacity;
+  int    *fonts;       /* Fonts selected, in order of first use */
+  int     num_fonts;
+  char   *used;        /* Per device font: selected on this page */
+  char  **used_chars;  /* Per device font: glyphs used on this page */
+  int     failed;      /* The page needs the document's device */
+};
+
 #define FORMAT_BUF_SIZE 4096
 struct pdf_dev {
   int               motion_state;
@@ -240,6 +254,7 @@ struct pdf_dev {
   struct dev_font  *fonts;
   int               num_dev_fonts;
   int               max_dev_fonts;
+  struct dev_page  *page; /* NULL for the document's device */
   char              format_buffer[FORMAT_BUF_SIZE+1];
 };
 
@@ -258,7 +273,18 @@ current_device (void)
 static void
 dev_out (pdf_dev *p, const char *str, size_t len)
 {
-  pdf_doc_add_page_content(str, len);
+  struct dev_page *page = p->page;
+
+  if (!page) {
+    pdf_doc_add_page_content(str, len);
+    return;
+  }
+  if (page->length + len > page->capacity) {
+    page->capacity = page->length + len + FORMAT_BUF_SIZE;
+    page->content  = RENEW(page->content, page->capacity, char);
+  }
+  memcpy(page->content + page->length, str, len);
+  page->length += len;
 }
 
 static double
@@ -635,7 +661,7 @@ static void
 start_string (pdf_dev *p,
               spt_t xpos, spt_t ypos, double slant, double extend, int rotate)
 {
-  spt_t delx, dely, error_delx, error_dely;
+  spt_t delx, dely, error_delx = 0, error_dely = 0;
   spt_t desired_delx, desired_dely;
   int   len = 0;
 
@@ -872,16 +898,33 @@ pdf_dev_set_font (pdf_dev *p, int font_id)
   p->text_state.matrix.extend = font->extend;
   p->text_state.matrix.rotate = text_rotate;
 
-  if (!font->resource) {
-    font->resource   = pdf_get_font_reference(font->font_id);
-    font->used_chars = pdf_get_font_usedchars(font->font_id);
-  }
+  if (p->page) {
+    struct dev_page *page = p->page;
 
-  if (!font->used_on_this_page) {
-    pdf_doc_add_page_resource("Font",
-                              font->short_name,
-                              pdf_link_obj(font->resource));
-    font->used_on_this_page = 1;
+    /* Font resources are created by the document's device. */
+    ASSERT(font->resource);
+    if (!page->used[font_id]) {
+      if (font->used_chars) {
+        int size = (font->format == PDF_FONTTYPE_COMPOSITE) ? 8192 : 256;
+
+        page->used_chars[font_id] = NEW(size, char);
+        memset(page->used_chars[font_id], 0, size);
+      }
+      page->fonts[page->num_fonts++] = font_id;
+      page->used[font_id] = 1;
+    }
+  } else {
+    if (!font->resource) {
+      font->resource   = pdf_get_font_reference(font->font_id);
+      font->used_chars = pdf_get_font_usedchars(font->font_id);
+    }
+
+    if (!font->used_on_this_page) {
+      pdf_doc_add_page_resource("Font",
+                                font->short_name,
+                                pdf_link_obj(font->resource));
+      font->used_on_this_page = 1;
+    }
   }
 
   font_scale = (double) font->sptsize * p->unit.dvi2pts;
@@ -953,13 +996,13 @@ handle_multibyte_string (struct dev_font *font, const unsigned char **str_ptr, i
   return 0;
 }
 
-void
-pdf_dev_set_string (spt_t xpos, spt_t ypos,
-                    const void *instr_ptr, int instr_len, spt_t width, int font_id)
+static void
+dev_set_string (pdf_dev *p, spt_t xpos, spt_t ypos,
+                const void *instr_ptr, int instr_len, spt_t width, int font_id)
 {
-  pdf_dev             *p = current_device();
   struct dev_font     *font;
   const unsigned char *str_ptr; /* Pointer to the reencoded string. */
+  char                *used_chars;
   int                  length, i, len = 0;
   spt_t                kern, delh, delv;
   spt_t                text_xorigin;
@@ -969,6 +1012,17 @@ pdf_dev_set_string (spt_t xpos, spt_t ypos,
     ERROR("Invalid font: %d (%d)", font_id, p->num_dev_fonts);
     return;
   }
+  if (p->page) {
+    font = GET_FONT(p, font_id);
+    /* Fonts not yet used and CMap conversion (which uses sbuf0) are
+     * left to the document's device.
+     */
+    if (!font->resource ||
+        (font->format == PDF_FONTTYPE_COMPOSITE && font->enc_id >= 0)) {
+      p->page->failed = 1;
+      return;
+    }
+  }
   if (font_id != p->text_state.font_id) {
     pdf_dev_set_font(p, font_id);
   }
@@ -985,21 +1039,26 @@ pdf_dev_set_string (spt_t xpos, spt_t ypos,
   str_ptr = instr_ptr;
   length  = instr_len;
 
+  used_chars = p->page ? p->page->used_chars[font_id] : font->used_chars;
   if (font->format == PDF_FONTTYPE_COMPOSITE) {
     if (handle_multibyte_string(font, &str_ptr, &length) < 0) {
+      if (p->page) {
+        p->page->failed = 1;
+        return;
+      }
       ERROR("Error in converting input string...");
       return;
     }
-    if (font->used_chars != NULL) {
+    if (used_chars != NULL) {
       for (i = 0; i < length; i += 2) {
         unsigned short cid = (str_ptr[i] << 8) | str_ptr[i + 1];
-        add_to_used_chars2(font->used_chars, cid);
+        add_to_used_chars2(used_chars, cid);
       }
     }
   } else {
-    if (font->used_chars != NULL) {
+    if (used_chars != NULL) {
       for (i = 0; i < length; i++)
-        font->used_chars[str_ptr[i]] = 1;
+        used_chars[str_ptr[i]] = 1;
     }
   }
 
@@ -1097,6 +1156,63 @@ pdf_dev_set_string (spt_t xpos, spt_t ypos,
   p->text_state.offset += width;
 }
 
+void
+pdf_dev_set_string (spt_t xpos, spt_t ypos,
+                    const void *instr_ptr, int instr_len, spt_t width, int font_id)
+{
+  dev_set_string(current_device(), xpos, ypos, instr_ptr, instr_len, width, font_id);
+}
+
+/* Set len one-byte characters in a row, the i-th advancing by widths[i].
+ * Once the first one is set, the position of the next one relative to
+ * the text origin stays the same along the run.  If that one needs
+ * neither a kern nor a new text object, none of the others do, and the
+ * rest of a simple font run is written as one string.  Otherwise, the
+ * characters are set one at a time.  The output is the same either way.
+ */
+void
+pdf_dev_set_string_run (spt_t xpos, spt_t ypos, const unsigned char *str,
+                        const spt_t *widths, int len, int font_id)
+{
+  pdf_dev         *p = current_device();
+  struct dev_font *font;
+  spt_t            delh, delv, kern, width;
+  int              i, length;
+
+  if (len < 1)
+    return;
+  dev_set_string(p, xpos, ypos, str, 1, widths[0], font_id);
+  xpos += widths[0];
+
+  font = CURRENTFONT(p);
+  if (len > 1 && font && font->format != PDF_FONTTYPE_COMPOSITE &&
+      p->motion_state == STRING_MODE && !p->text_state.force_reset &&
+      p->text_state.dir_mode == 0 && !p->text_state.is_mb) {
+    delh = p->text_state.ref_x + p->text_state.offset - xpos;
+    delv = ypos - p->text_state.ref_y;
+    kern = (spt_t) (1000.0 / font->extend * delh / font->sptsize);
+    if (labs(delv) <= p->unit.min_bp_val &&
+        labs(delh) <= WORD_SPACE_MAX(font) && kern == 0) {
+      width = 0;
+      for (i = 1; i < len; i++) {
+        if (font->used_chars != NULL)
+          font->used_chars[str[i]] = 1;
+        width += widths[i];
+      }
+      length = pdfobj_escape_str(p->format_buffer, FORMAT_BUF_SIZE,
+                                 str + 1, len - 1);
+      dev_out(p, p->format_buffer, length);  /* op: */
+      p->text_state.offset += width;
+      return;
+    }
+  }
+
+  for (i = 1; i < len; i++) {
+    dev_set_string(p, xpos, ypos, str + i, 1, widths[i], font_id);
+    xpos += widths[i];
+  }
+}
+
 void
 pdf_init_device (double dvi2pts, int precision, int black_and_white)
 {
@@ -1143,6 +1259,7 @@ pdf_init_device (double dvi2pts, int precision, int black_and_white)
 
   p->num_dev_fonts  = p->max_dev_fonts = 0;
   p->fonts          = NULL;
+  p->page           = NULL;
 
   return;
 }
@@ -1406,10 +1523,9 @@ dev_sprint_line (pdf_dev *p, char *buf, spt_t width,
 
 /* Not optimized. */
 #define PDF_LINE_THICKNESS_MAX 5.0
-void
-pdf_dev_set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
+static void
+dev_set_rule (pdf_dev *p, spt_t xpos, spt_t ypos, spt_t width, spt_t height)
 {
-  pdf_dev *p = current_device();
   int      len = 0;
   double   width_in_bp;
 
@@ -1442,6 +1558,11 @@ pdf_dev_set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
        *  "Details of Graphics State Parameters", p. 185.
        */
       if (height < p->unit.min_bp_val) {
+        if (p->page) {
+          /* Warnings are given in page order by the document's device. */
+          p->page->failed = 1;
+          return;
+        }
         WARN("Too thin line: height=%ld (%g bp)", height, width_in_bp);
         WARN("Please consider using \"-d\" option.");
       }
@@ -1453,6 +1574,10 @@ pdf_dev_set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
                              ypos + height/2);
     } else {
       if (width < p->unit.min_bp_val) {
+        if (p->page) {
+          p->page->failed = 1;
+          return;
+        }
         WARN("Too thin line: width=%ld (%g bp)", width, width_in_bp);
         WARN("Please consider using \"-d\" option.");
       }
@@ -1469,6 +1594,12 @@ pdf_dev_set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
   dev_out(p, p->format_buffer, len);  /* op: q re f Q */
 }
 
+void
+pdf_dev_set_rule (spt_t xpos, spt_t ypos, spt_t width, spt_t height)
+{
+  dev_set_rule(current_device(), xpos, ypos, width, height);
+}
+
 /* Rectangle in device space coordinate. */
 void
 pdf_dev_set_rect (pdf_rect *rect,
@@ -1538,10 +1669,9 @@ pdf_dev_get_dirmode (void)
   return p->text_state.dir_mode;
 }
 
-void
-pdf_dev_set_dirmode (int text_dir)
+static void
+dev_set_dirmode (pdf_dev *p, int text_dir)
 {
-  pdf_dev *p = current_device();
   struct dev_font *font;
   int text_rotate;
   int vert_dir, vert_font;
@@ -1565,6 +1695,163 @@ pdf_dev_set_dirmode (int text_dir)
   p->text_state.dir_mode      = text_dir;
 }
 
+void
+pdf_dev_set_dirmode (int text_dir)
+{
+  dev_set_dirmode(current_device(), text_dir);
+}
+
+/*
+ * Pages interpreted in worker threads.
+ *
+ * A page device starts in the state the document's device is left in
+ * by pdf_dev_bop() and draws with the fonts already located. It can
+ * only use fonts which have been used on an earlier page; the caller
+ * checks pdf_dev_page_failed() and interprets the page again with the
+ * document's device when it can't be done this way.
+ */
+pdf_dev *
+pdf_dev_page_new (void)
+{
+  pdf_dev         *p = current_device();
+  pdf_dev         *dev;
+  struct dev_page *page;
+
+  dev  = NEW(1, pdf_dev);
+  *dev = *p;
+
+  dev->motion_state = GRAPHICS_MODE;
+  dev->text_state.font_id       = -1;
+  dev->text_state.matrix.slant  = 0.0;
+  dev->text_state.matrix.extend = 1.0;
+  dev->text_state.matrix.rotate = TEXT_WMODE_HH;
+  dev->text_state.bold_param    = 0.0;
+  dev->text_state.dir_mode      = 0;
+  dev->text_state.force_reset   = 0;
+  dev->text_state.is_mb         = 0;
+
+  page = NEW(1, struct dev_page);
+  page->content    = NULL;
+  page->length     = page->capacity = 0;
+  page->num_fonts  = 0;
+  page->fonts      = NEW(p->num_dev_fonts + 1, int);
+  page->used       = NEW(p->num_dev_fonts + 1, char);
+  page->used_chars = NEW(p->num_dev_fonts + 1, char *);
+  memset(page->used, 0, p->num_dev_fonts + 1);
+  memset(page->used_chars, 0, (p->num_dev_fonts + 1) * sizeof(char *));
+  page->failed     = 0;
+  dev->page = page;
+
+  return dev;
+}
+
+void
+pdf_dev_page_release (pdf_dev *dev)
+{
+  struct dev_page *page;
+  int              i;
+
+  if (!dev)
+    return;
+
+  page = dev->page;
+  for (i = 0; i < dev->num_dev_fonts; i++) {
+    if (page->used_chars[i])
+      RELEASE(page->used_chars[i]);
+  }
+  RELEASE(page->used_chars);
+  RELEASE(page->used);
+  RELEASE(page->fonts);
+  if (page->content)
+    RELEASE(page->content);
+  RELEASE(page);
+  RELEASE(dev);
+}
+
+int
+pdf_dev_page_failed (pdf_dev *dev)
+{
+  return dev->page->failed;
+}
+
+void
+pdf_dev_page_set_string (pdf_dev *dev, spt_t xpos, spt_t ypos,
+                         const void *instr_ptr, int instr_len,
+                         spt_t width, int font_id)
+{
+  if (!dev->page->failed)
+    dev_set_string(dev, xpos, ypos, instr_ptr, instr_len, width, font_id);
+}
+
+void
+pdf_dev_page_set_rule (pdf_dev *dev,
+                       spt_t xpos, spt_t ypos, spt_t width, spt_t height)
+{
+  if (!dev->page->failed)
+    dev_set_rule(dev, xpos, ypos, width, height);
+}
+
+void
+pdf_dev_page_set_dirmode (pdf_dev *dev, int text_dir)
+{
+  dev_set_dirmode(dev, text_dir);
+}
+
+/* Called after pdf_doc_begin_page() instead of drawing the page.
+ * Returns -1, having done nothing, if the document's device is not
+ * in the state the page device started with.
+ */
+int
+pdf_dev_page_finish (pdf_dev *dev)
+{
+  pdf_dev         *p = current_device();
+  struct dev_page *page = dev->page;
+  int              i, j;
+
+  if (page->failed ||
+      p->motion_state != GRAPHICS_MODE ||
+      p->text_state.font_id != -1 ||
+      p->text_state.matrix.slant  != 0.0 ||
+      p->text_state.matrix.extend != 1.0 ||
+      p->text_state.matrix.rotate != TEXT_WMODE_HH ||
+      p->text_state.bold_param != 0.0 ||
+      p->text_state.dir_mode != 0 ||
+      p->text_state.force_reset != 0 ||
+      p->text_state.is_mb != 0 ||
+      p->param.autorotate != dev->param.autorotate ||
+      p->num_dev_fonts < dev->num_dev_fonts)
+    return -1;
+  for (i = 0; i < p->num_dev_fonts; i++) {
+    if (p->fonts[i].used_on_this_page)
+      return -1;
+  }
+
+  if (page->length > 0)
+    pdf_doc_add_page_content(page->content, page->length);
+
+  for (i = 0; i < page->num_fonts; i++) {
+    int              font_id = page->fonts[i];
+    struct dev_font *font    = GET_FONT(p, font_id);
+    char            *used_chars = page->used_chars[font_id];
+
+    pdf_doc_add_page_resource("Font",
+                              font->short_name,
+                              pdf_link_obj(font->resource));
+    font->used_on_this_page = 1;
+    if (used_chars) {
+      int size = (font->format == PDF_FONTTYPE_COMPOSITE) ? 8192 : 256;
+
+      for (j = 0; j < size; j++)
+        font->used_chars[j] |= used_chars[j];
+    }
+  }
+
+  p->motion_state = dev->motion_state;
+  p->text_state   = dev->text_state;
+
+  return 0;
+}
+
 static void
 dev_set_param_autorotate (pdf_dev *p, int auto_rotate)
 {
@@ -105,6 +105,8 @@ extern double dev_unit_dviunit  (void);
 extern void   pdf_dev_set_string (spt_t xpos, spt_t ypos,
                                   const void *instr_ptr, int instr_len,
                                   spt_t text_width, int font_id);
+extern void   pdf_dev_set_string_run (spt_t xpos, spt_t ypos, const unsigned char *str,
+                                     const spt_t *widths, int len, int font_id);
 extern void   pdf_dev_set_rule   (spt_t xpos, spt_t ypos, spt_t width, spt_t height);
 
 /* Place XObject: rect returned */
@@ -165,6 +167,22 @@ extern void   pdf_dev_reset_color (int force);
 extern void   pdf_dev_bop (const pdf_tmatrix *M);
 extern void   pdf_dev_eop (void);
 
+/* Pages without specials may be drawn in worker threads, each with a
+ * device of its own, and added to the document in page order with
+ * pdf_dev_page_finish() after pdf_doc_begin_page(). It returns -1 if
+ * the page must be drawn again with the document's device.
+ */
+extern pdf_dev *pdf_dev_page_new     (void);
+extern void     pdf_dev_page_release (pdf_dev *dev);
+extern int      pdf_dev_page_failed  (pdf_dev *dev);
+extern int      pdf_dev_page_finish  (pdf_dev *dev);
+extern void     pdf_dev_page_set_string (pdf_dev *dev, spt_t xpos, spt_t ypos,
+                                         const void *instr_ptr, int instr_len,
+                                         spt_t text_width, int font_id);
+extern void     pdf_dev_page_set_rule   (pdf_dev *dev, spt_t xpos, spt_t ypos,
+                                         spt_t width, spt_t height);
+extern void     pdf_dev_page_set_dirmode (pdf_dev *dev, int dir_mode);
+
 /* Text is normal and line art is not normal in dvipdfmx. So we don't have
  * begin_text (BT in PDF) and end_text (ET), but instead we have graphics_mode()
  * to terminate text section. pdf_dev_flushpath() and others call this.
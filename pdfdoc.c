@@ -824,6 +824,9 @@ pdf_doc_get_page_count (pdf_file *pf)
   pdf_obj *page_tree = NULL;
   pdf_obj *catalog;
 
+  if (pdf_file_get_page_count(pf) > 0)
+    return pdf_file_get_page_count(pf);
+
   catalog = pdf_file_get_catalog(pf);
 
   page_tree = pdf_deref_obj(pdf_lookup_dict(catalog, "Pages"));
@@ -1076,6 +1079,257 @@ set_transform_matrix (pdf_tmatrix *matrix, pdf_rect *bbox, pdf_obj *rotate)
  * displayed or printed. The value must be a multiple of 90. Default value: 0.
  */
 
+static int
+get_box_values (pdf_obj *box, double *v)
+{
+  int i;
+
+  if (!PDF_OBJ_ARRAYTYPE(box) || pdf_array_length(box) != 4)
+    return -1;
+  for (i = 0; i < 4; i++) {
+    pdf_obj *tmp = pdf_deref_obj(pdf_get_array(box, i));
+    if (!PDF_OBJ_NUMBERTYPE(tmp)) {
+      if (tmp)
+        pdf_release_obj(tmp);
+      return -1;
+    }
+    v[i] = pdf_number_value(tmp);
+    pdf_release_obj(tmp);
+  }
+
+  return 0;
+}
+
+static pdf_obj *
+new_box (const double *v)
+{
+  pdf_obj *box = pdf_new_array();
+  int      i;
+
+  for (i = 0; i < 4; i++)
+    pdf_add_array(box, pdf_new_number(v[i]));
+
+  return box;
+}
+
+/* Fill in INFO for a page found by walking the page tree. Returns -1 if
+ * some of the attributes can't be recorded as plain numbers, in which case
+ * the page tree will be walked again next time.
+ */
+static int
+record_page_info (pdf_page_info *info, pdf_obj **boxes, pdf_obj *rotate)
+{
+  int i;
+
+  info->boxes = 0;
+  for (i = 0; i < PDF_PAGE_BOXES; i++) {
+    if (!boxes[i])
+      continue;
+    if (get_box_values(boxes[i], info->box[i]) < 0)
+      return -1;
+    info->boxes |= (1 << i);
+  }
+  info->has_rotate = rotate ? 1 : 0;
+  if (rotate)
+    info->rotate = pdf_number_value(rotate);
+
+  return 0;
+}
+
+/* Attributes inherited from the ancestors of a node of the page tree. */
+struct page_attrs
+{
+  pdf_obj *boxes[PDF_PAGE_BOXES];
+  pdf_obj *rotate;
+  uint32_t res_label;
+  uint16_t res_generation;
+};
+
+static const char *page_box_names[PDF_PAGE_BOXES] = {
+  "MediaBox", "CropBox", "ArtBox", "TrimBox", "BleedBox"
+};
+
+/* Object numbers of the page tree nodes visited so far, one bit each. */
+struct page_tree_seen
+{
+  unsigned char *bits;
+  uint32_t       size; /* in bytes */
+};
+
+/* Mark the node with object number LABEL as visited. Returns 1 if it was
+ * visited before.
+ */
+static int
+mark_page_tree_node (struct page_tree_seen *seen, uint32_t label)
+{
+  uint32_t      byte = label / 8;
+  unsigned char bit  = 1 << (label % 8);
+
+  if (byte >= seen->size) {
+    uint32_t size = MAX(2 * seen->size, byte + 1);
+
+    seen->bits = RENEW(seen->bits, size, unsigned char);
+    memset(seen->bits + seen->size, 0, size - seen->size);
+    seen->size = size;
+  }
+  if (seen->bits[byte] & bit)
+    return 1;
+  seen->bits[byte] |= bit;
+
+  return 0;
+}
+
+/* Record all pages below the page tree node REF in a single walk, so that
+ * looking up a page doesn't need to descend the page tree again. Returns -1
+ * if the tree is not in a shape where pages would be numbered the same way
+ * as pdf_doc_get_page() does it, that is if the /Count of some node doesn't
+ * match the pages found below it, or if some node is reached twice.
+ */
+static int
+index_page_tree (pdf_file *pf, pdf_obj *ref, const struct page_attrs *parent,
+                 struct page_tree_seen *seen, int *page_no, int depth)
+{
+  struct page_attrs attrs = *parent;
+  pdf_obj *node, *kids, *count, *tmp;
+  uint32_t label;
+  uint16_t generation;
+  int      i, error = 0;
+
+  if (!depth || pdf_indirect_label(ref, &label, &generation) < 0)
+    return -1;
+  node = pdf_deref_obj(ref);
+  if (!PDF_OBJ_DICTTYPE(node)) {
+    if (node)
+      pdf_release_obj(node);
+    return -1;
+  }
+  if (mark_page_tree_node(seen, label)) {
+    WARN("Object %u reached twice in the page tree of included PDF.", label);
+    pdf_release_obj(node);
+    return -1;
+  }
+
+  for (i = 0; i < PDF_PAGE_BOXES; i++) {
+    if ((tmp = pdf_deref_obj(pdf_lookup_dict(node, page_box_names[i]))))
+      attrs.boxes[i] = tmp;
+  }
+  if ((tmp = pdf_deref_obj(pdf_lookup_dict(node, "Rotate"))))
+    attrs.rotate = tmp;
+  if ((tmp = pdf_deref_obj(pdf_lookup_dict(node, "Resources")))) {
+    attrs.res_label      = label;
+    attrs.res_generation = generation;
+    pdf_release_obj(tmp);
+  }
+
+  kids  = pdf_deref_obj(pdf_lookup_dict(node, "Kids"));
+  count = pdf_deref_obj(pdf_lookup_dict(node, "Count"));
+  if (!kids) {
+    /* Page object */
+    pdf_page_info info;
+
+    if (count) {
+      error = -1;
+    } else {
+      memset(&info, 0, sizeof(pdf_page_info));
+      info.page_label      = label;
+      info.page_generation = generation;
+      info.res_label       = attrs.res_label;
+      info.res_generation  = attrs.res_generation;
+      (*page_no)++;
+      /* Pages which can't be recorded are left to pdf_doc_get_page(). */
+      if (info.res_label &&
+          (!attrs.rotate || PDF_OBJ_NUMBERTYPE(attrs.rotate)) &&
+          record_page_info(&info, attrs.boxes, attrs.rotate) == 0)
+        pdf_file_set_page_info(pf, *page_no, &info);
+    }
+  } else if (!PDF_OBJ_ARRAYTYPE(kids) || !PDF_OBJ_NUMBERTYPE(count)) {
+    error = -1;
+  } else {
+    int first = *page_no;
+
+    for (i = 0; !error && i < pdf_array_length(kids); i++)
+      error = index_page_tree(pf, pdf_get_array(kids, i), &attrs, seen,
+                              page_no, depth - 1);
+    if (!error && *page_no - first != (int) pdf_number_value(count))
+      error = -1;
+  }
+  if (kids)
+    pdf_release_obj(kids);
+  if (count)
+    pdf_release_obj(count);
+
+  for (i = 0; i < PDF_PAGE_BOXES; i++) {
+    if (attrs.boxes[i] != parent->boxes[i])
+      pdf_release_obj(attrs.boxes[i]);
+  }
+  if (attrs.rotate != parent->rotate)
+    pdf_release_obj(attrs.rotate);
+  pdf_release_obj(node);
+
+  return error;
+}
+
+/* A page tree without pages is recorded as one that can't be indexed:
+ * there is nothing to look up, and a count of 0 would have it indexed
+ * again on every call.
+ */
+static void
+index_pages (pdf_file *pf)
+{
+  struct page_attrs     attrs;
+  struct page_tree_seen seen = { NULL, 0 };
+  pdf_obj *catalog;
+  int      page_no = 0;
+
+  memset(&attrs, 0, sizeof(struct page_attrs));
+  catalog = pdf_file_get_catalog(pf);
+  if (index_page_tree(pf, pdf_lookup_dict(catalog, "Pages"), &attrs, &seen,
+                      &page_no, PDF_OBJ_MAX_DEPTH) < 0 || page_no == 0)
+    pdf_file_set_page_count(pf, -1);
+  else
+    pdf_file_set_page_count(pf, page_no);
+  if (seen.bits)
+    RELEASE(seen.bits);
+}
+
+/* Look up a page recorded by a previous call, possibly in another run. */
+static pdf_obj *
+get_cached_page (pdf_file *pf, int page_no,
+                 pdf_obj **boxes, pdf_obj **rotate, pdf_obj **resources)
+{
+  pdf_page_info info;
+  pdf_obj *page, *node, *tmp;
+  int      i;
+
+  if (pdf_file_get_page_info(pf, page_no, &info) < 0)
+    return NULL;
+
+  tmp  = pdf_new_indirect(pf, info.page_label, info.page_generation);
+  page = pdf_deref_obj(tmp);
+  pdf_release_obj(tmp);
+  tmp  = pdf_new_indirect(pf, info.res_label, info.res_generation);
+  node = pdf_deref_obj(tmp);
+  pdf_release_obj(tmp);
+  if (!PDF_OBJ_DICTTYPE(page) || !PDF_OBJ_DICTTYPE(node)) {
+    if (page)
+      pdf_release_obj(page);
+    if (node)
+      pdf_release_obj(node);
+    return NULL;
+  }
+  *resources = pdf_deref_obj(pdf_lookup_dict(node, "Resources"));
+  pdf_release_obj(node);
+
+  for (i = 0; i < PDF_PAGE_BOXES; i++) {
+    if (info.boxes & (1 << i))
+      boxes[i] = new_box(info.box[i]);
+  }
+  if (info.has_rotate)
+    *rotate = pdf_new_number(info.rotate);
+
+  return page;
+}
+
 /* count_p removed: Please use different interface if you want to get total page
  * number. pdf_doc_get_page() is obviously not an interface to do such.
  */
@@ -1089,10 +1343,40 @@ pdf_doc_get_page (pdf_file *pf,
   pdf_obj *resources = NULL, *rotate = NULL;
   pdf_obj *art_box = NULL, *trim_box = NULL, *bleed_box = NULL;
   pdf_obj *media_box = NULL, *crop_box = NULL;
+  pdf_page_info info;
+  int      cacheable = 0;
   int      error = 0;
 
+  if (pdf_file_get_page_count(pf) == 0)
+    index_pages(pf);
+  if (pdf_file_get_page_count(pf) > 0 &&
+      (page_no <= 0 || page_no > pdf_file_get_page_count(pf))) {
+    WARN("Page %d does not exist.", page_no);
+    return NULL;
+  }
+  {
+    pdf_obj *boxes[PDF_PAGE_BOXES] = { NULL, NULL, NULL, NULL, NULL };
+
+    page_tree = get_cached_page(pf, page_no, boxes, &rotate, &resources);
+    if (page_tree) {
+      media_box = boxes[PDF_PAGE_MEDIABOX];
+      crop_box  = boxes[PDF_PAGE_CROPBOX];
+      art_box   = boxes[PDF_PAGE_ARTBOX];
+      trim_box  = boxes[PDF_PAGE_TRIMBOX];
+      bleed_box = boxes[PDF_PAGE_BLEEDBOX];
+      goto page_found;
+    }
+  }
+
   catalog = pdf_file_get_catalog(pf);
 
+  /* The page and the node holding its resources are remembered by their
+   * object numbers, so the page tree needs to consist of indirect objects.
+   */
+  memset(&info, 0, sizeof(pdf_page_info));
+  cacheable = pdf_indirect_label(pdf_lookup_dict(catalog, "Pages"),
+                                 &info.page_label,
+                                 &info.page_generation) == 0;
   page_tree = pdf_deref_obj(pdf_lookup_dict(catalog, "Pages"));
 
   if (!PDF_OBJ_DICTTYPE(page_tree))
@@ -1109,7 +1393,7 @@ pdf_doc_get_page (pdf_file *pf,
     count = pdf_number_value(tmp);
     pdf_release_obj(tmp);
     if (page_no <= 0 || page_no > count) {
-      WARN("Page %ld does not exist.", page_no);
+      WARN("Page %d does not exist.", page_no);
       goto error_silent;
     }
   }
@@ -1158,6 +1442,8 @@ pdf_doc_get_page (pdf_file *pf,
         if (resources)
           pdf_release_obj(resources);
         resources = tmp;
+        info.res_label      = info.page_label;
+        info.res_generation = info.page_generation;
       }
 
       kids = pdf_deref_obj(pdf_lookup_dict(page_tree, "Kids"));
@@ -1173,6 +1459,9 @@ pdf_doc_get_page (pdf_file *pf,
         int count;
 
         pdf_release_obj(page_tree);
+        if (pdf_indirect_label(pdf_get_array(kids, i), &info.page_label,
+                               &info.page_generation) < 0)
+          cacheable = 0;
         page_tree = pdf_deref_obj(pdf_get_array(kids, i));
         if (!PDF_OBJ_DICTTYPE(page_tree))
           goto error_exit;
@@ -1199,6 +1488,7 @@ pdf_doc_get_page (pdf_file *pf,
       goto error_exit;
   }
 
+ page_found:
   if (!PDF_OBJ_DICTTYPE(resources))
     goto error_exit;
   if (resources_p)
@@ -1213,6 +1503,18 @@ pdf_doc_get_page (pdf_file *pf,
   if (error)
     goto error_exit;
 
+  if (cacheable) {
+    pdf_obj *boxes[PDF_PAGE_BOXES];
+
+    boxes[PDF_PAGE_MEDIABOX]  = media_box;
+    boxes[PDF_PAGE_CROPBOX]   = crop_box;
+    boxes[PDF_PAGE_ARTBOX]    = art_box;
+    boxes[PDF_PAGE_TRIMBOX]   = trim_box;
+    boxes[PDF_PAGE_BLEEDBOX]  = bleed_box;
+    if (record_page_info(&info, boxes, rotate) == 0)
+      pdf_file_set_page_info(pf, page_no, &info);
+  }
+
 goto clean_exit; /* Success */
 
  error_exit:
@@ -2280,7 +2582,9 @@ pdf_doc_new_page (pdf_doc *p)
   }
 
   currentpage->background = NULL;
-  currentpage->contents   = pdf_new_stream(STREAM_COMPRESS);
+  /* Page content is compressed as it is produced. */
+  currentpage->contents   = pdf_new_stream(STREAM_COMPRESS |
+                                           STREAM_COMPRESS_INCREMENTAL);
   currentpage->resources  = pdf_new_dict();
 
   currentpage->annots = NULL;
@@ -2496,7 +2800,13 @@ pdf_open_document (const char *filename,
   pdf_out_init(filename, id1, id2,
                settings.ver_major, settings.ver_minor, settings.object.compression_level,
                settings.enable_encrypt,
-               settings.object.enable_objstm, settings.object.enable_predictor);
+               settings.object.enable_objstm, settings.object.enable_predictor,
+               settings.object.num_threads,
+               settings.object.enable_dedup,
+               settings.object.enable_linearize);
+  if (settings.object.compression_policy &&
+      pdf_out_set_compression_policy(settings.object.compression_policy) < 0)
+    ERROR("Invalid compression policy: %s", settings.object.compression_policy);
   pdf_files_init();
 
   pdf_doc_init_catalog(p);
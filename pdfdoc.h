@@ -56,6 +56,10 @@ struct pdf_obj_setting {
     int         enable_objstm;
     int         enable_predictor;
     int         compression_level;
+    int         num_threads;   /* 0 for compressing streams in sequence */
+    int         enable_dedup;  /* merge identical objects */
+    int         enable_linearize;
+    const char *compression_policy; /* per stream class, NULL for none */
 };
 
 struct pdf_setting
@@ -35,6 +35,8 @@
 #include "mfileio.h"
 #include "dpxconf.h"
 #include "dpxutil.h"
+#include "dpxfile.h"
+#include "dpxcrypt.h"
 
 #include "pdflimits.h"
 #include "pdfencrypt.h"
@@ -44,12 +46,31 @@
 #include <zlib.h>
 #endif /* HAVE_ZLIB */
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_ZLIB)
+#include <pthread.h>
+#define PDFOBJ_USE_THREADS 1
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define PDFOBJ_USE_MMAP 1
+#endif
+
+/* SSE2 and AVX2 versions of predictor filters, chosen at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define PDFOBJ_USE_SIMD 1
+#endif
+
 #include "pdfobj.h"
 #include "pdfdev.h"
 
 #define STREAM_ALLOC_SIZE      4096u
 #define ARRAY_ALLOC_SIZE       256
 #define IND_OBJECTS_ALLOC_SIZE 512
+#define DICT_HASH_THRESHOLD    16
+#define OUTPUT_BUFFER_SIZE     65536
 
 #define OBJ_NO_OBJSTM   (1 << 0)
 /* Objects with this flag will not be put into an object stream.
@@ -95,9 +116,15 @@ struct pdf_string
   size_t         length;
 };
 
+/* Names are interned: all name objects with the same value share a single
+ * pdf_name, allocated once together with its string and never released.
+ * Two names are equal if and only if their pdf_name pointers are equal.
+ */
 struct pdf_name
 {
-  char *name;
+  char   *name;   /* NULL for the empty name */
+  size_t  length;
+  size_t  hash;
 };
 
 struct pdf_array
@@ -107,11 +134,24 @@ struct pdf_array
   struct pdf_obj **values;
 };
 
+struct pdf_dict_node
+{
+  struct pdf_obj       *key;
+  struct pdf_obj       *value;
+  struct pdf_dict_node *next;
+};
+
+/* Entries are kept in a list in the order they are added, which is the
+ * order they are written out. Dictionaries with more than
+ * DICT_HASH_THRESHOLD entries get a hash index for key lookup.
+ */
 struct pdf_dict
 {
-  struct pdf_obj  *key;
-  struct pdf_obj  *value;
-  struct pdf_dict *next;
+  struct pdf_dict_node  *first;
+  struct pdf_dict_node  *last;
+  size_t                 size;
+  size_t                 hash_size; /* 0 if not indexed, else power of 2 */
+  struct pdf_dict_node **hash;
 };
 
 /* DecodeParms for FlateDecode */
@@ -133,6 +173,21 @@ struct pdf_dict
  *   http://www.w3.org/TR/PNG-Encoders.html#E.Filter-selection
  */
 
+/* Compression level and the use of predictors can be chosen separately
+ * for the following classes of streams, see pdf_out_set_compression_policy().
+ * The class of a stream is guessed from its dictionary when it is written.
+ */
+#define STREAM_CLASS_CONTENT  0 /* page contents, forms and anything else */
+#define STREAM_CLASS_FONT     1 /* embedded font files and CMaps */
+#define STREAM_CLASS_IMAGE    2 /* image XObjects */
+#define STREAM_CLASS_METADATA 3 /* XMP metadata and ICC profiles */
+#define STREAM_CLASS_OBJSTM   4 /* object and cross-reference streams */
+#define STREAM_CLASSES        5
+
+static const char *stream_class_names[STREAM_CLASSES] = {
+  "content", "font", "image", "metadata", "objstm"
+};
+
 struct pdf_stream
 {
   struct pdf_obj     *dict;
@@ -142,7 +197,88 @@ struct pdf_stream
   size_t              max_length;
   int32_t             _flags;
   struct decode_parms decodeparms;
+#ifdef HAVE_ZLIB
+  z_stream           *deflate;        /* see STREAM_COMPRESS_INCREMENTAL */
+#endif
+};
+
+/* Buffer reused by filters to avoid allocation for each stream */
+struct scratch_buffer
+{
+  unsigned char *data;
+  size_t         size;
+};
+
+/* Filtering and compression of stream data.
+ * This only works on plain memory buffers and never touches PDF objects,
+ * so that it can be done by a worker thread. The input data is never
+ * modified; filters write their output into the scratch buffers.
+ */
+struct flate_job
+{
+  const unsigned char   *data;   /* the stream data, then the output of
+                                  * flate_job_run() in a scratch buffer */
+  size_t                 length;
+  size_t                 filtered_length; /* length before compression */
+  int                    level;  /* zlib compression level, 0 for none */
+  struct decode_parms    parms;  /* predictor 0 for none */
+  int                    error;
+  struct scratch_buffer *predicted;
+  struct scratch_buffer *compressed;
+};
+
+/* Digest of an object written to the output, see dedup_obj(). */
+struct dedup_entry
+{
+  unsigned char digest[32];
+  uint32_t      label; /* 0 for an empty slot */
+};
+
+#if defined(PDFOBJ_USE_THREADS)
+/* Stream objects waiting to be written out.
+ * The data is compressed by worker threads but streams are written in the
+ * order they were released so that the output does not depend on timing.
+ */
+struct pending_stream
+{
+  uint32_t               label;
+  uint16_t               generation;
+  int32_t                flags;
+  pdf_obj               *dict;    /* copy of the stream dictionary */
+  unsigned char         *raw;     /* stream data taken from the object */
+  int                    has_filters;
+  int                    state;
+  struct flate_job       job;
+  struct scratch_buffer  scratch[2];
+  struct pending_stream *next;
+};
+
+#define PENDING_QUEUED  0
+#define PENDING_RUNNING 1
+#define PENDING_DONE    2
+
+/* A band of rows of a large stream, compressed by a worker thread into
+ * a piece of raw deflate data. See write_stream_bands().
+ */
+struct stream_band
+{
+  const unsigned char   *data;    /* data of the whole stream */
+  struct decode_parms    parms;
+  int                    level;
+  size_t                 first;   /* rows, or bytes without predictor */
+  size_t                 count;
+  int                    last;
+  /* Results */
+  unsigned char         *output;
+  size_t                 output_length;
+  size_t                 filtered_length;
+  unsigned long          adler;
+  int                    error;
+  int                    state;
+  struct scratch_buffer  scratch[2];
+  struct stream_band    *next;
 };
+#endif /* PDFOBJ_USE_THREADS */
 
 struct pdf_indirect
 {
@@ -159,6 +295,7 @@ typedef struct pdf_string   pdf_string;
 typedef struct pdf_name     pdf_name;
 typedef struct pdf_array    pdf_array;
 typedef struct pdf_dict     pdf_dict;
+typedef struct pdf_dict_node pdf_dict_node;
 typedef struct pdf_stream   pdf_stream;
 typedef struct pdf_indirect pdf_indirect;
 
@@ -171,21 +308,62 @@ typedef struct xref_entry
   pdf_obj     *indirect;   /* used for imported objects        */
 } xref_entry;
 
+/* Entries of the cross-reference table of the output file */
+struct out_xref_entry
+{
+  uint32_t     field2;     /* offset in file or object stream  */
+  uint16_t     field3;     /* generation or index              */
+  uint8_t      type;       /* object storage type              */
+};
+
+/* Set of object numbers, one bit each, grown as needed */
+struct label_set
+{
+  unsigned char *bits;
+  size_t         size;     /* in bytes */
+};
+
 struct pdf_file
 {
   FILE         *file;
+  const char   *map;    /* contents of the file if mapped into memory */
   pdf_obj      *trailer;
   xref_entry   *xref_table;
   pdf_obj      *catalog;
   int           num_obj;
   int           file_size;
   int           version;
+  /* Where the trailer was found, see PDF_TRAILER_XXX */
+  int           trailer_type;
+  size_t        trailer_pos;
+  /* Pages found so far, indexed by page number - 1 */
+  pdf_page_info *pages;
+  int           num_pages;
+  int           page_count; /* 0: not indexed yet, -1: can't be indexed */
+  char         *cache_name; /* NULL if not cached */
+  struct pdf_cache_header *cache_key;
+  int           cache_dirty;
 };
 
+#define PDF_TRAILER_TABLE  1 /* after a cross-reference table */
+#define PDF_TRAILER_STREAM 2 /* dictionary of a cross-reference stream */
+
 static int error_out = 0;
 
 #define OBJSTM_MAX_OBJS  200
 /* the limit is only 100 for linearized PDF */
+#define OBJSTM_MAX_BYTES 65536
+
+/* Objects are collected in separate object streams by kind, so that
+ * objects needed together, e.g. to display a page, are found together.
+ * See objstm_kind().
+ */
+#define OBJSTM_KIND_OTHER   0
+#define OBJSTM_KIND_PAGE    1 /* pages and annotations */
+#define OBJSTM_KIND_FONT    2 /* fonts, descriptors and encodings */
+#define OBJSTM_KIND_OUTLINE 3 /* outline items */
+#define OBJSTM_KIND_NAMES   4 /* name and number tree nodes */
+#define OBJSTM_KINDS        5
 
 struct pdf_out {
   struct {
@@ -204,10 +382,14 @@ struct pdf_out {
     struct {
       int       level;
       int       use_predictor;
+      /* Settings for each class of streams, -1 for the above */
+      int       class_level[STREAM_CLASSES];
+      int       class_predictor[STREAM_CLASSES];
     } compression;
 
     int         enable_encrypt;
     int         use_objstm;
+    int         num_threads; /* requested by -j, 0 once handled */
   } options;
 
   struct {
@@ -215,28 +397,71 @@ struct pdf_out {
     size_t      file_position;
     int         line_position;
     size_t      compression_saved;
+    int         incompressible;   /* number of streams left uncompressed */
+    /* Output is collected here and written to file in large chunks */
+    char       *buffer;
+    size_t      buffer_used;
   } output;
 
+  /* Reused by filters when streams are written sequentially */
+  struct scratch_buffer scratch[2];
+
   struct {
     uint32_t    next_label;
-    uint32_t    max_ind_objects;
+    uint32_t    max_ind_objects; /* allocated entries of xref_table */
   } obj;
 
   pdf_sec      *sec_data;
 
   pdf_obj      *trailer;
   uint32_t      startxref;
-  xref_entry *  xref_table;
+  struct out_xref_entry *xref_table;
 
   pdf_obj      *xref_stream;
   pdf_obj      *output_stream;
-  pdf_obj      *current_objstm;
-  /* The following flag bits are (8,338,607+1)/8 bytes data
-   * each bit represenging if the object is freed.
-   * Where the value 8,338,607 is taken from PDF ref. manual, v.1.7,
-   * Appendix C, "Implementation Limits". 
-   */
-  char         *free_list;
+  pdf_obj      *current_objstm[OBJSTM_KINDS];
+  /* Length of the stream just written, to be flushed after "endobj" */
+  pdf_obj      *stream_length;
+  /* Objects which have been released (and written out) */
+  struct label_set free_list;
+
+  /* Merging of identical objects, see dedup_obj() */
+  struct {
+    struct dedup_entry *table;      /* NULL if not enabled */
+    size_t              size;       /* power of 2 */
+    size_t              count;
+    uint32_t           *alias;      /* label of the first copy, or 0 */
+    uint32_t            max_alias;
+    struct label_set    referenced; /* labels referred to in the output */
+    pdf_obj            *buffer;     /* objects are serialized here */
+    int                 merged;
+    size_t              saved;
+  } dedup;
+
+  /* Linearized output, see pdf_out_linearize() */
+  struct {
+    char               *filename;   /* NULL if not enabled */
+    char               *tmpname;    /* the document is written here first */
+    uint32_t           *labels;     /* new labels of objects read back */
+    uint32_t            num_labels;
+  } linear;
+
+#if defined(PDFOBJ_USE_THREADS)
+  struct {
+    int                    num_threads; /* 0 for sequential compression */
+    int                    num_started;
+    int                    num_pending;
+    int                    max_pending;
+    struct pending_stream *head, *tail;
+    struct pending_stream *next_job;    /* not yet taken by a worker */
+    struct stream_band    *next_band;
+    int                    quit;
+    pthread_t             *threads;
+    pthread_mutex_t        mutex;
+    pthread_cond_t         work_cond;
+    pthread_cond_t         done_cond;
+  } workers;
+#endif
 };
 
 #if defined(LIBDPX)
@@ -256,6 +481,8 @@ current_output (void)
 static void
 init_pdf_out_struct (pdf_out *p)
 {
+  int i;
+
   ASSERT(p);
 
   p->state.enc_mode = 0;
@@ -268,13 +495,22 @@ init_pdf_out_struct (pdf_out *p)
 
   p->options.compression.level = 9;
   p->options.compression.use_predictor = 1;
+  for (i = 0; i < STREAM_CLASSES; i++) {
+    p->options.compression.class_level[i]     = -1;
+    p->options.compression.class_predictor[i] = -1;
+  }
   p->options.enable_encrypt    = 0;
   p->options.use_objstm        = 1;
+  p->options.num_threads       = 0;
 
   p->output.file = NULL;
   p->output.file_position = 0;
   p->output.line_position = 0;
   p->output.compression_saved = 0;
+  p->output.incompressible    = 0;
+  p->output.buffer      = NULL;
+  p->output.buffer_used = 0;
+  memset(p->scratch, 0, sizeof(p->scratch));
 #if defined(LIBDPX)
   output_file_size = 0;
 #endif /* LIBDPX */
@@ -289,17 +525,43 @@ init_pdf_out_struct (pdf_out *p)
 
   p->xref_stream    = NULL;
   p->output_stream  = NULL;
-  p->current_objstm = NULL;
+  p->stream_length  = NULL;
+  memset(p->current_objstm, 0, sizeof(p->current_objstm));
+
+  p->free_list.bits = NULL;
+  p->free_list.size = 0;
+
+  memset(&p->dedup, 0, sizeof(p->dedup));
+  memset(&p->linear, 0, sizeof(p->linear));
 
-  p->free_list = NEW((PDF_NUM_INDIRECT_MAX+1)/8, char);
-  memset(p->free_list, 0, (PDF_NUM_INDIRECT_MAX+1)/8);
+#if defined(PDFOBJ_USE_THREADS)
+  memset(&p->workers, 0, sizeof(p->workers));
+#endif
 }
 
 static void
 clean_pdf_out_struct (pdf_out *p)
 {
-  if (p->free_list)
-    RELEASE(p->free_list);
+  if (p->free_list.bits)
+    RELEASE(p->free_list.bits);
+  if (p->dedup.table)
+    RELEASE(p->dedup.table);
+  if (p->dedup.alias)
+    RELEASE(p->dedup.alias);
+  if (p->dedup.referenced.bits)
+    RELEASE(p->dedup.referenced.bits);
+  if (p->linear.filename)
+    RELEASE(p->linear.filename);
+  if (p->linear.tmpname)
+    dpx_delete_temp_file(p->linear.tmpname, true);
+  if (p->linear.labels)
+    RELEASE(p->linear.labels);
+  if (p->output.buffer)
+    RELEASE(p->output.buffer);
+  if (p->scratch[0].data)
+    RELEASE(p->scratch[0].data);
+  if (p->scratch[1].data)
+    RELEASE(p->scratch[1].data);
   memset(p, 0, sizeof(pdf_out));
 }
 
@@ -313,20 +575,27 @@ static void     pdf_write_obj (pdf_out *p, pdf_obj *object);
 
 static void     set_objstm_data (pdf_obj *objstm, int *data);
 static int     *get_objstm_data (pdf_obj *objstm);
-static void     release_objstm  (pdf_obj *objstm);
+static void     release_objstm  (pdf_out *p, pdf_obj *objstm);
+static void     merge_objstm    (pdf_obj *dst, pdf_obj *src);
 
 static void     pdf_out_char (pdf_out *p, char c);
 static void     pdf_out_str  (pdf_out *p, const void *buffer, size_t length);
+static void     pdf_out_flush_buffer (pdf_out *p);
+static void     pdf_out_linearize    (pdf_out *p);
+
+static void     predictor_init  (void);
 
 static pdf_obj *pdf_new_ref      (pdf_out *p, pdf_obj *object);
 static void     release_indirect (pdf_indirect *data);
 static void     write_indirect   (pdf_out *p, pdf_indirect *indirect);
 
-static void     release_boolean (pdf_obj *data);
+static void     release_boolean (pdf_boolean *data);
 static void     write_boolean   (pdf_out *p, pdf_boolean *data);
 
 static void     write_null      (pdf_out *p);
 
+static void     pool_show_stats (void);
+
 static void     release_number  (pdf_number *number);
 static void     write_number    (pdf_out *p, pdf_number *number);
 
@@ -345,6 +614,16 @@ static void     release_dict    (pdf_dict *dict);
 static void     write_stream    (pdf_out *p, pdf_stream *stream);
 static void     release_stream  (pdf_stream *stream);
 
+static void     check_workers   (pdf_out *p);
+#if defined(PDFOBJ_USE_THREADS)
+static void     start_workers   (pdf_out *p, int num_threads);
+static void     stop_workers    (pdf_out *p);
+static void     defer_stream    (pdf_out *p, pdf_obj *object);
+static void     write_pending_stream (pdf_out *p);
+static size_t   write_stream_bands (pdf_out *p, struct flate_job *job,
+                                    size_t *filtered_length);
+#endif
+
 static void
 pdf_out_set_compression (pdf_out *p, int level)
 {
@@ -367,6 +646,68 @@ pdf_out_set_compression (pdf_out *p, int level)
   return;
 }
 
+static int
+stream_compression_level (pdf_out *p, int cls)
+{
+  if (p->options.compression.class_level[cls] >= 0)
+    return p->options.compression.class_level[cls];
+  return p->options.compression.level;
+}
+
+static int
+stream_use_predictor (pdf_out *p, int cls)
+{
+  if (p->options.compression.class_predictor[cls] >= 0)
+    return p->options.compression.class_predictor[cls];
+  return p->options.compression.use_predictor;
+}
+
+/* Set compression for classes of streams. SPEC is a comma separated list
+ * of CLASS=VALUE where CLASS is one of the names in stream_class_names[]
+ * and VALUE is a compression level (0-9), "predictor" or "nopredictor".
+ * Returns -1 if SPEC is invalid.
+ */
+int
+pdf_out_set_compression_policy (const char *spec)
+{
+  pdf_out    *p = current_output();
+  const char *next;
+
+  ASSERT(spec);
+
+  for (; *spec; spec = *next ? next + 1 : next) {
+    const char *value;
+    int         cls, len;
+
+    next  = strchr(spec, ',');
+    if (!next)
+      next = spec + strlen(spec);
+    value = memchr(spec, '=', next - spec);
+    if (!value)
+      return -1;
+    for (cls = 0; cls < STREAM_CLASSES; cls++) {
+      if (strlen(stream_class_names[cls]) == value - spec &&
+          !memcmp(spec, stream_class_names[cls], value - spec))
+        break;
+    }
+    if (cls == STREAM_CLASSES)
+      return -1;
+    value++;
+    len = next - value;
+    if (len == 1 && value[0] >= '0' && value[0] <= '9')
+      p->options.compression.class_level[cls] = value[0] - '0';
+    else if (len == 9 && !memcmp(value, "predictor", 9))
+      p->options.compression.class_predictor[cls] = 1;
+    else if (len == 11 && !memcmp(value, "nopredictor", 11))
+      p->options.compression.class_predictor[cls] = 0;
+    else
+      return -1;
+  }
+  check_workers(p);
+
+  return 0;
+}
+
 FILE *
 pdf_get_output_file (void)
 {
@@ -434,15 +775,40 @@ add_xref_entry (pdf_out *p,
   ASSERT(p);
 
   if (label >= p->obj.max_ind_objects) {
-    p->obj.max_ind_objects = (label/IND_OBJECTS_ALLOC_SIZE+1)*IND_OBJECTS_ALLOC_SIZE;
-    p->xref_table = RENEW(p->xref_table, p->obj.max_ind_objects, xref_entry);
+    uint32_t size = MAX(p->obj.max_ind_objects, IND_OBJECTS_ALLOC_SIZE);
+
+    while (size <= label)
+      size *= 2;
+    p->xref_table = RENEW(p->xref_table, size, struct out_xref_entry);
+    memset(p->xref_table + p->obj.max_ind_objects, 0,
+           (size - p->obj.max_ind_objects) * sizeof(struct out_xref_entry));
+    p->obj.max_ind_objects = size;
   }
 
   p->xref_table[label].type     = type;
   p->xref_table[label].field2   = field2;
   p->xref_table[label].field3   = field3;
-  p->xref_table[label].direct   = NULL;
-  p->xref_table[label].indirect = NULL;
+}
+
+static void
+label_set_add (struct label_set *set, uint32_t label)
+{
+  if (label / 8 >= set->size) {
+    size_t size = MAX(set->size, IND_OBJECTS_ALLOC_SIZE / 8);
+
+    while (size <= label / 8)
+      size *= 2;
+    set->bits = RENEW(set->bits, size, unsigned char);
+    memset(set->bits + set->size, 0, size - set->size);
+    set->size = size;
+  }
+  set->bits[label/8] |= (1 << (7-(label % 8)));
+}
+
+static int
+label_set_has (const struct label_set *set, uint32_t label)
+{
+  return label / 8 < set->size && (set->bits[label/8] & (1 << (7-(label % 8))));
 }
 
 #define BINARY_MARKER "%\344\360\355\370\n"
@@ -453,12 +819,34 @@ pdf_out_init (const char *filename,
               int ver_major, int ver_minor, int compression_level,
               int enable_encrypt,
               int enable_objstm,
-              int enable_predictor)
+              int enable_predictor,
+              int num_threads,
+              int enable_dedup,
+              int enable_linearize)
 {
   pdf_out  *p = current_output();
   char      v;
 
   init_pdf_out_struct(p);
+  predictor_init();
+
+  /* The document is written to a temporary file and rearranged when it
+   * is complete. No object streams are used for it.
+   */
+  if (enable_linearize) {
+    if (!filename)
+      WARN("Linearization is not supported for output to stdout.");
+    else if (enable_encrypt)
+      WARN("Linearization is not supported for encrypted output.");
+    else if (!(p->linear.tmpname = dpx_create_temp_file()))
+      WARN("Could not create a temporary file for linearization.");
+    else {
+      p->linear.filename = NEW(strlen(filename)+1, char);
+      strcpy(p->linear.filename, filename);
+      filename      = p->linear.tmpname;
+      enable_objstm = 0;
+    }
+  }
 
   pdf_out_set_version(p, ver_major, ver_minor);
   pdf_out_set_compression(p, compression_level);
@@ -501,6 +889,8 @@ pdf_out_init (const char *filename,
         ERROR("Unable to open file.");
     }
   }
+  p->output.buffer      = NEW(OUTPUT_BUFFER_SIZE, char);
+  p->output.buffer_used = 0;
   pdf_out_str(p, "%PDF-", strlen("%PDF-"));
   v = '0' + p->version.major;
   pdf_out_str(p, &v, 1);
@@ -524,9 +914,41 @@ pdf_out_init (const char *filename,
   p->state.enc_mode = 0;
   p->options.compression.use_predictor = enable_predictor;
 
+  if (enable_dedup) {
+    p->dedup.size       = 1024;
+    p->dedup.table      = NEW(p->dedup.size, struct dedup_entry);
+    memset(p->dedup.table, 0, p->dedup.size * sizeof(struct dedup_entry));
+  }
+
+  p->options.num_threads = num_threads;
+  check_workers(p);
+
   return p;
 }
 
+/* Start the worker threads requested by -j as soon as some class of
+ * streams is to be compressed. This is checked again once the compression
+ * policy is known, so that -z0 with a per-class level still uses them.
+ */
+static void
+check_workers (pdf_out *p)
+{
+  int cls, level = p->options.compression.level;
+
+  if (p->options.num_threads <= 0)
+    return;
+  for (cls = 0; cls < STREAM_CLASSES; cls++)
+    level = MAX(level, p->options.compression.class_level[cls]);
+  if (level <= 0)
+    return;
+#if defined(PDFOBJ_USE_THREADS)
+  start_workers(p, p->options.num_threads);
+#else
+  WARN("Multi-threaded compression not supported. Streams will be compressed sequentially.");
+#endif
+  p->options.num_threads = 0;
+}
+
 void
 pdf_out_set_encrypt (int keybits, int32_t permission,
                      const char *opasswd, const char *upasswd,
@@ -557,6 +979,23 @@ pdf_out_set_encrypt (int keybits, int32_t permission,
   }
 }
 
+/* Chain the free entries of the cross-reference table, like the labels
+ * of merged objects, into the list of free objects starting at object 0.
+ */
+static void
+link_free_entries (pdf_out *p)
+{
+  uint32_t label, next = 0;
+
+  for (label = p->obj.next_label; label-- > 1; ) {
+    if (p->xref_table[label].type == 0) {
+      p->xref_table[label].field2 = next;
+      next = label;
+    }
+  }
+  p->xref_table[0].field2 = next;
+}
+
 static void
 dump_xref_table (pdf_out *p)
 {
@@ -565,6 +1004,7 @@ dump_xref_table (pdf_out *p)
 
   ASSERT(p);
 
+  link_free_entries(p);
   pdf_out_str(p, "xref\n", 5);
 
   length = sprintf(buf, "%d %u\n", 0, p->obj.next_label);
@@ -613,8 +1053,12 @@ dump_xref_stream (pdf_out *p)
 
   ASSERT(p);
 
+  /* We need the xref entry for the xref stream right now */
+  add_xref_entry(p, p->obj.next_label - 1, 1, p->startxref, 0);
+  link_free_entries(p);
+
   /* determine the necessary size of the offset field */
-  pos = p->startxref; /* maximal offset value */
+  pos = MAX(p->startxref, p->obj.next_label); /* maximal offset value */
   poslen = 1;
   while (pos >>= 8)
     poslen++;
@@ -625,9 +1069,6 @@ dump_xref_stream (pdf_out *p)
   pdf_add_array(w, pdf_new_number(2));      /* generation          */
   pdf_add_dict(p->trailer, pdf_new_name("W"), w);
 
-  /* We need the xref entry for the xref stream right now */
-  add_xref_entry(p, p->obj.next_label - 1, 1, p->startxref, 0);
-
   for (i = 0; i < p->obj.next_label; i++) {
     size_t   j;
     uint16_t f3;
@@ -662,14 +1103,41 @@ pdf_out_flush (void)
   char     buf[16];
 
   if (p->output.file) {
-    int  length;
+    int  length, i;
 
-    /* Flush current object stream */
-    if (p->current_objstm) {
-      release_objstm(p->current_objstm);
-      p->current_objstm =NULL;
+    /* Flush current object streams. Small leftovers are merged so that
+     * short documents don't end up with an object stream for each kind.
+     */
+    {
+      pdf_obj *last = NULL;
+
+      for (i = 0; i < OBJSTM_KINDS; i++) {
+        pdf_obj *objstm = p->current_objstm[i];
+
+        if (!objstm)
+          continue;
+        p->current_objstm[i] = NULL;
+        if (last &&
+            get_objstm_data(last)[0] + get_objstm_data(objstm)[0] <= OBJSTM_MAX_OBJS &&
+            pdf_stream_length(last) + pdf_stream_length(objstm) < OBJSTM_MAX_BYTES) {
+          merge_objstm(last, objstm);
+        } else {
+          if (last)
+            release_objstm(p, last);
+          last = objstm;
+        }
+      }
+      if (last)
+        release_objstm(p, last);
     }
 
+#if defined(PDFOBJ_USE_THREADS)
+    /* Write out streams still waiting for compression */
+    while (p->workers.head)
+      write_pending_stream(p);
+    stop_workers(p);
+#endif
+
     /*
      * Label xref stream - we need the number of correct objects
      * for the xref stream dictionary (= trailer).
@@ -679,6 +1147,7 @@ pdf_out_flush (void)
       pdf_label_obj(p, p->xref_stream);
 
     /* Record where this xref is for trailer */
+    pdf_out_flush_buffer(p);
     p->startxref = p->output.file_position;
 
     pdf_add_dict(p->trailer,
@@ -694,11 +1163,21 @@ pdf_out_flush (void)
     /* Done with xref table */
     RELEASE(p->xref_table);
     p->xref_table = NULL;
+    if (p->dedup.buffer) {
+      pdf_release_obj(p->dedup.buffer);
+      p->dedup.buffer = NULL;
+    }
 
     pdf_out_str(p, "startxref\n", 10);
     length = sprintf(buf, "%u\n", p->startxref);
     pdf_out_str(p, buf, length);
     pdf_out_str(p, "%%EOF\n", 6);
+    pdf_out_flush_buffer(p);
+    MFCLOSE(p->output.file);
+    p->output.file = NULL;
+
+    if (p->linear.filename)
+      pdf_out_linearize(p);
 
 #if !defined(LIBDPX)
     MESG("\n");
@@ -707,6 +1186,15 @@ pdf_out_flush (void)
       if (p->options.compression.level > 0) {
         MESG("Compression saved %ld bytes\n", p->output.compression_saved);
       }
+      if (p->output.incompressible > 0) {
+        MESG("Incompressible streams left uncompressed: %d\n",
+             p->output.incompressible);
+      }
+      if (p->dedup.merged > 0) {
+        MESG("Identical objects merged: %d (%ld bytes)\n",
+             p->dedup.merged, p->dedup.saved);
+      }
+      pool_show_stats();
     }
 #if !defined(LIBDPX)
     MESG("%ld bytes written", p->output.file_position);
@@ -714,8 +1202,6 @@ pdf_out_flush (void)
     output_file_size = p->output.file_position;
 #endif /* !LIBDPX */
 
-    MFCLOSE(p->output.file);
-    p->output.file = NULL;
     p->output.file_position = 0;
     p->output.line_position = 0;
   }
@@ -754,9 +1240,18 @@ pdf_error_cleanup (void)
    * This routine is the cleanup required for an abnormal exit.
    * For now, simply close the file.
    */
-  if (p->output.file)
+#if defined(PDFOBJ_USE_THREADS)
+  stop_workers(p);
+#endif
+  if (p->output.file) {
+    pdf_out_flush_buffer(p);
     MFCLOSE(p->output.file);
+  }
   p->output.file = NULL;
+  if (p->linear.tmpname) {
+    dpx_delete_temp_file(p->linear.tmpname, true);
+    p->linear.tmpname = NULL;
+  }
 }
 
 
@@ -800,7 +1295,9 @@ pdf_out_char (pdf_out *p, char c)
     if (p->output_stream)
     pdf_add_stream(p->output_stream, &c, 1);
     else {
-      fputc(c, p->output.file);
+      if (p->output.buffer_used == OUTPUT_BUFFER_SIZE)
+        pdf_out_flush_buffer(p);
+      p->output.buffer[p->output.buffer_used++] = c;
       p->output.file_position += 1;
       if (c == '\n')
         p->output.line_position  = 0;
@@ -810,6 +1307,18 @@ pdf_out_char (pdf_out *p, char c)
   }
 }
 
+/* Write out buffered output to the file. */
+static void
+pdf_out_flush_buffer (pdf_out *p)
+{
+  ASSERT(p);
+
+  if (p->output.buffer_used > 0) {
+    fwrite(p->output.buffer, 1, p->output.buffer_used, p->output.file);
+    p->output.buffer_used = 0;
+  }
+}
+
 static char xchar[] = "0123456789abcdef";
 
 static void
@@ -832,7 +1341,14 @@ pdf_out_str (pdf_out *p, const void *buffer, size_t length)
     if (p->output_stream)
       pdf_add_stream(p->output_stream, buffer, length);
     else {
-      fwrite(buffer, 1, length, p->output.file);
+      if (p->output.buffer_used + length > OUTPUT_BUFFER_SIZE)
+        pdf_out_flush_buffer(p);
+      if (length >= OUTPUT_BUFFER_SIZE) /* Large stream data */
+        fwrite(buffer, 1, length, p->output.file);
+      else {
+        memcpy(p->output.buffer + p->output.buffer_used, buffer, length);
+        p->output.buffer_used += length;
+      }
       p->output.file_position += length;
       p->output.line_position += length;
       /* "foo\nbar\n "... */
@@ -871,6 +1387,89 @@ void pdf_out_white (pdf_out *p)
 
 #define INVALIDOBJ(o)  ((o) == NULL || (o)->type <= 0 || (o)->type > PDF_UNDEFINED)
 
+/* Size-class pools for small structures
+ *
+ * pdf_obj and the payload of numbers, booleans, dictionaries and
+ * indirect references are created and released in very large numbers.
+ * They are carved out of large blocks and released items are kept in a
+ * free list per size class (multiples of 8 bytes) for reuse. Blocks are
+ * never returned to the system. The free list link is kept in the last
+ * word of an item, so that the type of a released pdf_obj stays invalid.
+ * Only the main thread may allocate PDF objects.
+ */
+#define POOL_CLASSES    8
+#define POOL_BLOCK_SIZE 65536
+
+static struct {
+  void             *free_items;
+  size_t            num_blocks;
+  size_t            num_alloc;  /* total number of allocations */
+  size_t            in_use;
+  size_t            max_in_use;
+} obj_pools[POOL_CLASSES];
+
+#define POOL_CLASS(size) (((size) + 7) / 8 - 1)
+#define POOL_NEXT(item, c) (*(void **) ((char *) (item) + ((c) + 1) * 8 - sizeof(void *)))
+#define POOL_NEW(type)    ((type *) pool_alloc(sizeof(type)))
+#define POOL_RELEASE(ptr) pool_release((ptr), sizeof(*(ptr)))
+
+static void *
+pool_alloc (size_t size)
+{
+  size_t  c = POOL_CLASS(size);
+  void   *item;
+
+  ASSERT(c < POOL_CLASSES);
+
+  if (!obj_pools[c].free_items) {
+    size_t  item_size = (c + 1) * 8, i, n = POOL_BLOCK_SIZE / item_size;
+    char   *block     = NEW(POOL_BLOCK_SIZE, char);
+
+    for (i = n; i-- > 0; ) {
+      item = block + i * item_size;
+      POOL_NEXT(item, c) = obj_pools[c].free_items;
+      obj_pools[c].free_items = item;
+    }
+    obj_pools[c].num_blocks++;
+  }
+  item = obj_pools[c].free_items;
+  obj_pools[c].free_items = POOL_NEXT(item, c);
+
+  obj_pools[c].num_alloc++;
+  if (++obj_pools[c].in_use > obj_pools[c].max_in_use)
+    obj_pools[c].max_in_use = obj_pools[c].in_use;
+
+  return item;
+}
+
+static void
+pool_release (void *ptr, size_t size)
+{
+  size_t c = POOL_CLASS(size);
+
+  ASSERT(c < POOL_CLASSES);
+
+  POOL_NEXT(ptr, c) = obj_pools[c].free_items;
+  obj_pools[c].free_items = ptr;
+  obj_pools[c].in_use--;
+}
+
+static void
+pool_show_stats (void)
+{
+  size_t c;
+
+  MESG("Object pools (size: allocations/peak/blocks):\n");
+  for (c = 0; c < POOL_CLASSES; c++) {
+    if (obj_pools[c].num_blocks == 0)
+      continue;
+    MESG("  %2u bytes: %lu/%lu/%lu\n", (unsigned) ((c + 1) * 8),
+         (unsigned long) obj_pools[c].num_alloc,
+         (unsigned long) obj_pools[c].max_in_use,
+         (unsigned long) obj_pools[c].num_blocks);
+  }
+}
+
 static pdf_obj *
 pdf_new_obj(int type)
 {
@@ -879,7 +1478,7 @@ pdf_new_obj(int type)
   if (type > PDF_UNDEFINED || type < 0)
     ERROR("Invalid object type: %d", type);
 
-  result = NEW(1, pdf_obj);
+  result = POOL_NEW(pdf_obj);
   result->type  = type;
   result->data  = NULL;
   result->label      = 0;
@@ -982,20 +1581,38 @@ pdf_ref_obj (pdf_obj *object)
 static void
 release_indirect (pdf_indirect *data)
 {
-  RELEASE(data);
+  POOL_RELEASE(data);
 }
 
 static void
 write_indirect (pdf_out *p, pdf_indirect *indirect)
 {
-  int   length;
-  char  buf[64];
+  int      length;
+  char     buf[64];
+  uint32_t label = indirect->label;
 
   ASSERT(p);
-  ASSERT(!indirect->pf);
 
-  length = sprintf(buf, "%u %hu R",
-                   indirect->label, indirect->generation);
+  if (indirect->pf) {
+    /* Objects read back by pdf_out_linearize() */
+    ASSERT(p->linear.labels && label < p->linear.num_labels);
+    label = p->linear.labels[label];
+    if (label == 0) {
+      write_null(p);
+      return;
+    }
+    length = sprintf(buf, "%u 0 R", label);
+    pdf_out_str(p, buf, length);
+    return;
+  }
+
+  if (p->dedup.table) {
+    if (label < p->dedup.max_alias && p->dedup.alias[label])
+      label = p->dedup.alias[label];
+    else if (p->output_stream != p->dedup.buffer)
+      label_set_add(&p->dedup.referenced, label);
+  }
+  length = sprintf(buf, "%u %hu R", label, indirect->generation);
   pdf_out_str(p, buf, length);
 }
 
@@ -1037,7 +1654,7 @@ pdf_new_boolean (char value)
   pdf_boolean *data;
 
   result = pdf_new_obj(PDF_BOOLEAN);
-  data   = NEW(1, pdf_boolean);
+  data   = POOL_NEW(pdf_boolean);
   data->value  = value;
   result->data = data;
 
@@ -1045,9 +1662,9 @@ pdf_new_boolean (char value)
 }
 
 static void
-release_boolean (pdf_obj *data)
+release_boolean (pdf_boolean *data)
 {
-  RELEASE (data);
+  POOL_RELEASE(data);
 }
 
 static void
@@ -1079,7 +1696,7 @@ pdf_new_number (double value)
   pdf_number *data;
 
   result = pdf_new_obj(PDF_NUMBER);
-  data   = NEW(1, pdf_number);
+  data   = POOL_NEW(pdf_number);
   data->value  = value;
   result->data = data;
 
@@ -1089,7 +1706,7 @@ pdf_new_number (double value)
 static void
 release_number (pdf_number *data)
 {
-  RELEASE (data);
+  POOL_RELEASE(data);
 }
 
 static void
@@ -1325,25 +1942,135 @@ pdf_set_string (pdf_obj *object, unsigned char *str, unsigned length)
   }
 }
 
+/* Table of interned names, open addressing with linear probing. */
+static struct {
+  pdf_name **table;
+  size_t     size;  /* power of 2 */
+  size_t     count;
+} name_atoms = {NULL, 0, 0};
+
+/* Frequently used keys and values, interned in one go on first use */
+static const char *const common_names[] = {
+  "Type", "Subtype", "Length", "Filter", "FlateDecode", "DecodeParms",
+  "Resources", "Font", "XObject", "ExtGState", "ColorSpace", "Pattern",
+  "Shading", "ProcSet", "Contents", "MediaBox", "Parent", "Kids", "Count",
+  "Page", "Pages", "Annots", "Width", "Height", "BitsPerComponent",
+  "Image", "Form", "BBox", "Matrix", "Name", "BaseFont", "Encoding",
+  "FirstChar", "LastChar", "Widths", "FontDescriptor", "N", "First",
+  "ObjStm", "XRef", NULL
+};
+
+static size_t
+name_hash (const char *name, size_t length)
+{
+  size_t h = 5381;
+
+  while (length-- > 0)
+    h = (h << 5) + h + (unsigned char) *name++;
+
+  return h;
+}
+
+static pdf_name **
+name_atom_slot (const char *name, size_t length, size_t hash)
+{
+  size_t     i, mask = name_atoms.size - 1;
+  pdf_name  *atom;
+
+  for (i = hash & mask; (atom = name_atoms.table[i]) != NULL; i = (i + 1) & mask) {
+    if (atom->hash == hash && atom->length == length &&
+        (length == 0 || !memcmp(atom->name, name, length)))
+      break;
+  }
+
+  return &name_atoms.table[i];
+}
+
+static void
+name_atoms_grow (void)
+{
+  pdf_name **old_table = name_atoms.table;
+  size_t     old_size  = name_atoms.size, i;
+
+  name_atoms.size  = old_size ? 2 * old_size : 1024;
+  name_atoms.table = NEW(name_atoms.size, pdf_name *);
+  memset(name_atoms.table, 0, name_atoms.size * sizeof(pdf_name *));
+  for (i = 0; i < old_size; i++) {
+    pdf_name *atom = old_table[i];
+    if (atom)
+      *name_atom_slot(atom->name, atom->length, atom->hash) = atom;
+  }
+  if (old_table)
+    RELEASE(old_table);
+}
+
+static pdf_name *name_intern (const char *name);
+
+static void
+name_atoms_init (void)
+{
+  const char *const *p;
+
+  name_atoms_grow();
+  for (p = common_names; *p; p++)
+    name_intern(*p);
+}
+
+/* Returns interned pdf_name for NAME, or NULL if no such name was ever
+ * created (and hence no dictionary can contain it as a key).
+ */
+static pdf_name *
+name_lookup (const char *name)
+{
+  size_t length;
+
+  if (!name_atoms.table)
+    name_atoms_init();
+
+  length = strlen(name);
+  return *name_atom_slot(name, length, name_hash(name, length));
+}
+
+static pdf_name *
+name_intern (const char *name)
+{
+  pdf_name **slot, *atom;
+  size_t     length, hash;
+
+  if (!name_atoms.table)
+    name_atoms_init();
+
+  length = strlen(name);
+  hash   = name_hash(name, length);
+  slot   = name_atom_slot(name, length, hash);
+  if (*slot)
+    return *slot;
+
+  atom = (pdf_name *) NEW(sizeof(pdf_name) + length + 1, char);
+  atom->length = length;
+  atom->hash   = hash;
+  if (length != 0) {
+    atom->name = (char *) (atom + 1);
+    memcpy(atom->name, name, length);
+    atom->name[length] = '\0';
+  } else {
+    atom->name = NULL;
+  }
+  *slot = atom;
+  if (++name_atoms.count * 2 > name_atoms.size)
+    name_atoms_grow();
+
+  return atom;
+}
+
 /* Name does *not* include the /. */ 
 pdf_obj *
 pdf_new_name (const char *name)
 {
   pdf_obj  *result;
-  size_t    length;
-  pdf_name *data;
 
   result = pdf_new_obj(PDF_NAME);
-  data   = NEW (1, pdf_name);
-  result->data = data;
-  length = strlen(name);
-  if (length != 0) {
-    data->name = NEW(length+1, char);
-    memcpy(data->name, name, length);
-    data->name[length] = '\0';
-  } else {
-    data->name = NULL;
-  }
+  result->data = name_intern(name);
 
   return result;
 }
@@ -1357,7 +2084,7 @@ write_name (pdf_out *p, pdf_name *name)
   ASSERT(p);
 
   s      = name->name;
-  length = name->name ? strlen(name->name) : 0;
+  length = name->length;
   /*
    * From PDF Reference, 3rd ed., p.33:
    *
@@ -1393,11 +2120,8 @@ write_name (pdf_out *p, pdf_name *name)
 static void
 release_name (pdf_name *data)
 {
-  if (data->name != NULL) {
-    RELEASE(data->name);
-    data->name = NULL;
-  }
-  RELEASE(data);
+  /* Interned names are shared and kept until exit. */
+  (void) data;
 }
 
 char *
@@ -1622,21 +2346,22 @@ pdf_pop_array (pdf_obj *array)
 static void
 write_dict (pdf_out *p, pdf_dict *dict)
 {
+  pdf_dict_node *node;
+
 #if 0
   pdf_out_str (p, "<<\n", 3); /* dropping \n saves few kb. */
 #else
   pdf_out_str(p, "<<", 2);
 #endif
-  while (dict->key != NULL) {
-    pdf_write_obj(p, dict->key);
-    if (pdf_need_white(PDF_NAME, (dict->value)->type)) {
+  for (node = dict->first; node != NULL; node = node->next) {
+    pdf_write_obj(p, node->key);
+    if (pdf_need_white(PDF_NAME, (node->value)->type)) {
       pdf_out_white(p);
     }
-    pdf_write_obj(p, dict->value);
+    pdf_write_obj(p, node->value);
 #if 0
     pdf_out_char (file, '\n'); /* removing this saves few kb. */
 #endif
-    dict = dict->next;
   }
   pdf_out_str(p, ">>", 2);
 }
@@ -1648,10 +2373,12 @@ pdf_new_dict (void)
   pdf_dict *data;
 
   result = pdf_new_obj(PDF_DICT);
-  data   = NEW(1, pdf_dict);
-  data->key    = NULL;
-  data->value  = NULL;
-  data->next   = NULL;
+  data   = POOL_NEW(pdf_dict);
+  data->first     = NULL;
+  data->last      = NULL;
+  data->size      = 0;
+  data->hash_size = 0;
+  data->hash      = NULL;
   result->data = data;
 
   return result;
@@ -1660,101 +2387,131 @@ pdf_new_dict (void)
 static void
 release_dict (pdf_dict *data)
 {
-  pdf_dict *next;
+  pdf_dict_node *node, *next;
 
-  while (data != NULL && data->key != NULL) {
-    pdf_release_obj(data->key);
-    pdf_release_obj(data->value);
-    data->key   = NULL;
-    data->value = NULL;
-    next = data->next;
-    RELEASE(data);
-    data = next;
+  for (node = data->first; node != NULL; node = next) {
+    next = node->next;
+    pdf_release_obj(node->key);
+    pdf_release_obj(node->value);
+    node->key   = NULL;
+    node->value = NULL;
+    POOL_RELEASE(node);
   }
-  RELEASE(data);
+  if (data->hash)
+    RELEASE(data->hash);
+  POOL_RELEASE(data);
 }
 
-/* Array is ended by a node with NULL this pointer */
-/* pdf_add_dict returns 0 if the key is new and non-zero otherwise */
-int
-pdf_add_dict (pdf_obj *dict, pdf_obj *key, pdf_obj *value)
+static void
+dict_hash_insert (pdf_dict *data, pdf_dict_node *node)
 {
-  pdf_dict *data, *new_node;
+  size_t i, mask = data->hash_size - 1;
 
-  TYPECHECK(dict, PDF_DICT);
-  TYPECHECK(key,  PDF_NAME);
+  i = ((pdf_name *) node->key->data)->hash & mask;
+  while (data->hash[i] != NULL)
+    i = (i + 1) & mask;
+  data->hash[i] = node;
+}
 
-  /* It seems that NULL is sometimes used for null object... */
-  if (value != NULL && INVALIDOBJ(value))
-    ERROR("pdf_add_dict(): Passed invalid value");
+/* (Re)build the hash index for at least twice as many slots as entries. */
+static void
+dict_hash_rebuild (pdf_dict *data)
+{
+  pdf_dict_node *node;
+  size_t         hash_size = 32;
 
-  /* If this key already exists, simply replace the value */
-  for (data = dict->data; data->key != NULL; data = data->next) {
-    if (!strcmp(pdf_name_value(key), pdf_name_value(data->key))) {
-      /* Release the old value */
-      pdf_release_obj(data->value);
-      /* Release the new key (we don't need it) */
-      pdf_release_obj(key);
-      data->value = value;
-      return 1;
-    }
+  while (hash_size < 2 * data->size)
+    hash_size <<= 1;
+  if (hash_size != data->hash_size) {
+    data->hash      = RENEW(data->hash, hash_size, pdf_dict_node *);
+    data->hash_size = hash_size;
   }
-  /*
-   * We didn't find the key. We build a new "end" node and add
-   * the new key just before the end
-   */
-  new_node = NEW (1, pdf_dict);
-  new_node->key = NULL;
-  new_node->value = NULL;
-  new_node->next = NULL;
-  data->next  = new_node;
-  data->key   = key;
-  data->value = value;
-  return 0;
+  memset(data->hash, 0, hash_size * sizeof(pdf_dict_node *));
+  for (node = data->first; node != NULL; node = node->next)
+    dict_hash_insert(data, node);
 }
 
-#if 0
-void
-pdf_put_dict (pdf_obj *dict, const char *key, pdf_obj *value)
+/* Names are interned, so keys can be compared by pointer. */
+static pdf_dict_node *
+dict_find_node (pdf_dict *data, const pdf_name *key)
 {
-  pdf_dict *data;
+  pdf_dict_node *node;
 
-  TYPECHECK(dict, PDF_DICT);
+  if (data->hash) {
+    size_t i, mask = data->hash_size - 1;
 
-  if (!key) {
-    ERROR("pdf_put_dict(): Passed invalid key.");
+    for (i = key->hash & mask;
+         (node = data->hash[i]) != NULL; i = (i + 1) & mask) {
+      if (node->key->data == key)
+        return node;
+    }
+    return NULL;
   }
-  /* It seems that NULL is sometimes used for null object... */
-  if (value != NULL && INVALIDOBJ(value)) {
-    ERROR("pdf_add_dict(): Passed invalid value.");
+
+  for (node = data->first; node != NULL; node = node->next) {
+    if (node->key->data == key)
+      return node;
   }
 
-  data = dict->data;
+  return NULL;
+}
 
-  while (data->key != NULL) {
-    if (!strcmp(key, pdf_name_value(data->key))) {
-      pdf_release_obj(data->value);
-      data->value = value;
-      break;
-    }
-    data = data->next;
+/* pdf_add_dict returns 0 if the key is new and non-zero otherwise */
+int
+pdf_add_dict (pdf_obj *dict, pdf_obj *key, pdf_obj *value)
+{
+  pdf_dict      *data;
+  pdf_dict_node *node;
+
+  TYPECHECK(dict, PDF_DICT);
+  TYPECHECK(key,  PDF_NAME);
+
+  /* It seems that NULL is sometimes used for null object... */
+  if (value != NULL && INVALIDOBJ(value))
+    ERROR("pdf_add_dict(): Passed invalid value");
+
+  data = dict->data;
+  /* If this key already exists, simply replace the value */
+  node = dict_find_node(data, key->data);
+  if (node) {
+    /* Release the old value */
+    pdf_release_obj(node->value);
+    /* Release the new key (we don't need it) */
+    pdf_release_obj(key);
+    node->value = value;
+    return 1;
   }
 
-  /*
-   * If we didn't find the key, build a new "end" node and add
-   * the new key just before the end
-   */
-  if (data->key == NULL) {
-    pdf_dict *new_node;
+  /* We didn't find the key. Append it at the end. */
+  node = POOL_NEW(pdf_dict_node);
+  node->key   = key;
+  node->value = value;
+  node->next  = NULL;
+  if (data->last)
+    data->last->next = node;
+  else
+    data->first = node;
+  data->last = node;
+  data->size++;
+
+  if (data->hash && 2 * data->size <= data->hash_size)
+    dict_hash_insert(data, node);
+  else if (data->size > DICT_HASH_THRESHOLD)
+    dict_hash_rebuild(data);
 
-    new_node = NEW (1, pdf_dict);
-    new_node->key   = NULL;
-    new_node->value = NULL;
-    new_node->next  = NULL;
-    data->next  = new_node;
-    data->key   = pdf_new_name(key);
-    data->value = value;
+  return 0;
+}
+
+#if 0
+void
+pdf_put_dict (pdf_obj *dict, const char *key, pdf_obj *value)
+{
+  TYPECHECK(dict, PDF_DICT);
+
+  if (!key) {
+    ERROR("pdf_put_dict(): Passed invalid key.");
   }
+  pdf_add_dict(dict, pdf_new_name(key), value);
 }
 #endif
 
@@ -1762,15 +2519,13 @@ pdf_put_dict (pdf_obj *dict, const char *key, pdf_obj *value)
 void
 pdf_merge_dict (pdf_obj *dict1, pdf_obj *dict2)
 {
-  pdf_dict *data;
+  pdf_dict_node *node;
 
   TYPECHECK(dict1, PDF_DICT);
   TYPECHECK(dict2, PDF_DICT);
 
-  data = dict2->data;
-  while (data->key != NULL) {
-    pdf_add_dict(dict1, pdf_link_obj(data->key), pdf_link_obj(data->value));
-    data = data->next;
+  for (node = ((pdf_dict *) dict2->data)->first; node; node = node->next) {
+    pdf_add_dict(dict1, pdf_link_obj(node->key), pdf_link_obj(node->value));
   }
 }
 
@@ -1778,60 +2533,56 @@ int
 pdf_foreach_dict (pdf_obj *dict,
 		  int (*proc) (pdf_obj *, pdf_obj *, void *), void *pdata)
 {
-  int       error = 0;
-  pdf_dict *data;
+  int            error = 0;
+  pdf_dict_node *node;
 
   ASSERT(proc);
 
   TYPECHECK(dict, PDF_DICT);
 
-  data = dict->data;
+  node = ((pdf_dict *) dict->data)->first;
   while (!error &&
-	 data->key != NULL) {
-    error = proc(data->key, data->value, pdata);
-    data = data->next;
+	 node != NULL) {
+    error = proc(node->key, node->value, pdata);
+    node = node->next;
   }
 
   return error;
 }
 
-#define pdf_match_name(o,s) ((o) && (s) && !strcmp(((pdf_name *)(o)->data)->name, (s)))
 pdf_obj *
 pdf_lookup_dict (pdf_obj *dict, const char *name)
 {
-  pdf_dict *data;
+  pdf_dict_node *node;
+  pdf_name      *key;
 
   ASSERT(name);
 
   TYPECHECK(dict, PDF_DICT);
 
-  data = dict->data;
-  while (data->key != NULL) {
-    if (!strcmp(name, pdf_name_value(data->key))) {
-      return data->value;
-    }
-    data = data->next;
-  }
+  key = name_lookup(name);
+  if (!key)
+    return NULL;
+  node = dict_find_node(dict->data, key);
 
-  return NULL;
+  return node ? node->value : NULL;
 }
 
 /* Returns array of dictionary keys */
 pdf_obj *
 pdf_dict_keys (pdf_obj *dict)
 {
-  pdf_obj  *keys;
-  pdf_dict *data;
+  pdf_obj       *keys;
+  pdf_dict_node *node;
 
   TYPECHECK(dict, PDF_DICT);
 
   keys = pdf_new_array();
-  for (data = dict->data; (data &&
-			   data->key != NULL); data = data->next) {
+  for (node = ((pdf_dict *) dict->data)->first; node; node = node->next) {
     /* We duplicate name object rather than linking keys.
      * If we forget to free keys, broken PDF is generated.
      */
-    pdf_add_array(keys, pdf_new_name(pdf_name_value(data->key)));
+    pdf_add_array(keys, pdf_new_name(pdf_name_value(node->key)));
   }
 
   return keys;
@@ -1840,25 +2591,91 @@ pdf_dict_keys (pdf_obj *dict)
 void
 pdf_remove_dict (pdf_obj *dict, const char *name)
 {
-  pdf_dict *data, **data_p;
+  pdf_dict       *data;
+  pdf_dict_node  *node, *prev;
+  pdf_name       *key;
 
   TYPECHECK(dict, PDF_DICT);
 
-  data   = dict->data;
-  data_p = (pdf_dict **) (void *) &(dict->data);
-  while (data->key != NULL) {
-    if (pdf_match_name(data->key, name)) {
-      pdf_release_obj(data->key);
-      pdf_release_obj(data->value);
-      *data_p = data->next;
-      RELEASE(data);
+  if (!name || !(key = name_lookup(name)))
+    return;
+  data = dict->data;
+  for (prev = NULL, node = data->first; node != NULL;
+       prev = node, node = node->next) {
+    if (node->key->data == key)
       break;
+  }
+  if (!node)
+    return;
+
+  if (prev)
+    prev->next  = node->next;
+  else
+    data->first = node->next;
+  if (data->last == node)
+    data->last = prev;
+  data->size--;
+  pdf_release_obj(node->key);
+  pdf_release_obj(node->value);
+  POOL_RELEASE(node);
+
+  if (data->hash) {
+    if (data->size > DICT_HASH_THRESHOLD)
+      dict_hash_rebuild(data);
+    else {
+      RELEASE(data->hash);
+      data->hash      = NULL;
+      data->hash_size = 0;
     }
-    data_p = &(data->next);
-    data   = data->next;
   }
 }
 
+/* Make room for at least LENGTH more bytes in the stream buffer.
+ * The buffer grows by half its size at a time so that streams built
+ * from many small pieces are not copied over and over again.
+ */
+static void
+stream_grow (pdf_stream *data, size_t length)
+{
+  size_t size;
+
+  if (data->stream_length + length <= data->max_length)
+    return;
+  size = data->stream_length + length + STREAM_ALLOC_SIZE;
+  if (size < data->max_length + data->max_length / 2)
+    size = data->max_length + data->max_length / 2;
+  data->max_length = size;
+  data->stream     = RENEW(data->stream, data->max_length, unsigned char);
+}
+
+#ifdef HAVE_ZLIB
+/* Compress LENGTH bytes of DATA into the stream buffer of a stream with
+ * STREAM_COMPRESS_INCREMENTAL set.
+ */
+static void
+stream_deflate (pdf_stream *data, const void *stream_data, size_t length,
+                int flush)
+{
+  z_stream *z = data->deflate;
+  int       status;
+
+  z->next_in  = (unsigned char *) stream_data;
+  z->avail_in = length;
+  for (;;) {
+    stream_grow(data, 1);
+    z->next_out  = data->stream + data->stream_length;
+    z->avail_out = data->max_length - data->stream_length;
+    status = deflate(z, flush);
+    if (status == Z_STREAM_ERROR)
+      ERROR("Zlib error");
+    data->stream_length = data->max_length - z->avail_out;
+    if (flush == Z_FINISH ? status == Z_STREAM_END : z->avail_out > 0)
+      break;
+  }
+}
+
+#endif /* HAVE_ZLIB */
+
 pdf_obj *
 pdf_new_stream (int flags)
 {
@@ -1884,6 +2701,22 @@ pdf_new_stream (int flags)
   data->decodeparms.bits_per_component = 0;
   data->decodeparms.colors    = 0;
 
+#ifdef HAVE_ZLIB
+  data->deflate = NULL;
+  if ((flags & STREAM_COMPRESS) && (flags & STREAM_COMPRESS_INCREMENTAL)) {
+    pdf_out *p = current_output();
+
+    int      level = stream_compression_level(p, STREAM_CLASS_CONTENT);
+
+    if (level > 0) {
+      data->deflate = NEW(1, z_stream);
+      memset(data->deflate, 0, sizeof(z_stream));
+      if (deflateInit(data->deflate, level) != Z_OK)
+        ERROR("Zlib error");
+    }
+  }
+#endif
+
   result->data = data;
   result->flags |= OBJ_NO_OBJSTM;
 
@@ -1921,2414 +2754,5254 @@ pdf_stream_set_predictor (pdf_obj *stream,
  *   absolute differences heuristic and was first proposed by Lee Daniel
  *   Crocker in February 1995.
  */
-static unsigned char *
-filter_PNG15_apply_filter (unsigned char *raster,
-                           int32_t columns, int32_t rows,
-                           int8_t bpc, int8_t colors, int32_t *length)
-{
-  unsigned char *dst;
-  int      bits_per_pixel  = colors * bpc;
-  int      bytes_per_pixel = (bits_per_pixel + 7) / 8;
-  int32_t  rowbytes = columns * bytes_per_pixel;
-  int32_t  i, j;
-
-  ASSERT(raster && length);
-
-  /* Result */
-  dst = NEW((rowbytes+1)*rows, unsigned char);
-  *length = (rowbytes + 1) * rows;
+/* Row kernels for the PNG and TIFF predictors.
+ *
+ * The PNG kernels take the current row P and the previous row UP, each
+ * preceded by BPP zero bytes, so that the bytes left of the first pixel
+ * and the row above the first row read as zero without further tests.
+ * Besides the plain C versions there are SSE2 and AVX2 versions where
+ * the compiler supports them; predictor_init() picks the best one the
+ * processor can run.
+ */
+struct predictor_kernels
+{
+  void (*png_sums)  (const unsigned char *p, const unsigned char *up,
+                     int32_t rowbytes, int bpp, uint32_t *sum);
+  void (*png_apply) (int type,
+                     const unsigned char *p, const unsigned char *up,
+                     int32_t rowbytes, int bpp, unsigned char *dst);
+  void (*tiff2_8)   (const unsigned char *p, int32_t rowbytes, int colors,
+                     unsigned char *dst);
+  void (*tiff2_16)  (const unsigned char *p, int32_t rowbytes, int colors,
+                     unsigned char *dst);
+};
 
-  for (j = 0; j < rows; j++) {
-    int type = 0;
-    unsigned char *pp = dst + j * (rowbytes + 1);
-    unsigned char *p  = raster + j * rowbytes;
-    uint32_t sum[5]   = {0, 0, 0, 0, 0};
-    /* First calculated sum of values to make a heuristic guess
-     * of optimal predictor function.
-     */
-    for (i = 0; i < rowbytes; i++) {
-      int left  = (i - bytes_per_pixel >= 0) ? p[i - bytes_per_pixel] : 0;
-      int up    = (j > 0) ? *(p+i-rowbytes) : 0;
-      int uplft = (j > 0) ?
-                    ((i - bytes_per_pixel >= 0) ?
-                      *(p+i-rowbytes-bytes_per_pixel) : 0) : 0;
-      /* Type 0 -- None */
-      sum[0] += p[i];
-      /* Type 1 -- Sub */
-      sum[1] += abs((int) p[i] - left);
-      /* Type 2 -- Up */
-      sum[2] += abs((int) p[i] - up);
-      /* Type 3 -- Average */
-      {
-        int tmp = floor((up + left) / 2);
-        sum[3] += abs((int) p[i] - tmp);
-      }
-      /* Type 4 -- Peath */
-      {
-        int q = left + up - uplft;
-        int qa = abs(q - left), qb = abs(q - up), qc = abs(q - uplft);
-        if (qa <= qb && qa <= qc)
-          sum[4] += abs((int) p[i] - left);
-        else if (qb <= qc)
-          sum[4] += abs((int) p[i] - up);
-        else
-          sum[4] += abs((int) p[i] - uplft);
-      }
-    }
-    {
-      int min = sum[0], min_idx = 0;
-      for (i = 0; i < 5; i++) {
-        if (sum[i] < min) {
-          min = sum[i]; min_idx = i;
-        }
-      }
-      type = min_idx;
-    }
-    /* Now we actually apply filter. */
-    pp[0] = type;
-    switch (type) {
-    case 0:
-      memcpy(pp+1, p, rowbytes);
-      break;
-    case 1:
-      for (i = 0; i < rowbytes; i++) {
-        int left = (i - bytes_per_pixel >= 0) ? p[i - bytes_per_pixel] : 0;
-        pp[i+1] = p[i] - left;
-      }
-      break;
-    case 2:
-      for (i = 0; i < rowbytes; i++) {
-        int up  = (j > 0) ? *(p+i - rowbytes) : 0;
-        pp[i+1] = p[i] - up;
-      }
-      break;
-    case 3:
-      {
-        for (i = 0; i < rowbytes; i++) {
-          int up   = (j > 0) ? *(p+i-rowbytes) : 0;
-          int left = (i - bytes_per_pixel >= 0) ? p[i - bytes_per_pixel] : 0;
-          int tmp  = floor((up + left) / 2);
-          pp[i+1]  = p[i] - tmp;
-        }
-      }
-      break;
-    case 4: /* Peath */
-      {
-        for (i = 0; i < rowbytes; i++) {
-          int up   = (j > 0) ? *(p+i-rowbytes) : 0;
-          int left = (i - bytes_per_pixel >= 0) ? p[i - bytes_per_pixel] : 0;
-          int uplft = (j > 0) ?
-                        ((i - bytes_per_pixel >= 0) ?
-                          *(p+i-rowbytes-bytes_per_pixel) : 0) : 0;
-          int q = left + up - uplft;
-          int qa = abs(q - left), qb = abs(q - up), qc = abs(q - uplft);
-          if (qa <= qb && qa <= qc)
-            pp[i+1] = p[i] - left;
-          else if (qb <= qc)
-            pp[i+1] = p[i] - up;
-          else
-            pp[i+1] = p[i] - uplft;
-        }
-      }
-      break;
-    }
-  }
+static int
+paeth_predictor (int left, int up, int uplft)
+{
+  int pa = abs(up - uplft), pb = abs(left - uplft);
+  int pc = abs(left + up - 2 * uplft);
 
-  return  dst;
+  if (pa <= pb && pa <= pc)
+    return left;
+  else if (pb <= pc)
+    return up;
+  return uplft;
 }
 
-/* TIFF predictor filter support
- * This modifies "raster" itself!
+/* Sums of absolute differences between the data and the prediction
+ * for each of the five PNG filter types.
  */
 static void
-apply_filter_TIFF2_1_2_4 (unsigned char *raster,
-                          int32_t width, int32_t height,
-                          int8_t bpc, int8_t num_comp)
+png_sums_c (const unsigned char *p, const unsigned char *up,
+            int32_t rowbytes, int bpp, uint32_t *sum)
 {
-  int32_t   rowbytes = (bpc * num_comp * width + 7) / 8;
-  uint8_t   mask     = (1 << bpc) - 1;
-  uint16_t *prev;
-  int32_t   i, j;
+  int32_t i;
 
-  ASSERT(raster);
-  ASSERT( bpc > 0 && bpc <= 8 );
+  for (i = 0; i < rowbytes; i++) {
+    int x = p[i], left = p[i - bpp], above = up[i], uplft = up[i - bpp];
 
-  prev = NEW(num_comp, uint16_t);
+    sum[0] += x;
+    sum[1] += abs(x - left);
+    sum[2] += abs(x - above);
+    sum[3] += abs(x - ((left + above) >> 1));
+    sum[4] += abs(x - paeth_predictor(left, above, uplft));
+  }
+}
 
-  /* Generic routine for 1 to 16 bit.
-   * It supports, e.g., 7 bpc images too.
-   * Actually, it is not necessary to have 16 bit inbuf and outbuf
-   * since we only need 1, 2, and 4 bit support here. 8 bit is enough.
-   */
-  for (j = 0; j < height; j++) {
-    int32_t  k, l, inbits, outbits;
-    uint16_t inbuf, outbuf;
-    int      c;
+static void
+png_apply_c (int type, const unsigned char *p, const unsigned char *up,
+             int32_t rowbytes, int bpp, unsigned char *dst)
+{
+  int32_t i;
 
-    memset(prev, 0, sizeof(uint16_t)*num_comp);
-    inbuf = outbuf = 0; inbits = outbits = 0;
-    l = k = j * rowbytes;
-    for (i = 0; i < width; i++) {
-      for (c = 0; c < num_comp; c++) {
-        uint8_t cur;
-        int8_t  sub;
-        if (inbits < bpc) { /* need more byte */
-          inbuf   = (inbuf << 8) | raster[l]; l++;
-          inbits += 8;
-        }
-        cur     = (inbuf >> (inbits - bpc)) & mask;
-        inbits -= bpc; /* consumed bpc bits */
-        sub     = cur - prev[c];
-        prev[c] = cur;
-        if (sub < 0)
-          sub += (1 << bpc);
-        /* Append newly filtered component value */
-        outbuf   = (outbuf << bpc) | sub;
-        outbits += bpc;
-        /* flush */
-        if (outbits >= 8) {
-          raster[k] = (outbuf >> (outbits - 8)); k++;
-          outbits  -= 8;
-        }
-      }
-    }
-    if (outbits > 0) {
-      raster[k] = (outbuf << (8 - outbits));
-      k++;
-    }
+  switch (type) {
+  case 0:
+    memcpy(dst, p, rowbytes);
+    break;
+  case 1:
+    for (i = 0; i < rowbytes; i++)
+      dst[i] = p[i] - p[i - bpp];
+    break;
+  case 2:
+    for (i = 0; i < rowbytes; i++)
+      dst[i] = p[i] - up[i];
+    break;
+  case 3:
+    for (i = 0; i < rowbytes; i++)
+      dst[i] = p[i] - ((p[i - bpp] + up[i]) >> 1);
+    break;
+  case 4: /* Paeth */
+    for (i = 0; i < rowbytes; i++)
+      dst[i] = p[i] - paeth_predictor(p[i - bpp], up[i], up[i - bpp]);
+    break;
   }
-  RELEASE(prev);
 }
 
-static unsigned char *
-filter_TIFF2_apply_filter (unsigned char *raster,
-                           int32_t columns, int32_t rows,
-                           int8_t bpc, int8_t colors, int32_t *length)
+/* TIFF predictor 2 for one row of 8 bit components */
+static void
+tiff2_8_c (const unsigned char *p, int32_t rowbytes, int colors,
+           unsigned char *dst)
 {
-  unsigned char *dst;
-  uint16_t      *prev;
-  int32_t        rowbytes = (bpc * colors * columns + 7) / 8;
-  int32_t        i, j;
+  int32_t k;
 
-  ASSERT(raster && length);
+  for (k = 0; k < colors && k < rowbytes; k++)
+    dst[k] = p[k];
+  for (; k < rowbytes; k++)
+    dst[k] = p[k] - p[k - colors];
+}
 
-  dst = NEW(rowbytes*rows, unsigned char);
-  memcpy(dst, raster, rowbytes*rows);
-  *length = rowbytes * rows;
+/* Same for 16 bit components stored big-endian, starting at byte K */
+static void
+tiff2_16_from (const unsigned char *p, int32_t k, int32_t rowbytes,
+               int32_t stride, unsigned char *dst)
+{
+  for (; k + 1 < rowbytes; k += 2) {
+    uint16_t cur  = (p[k] << 8) | p[k + 1];
+    uint16_t prev = (p[k - stride] << 8) | p[k - stride + 1];
+    uint16_t sub  = cur - prev;
 
-  switch (bpc) {
-  case 1: case 2: case 4:
-    apply_filter_TIFF2_1_2_4(dst, columns, rows, bpc, colors);
-    break;
+    dst[k]     = (sub >> 8) & 0xff;
+    dst[k + 1] = sub & 0xff;
+  }
+}
 
-  case 8:
-    prev = NEW(colors, uint16_t);
-    for (j = 0; j < rows; j++) {
-      memset(prev, 0, sizeof(uint16_t)*colors);
-      for (i = 0; i < columns; i++) {
-        int     c;
-        int32_t pos = colors * (columns * j + i);
-        for (c = 0; c < colors; c++) {
-          uint8_t cur = raster[pos+c];
-          int32_t sub = cur - prev[c];
-          prev[c]     = cur;
-          dst[pos+c]  = sub;
-        }
-      }
-    }
-    RELEASE(prev);
-    break;
+static void
+tiff2_16_c (const unsigned char *p, int32_t rowbytes, int colors,
+            unsigned char *dst)
+{
+  int32_t k, stride = 2 * colors;
 
-  case 16:
-    prev = NEW(colors, uint16_t);
-    for (j = 0; j < rows; j++) {
-      memset(prev, 0, sizeof(uint16_t)*colors);
-      for (i = 0; i < columns; i++) {
-        int     c;
-        int32_t pos = 2 * colors * (columns * j + i);
-        for (c = 0; c < colors; c++) {
-          uint16_t cur   = ((uint8_t)raster[pos+2*c])*256 +
-                             (uint8_t)raster[pos+2*c+1];
-          uint16_t sub   = cur - prev[c];
-          prev[c]        = cur;
-          dst[pos+2*c  ] = (sub >> 8) & 0xff;
-          dst[pos+2*c+1] = sub & 0xff;
-        }
-      }
-    }
-    RELEASE(prev);
-    break;
+  for (k = 0; k < stride && k < rowbytes; k++)
+    dst[k] = p[k];
+  tiff2_16_from(p, k, rowbytes, stride, dst);
+}
 
-  }
+#if defined(PDFOBJ_USE_SIMD)
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
 
-  return  dst;
+/* floor((a + b) / 2) for unsigned bytes; pavgb rounds up */
+static inline SSE2 __m128i
+avg_floor_sse2 (__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b),
+                      _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
 }
 
-static pdf_obj *
-filter_create_predictor_dict (int predictor, int32_t columns,
-                              int bpc, int colors)
+static inline SSE2 __m128i
+abs_epi16_sse2 (__m128i v)
 {
-  pdf_obj *parms;
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
 
-  parms = pdf_new_dict();
-  pdf_add_dict(parms, pdf_new_name("BitsPerComponent"), pdf_new_number(bpc));
-  pdf_add_dict(parms, pdf_new_name("Colors"),  pdf_new_number(colors));
-  pdf_add_dict(parms, pdf_new_name("Columns"), pdf_new_number(columns));
-  pdf_add_dict(parms, pdf_new_name("Predictor"), pdf_new_number(predictor));
+/* Paeth predictor on 16 bit lanes */
+static inline SSE2 __m128i
+paeth_epi16_sse2 (__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = abs_epi16_sse2(_mm_sub_epi16(b, c));
+  __m128i pb = abs_epi16_sse2(_mm_sub_epi16(a, c));
+  __m128i pc = abs_epi16_sse2(_mm_sub_epi16(_mm_add_epi16(a, b),
+                                            _mm_add_epi16(c, c)));
+  __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb),
+                               _mm_cmpgt_epi16(pa, pc));
+  __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+  __m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b),
+                                _mm_and_si128(not_b, c));
 
-  return  parms;
+  return _mm_or_si128(_mm_andnot_si128(not_a, a),
+                      _mm_and_si128(not_a, b_or_c));
 }
 
-static void
-write_stream (pdf_out *p, pdf_stream *stream)
+static inline SSE2 __m128i
+paeth_sse2 (__m128i a, __m128i b, __m128i c)
 {
-  unsigned char *filtered;
-  size_t         filtered_length;
-#ifdef HAVE_ZLIB
-  uLong          buffer_length;
-#else
-  size_t         buffer_length;
-#endif
-  unsigned char *buffer;
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo, hi;
 
-  ASSERT(p);
+  lo = paeth_epi16_sse2(_mm_unpacklo_epi8(a, zero),
+                        _mm_unpacklo_epi8(b, zero),
+                        _mm_unpacklo_epi8(c, zero));
+  hi = paeth_epi16_sse2(_mm_unpackhi_epi8(a, zero),
+                        _mm_unpackhi_epi8(b, zero),
+                        _mm_unpackhi_epi8(c, zero));
 
-  /*
-   * Always work from a copy of the stream. All filters read from
-   * "filtered" and leave their result in "filtered".
-   */
-#if 0
-  filtered = NEW(stream->stream_length + 1, unsigned char);
-#endif
-  filtered = NEW(stream->stream_length, unsigned char);
-  memcpy(filtered, stream->stream, stream->stream_length);
-  filtered_length = stream->stream_length;
+  return _mm_packus_epi16(lo, hi);
+}
 
-  /* PDF/A requires Metadata to be not filtered. */
-  {
-    pdf_obj *type;
-    type = pdf_lookup_dict(stream->dict, "Type");
-    if (type && !strcmp("Metadata", pdf_name_value(type))) {
-      stream->_flags &= ~STREAM_COMPRESS;
-    }
-  }
+static inline SSE2 uint32_t
+hsum_sse2 (__m128i v)
+{
+  return (uint32_t) (_mm_cvtsi128_si32(v) +
+                     _mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+}
 
-#ifdef HAVE_ZLIB
-  /* Apply compression filter if requested */
-  if (stream->stream_length > 0 &&
-      (stream->_flags & STREAM_COMPRESS) &&
-      p->options.compression.level > 0) {
-    pdf_obj *filters;
-
-    /* First apply predictor filter if requested. */
-    if ( p->options.compression.use_predictor &&
-        (stream->_flags & STREAM_USE_PREDICTOR) &&
-        !pdf_lookup_dict(stream->dict, "DecodeParms")) {
-      int      bits_per_pixel  = stream->decodeparms.colors *
-                                   stream->decodeparms.bits_per_component;
-      int32_t  len  = (stream->decodeparms.columns * bits_per_pixel + 7) / 8;
-      int32_t  rows = stream->stream_length / len;
-      unsigned char *filtered2 = NULL;
-      int32_t        length2 = stream->stream_length;
-      pdf_obj       *parms;
-
-      parms = filter_create_predictor_dict(stream->decodeparms.predictor,
-                                        stream->decodeparms.columns,
-                                        stream->decodeparms.bits_per_component,
-                                        stream->decodeparms.colors);
-
-      switch (stream->decodeparms.predictor) {
-      case 2: /* TIFF2 */
-        filtered2 = filter_TIFF2_apply_filter(filtered,
-                                         stream->decodeparms.columns,
-                                         rows,
-                                         stream->decodeparms.bits_per_component,
-                                         stream->decodeparms.colors, &length2);
-        break;
-      case 15: /* PNG optimun */
-        filtered2 = filter_PNG15_apply_filter(filtered,
-                                         stream->decodeparms.columns,
-                                         rows,
-                                         stream->decodeparms.bits_per_component,
-                                         stream->decodeparms.colors, &length2);
-        break;
-      default:
-        WARN("Unknown/unsupported Predictor function %d.",
-             stream->decodeparms.predictor);
-        break;
-      }
-      if (parms && filtered2) {
-        RELEASE(filtered);
-        filtered = filtered2;
-        filtered_length = length2;
-        pdf_add_dict(stream->dict, pdf_new_name("DecodeParms"), parms);
-      }
-    }
-
-    filters = pdf_lookup_dict(stream->dict, "Filter");
-
-    buffer_length = filtered_length + filtered_length/1000 + 14;
-    buffer = NEW(buffer_length, unsigned char);
-    {
-      pdf_obj *filter_name = pdf_new_name("FlateDecode");
+static SSE2 void
+png_sums_sse2 (const unsigned char *p, const unsigned char *up,
+               int32_t rowbytes, int bpp, uint32_t *sum)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero, s4 = zero;
+  int32_t i;
 
-      if (filters)
-        /*
-         * FlateDecode is the first filter to be applied to the stream.
-         */
-        pdf_unshift_array(filters, filter_name);
-      else
-        /*
-         * Adding the filter as a name instead of a one-element array
-         * is crucial because otherwise Adobe Reader cannot read the
-         * cross-reference stream any more, cf. the PDF v1.5 Errata.
-         */
-        pdf_add_dict(stream->dict, pdf_new_name("Filter"), filter_name);
-    }
-#ifdef HAVE_ZLIB_COMPRESS2    
-    if (compress2(buffer, &buffer_length, filtered,
-        filtered_length, p->options.compression.level)) {
-      ERROR("Zlib error");
-    }
-#else 
-    if (compress(buffer, &buffer_length, filtered,
-        filtered_length)) {
-      ERROR ("Zlib error");
-    }
-#endif /* HAVE_ZLIB_COMPRESS2 */
-    RELEASE(filtered);
-    p->output.compression_saved +=
-      filtered_length - buffer_length
-        - (filters ? strlen("/FlateDecode "): strlen("/Filter/FlateDecode\n"));
+  for (i = 0; i + 16 <= rowbytes; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (p  + i));
+    __m128i a = _mm_loadu_si128((const __m128i *) (p  + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *) (up + i));
+    __m128i c = _mm_loadu_si128((const __m128i *) (up + i - bpp));
 
-    filtered        = buffer;
-    filtered_length = buffer_length;
+    s0 = _mm_add_epi64(s0, _mm_sad_epu8(x, zero));
+    s1 = _mm_add_epi64(s1, _mm_sad_epu8(x, a));
+    s2 = _mm_add_epi64(s2, _mm_sad_epu8(x, b));
+    s3 = _mm_add_epi64(s3, _mm_sad_epu8(x, avg_floor_sse2(a, b)));
+    s4 = _mm_add_epi64(s4, _mm_sad_epu8(x, paeth_sse2(a, b, c)));
   }
-#endif /* HAVE_ZLIB */
+  sum[0] += hsum_sse2(s0);
+  sum[1] += hsum_sse2(s1);
+  sum[2] += hsum_sse2(s2);
+  sum[3] += hsum_sse2(s3);
+  sum[4] += hsum_sse2(s4);
+  png_sums_c(p + i, up + i, rowbytes - i, bpp, sum);
+}
 
-  /* AES will change the size of data! */
-  if (p->state.enc_mode) {
-    unsigned char *cipher = NULL;
-    size_t         cipher_len = 0;
-    pdf_encrypt_data(p->sec_data, filtered, filtered_length, &cipher, &cipher_len);
-    RELEASE(filtered);
-    filtered        = cipher;
-    filtered_length = cipher_len;
-  }
+static SSE2 void
+png_apply_sse2 (int type, const unsigned char *p, const unsigned char *up,
+                int32_t rowbytes, int bpp, unsigned char *dst)
+{
+  int32_t i;
 
-  #if 0
-  /*
-   * An optional end-of-line marker preceding the "endstream" is
-   * not part of stream data. See, PDF Reference 4th ed., p. 38.
-   */
-  /* Add a '\n' if the last character wasn't one */
-  if (filtered_length > 0 &&
-      filtered[filtered_length-1] != '\n') {
-    filtered[filtered_length] = '\n';
-    filtered_length++;
+  if (type == 0) {
+    memcpy(dst, p, rowbytes);
+    return;
   }
-#endif
-
-  pdf_add_dict(stream->dict,
-	       pdf_new_name("Length"), pdf_new_number(filtered_length));
+  for (i = 0; i + 16 <= rowbytes; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (p  + i));
+    __m128i a = _mm_loadu_si128((const __m128i *) (p  + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *) (up + i));
+    __m128i pred;
 
-  pdf_write_obj(p, stream->dict);
+    switch (type) {
+    case 1:
+      pred = a;
+      break;
+    case 2:
+      pred = b;
+      break;
+    case 3:
+      pred = avg_floor_sse2(a, b);
+      break;
+    default:
+      pred = paeth_sse2(a, b,
+                        _mm_loadu_si128((const __m128i *) (up + i - bpp)));
+      break;
+    }
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_sub_epi8(x, pred));
+  }
+  png_apply_c(type, p + i, up + i, rowbytes - i, bpp, dst + i);
+}
 
-  pdf_out_str(p, "\nstream\n", 8);
+static SSE2 void
+tiff2_8_sse2 (const unsigned char *p, int32_t rowbytes, int colors,
+              unsigned char *dst)
+{
+  int32_t k;
 
-  if (filtered_length > 0)
-    pdf_out_str(p, filtered, filtered_length);
-  RELEASE(filtered);
+  for (k = 0; k < colors && k < rowbytes; k++)
+    dst[k] = p[k];
+  for (; k + 16 <= rowbytes; k += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (p + k));
+    __m128i y = _mm_loadu_si128((const __m128i *) (p + k - colors));
 
-  /*
-   * This stream length "object" gets reset every time write_stream is
-   * called for the stream object.
-   * If this stream gets written more than once with different
-   * filters, this could be a problem.
-   */
+    _mm_storeu_si128((__m128i *) (dst + k), _mm_sub_epi8(x, y));
+  }
+  for (; k < rowbytes; k++)
+    dst[k] = p[k] - p[k - colors];
+}
 
-  pdf_out_str(p, "\n", 1);
-  pdf_out_str(p, "endstream", 9);
+static inline SSE2 __m128i
+bswap16_sse2 (__m128i v)
+{
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
 }
 
-static void
-release_stream (pdf_stream *stream)
+static SSE2 void
+tiff2_16_sse2 (const unsigned char *p, int32_t rowbytes, int colors,
+               unsigned char *dst)
 {
-  pdf_release_obj(stream->dict);
-  stream->dict = NULL;
+  int32_t k, stride = 2 * colors;
 
-  if (stream->stream) {
-    RELEASE(stream->stream);
-    stream->stream = NULL;
-  }
+  for (k = 0; k < stride && k < rowbytes; k++)
+    dst[k] = p[k];
+  for (; k + 16 <= rowbytes; k += 16) {
+    __m128i x = bswap16_sse2(_mm_loadu_si128((const __m128i *) (p + k)));
+    __m128i y = bswap16_sse2(_mm_loadu_si128((const __m128i *) (p + k - stride)));
 
-  if (stream->objstm_data) {
-    RELEASE(stream->objstm_data);
-    stream->objstm_data = NULL;
+    _mm_storeu_si128((__m128i *) (dst + k),
+                     bswap16_sse2(_mm_sub_epi16(x, y)));
   }
+  tiff2_16_from(p, k, rowbytes, stride, dst);
+}
 
-  RELEASE(stream);
+/* The AVX2 versions work the same way on 32 bytes at a time. Unpacking
+ * and packing work within 128 bit lanes, so the byte order is kept.
+ */
+static inline AVX2 __m256i
+avg_floor_avx2 (__m256i a, __m256i b)
+{
+  return _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                         _mm256_and_si256(_mm256_xor_si256(a, b),
+                                          _mm256_set1_epi8(1)));
 }
 
-pdf_obj *
-pdf_stream_dict (pdf_obj *stream)
+static inline AVX2 __m256i
+paeth_epi16_avx2 (__m256i a, __m256i b, __m256i c)
 {
-  pdf_stream *data;
+  __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+  __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+  __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b),
+                                                 _mm256_add_epi16(c, c)));
+  __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+                                  _mm256_cmpgt_epi16(pa, pc));
+  __m256i not_b = _mm256_cmpgt_epi16(pb, pc);
 
-  TYPECHECK(stream, PDF_STREAM);
+  return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a);
+}
 
-  data = stream->data;
+static inline AVX2 __m256i
+paeth_avx2 (__m256i a, __m256i b, __m256i c)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo, hi;
 
-  return data->dict;
+  lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero),
+                        _mm256_unpacklo_epi8(b, zero),
+                        _mm256_unpacklo_epi8(c, zero));
+  hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero),
+                        _mm256_unpackhi_epi8(b, zero),
+                        _mm256_unpackhi_epi8(c, zero));
+
+  return _mm256_packus_epi16(lo, hi);
 }
 
-const void *
-pdf_stream_dataptr (pdf_obj *stream)
+static inline AVX2 uint32_t
+hsum_avx2 (__m256i v)
 {
-  pdf_stream *data;
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
 
-  TYPECHECK(stream, PDF_STREAM);
+  return (uint32_t) (_mm_cvtsi128_si32(s) +
+                     _mm_cvtsi128_si32(_mm_srli_si128(s, 8)));
+}
 
-  data = stream->data;
+static AVX2 void
+png_sums_avx2 (const unsigned char *p, const unsigned char *up,
+               int32_t rowbytes, int bpp, uint32_t *sum)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i s0 = zero, s1 = zero, s2 = zero, s3 = zero, s4 = zero;
+  int32_t i;
 
-  return (const void *) data->stream;
+  for (i = 0; i + 32 <= rowbytes; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (p  + i));
+    __m256i a = _mm256_loadu_si256((const __m256i *) (p  + i - bpp));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (up + i));
+    __m256i c = _mm256_loadu_si256((const __m256i *) (up + i - bpp));
+
+    s0 = _mm256_add_epi64(s0, _mm256_sad_epu8(x, zero));
+    s1 = _mm256_add_epi64(s1, _mm256_sad_epu8(x, a));
+    s2 = _mm256_add_epi64(s2, _mm256_sad_epu8(x, b));
+    s3 = _mm256_add_epi64(s3, _mm256_sad_epu8(x, avg_floor_avx2(a, b)));
+    s4 = _mm256_add_epi64(s4, _mm256_sad_epu8(x, paeth_avx2(a, b, c)));
+  }
+  sum[0] += hsum_avx2(s0);
+  sum[1] += hsum_avx2(s1);
+  sum[2] += hsum_avx2(s2);
+  sum[3] += hsum_avx2(s3);
+  sum[4] += hsum_avx2(s4);
+  png_sums_c(p + i, up + i, rowbytes - i, bpp, sum);
 }
 
-int
-pdf_stream_length (pdf_obj *stream)
+static AVX2 void
+png_apply_avx2 (int type, const unsigned char *p, const unsigned char *up,
+                int32_t rowbytes, int bpp, unsigned char *dst)
 {
-  pdf_stream *data;
+  int32_t i;
 
-  TYPECHECK(stream, PDF_STREAM);
-
-  data = stream->data;
+  if (type == 0) {
+    memcpy(dst, p, rowbytes);
+    return;
+  }
+  for (i = 0; i + 32 <= rowbytes; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (p  + i));
+    __m256i a = _mm256_loadu_si256((const __m256i *) (p  + i - bpp));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (up + i));
+    __m256i pred;
 
-  return (int) data->stream_length;
+    switch (type) {
+    case 1:
+      pred = a;
+      break;
+    case 2:
+      pred = b;
+      break;
+    case 3:
+      pred = avg_floor_avx2(a, b);
+      break;
+    default:
+      pred = paeth_avx2(a, b,
+                        _mm256_loadu_si256((const __m256i *) (up + i - bpp)));
+      break;
+    }
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_sub_epi8(x, pred));
+  }
+  png_apply_c(type, p + i, up + i, rowbytes - i, bpp, dst + i);
 }
 
-static void
-set_objstm_data (pdf_obj *objstm, int *data) {
-  TYPECHECK(objstm, PDF_STREAM);
+static AVX2 void
+tiff2_8_avx2 (const unsigned char *p, int32_t rowbytes, int colors,
+              unsigned char *dst)
+{
+  int32_t k;
 
-  ((pdf_stream *) objstm->data)->objstm_data = data;
-}
+  for (k = 0; k < colors && k < rowbytes; k++)
+    dst[k] = p[k];
+  for (; k + 32 <= rowbytes; k += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (p + k));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (p + k - colors));
 
-static int *
-get_objstm_data (pdf_obj *objstm) {
-  TYPECHECK(objstm, PDF_STREAM);
+    _mm256_storeu_si256((__m256i *) (dst + k), _mm256_sub_epi8(x, y));
+  }
+  for (; k < rowbytes; k++)
+    dst[k] = p[k] - p[k - colors];
+}
 
-  return ((pdf_stream *) objstm->data)->objstm_data;
+static inline AVX2 __m256i
+bswap16_avx2 (__m256i v)
+{
+  return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
 }
 
-void
-pdf_add_stream (pdf_obj *stream, const void *stream_data, int length)
+static AVX2 void
+tiff2_16_avx2 (const unsigned char *p, int32_t rowbytes, int colors,
+               unsigned char *dst)
 {
-  pdf_stream *data;
+  int32_t k, stride = 2 * colors;
 
-  TYPECHECK(stream, PDF_STREAM);
+  for (k = 0; k < stride && k < rowbytes; k++)
+    dst[k] = p[k];
+  for (; k + 32 <= rowbytes; k += 32) {
+    __m256i x = bswap16_avx2(_mm256_loadu_si256((const __m256i *) (p + k)));
+    __m256i y = bswap16_avx2(_mm256_loadu_si256((const __m256i *) (p + k - stride)));
 
-  if (length < 1)
-    return;
-  data = stream->data;
-  if (data->stream_length + length > data->max_length) {
-    data->max_length += length + STREAM_ALLOC_SIZE;
-    data->stream      = RENEW(data->stream, data->max_length, unsigned char);
+    _mm256_storeu_si256((__m256i *) (dst + k),
+                        bswap16_avx2(_mm256_sub_epi16(x, y)));
   }
-  memcpy(data->stream + data->stream_length, stream_data, length);
-  data->stream_length += length;
+  tiff2_16_from(p, k, rowbytes, stride, dst);
 }
+#endif /* PDFOBJ_USE_SIMD */
 
-#if HAVE_ZLIB
-#define WBUF_SIZE 4096
+static struct predictor_kernels predictor = {
+  png_sums_c, png_apply_c, tiff2_8_c, tiff2_16_c
+};
 
-static int
-filter_get_DecodeParms_FlateDecode (struct decode_parms *parms, pdf_obj *dict)
-{
-  pdf_obj *tmp;
+/* Select the kernels to use. This must be done before any worker
+ * thread is started.
+ */
+static void
+predictor_init (void)
+{
+#if defined(PDFOBJ_USE_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    predictor.png_sums  = png_sums_avx2;
+    predictor.png_apply = png_apply_avx2;
+    predictor.tiff2_8   = tiff2_8_avx2;
+    predictor.tiff2_16  = tiff2_16_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    predictor.png_sums  = png_sums_sse2;
+    predictor.png_apply = png_apply_sse2;
+    predictor.tiff2_8   = tiff2_8_sse2;
+    predictor.tiff2_16  = tiff2_16_sse2;
+  }
+#endif
+}
 
-  ASSERT(dict && parms);
-  ASSERT(PDF_OBJ_DICTTYPE(dict));
+/* Size of the output of PNG predictor: one tag byte is added to each row */
+#define PNG15_FILTERED_LENGTH(columns,rows,bpc,colors) \
+  (((columns) * (((bpc) * (colors) + 7) / 8) + 1) * (size_t) (rows))
 
-  /* Fill with default values */
-  parms->predictor = 1;
-  parms->colors    = 1;
-  parms->bits_per_component = 8;
-  parms->columns   = 1;
+/* Filter ROWS rows of RASTER starting at FIRST_ROW. The result for row
+ * FIRST_ROW is written to the start of DST.
+ */
+static int32_t
+filter_PNG15_apply_filter (const unsigned char *raster,
+                           int32_t columns, int32_t first_row, int32_t rows,
+                           int8_t bpc, int8_t colors, unsigned char *dst)
+{
+  int            bits_per_pixel  = colors * bpc;
+  int            bytes_per_pixel = (bits_per_pixel + 7) / 8;
+  int32_t        rowbytes = columns * bytes_per_pixel;
+  unsigned char *buf, *p, *up;
+  int32_t        i, j;
 
-  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Predictor"));
-  if (tmp) {
-    parms->predictor = pdf_number_value(tmp);
-    pdf_release_obj(tmp);
-  }
-  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Colors"));
-  if (tmp) {
-    parms->colors = pdf_number_value(tmp);
-    pdf_release_obj(tmp);
-  }
-  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "BitsPerComponent"));
-  if (tmp) {
-    parms->bits_per_component = pdf_number_value(tmp);
-    pdf_release_obj(tmp);
-  }
-  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Columns"));
-  if (tmp) {
-    parms->columns = pdf_number_value(tmp);
-    pdf_release_obj(tmp);
+  ASSERT(raster && dst);
+
+  /* Copies of the current and the previous row, see predictor_kernels */
+  buf = NEW(2 * (rowbytes + bytes_per_pixel), unsigned char);
+  memset(buf, 0, 2 * (rowbytes + bytes_per_pixel));
+  p  = buf + bytes_per_pixel;
+  up = p + rowbytes + bytes_per_pixel;
+  if (first_row > 0)
+    memcpy(up, raster + (size_t) (first_row - 1) * rowbytes, rowbytes);
+
+  for (j = 0; j < rows; j++) {
+    unsigned char *pp  = dst + (size_t) j * (rowbytes + 1);
+    uint32_t       sum[5] = {0, 0, 0, 0, 0};
+    unsigned char *tmp;
+    int            type = 0;
+
+    memcpy(p, raster + (size_t) (first_row + j) * rowbytes, rowbytes);
+    /* First calculated sum of values to make a heuristic guess
+     * of optimal predictor function.
+     */
+    predictor.png_sums(p, up, rowbytes, bytes_per_pixel, sum);
+    for (i = 1; i < 5; i++) {
+      if (sum[i] < sum[type])
+        type = i;
+    }
+    /* Now we actually apply filter. */
+    pp[0] = type;
+    predictor.png_apply(type, p, up, rowbytes, bytes_per_pixel, pp + 1);
+
+    tmp = up; up = p; p = tmp;
   }
-  if (parms->bits_per_component != 1 &&
-      parms->bits_per_component != 2 &&
-      parms->bits_per_component != 4 &&
-      parms->bits_per_component != 8 &&
-      parms->bits_per_component != 16) {
-      WARN("Invalid BPC value in DecodeParms: %d", parms->bits_per_component);
-      return -1;
-  } else if (parms->predictor <= 0 || parms->colors <= 0 ||
-             parms->columns <= 0)
-    return -1;
-  return 0;
+  RELEASE(buf);
+
+  return (rowbytes + 1) * rows;
 }
 
-/* From Xpdf version 3.04
- * I'm not sure if I properly ported... Untested.
+/* TIFF predictor filter support
+ * This modifies "raster" itself!
  */
-static int
-filter_row_TIFF2 (unsigned char *dst, const unsigned char *src,
-                  struct decode_parms *parms)
+static void
+apply_filter_TIFF2_1_2_4 (unsigned char *raster,
+                          int32_t width, int32_t height,
+                          int8_t bpc, int8_t num_comp)
 {
-  const unsigned char *p = src;
-  unsigned char *col;
-  /* bits_per_component < 8 here */
-  int  mask = (1 << parms->bits_per_component) - 1;
-  int  inbuf, outbuf; /* 2 bytes buffer */
-  int  i, ci, j, k, inbits, outbits;
+  int32_t   rowbytes = (bpc * num_comp * width + 7) / 8;
+  uint8_t   mask     = (1 << bpc) - 1;
+  uint16_t *prev;
+  int32_t   i, j;
 
-  col = NEW(parms->colors, unsigned char);
-  memset(col, 0, parms->colors);
-  inbuf = outbuf = 0; inbits = outbits = 0;
-  j = k = 0;
-  for (i = 0; i < parms->columns; i++) {
-    /* expanding each color component into an 8-bits bytes array */
-    for (ci = 0; ci < parms->colors; ci++) {
-      if (inbits < parms->bits_per_component) {
-         /* need more byte */
-         inbuf   = (inbuf << 8) | p[j++];
-         inbits += 8;
-      }
-      /* predict current color component */
-      col[ci]  = (unsigned char) ((col[ci] +
-                 (inbuf >> (inbits - parms->bits_per_component))) & mask);
-      inbits  -= parms->bits_per_component; /* consumed bpc bits */
-      /* append newly predicted color component value */
-      outbuf   = (outbuf << parms->bits_per_component) | col[ci];
-      outbits += parms->bits_per_component;
-      if (outbits >= 8) { /* flush */
-        dst[k++] = (unsigned char) (outbuf >> (outbits - 8));
-        outbits -= 8;
+  ASSERT(raster);
+  ASSERT( bpc > 0 && bpc <= 8 );
+
+  prev = NEW(num_comp, uint16_t);
+
+  /* Generic routine for 1 to 16 bit.
+   * It supports, e.g., 7 bpc images too.
+   * Actually, it is not necessary to have 16 bit inbuf and outbuf
+   * since we only need 1, 2, and 4 bit support here. 8 bit is enough.
+   */
+  for (j = 0; j < height; j++) {
+    int32_t  k, l, inbits, outbits;
+    uint16_t inbuf, outbuf;
+    int      c;
+
+    memset(prev, 0, sizeof(uint16_t)*num_comp);
+    inbuf = outbuf = 0; inbits = outbits = 0;
+    l = k = j * rowbytes;
+    for (i = 0; i < width; i++) {
+      for (c = 0; c < num_comp; c++) {
+        uint8_t cur;
+        int8_t  sub;
+        if (inbits < bpc) { /* need more byte */
+          inbuf   = (inbuf << 8) | raster[l]; l++;
+          inbits += 8;
+        }
+        cur     = (inbuf >> (inbits - bpc)) & mask;
+        inbits -= bpc; /* consumed bpc bits */
+        sub     = cur - prev[c];
+        prev[c] = cur;
+        if (sub < 0)
+          sub += (1 << bpc);
+        /* Append newly filtered component value */
+        outbuf   = (outbuf << bpc) | sub;
+        outbits += bpc;
+        /* flush */
+        if (outbits >= 8) {
+          raster[k] = (outbuf >> (outbits - 8)); k++;
+          outbits  -= 8;
+        }
       }
     }
+    if (outbits > 0) {
+      raster[k] = (outbuf << (8 - outbits));
+      k++;
+    }
   }
-  if (outbits > 0) {
-    dst[k] = (unsigned char) (outbuf << (8 - outbits));
-  }
-  RELEASE(col);
-
-  return 0;
+  RELEASE(prev);
 }
 
-/* This routine is inefficient. Length is typically 4 for Xref streams.
- * Especially, calling pdf_add_stream() for each 4 bytes append is highly
- * inefficient.
- */
-static pdf_obj *
-filter_stream_decode_Predictor (const void *src, size_t srclen, struct decode_parms *parms)
+#define TIFF2_FILTERED_LENGTH(columns,rows,bpc,colors) \
+  ((((bpc) * (colors) * (columns) + 7) / 8) * (size_t) (rows))
+
+static int32_t
+filter_TIFF2_apply_filter (const unsigned char *raster,
+                           int32_t columns, int32_t first_row, int32_t rows,
+                           int8_t bpc, int8_t colors, unsigned char *dst)
 {
-  pdf_obj             *dst;
-  const unsigned char *p = (const unsigned char *) src;
-  const unsigned char *endptr = p + srclen;
-  unsigned char       *prev, *buf;
-  int                  bits_per_pixel  = parms->colors * parms->bits_per_component;
-  int                  bytes_per_pixel = (bits_per_pixel + 7) / 8;
-  int                  length = (parms->columns * bits_per_pixel + 7) / 8;
-  int                  i, error = 0;
+  int32_t        rowbytes = (bpc * colors * columns + 7) / 8;
+  int32_t        j;
 
-  dst  = pdf_new_stream(0);
+  ASSERT(raster && dst);
 
-  prev = NEW(length, unsigned char);
-  buf  = NEW(length, unsigned char);
+  /* Rows are filtered independently of each other. */
+  raster += (size_t) first_row * rowbytes;
 
-  memset(prev, 0, length);
-  switch (parms->predictor) {
-  case 1 : /* No prediction */
-    pdf_add_stream(dst, src, srclen); /* Just copy */
-    break;
-  case 2: /* TIFF Predictor 2 */
-    {
-      if (parms->bits_per_component == 8) {
-        while (p + length < endptr) {
-          /* Same as PNG Sub */
-          for (i = 0; i < length; i++) {
-            int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
-            buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
-          }
-          pdf_add_stream(dst, buf, length);
-          p += length;
-        }
-      } else if (parms->bits_per_component == 16) {
-        while (p + length < endptr) {
-          for (i = 0; i < length; i += 2) {
-            int  b  = i - bytes_per_pixel;
-            char hi = b >= 0 ? buf[b] : 0;
-            char lo = b >= 0 ? buf[b + 1] : 0;
-            int  pv = (hi << 8) | lo;
-            int  cv = (p[i] << 8) | p[i + 1];
-            int  c  = pv + cv;
-            buf[i]     = (unsigned char) (c >> 8);
-            buf[i + 1] = (unsigned char) (c & 0xff);
-          }
-          pdf_add_stream(dst, buf, length);
-          p += length;
-        }
-      } else { /* bits per component 1, 2, 4 */
-        while (!error && p + length < endptr) {
-          error = filter_row_TIFF2(buf, p, parms);
-          if (!error) {
-            pdf_add_stream(dst, buf, length);
-            p += length;
-          }
-        }
-      }
-    }
+  switch (bpc) {
+  case 1: case 2: case 4:
+    memcpy(dst, raster, rowbytes*rows);
+    apply_filter_TIFF2_1_2_4(dst, columns, rows, bpc, colors);
     break;
-  /* PNG predictors: first byte of each rows is predictor type */
-  case 10: /* PNG None */
-  case 11: /* PNG Sub on all rows */
-  case 12: /* PNG UP on all rows */
-  case 13: /* PNG Average on all rows */
-  case 14: /* PNG Paeth on all rows */
-  case 15: /* PNG optimun: prediction algorithm can change from line to line. */
-    {
-      int type = parms->predictor - 10;
 
-      while (!error && p + length < endptr) {
-        if (parms->predictor == 15)
-          type = *p;
-        else if (*p != type) {
-          WARN("Mismatched Predictor type in data stream.");
-          error = -1;
-        }
-        p++;
-        switch (type) {
-        case 0: /* Do nothing just skip first byte */
-          memcpy(buf, p, length);
-          break;
-        case 1:
-          for (i = 0; i < length; i++) {
-            int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
-            buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
-          }
-          break;
-        case 2:
-          for (i = 0; i < length; i++) {
-            buf[i] = (unsigned char)(((int) p[i] + (int) prev[i]) & 0xff);
-          }
-          break;
-        case 3:
-          for (i = 0; i < length; i++) {
-            int up   = prev[i];
-            int left = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
-            int tmp  = floor((up + left) / 2);
-            buf[i] = (unsigned char)((p[i] + tmp) & 0xff);
-          }
-          break;
-        case 4:
-          for (i = 0; i < length; i++) {
-            int a = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0; /* left */
-            int b = prev[i]; /* above */
-            int c = i - bytes_per_pixel >= 0 ? prev[i - bytes_per_pixel] : 0; /* upper left */
-            int q = a + b - c;
-            int qa = q - a, qb = q - b, qc = q - c;
-            qa = qa < 0 ? -qa : qa;
-            qb = qb < 0 ? -qb : qb;
-            qc = qc < 0 ? -qc : qc;
-            if (qa <= qb && qa <= qc)
-              buf[i] = (unsigned char) (((int) p[i] + a) & 0xff);
-            else if (qb <= qc)
-              buf[i] = (unsigned char) (((int) p[i] + b) & 0xff);
-            else
-              buf[i] = (unsigned char) (((int) p[i] + c) & 0xff);
-          }
-          break;
-        default:
-          WARN("Unknown PNG predictor type: %d", type);
-          error = -1;
-        }
-        if (!error) {
-          pdf_add_stream(dst, buf, length); /* highly inefficient */
-          memcpy(prev, buf, length);
-          p += length;
-        }
-      }
-    }
+  case 8:
+    for (j = 0; j < rows; j++)
+      predictor.tiff2_8(raster + (size_t) j * rowbytes, rowbytes, colors,
+                        dst + (size_t) j * rowbytes);
     break;
-  default:
-    WARN("Unknown Predictor type value :%d", parms->predictor);
-    error = -1;
-  }
 
-  RELEASE(prev);
-  RELEASE(buf);
+  case 16:
+    for (j = 0; j < rows; j++)
+      predictor.tiff2_16(raster + (size_t) j * rowbytes, rowbytes, colors,
+                         dst + (size_t) j * rowbytes);
+    break;
 
-  if (error) {
-    pdf_release_obj(dst);
-    dst = NULL;
+  default:
+    memcpy(dst, raster, rowbytes*rows);
+    break;
   }
 
-  return dst;
+  return rowbytes * rows;
 }
 
 static pdf_obj *
-filter_stream_decode_FlateDecode (const void *data, size_t len, struct decode_parms *parms)
+filter_create_predictor_dict (int predictor, int32_t columns,
+                              int bpc, int colors)
 {
-  pdf_obj  *dst;
-  pdf_obj  *tmp;
-  z_stream  z;
-  Bytef     wbuf[WBUF_SIZE];
+  pdf_obj *parms;
 
-  z.zalloc = Z_NULL; z.zfree = Z_NULL; z.opaque = Z_NULL;
+  parms = pdf_new_dict();
+  pdf_add_dict(parms, pdf_new_name("BitsPerComponent"), pdf_new_number(bpc));
+  pdf_add_dict(parms, pdf_new_name("Colors"),  pdf_new_number(colors));
+  pdf_add_dict(parms, pdf_new_name("Columns"), pdf_new_number(columns));
+  pdf_add_dict(parms, pdf_new_name("Predictor"), pdf_new_number(predictor));
 
-  z.next_in  = (z_const Bytef *) data; z.avail_in  = len;
-  z.next_out = (Bytef *) wbuf; z.avail_out = WBUF_SIZE;
+  return  parms;
+}
 
-  if (inflateInit(&z) != Z_OK) {
-    WARN("inflateInit() failed.");
-    return NULL;
+#define SCRATCH_KEEP_MAX (4 << 20)
+
+static unsigned char *
+scratch_reserve (struct scratch_buffer *buf, size_t size)
+{
+  if (size > buf->size) {
+    if (buf->data)
+      RELEASE(buf->data);
+    buf->data = NEW(size, unsigned char);
+    buf->size = size;
   }
 
-  tmp = pdf_new_stream(0);
-  for (;;) {
-    int status;
-    status = inflate(&z, Z_NO_FLUSH);
-    if (status == Z_STREAM_END) {
-      break;
-    } else if (status == Z_DATA_ERROR && z.avail_in == 0) {
-      WARN("Ignoring zlib error: status=%d, message=\"%s\"", status, z.msg);
-      break;
-    } else if (status != Z_OK) {
-      WARN("inflate() failed. Broken PDF file?");
-      inflateEnd(&z);
-      pdf_release_obj(tmp);
-      return NULL;
-    }
-
-    if (z.avail_out == 0) {
-      pdf_add_stream(tmp, wbuf, WBUF_SIZE);
-      z.next_out  = wbuf;
-      z.avail_out = WBUF_SIZE;
-    }
-  }
-
-  if (WBUF_SIZE - z.avail_out > 0)
-    pdf_add_stream(tmp, wbuf, WBUF_SIZE - z.avail_out);
+  return buf->data;
+}
 
-  if (inflateEnd(&z) == Z_OK) {
-    if (parms) { 
-      dst = filter_stream_decode_Predictor(pdf_stream_dataptr(tmp), pdf_stream_length(tmp), parms);
-    } else {
-      dst = pdf_link_obj(tmp);
-    }
-  } else {
-    dst = NULL;
+static void
+scratch_trim (struct scratch_buffer *buf)
+{
+  if (buf->size > SCRATCH_KEEP_MAX) {
+    RELEASE(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
   }
-  pdf_release_obj(tmp);
-
-  return dst;
 }
-#endif
 
-static pdf_obj *
-filter_stream_decode_ASCIIHexDecode (const void *data, size_t len)
+/* Guess the class of a stream from its dictionary */
+static int
+stream_class (pdf_stream *stream)
 {
-  pdf_obj       *dst;
-  int            eod, error;
-  const char    *p = (const char *) data;
-  const char    *endptr = p + len;
-  unsigned char *buf, ch;
-  size_t         pos, n;
+  pdf_obj    *type, *subtype;
+  const char *name;
 
-  buf = NEW((len+1)/2, unsigned char);
-  skip_white(&p, endptr);
-  ch = 0; n = 0; pos = 0; eod = 0; error = 0;
-  while (p < endptr && !error && !eod) {
-    char c1, val;
-    c1 = p[0];
-    if (c1 >= 'A' && c1 <= 'F') {
-      val = c1 - 'A' + 10;
-    } else if (c1 >= 'a' && c1 <= 'f') {
-      val = c1 - 'a' + 10;
-    } else if (c1 >= '0' && c1 <= '9') {
-      val = c1 - '0';
-    } else if (c1 == '>') {
-      val = 0;
-      eod = 1;
-      if ((pos % 2) == 0)
-        break;
-    } else {
-      error = -1;
-      break;
-    }
-    if (pos % 2) {
-      buf[n] = ch + val;
-      n++;
-      ch = 0;
-    } else {
-      ch = val << 4;
-    }
-    pos++; p++;
-    skip_white(&p, endptr);
+  type    = pdf_lookup_dict(stream->dict, "Type");
+  subtype = pdf_lookup_dict(stream->dict, "Subtype");
+
+  if (PDF_OBJ_NAMETYPE(subtype)) {
+    name = pdf_name_value(subtype);
+    if (!strcmp(name, "Image"))
+      return STREAM_CLASS_IMAGE;
+    else if (!strcmp(name, "Type1C") || !strcmp(name, "CIDFontType0C") ||
+             !strcmp(name, "OpenType"))
+      return STREAM_CLASS_FONT;
   }
-  if (error || !eod) {
-    WARN("Invalid ASCIIHex data seen: %s", error ? "Invalid character" : "No EOD marker");
-    dst = NULL;
-  } else {
-    dst = pdf_new_stream(0);
-    pdf_add_stream(dst, buf, n);
+  if (PDF_OBJ_NAMETYPE(type)) {
+    name = pdf_name_value(type);
+    if (!strcmp(name, "Metadata"))
+      return STREAM_CLASS_METADATA;
+    else if (!strcmp(name, "ObjStm") || !strcmp(name, "XRef"))
+      return STREAM_CLASS_OBJSTM;
+    else if (!strcmp(name, "CMap"))
+      return STREAM_CLASS_FONT;
   }
-  RELEASE(buf);
+  if (pdf_lookup_dict(stream->dict, "Length1"))
+    return STREAM_CLASS_FONT;       /* FontFile and FontFile2 */
+  else if (pdf_lookup_dict(stream->dict, "N") && !type)
+    return STREAM_CLASS_METADATA;   /* ICC profile */
 
-  return dst;
+  return STREAM_CLASS_CONTENT;
 }
 
-/* Percent sign is not start of comment here.
- * We need this for reading Ascii85 encoded data.
+#ifdef HAVE_ZLIB
+/* Data smaller than this is always compressed */
+#define INCOMPRESSIBLE_MIN     16384
+#define INCOMPRESSIBLE_SAMPLE  65536
+#define INCOMPRESSIBLE_PIECES  8
+
+/* Check if DATA will hardly get smaller by compressing it, e.g., because
+ * it is compressed already. Pieces taken from all over the data are
+ * tested: only if their byte entropy is close to 8 bits they are
+ * compressed at level 1 to see what is gained.
  */
-#define is_space(c) ((c) == ' '  || (c) == '\t' || (c) == '\f' || \
-		     (c) == '\r' || (c) == '\n' || (c) == '\0')
-static void
-skip_white_a85 (const char **p, const char *endptr)
+static int
+is_incompressible (const unsigned char *data, size_t length)
 {
-  while (*p < endptr && (is_space(**p))) {
-    (*p)++;
-  } 
-}
+  const unsigned char *sample;
+  unsigned char       *copy = NULL, *buffer;
+  size_t               sample_length, count[256], i;
+  uLong                buffer_length;
+  double               entropy = 0.0;
+  int                  result  = 0;
 
-static pdf_obj *
-filter_stream_decode_ASCII85Decode (const void *data, size_t len)
-{
-  pdf_obj       *dst;
-  int            eod, error;
-  const char    *p = (const char *) data;
-  const char    *endptr = p + len;
-  unsigned char *buf;
-  size_t         n;
+  if (length < INCOMPRESSIBLE_MIN)
+    return 0;
 
-  buf = NEW(((len+4)/5)*4, unsigned char);
-  skip_white_a85(&p, endptr);
-  n = 0; eod = 0; error = 0;
-  while (p < endptr && !error && !eod) {
-    char q[5] = {'u', 'u', 'u', 'u', 'u'};
-    int  m;
-    char ch;
+  if (length <= INCOMPRESSIBLE_SAMPLE) {
+    sample        = data;
+    sample_length = length;
+  } else {
+    size_t piece = INCOMPRESSIBLE_SAMPLE / INCOMPRESSIBLE_PIECES;
 
-    ch = p[0];
-    p++;
-    skip_white_a85(&p, endptr);
-    if (ch == 'z') {
-      memset(buf+n, 0, 4);
-      n += 4;
-      continue;
-    } else if (ch == '~') {
-      if (p < endptr && p[0] == '>') {
-        eod = 1;
-        p++;
-      } else {
-        error = -1;
-      }
-      break;
-    }
-    q[0] = ch;
-    for (m = 1; m < 5 && p < endptr; m++) {
-      ch = p[0];
-      p++;
-      skip_white_a85(&p, endptr);
-      if (ch == '~') {
-        if (p < endptr && p[0] == '>') {
-          eod = 1;
-          p++;
-        } else {
-          error = -1;
-        }
-        break;
-      } else if (ch < '!' || ch > 'u') {
-        error = -1;
-        break;
-      } else {
-        q[m] = ch;
-      }
+    copy = NEW(INCOMPRESSIBLE_SAMPLE, unsigned char);
+    for (i = 0; i < INCOMPRESSIBLE_PIECES; i++) {
+      memcpy(copy + i * piece,
+             data + (length - piece) * i / (INCOMPRESSIBLE_PIECES - 1), piece);
     }
-    if (!error) {
-      uint32_t val = 0;
-      int      i;
-      if (m <= 1) {
-        error = -1;
-        break;
-      }
-      val = 85*85*85*(q[0] - '!') + 85*85*(q[1] - '!')
-              + 85*(q[2] - '!') + (q[3] - '!');
-      /* Check overflow */
-      if (val > UINT32_MAX / 85) {
-        error = -1;
-        break;
-      } else {
-        val = 85 * val;
-        if (val > UINT32_MAX - (q[4] - '!')) {
-          error = -1;
-          break;
-        }
-        val += (q[4] - '!');
-      }
-      if (!error) {
-        for (i = 3; i >= 0; i--) {
-          buf[n + i] = val & 0xff;
-          val /= 256;
-        }
-        n += m - 1;
-      }
+    sample        = copy;
+    sample_length = INCOMPRESSIBLE_SAMPLE;
+  }
+
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < sample_length; i++)
+    count[sample[i]]++;
+  for (i = 0; i < 256; i++) {
+    if (count[i] > 0) {
+      double q = (double) count[i] / sample_length;
+      entropy -= q * log(q) / log(2.0);
     }
   }
 
-  if (error) {
-    WARN("Error in reading ASCII85 data.");
-    dst = NULL;
-  } else if (!eod) {
-    WARN("Error in reading ASCII85 data: No EOD");
-    dst = NULL;
-  } else {
-    dst = pdf_new_stream(0);
-    pdf_add_stream(dst, buf, n);
+  if (entropy > 7.9) {
+    buffer_length = sample_length + sample_length/1000 + 14;
+    buffer = NEW(buffer_length, unsigned char);
+#ifdef HAVE_ZLIB_COMPRESS2
+    if (compress2(buffer, &buffer_length, sample, sample_length, 1) == Z_OK)
+#else
+    if (compress(buffer, &buffer_length, sample, sample_length) == Z_OK)
+#endif
+      result = buffer_length > sample_length - sample_length / 50;
+    RELEASE(buffer);
   }
-  RELEASE(buf);
+  if (copy)
+    RELEASE(copy);
 
-  return dst;
+  return result;
 }
+#endif /* HAVE_ZLIB */
 
-static pdf_obj *
-filter_stream_decode (const char *filter_name, pdf_obj *src, pdf_obj *parm)
+/* Set up filters in the stream dictionary and describe in JOB what has to
+ * be done to the stream data. Returns 1 if the stream already had a Filter
+ * entry before FlateDecode was added.
+ */
+static int
+setup_stream_filters (pdf_out *p, pdf_stream *stream, struct flate_job *job)
 {
-  pdf_obj    *dec;
-  const char *stream_data;
-  size_t      stream_length;
+  int has_filters = 0, deflated = 0, cls, level;
 
-  if (!filter_name)
-    return pdf_link_obj(src);
-
-  stream_data   = pdf_stream_dataptr(src);
-  stream_length = pdf_stream_length(src);
+  ASSERT(p);
 
-  if (!strcmp(filter_name, "ASCIIHexDecode")) {
-    dec = filter_stream_decode_ASCIIHexDecode(stream_data, stream_length);
-  } else if (!strcmp(filter_name, "ASCII85Decode")) {
-    dec = filter_stream_decode_ASCII85Decode(stream_data, stream_length);
-#if HAVE_ZLIB
-  } else if (!strcmp(filter_name, "FlateDecode")) {
-    struct decode_parms decode_parm;
-    if (parm)
-      filter_get_DecodeParms_FlateDecode(&decode_parm, parm);
-    dec = filter_stream_decode_FlateDecode(stream_data, stream_length, parm ? &decode_parm : NULL);
-#endif /* HAVE_ZLIB */
-  } else {
-    WARN("DecodeFilter \"%s\" not supported.", filter_name);
-    dec = NULL;
+#ifdef HAVE_ZLIB
+  /* Finish data compressed as it was added */
+  if (stream->deflate) {
+    if (stream->deflate->total_in > 0) {
+      stream_deflate(stream, NULL, 0, Z_FINISH);
+      deflated = 1;
+      p->output.compression_saved +=
+        stream->deflate->total_in - stream->deflate->total_out;
+    }
+    deflateEnd(stream->deflate);
+    RELEASE(stream->deflate);
+    stream->deflate = NULL;
   }
+#endif
 
-  return dec;
-}
-
-int
-pdf_concat_stream (pdf_obj *dst, pdf_obj *src)
-{
-  pdf_obj *filtered;
-  pdf_obj *stream_dict;
-  pdf_obj *filter, *parms;
-  int      error = 0;
+  job->data            = stream->stream;
+  job->length          = stream->stream_length;
+  job->level           = 0;
+  job->parms.predictor = 0;
+  job->filtered_length = job->length;
+  job->error           = 0;
 
-  if (!PDF_OBJ_STREAMTYPE(dst) || !PDF_OBJ_STREAMTYPE(src)) {
-    WARN("Passed invalid type in pdf_concat_stream().");
-    return -1;
+  /* PDF/A requires Metadata to be not filtered. */
+  {
+    pdf_obj *type;
+    type = pdf_lookup_dict(stream->dict, "Type");
+    if (type && !strcmp("Metadata", pdf_name_value(type))) {
+      stream->_flags &= ~STREAM_COMPRESS;
+    }
   }
 
-  stream_dict = pdf_stream_dict(src);
+  cls   = stream_class(stream);
+  level = stream_compression_level(p, cls);
 
-  filter = pdf_lookup_dict(stream_dict, "Filter");
-  if (!filter) {
-    pdf_add_stream(dst, pdf_stream_dataptr(src), pdf_stream_length(src));
-    return 0;
+#ifdef HAVE_ZLIB
+  /*
+   * Don't waste time on data which is compressed already. Data which is
+   * to be run through a predictor can not be judged by its raw bytes.
+   */
+  if (!deflated && stream->stream_length > 0 &&
+      (stream->_flags & STREAM_COMPRESS) && level > 0 &&
+      !(stream_use_predictor(p, cls) &&
+        (stream->_flags & STREAM_USE_PREDICTOR)) &&
+      is_incompressible(stream->stream, stream->stream_length)) {
+    p->output.incompressible++;
+    level = 0;
   }
-  if (pdf_lookup_dict(stream_dict, "DecodeParms")) {
-    /* Dictionary or array */
-    parms = pdf_deref_obj(pdf_lookup_dict(stream_dict, "DecodeParms"));
-    if (!parms) {
-      WARN("Failed to deref DeocdeParms...");
-      return -1;
-    } else if (!PDF_OBJ_ARRAYTYPE(parms) && !PDF_OBJ_DICTTYPE(parms)) {
-      WARN("PDF dict or array expected for DecodeParms...");
-      pdf_release_obj(parms);
-      return -1;
-    }
-  } else {
-    parms = NULL;
-  }
-  if (PDF_OBJ_ARRAYTYPE(filter)) {
-    int      i, num;
-    pdf_obj *prev = NULL;
 
-    num = pdf_array_length(filter);
-    if (parms) {
-      if (!PDF_OBJ_ARRAYTYPE(parms) || pdf_array_length(parms) != num) {
-        WARN("Invalid DecodeParam object found.");
-        pdf_release_obj(parms);
-        return -1;
+  /* Apply compression filter if requested */
+  if (deflated ||
+      (stream->stream_length > 0 &&
+       (stream->_flags & STREAM_COMPRESS) && level > 0)) {
+    pdf_obj *filters;
+
+    /* First apply predictor filter if requested. */
+    if (!deflated && stream_use_predictor(p, cls) &&
+        (stream->_flags & STREAM_USE_PREDICTOR) &&
+        !pdf_lookup_dict(stream->dict, "DecodeParms")) {
+      switch (stream->decodeparms.predictor) {
+      case 2:  /* TIFF2 */
+      case 15: /* PNG optimun */
+        job->parms = stream->decodeparms;
+        pdf_add_dict(stream->dict, pdf_new_name("DecodeParms"),
+                     filter_create_predictor_dict(stream->decodeparms.predictor,
+                                        stream->decodeparms.columns,
+                                        stream->decodeparms.bits_per_component,
+                                        stream->decodeparms.colors));
+        break;
+      default:
+        WARN("Unknown/unsupported Predictor function %d.",
+             stream->decodeparms.predictor);
+        break;
       }
     }
-    if (num == 0) {
-      filtered = pdf_link_obj(src);
-    } else {
-      filtered = NULL;
-      prev = pdf_link_obj(src);
-      for (i = 0; i < num && prev != NULL; i++) {
-        pdf_obj *tmp1, *tmp2;
 
-        tmp1 = pdf_deref_obj(pdf_get_array(filter, i));
-        if (parms) {
-          tmp2 = pdf_deref_obj(pdf_get_array(parms, i));
-        } else {
-          tmp2 = NULL;
-        }
-        if (PDF_OBJ_NAMETYPE(tmp1)) {
-          filtered = filter_stream_decode(pdf_name_value(tmp1), prev, tmp2);
-        } else if (PDF_OBJ_NULLTYPE(tmp1)) {
-          filtered = pdf_link_obj(prev);
-        } else {
-          WARN("Unexpected object found for /Filter...");
-          filtered = NULL;
-        }
-        if (prev)
-          pdf_release_obj(prev);
-        if (tmp1)
-          pdf_release_obj(tmp1);
-        if (tmp2)
-          pdf_release_obj(tmp2);
-        prev = filtered;      
-      }
+    filters = pdf_lookup_dict(stream->dict, "Filter");
+    {
+      pdf_obj *filter_name = pdf_new_name("FlateDecode");
+
+      if (filters)
+        /*
+         * FlateDecode is the first filter to be applied to the stream.
+         */
+        pdf_unshift_array(filters, filter_name);
+      else
+        /*
+         * Adding the filter as a name instead of a one-element array
+         * is crucial because otherwise Adobe Reader cannot read the
+         * cross-reference stream any more, cf. the PDF v1.5 Errata.
+         */
+        pdf_add_dict(stream->dict, pdf_new_name("Filter"), filter_name);
     }
-  } else if (PDF_OBJ_NAMETYPE(filter)) {
-    filtered = filter_stream_decode(pdf_name_value(filter), src, parms);
-  } else {
-    WARN("Invalid value for /Filter found.");
-    filtered = NULL;
+    has_filters = filters ? 1 : 0;
+    if (deflated)
+      p->output.compression_saved -=
+        has_filters ? strlen("/FlateDecode "): strlen("/Filter/FlateDecode\n");
+    else
+      job->level = level;
   }
-  if (parms)
-    pdf_release_obj(parms);
-  if (filtered) {
-    pdf_add_stream(dst, pdf_stream_dataptr(filtered), pdf_stream_length(filtered));
-    pdf_release_obj(filtered);
-    error = 0;
-  } else {
-    error = -1;
+#endif /* HAVE_ZLIB */
+
+  return has_filters;
+}
+
+/* Apply predictor and Flate compression to the data in JOB.
+ * No PDF objects may be touched here. Errors are reported to the caller
+ * via job->error.
+ */
+static void
+flate_job_run (struct flate_job *job)
+{
+#ifdef HAVE_ZLIB
+  uLong          buffer_length;
+  unsigned char *buffer;
+
+  if (job->level <= 0)
+    return;
+
+  if (job->parms.predictor == 2 || job->parms.predictor == 15) {
+    int      bits_per_pixel  = job->parms.colors *
+                                 job->parms.bits_per_component;
+    int32_t  len  = (job->parms.columns * bits_per_pixel + 7) / 8;
+    int32_t  rows = job->length / len;
+    unsigned char *filtered2;
+
+    if (job->parms.predictor == 2) {
+      filtered2 = scratch_reserve(job->predicted,
+                    TIFF2_FILTERED_LENGTH(job->parms.columns, rows,
+                                          job->parms.bits_per_component,
+                                          job->parms.colors));
+      job->length = filter_TIFF2_apply_filter(job->data,
+                                       job->parms.columns, 0, rows,
+                                       job->parms.bits_per_component,
+                                       job->parms.colors, filtered2);
+    } else {
+      filtered2 = scratch_reserve(job->predicted,
+                    PNG15_FILTERED_LENGTH(job->parms.columns, rows,
+                                          job->parms.bits_per_component,
+                                          job->parms.colors));
+      job->length = filter_PNG15_apply_filter(job->data,
+                                       job->parms.columns, 0, rows,
+                                       job->parms.bits_per_component,
+                                       job->parms.colors, filtered2);
+    }
+    job->data = filtered2;
   }
+  job->filtered_length = job->length;
 
-  return error;
+  buffer_length = job->length + job->length/1000 + 14;
+  buffer = scratch_reserve(job->compressed, buffer_length);
+#ifdef HAVE_ZLIB_COMPRESS2    
+  if (compress2(buffer, &buffer_length, job->data,
+      job->length, job->level)) {
+    job->error = 1;
+  }
+#else 
+  if (compress(buffer, &buffer_length, job->data,
+      job->length)) {
+    job->error = 1;
+  }
+#endif /* HAVE_ZLIB_COMPRESS2 */
+  job->data   = buffer;
+  job->length = buffer_length;
+#endif /* HAVE_ZLIB */
 }
 
-static pdf_obj *
-pdf_stream_uncompress (pdf_obj *src) {
-  pdf_obj *dst = pdf_new_stream(0);
+/* Write stream dictionary DICT and the data resulting from JOB. */
+static void
+write_stream_data (pdf_out *p, pdf_obj *dict,
+                   struct flate_job *job, int has_filters)
+{
+  const unsigned char *filtered        = job->data;
+  size_t               filtered_length = job->length;
+  unsigned char       *cipher          = NULL;
 
-  TYPECHECK(src, PDF_STREAM);
+  ASSERT(p);
 
-  pdf_merge_dict(pdf_stream_dict(dst), pdf_stream_dict(src));
-  pdf_remove_dict(pdf_stream_dict(dst), "Length");
-  pdf_concat_stream(dst, src);
+  if (job->error)
+    ERROR("Zlib error");
+  if (job->level > 0) {
+    p->output.compression_saved +=
+      job->filtered_length - filtered_length
+        - (has_filters ? strlen("/FlateDecode "): strlen("/Filter/FlateDecode\n"));
+  }
 
-  return dst;
+  /* AES will change the size of data! */
+  if (p->state.enc_mode) {
+    size_t         cipher_len = 0;
+    pdf_encrypt_data(p->sec_data, filtered, filtered_length, &cipher, &cipher_len);
+    filtered        = cipher;
+    filtered_length = cipher_len;
+  }
+
+  #if 0
+  /*
+   * An optional end-of-line marker preceding the "endstream" is
+   * not part of stream data. See, PDF Reference 4th ed., p. 38.
+   */
+  /* Add a '\n' if the last character wasn't one */
+  if (filtered_length > 0 &&
+      filtered[filtered_length-1] != '\n') {
+    filtered[filtered_length] = '\n';
+    filtered_length++;
+  }
+#endif
+
+  pdf_add_dict(dict,
+	       pdf_new_name("Length"), pdf_new_number(filtered_length));
+
+  pdf_write_obj(p, dict);
+
+  pdf_out_str(p, "\nstream\n", 8);
+
+  if (filtered_length > 0)
+    pdf_out_str(p, filtered, filtered_length);
+  if (cipher)
+    RELEASE(cipher);
+  job->data   = NULL;
+  job->length = 0;
+
+  /*
+   * This stream length "object" gets reset every time write_stream is
+   * called for the stream object.
+   * If this stream gets written more than once with different
+   * filters, this could be a problem.
+   */
+
+  pdf_out_str(p, "\n", 1);
+  pdf_out_str(p, "endstream", 9);
 }
 
-#if 0
-void
-pdf_stream_set_flags (pdf_obj *stream, int flags)
+#ifdef HAVE_ZLIB
+/* Streams larger than this are compressed piecewise and written out
+ * as the compressed data is produced, so that memory use does not grow
+ * with the size of the stream. Their /Length is an indirect object.
+ */
+#define STREAM_DEFLATE_MIN   (4 << 20)
+#define STREAM_DEFLATE_CHUNK 65536
+#define STREAM_DEFLATE_INPUT (STREAM_DEFLATE_CHUNK * 4)
+
+static int
+is_xref_stream (pdf_stream *stream)
 {
-  pdf_stream *data;
+  pdf_obj *type = pdf_lookup_dict(stream->dict, "Type");
 
-  TYPECHECK(stream, PDF_STREAM);
+  return (type && PDF_OBJ_NAMETYPE(type) &&
+          !strcmp(pdf_name_value(type), "XRef")) ? 1 : 0;
+}
 
-  data = stream->data;
-  data->_flags = flags;
+/* Feed LENGTH bytes of DATA to the deflate stream Z and write out
+ * what it produces. Returns the number of bytes written.
+ */
+static size_t
+deflate_out (pdf_out *p, z_stream *z, const unsigned char *data, size_t length,
+             int flush, unsigned char *buffer)
+{
+  size_t written = 0;
+  int    status;
+
+  z->next_in  = (unsigned char *) data;
+  z->avail_in = length;
+  do {
+    z->next_out  = buffer;
+    z->avail_out = STREAM_DEFLATE_CHUNK;
+    status = deflate(z, flush);
+    if (status == Z_STREAM_ERROR)
+      ERROR("Zlib error");
+    if (z->avail_out < STREAM_DEFLATE_CHUNK) {
+      pdf_out_str(p, buffer, STREAM_DEFLATE_CHUNK - z->avail_out);
+      written += STREAM_DEFLATE_CHUNK - z->avail_out;
+    }
+  } while (z->avail_out == 0 ||
+           (flush == Z_FINISH && status != Z_STREAM_END));
+
+  return written;
 }
 
-int
-pdf_stream_get_flags (pdf_obj *stream)
+/* Run the predictor of PARMS on ROWS rows of RASTER starting at
+ * FIRST_ROW. The result is left in BUF. Returns its length.
+ */
+static size_t
+filter_rows (const struct decode_parms *parms, const unsigned char *raster,
+             int32_t first_row, int32_t rows, struct scratch_buffer *buf)
 {
-  pdf_stream *data;
+  unsigned char *filtered;
 
-  TYPECHECK(stream, PDF_STREAM);
+  if (parms->predictor == 2) {
+    filtered = scratch_reserve(buf,
+                 TIFF2_FILTERED_LENGTH(parms->columns, rows,
+                                       parms->bits_per_component,
+                                       parms->colors));
+    return filter_TIFF2_apply_filter(raster, parms->columns, first_row, rows,
+                                     parms->bits_per_component,
+                                     parms->colors, filtered);
+  } else {
+    filtered = scratch_reserve(buf,
+                 PNG15_FILTERED_LENGTH(parms->columns, rows,
+                                       parms->bits_per_component,
+                                       parms->colors));
+    return filter_PNG15_apply_filter(raster, parms->columns, first_row, rows,
+                                     parms->bits_per_component,
+                                     parms->colors, filtered);
+  }
+}
 
-  data = stream->data;
+/* Compress the data of JOB with a single deflate stream, writing out the
+ * compressed data as it is produced. Returns the number of bytes written.
+ */
+static size_t
+write_stream_pieces (pdf_out *p, struct flate_job *job,
+                     size_t *filtered_length)
+{
+  z_stream       z;
+  unsigned char *buffer;
+  size_t         length = 0;
+
+  memset(&z, 0, sizeof(z_stream));
+  if (deflateInit(&z, job->level) != Z_OK)
+    ERROR("Zlib error");
+  buffer = scratch_reserve(job->compressed, STREAM_DEFLATE_CHUNK);
+
+  *filtered_length = 0;
+  if (job->parms.predictor == 2 || job->parms.predictor == 15) {
+    int      bits_per_pixel  = job->parms.colors *
+                                 job->parms.bits_per_component;
+    int32_t  len  = (job->parms.columns * bits_per_pixel + 7) / 8;
+    int32_t  rows = job->length / len;
+    int32_t  chunk_rows = STREAM_DEFLATE_INPUT / len + 1;
+    int32_t  row;
+
+    for (row = 0; row < rows; row += chunk_rows) {
+      int32_t n = MIN(chunk_rows, rows - row);
+      size_t  filtered_rows;
+
+      filtered_rows = filter_rows(&job->parms, job->data, row, n,
+                                  job->predicted);
+      *filtered_length += filtered_rows;
+      length += deflate_out(p, &z, job->predicted->data, filtered_rows,
+                            Z_NO_FLUSH, buffer);
+    }
+  } else {
+    size_t pos;
 
-  return data->_flags;
+    for (pos = 0; pos < job->length; pos += STREAM_DEFLATE_INPUT) {
+      size_t n = MIN(STREAM_DEFLATE_INPUT, job->length - pos);
+      length += deflate_out(p, &z, job->data + pos, n, Z_NO_FLUSH, buffer);
+    }
+    *filtered_length = job->length;
+  }
+  length += deflate_out(p, &z, NULL, 0, Z_FINISH, buffer);
+  deflateEnd(&z);
+
+  return length;
 }
+
+/* Write a large stream whose filters are already set up in JOB. */
+static void
+write_stream_deflated (pdf_out *p, pdf_stream *stream,
+                       struct flate_job *job, int has_filters)
+{
+  pdf_obj *length_obj;
+  size_t   length, filtered_length;
+
+  ASSERT(p && !p->stream_length);
+
+  length_obj = pdf_new_number(0);
+  length_obj->flags |= OBJ_NO_OBJSTM;
+  pdf_add_dict(stream->dict, pdf_new_name("Length"), pdf_ref_obj(length_obj));
+  pdf_write_obj(p, stream->dict);
+  pdf_out_str(p, "\nstream\n", 8);
+
+#if defined(PDFOBJ_USE_THREADS)
+  if (p->workers.num_threads > 0)
+    length = write_stream_bands(p, job, &filtered_length);
+  else
 #endif
+    length = write_stream_pieces(p, job, &filtered_length);
+
+  p->output.compression_saved +=
+    filtered_length - length
+      - (has_filters ? strlen("/FlateDecode "): strlen("/Filter/FlateDecode\n"));
+
+  pdf_out_str(p, "\n", 1);
+  pdf_out_str(p, "endstream", 9);
+
+  /* Written by pdf_flush_obj() once this object is complete */
+  pdf_set_number(length_obj, length);
+  p->stream_length = length_obj;
+}
+#endif /* HAVE_ZLIB */
 
 static void
-pdf_write_obj (pdf_out *p, pdf_obj *object)
+write_stream (pdf_out *p, pdf_stream *stream)
 {
+  struct flate_job job;
+  int              has_filters;
+
   ASSERT(p);
 
-  if (object == NULL) {
-    write_null(p);
-    return;
+  /*
+   * Filters never modify the stream data itself but leave their result
+   * in scratch buffers. Data written without filtering is not copied.
+   */
+  job.predicted  = &p->scratch[0];
+  job.compressed = &p->scratch[1];
+
+  has_filters = setup_stream_filters(p, stream, &job);
+#ifdef HAVE_ZLIB
+  /*
+   * Encrypted data can not be written piecewise and cross-reference
+   * streams must have a direct /Length.
+   */
+  if (job.level > 0 && job.length >= STREAM_DEFLATE_MIN &&
+      !p->state.enc_mode && !p->output_stream && !error_out &&
+      !is_xref_stream(stream)) {
+    write_stream_deflated(p, stream, &job, has_filters);
+  } else
+#endif /* HAVE_ZLIB */
+  {
+    flate_job_run(&job);
+    write_stream_data(p, stream->dict, &job, has_filters);
   }
 
-  if (INVALIDOBJ(object) || PDF_OBJ_UNDEFINED(object))
-    ERROR("pdf_write_obj: Invalid object, type = %d\n", object->type);
+  /* Don't hold on to huge buffers */
+  scratch_trim(&p->scratch[0]);
+  scratch_trim(&p->scratch[1]);
+}
 
-  if (error_out)
-    fprintf(stderr, "{%d}", object->refcount);
+#if defined(PDFOBJ_USE_THREADS)
+/* Copy OBJECT so that later modification of the original does not
+ * affect the copy. Objects which can not be modified are shared.
+ */
+static pdf_obj *
+pdf_snapshot_obj (pdf_obj *object)
+{
+  pdf_obj *copy;
 
   switch (object->type) {
-  case PDF_BOOLEAN:
-    write_boolean(p, object->data);
-    break;
   case PDF_NUMBER:
-    write_number (p, object->data);
+    copy = pdf_new_number(pdf_number_value(object));
     break;
   case PDF_STRING:
-    write_string (p, object->data);
-    break;
-  case PDF_NAME:
-    write_name(p, object->data);
+    copy = pdf_new_string(pdf_string_length(object) > 0 ?
+                          pdf_string_value(object) : "",
+                          pdf_string_length(object));
     break;
   case PDF_ARRAY:
-    write_array(p, object->data);
+    {
+      pdf_array *data = object->data;
+      size_t     i;
+
+      copy = pdf_new_array();
+      for (i = 0; i < data->size; i++)
+        pdf_add_array(copy, pdf_snapshot_obj(data->values[i]));
+    }
     break;
   case PDF_DICT:
-    write_dict (p, object->data);
-    break;
-  case PDF_STREAM:
-    write_stream(p, object->data);
-    break;
-  case PDF_NULL:
-    write_null(p);
+    {
+      pdf_dict_node *node;
+
+      copy = pdf_new_dict();
+      for (node = ((pdf_dict *) object->data)->first; node; node = node->next)
+        pdf_add_dict(copy, pdf_link_obj(node->key),
+                     pdf_snapshot_obj(node->value));
+    }
     break;
-  case PDF_INDIRECT:
-    write_indirect(p, object->data);
+  default:
+    copy = pdf_link_obj(object);
     break;
   }
+
+  return copy;
 }
 
-/* Write the object to the file */ 
+/* Size of the input of a band of a large stream */
+#define STREAM_BAND_SIZE   (1 << 20)
+/* Data preceding a band which is used as dictionary */
+#define STREAM_BAND_WINDOW 32768
+
+/* Filter and compress the rows of BAND into a piece of raw deflate data.
+ * The compressor is primed with the data preceding the band, so that
+ * compression is nearly as good as with a single deflate stream. Inner
+ * bands end with a full flush which leaves the output at a byte boundary.
+ * No PDF objects may be touched here.
+ */
 static void
-pdf_flush_obj (pdf_out *p, pdf_obj *object)
-{
-  size_t length;
-  char   buf[64];
+band_run (struct stream_band *band)
+{
+  const unsigned char *input, *dict;
+  size_t               input_length, dict_length, max_length;
+  z_stream             z;
+  int                  status;
+
+  if (band->parms.predictor == 2 || band->parms.predictor == 15) {
+    int32_t len  = (band->parms.columns * band->parms.colors *
+                    band->parms.bits_per_component + 7) / 8;
+    int32_t prev = MIN(band->first, STREAM_BAND_WINDOW / len + 1);
+
+    /* Rows of the previous band are filtered again for the dictionary */
+    dict_length  = prev > 0 ?
+                   filter_rows(&band->parms, band->data,
+                               band->first - prev, prev, &band->scratch[1]) : 0;
+    input_length = filter_rows(&band->parms, band->data,
+                               band->first, band->count, &band->scratch[0]);
+    input = band->scratch[0].data;
+    dict  = band->scratch[1].data;
+  } else {
+    dict_length  = MIN(band->first, STREAM_BAND_WINDOW);
+    dict         = band->data + band->first - dict_length;
+    input        = band->data + band->first;
+    input_length = band->count;
+  }
+  if (dict_length > STREAM_BAND_WINDOW) {
+    dict       += dict_length - STREAM_BAND_WINDOW;
+    dict_length = STREAM_BAND_WINDOW;
+  }
+  band->filtered_length = input_length;
+  band->adler = adler32(adler32(0L, Z_NULL, 0), input, input_length);
 
-  /*
-   * Record file position
-   */
-  add_xref_entry(p, object->label, 1,
-                 p->output.file_position, object->generation);
-  length = sprintf(buf, "%u %hu obj\n", object->label, object->generation);
-  p->state.enc_mode =
-    (p->options.enable_encrypt && !(object->flags & OBJ_NO_ENCRYPT)) ? 1 : 0;
-  if (p->state.enc_mode) {
-    pdf_enc_set_label(p->sec_data, object->label);
-    pdf_enc_set_generation(p->sec_data, object->generation);
+  memset(&z, 0, sizeof(z_stream));
+  if (deflateInit2(&z, band->level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    band->error = 1;
+    return;
   }
-  pdf_out_str(p, buf, length);
-  pdf_write_obj(p, object);
-  pdf_out_str(p, "\nendobj\n", 8);
-}
+  if (dict_length > 0 &&
+      deflateSetDictionary(&z, dict, dict_length) != Z_OK)
+    band->error = 1;
+  /* The dictionary is not needed any more, its buffer is reused. */
+  max_length   = deflateBound(&z, input_length) + 16;
+  band->output = scratch_reserve(&band->scratch[1], max_length);
+  z.next_in    = (unsigned char *) input;
+  z.avail_in   = input_length;
+  z.next_out   = band->output;
+  z.avail_out  = max_length;
+  status = deflate(&z, band->last ? Z_FINISH : Z_FULL_FLUSH);
+  if (status != (band->last ? Z_STREAM_END : Z_OK) ||
+      z.avail_in > 0 || z.avail_out == 0)
+    band->error = 1;
+  band->output_length = max_length - z.avail_out;
+  deflateEnd(&z);
+}
+
+static void *
+compression_worker (void *arg)
+{
+  pdf_out               *p = arg;
+  struct pending_stream *entry;
+  struct stream_band    *band;
+
+  pthread_mutex_lock(&p->workers.mutex);
+  for (;;) {
+    while (!p->workers.quit &&
+           !p->workers.next_job && !p->workers.next_band)
+      pthread_cond_wait(&p->workers.work_cond, &p->workers.mutex);
+    /* Bands first, the main thread is waiting for them. */
+    if (p->workers.next_band) {
+      band = p->workers.next_band;
+      p->workers.next_band = band->next;
+      if (band->state != PENDING_QUEUED)
+        continue;
+      band->state = PENDING_RUNNING;
+      pthread_mutex_unlock(&p->workers.mutex);
 
-static int
-pdf_add_objstm (pdf_out *p, pdf_obj *objstm, pdf_obj *object)
-{
-  int *data, pos;
+      band_run(band);
 
-  TYPECHECK(objstm, PDF_STREAM);
-  ASSERT(p);
+      pthread_mutex_lock(&p->workers.mutex);
+      band->state = PENDING_DONE;
+      pthread_cond_broadcast(&p->workers.done_cond);
+      continue;
+    }
+    if (!p->workers.next_job)
+      break;
+    entry = p->workers.next_job;
+    p->workers.next_job = entry->next;
+    if (entry->state != PENDING_QUEUED)
+      continue;
+    entry->state = PENDING_RUNNING;
+    pthread_mutex_unlock(&p->workers.mutex);
 
-  data = get_objstm_data(objstm);
-  pos = ++data[0];
+    flate_job_run(&entry->job);
 
-  data[2*pos]   = object->label;
-  data[2*pos+1] = pdf_stream_length(objstm);
+    pthread_mutex_lock(&p->workers.mutex);
+    entry->state = PENDING_DONE;
+    pthread_cond_broadcast(&p->workers.done_cond);
+  }
+  pthread_mutex_unlock(&p->workers.mutex);
 
-  add_xref_entry(p, object->label, 2, objstm->label, pos-1);
- 
-  /* redirect output into objstm */
-  p->output_stream  = objstm;
-  p->state.enc_mode = 0;
-  pdf_write_obj(p, object);
-  pdf_out_char(p, '\n');
-  p->output_stream = NULL;
+  return NULL;
+}
 
-  return pos;
+static void
+start_workers (pdf_out *p, int num_threads)
+{
+  int i;
+
+  ASSERT(p && num_threads > 0);
+
+  pthread_mutex_init(&p->workers.mutex, NULL);
+  pthread_cond_init(&p->workers.work_cond, NULL);
+  pthread_cond_init(&p->workers.done_cond, NULL);
+  p->workers.quit     = 0;
+  p->workers.head     = p->workers.tail = NULL;
+  p->workers.next_job = NULL;
+  p->workers.next_band = NULL;
+  p->workers.threads  = NEW(num_threads, pthread_t);
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&p->workers.threads[i], NULL, compression_worker, p)) {
+      WARN("Could not create compression thread.");
+      break;
+    }
+  }
+  p->workers.num_started = i;
+  /* The queue length only depends on the requested number of threads:
+   * If some threads could not be created, the main thread does their
+   * work but the output stays the same.
+   */
+  p->workers.num_threads = num_threads;
+  p->workers.num_pending = 0;
+  p->workers.max_pending = 4 * num_threads;
 }
 
 static void
-release_objstm (pdf_obj *objstm)
+release_pending_stream (struct pending_stream *entry)
 {
-  int *data = get_objstm_data(objstm);
-  int pos = data[0];
-  pdf_obj *dict;
-  pdf_stream *stream;
-  unsigned char *old_buf;
-  size_t         old_length;
-  stream = (pdf_stream *) objstm->data;
+  if (entry->raw)
+    RELEASE(entry->raw);
+  if (entry->scratch[0].data)
+    RELEASE(entry->scratch[0].data);
+  if (entry->scratch[1].data)
+    RELEASE(entry->scratch[1].data);
+  pdf_release_obj(entry->dict);
+  RELEASE(entry);
+}
 
-  /* Precede stream data by offset table */
-  old_buf = stream->stream;
-  old_length = stream->stream_length;
-  /* Reserve 22 bytes for each entry (two 10 digit numbers plus two spaces) */
-  stream->stream = NEW(old_length + 22*pos, unsigned char);
-  stream->stream_length = 0;
+static void
+stop_workers (pdf_out *p)
+{
+  int i;
 
-  {
-    int i = 2*pos, *val = data+2;
-    while (i--) {
-      char buf[32];
-      size_t length = sprintf(buf, "%d ", *(val++));
-      pdf_add_stream(objstm, buf, length);
-    }
+  ASSERT(p);
+
+  if (p->workers.num_threads == 0)
+    return;
+
+  pthread_mutex_lock(&p->workers.mutex);
+  p->workers.next_job = NULL;
+  p->workers.next_band = NULL;
+  p->workers.quit     = 1;
+  pthread_cond_broadcast(&p->workers.work_cond);
+  pthread_mutex_unlock(&p->workers.mutex);
+  for (i = 0; i < p->workers.num_started; i++)
+    pthread_join(p->workers.threads[i], NULL);
+  RELEASE(p->workers.threads);
+  p->workers.threads = NULL;
+
+  /* Only left on abnormal exit */
+  while (p->workers.head) {
+    struct pending_stream *entry = p->workers.head;
+
+    p->workers.head = entry->next;
+    release_pending_stream(entry);
   }
+  p->workers.tail = NULL;
 
-  dict = pdf_stream_dict(objstm);
-  pdf_add_dict(dict, pdf_new_name("Type"), pdf_new_name("ObjStm"));
-  pdf_add_dict(dict, pdf_new_name("N"), pdf_new_number(pos));
-  pdf_add_dict(dict, pdf_new_name("First"), pdf_new_number(stream->stream_length));
-  
-  pdf_add_stream(objstm, old_buf, old_length);
-  RELEASE(old_buf);
-  pdf_release_obj(objstm);
+  pthread_cond_destroy(&p->workers.done_cond);
+  pthread_cond_destroy(&p->workers.work_cond);
+  pthread_mutex_destroy(&p->workers.mutex);
+  p->workers.num_threads = 0;
+  p->workers.num_started = 0;
+  p->workers.num_pending = 0;
 }
 
-#define is_free(b,c) (((b)[(c)/8]) & (1 << (7-((c)%8))))
+/* Hand over a stream object to the compression threads.
+ * Filters are set up here since that modifies the stream dictionary.
+ * The stream data is taken from the object without copying.
+ */
+static void
+defer_stream (pdf_out *p, pdf_obj *object)
+{
+  pdf_stream            *stream = object->data;
+  struct pending_stream *entry;
+
+  entry = NEW(1, struct pending_stream);
+  entry->label      = object->label;
+  entry->generation = object->generation;
+  entry->flags      = object->flags;
+  entry->next       = NULL;
+
+  entry->job.predicted  = &entry->scratch[0];
+  entry->job.compressed = &entry->scratch[1];
+  memset(entry->scratch, 0, sizeof(entry->scratch));
+  entry->has_filters = setup_stream_filters(p, stream, &entry->job);
+  entry->raw         = stream->stream;
+  entry->dict        = pdf_snapshot_obj(stream->dict);
+  entry->state       = entry->job.level > 0 ? PENDING_QUEUED : PENDING_DONE;
+  stream->stream        = NULL;
+  stream->stream_length = 0;
+  stream->max_length    = 0;
+
+  pthread_mutex_lock(&p->workers.mutex);
+  if (p->workers.tail)
+    p->workers.tail->next = entry;
+  else
+    p->workers.head = entry;
+  p->workers.tail = entry;
+  if (!p->workers.next_job)
+    p->workers.next_job = entry;
+  pthread_cond_signal(&p->workers.work_cond);
+  pthread_mutex_unlock(&p->workers.mutex);
+
+  p->workers.num_pending++;
+  while (p->workers.num_pending > p->workers.max_pending)
+    write_pending_stream(p);
+}
+
+/* Write out the first stream in the queue, waiting for its compression
+ * to finish or doing it here if no thread has started on it yet.
+ */
+static void
+write_pending_stream (pdf_out *p)
+{
+  struct pending_stream *entry;
+  size_t                 length;
+  char                   buf[64];
+
+  ASSERT(p && p->workers.head);
+
+  pthread_mutex_lock(&p->workers.mutex);
+  entry = p->workers.head;
+  if (p->workers.next_job == entry)
+    p->workers.next_job = entry->next;
+  if (entry->state == PENDING_QUEUED) {
+    entry->state = PENDING_RUNNING;
+    pthread_mutex_unlock(&p->workers.mutex);
+    flate_job_run(&entry->job);
+    pthread_mutex_lock(&p->workers.mutex);
+    entry->state = PENDING_DONE;
+  }
+  while (entry->state != PENDING_DONE)
+    pthread_cond_wait(&p->workers.done_cond, &p->workers.mutex);
+  p->workers.head = entry->next;
+  if (!p->workers.head)
+    p->workers.tail = NULL;
+  pthread_mutex_unlock(&p->workers.mutex);
+  p->workers.num_pending--;
+
+  add_xref_entry(p, entry->label, 1,
+                 p->output.file_position, entry->generation);
+  length = sprintf(buf, "%u %hu obj\n", entry->label, entry->generation);
+  p->state.enc_mode =
+    (p->options.enable_encrypt && !(entry->flags & OBJ_NO_ENCRYPT)) ? 1 : 0;
+  if (p->state.enc_mode) {
+    pdf_enc_set_label(p->sec_data, entry->label);
+    pdf_enc_set_generation(p->sec_data, entry->generation);
+  }
+  pdf_out_str(p, buf, length);
+  write_stream_data(p, entry->dict, &entry->job, entry->has_filters);
+  pdf_out_str(p, "\nendobj\n", 8);
 
-void
-pdf_release_obj (pdf_obj *object)
-{
-  pdf_out *p = current_output();
+  release_pending_stream(entry);
+}
 
-  if (object == NULL)
-    return;
-  if (INVALIDOBJ(object) || object->refcount <= 0) {
-    MESG("\npdf_release_obj: object=%p, type=%d, refcount=%d\n",
-         object, object->type, object->refcount);
-    error_out = 1;
-    pdf_write_obj(p, object);
-    ERROR("pdf_release_obj:  Called with invalid object.");
-    error_out = 0;
+/* Compress the data of JOB in bands on the worker threads and write
+ * them out as one zlib stream, joining the pieces like pigz does: Each
+ * band is raw deflate data ending at a byte boundary and the checksums
+ * of the bands are combined for the trailer. The output only depends on
+ * the band size, not on the number of threads.
+ * Returns the number of bytes written.
+ */
+static size_t
+write_stream_bands (pdf_out *p, struct flate_job *job,
+                    size_t *filtered_length)
+{
+  struct stream_band *head = NULL, *tail = NULL, *band;
+  size_t              total, band_size, pos = 0, length = 0;
+  int                 num_bands = 0;
+  uLong               adler = adler32(0L, Z_NULL, 0);
+  unsigned char       buf[4];
+  unsigned int        header;
+
+  if (job->parms.predictor == 2 || job->parms.predictor == 15) {
+    int32_t len = (job->parms.columns * job->parms.colors *
+                   job->parms.bits_per_component + 7) / 8;
+
+    total     = job->length / len;
+    band_size = MAX(1, STREAM_BAND_SIZE / len);
+  } else {
+    total     = job->length;
+    band_size = STREAM_BAND_SIZE;
   }
-  object->refcount -= 1;
-  if (object->refcount == 0) {
-#if defined(PDFOBJ_DEBUG)
-  bucket[object->obj_id] = NULL;
-#endif
-    /*
-     * Nothing is using this object so it's okay to remove it.
-     * Nonzero "label" means object needs to be written before it's destroyed.
-     */
-    if (object->label) {
-      p->free_list[object->label/8] |= (1 << (7-(object->label % 8)));
-      if (p->output.file != NULL) {
-        if (!p->options.use_objstm || object->flags & OBJ_NO_OBJSTM ||
-            (p->options.enable_encrypt && (object->flags & OBJ_NO_ENCRYPT)) ||
-            object->generation) {
-          pdf_flush_obj(p, object);
-        } else {
-          if (!p->current_objstm) {
-            int *data = NEW(2*OBJSTM_MAX_OBJS+2, int);
-            data[0] = data[1] = 0;
-            p->current_objstm = pdf_new_stream(STREAM_COMPRESS);
-            set_objstm_data(p->current_objstm, data);
-            pdf_label_obj(p, p->current_objstm);
-          }
-          if (pdf_add_objstm(p, p->current_objstm, object) == OBJSTM_MAX_OBJS) {
-            release_objstm(p->current_objstm);
-            p->current_objstm = NULL;
-          }
-        }
-      }
+
+  /* zlib header, the same as deflate() writes */
+  header  = (Z_DEFLATED + ((15 - 8) << 4)) << 8;
+  header |= (job->level < 2 ? 0 : job->level < 6 ? 1 :
+             job->level == 6 ? 2 : 3) << 6;
+  header += 31 - (header % 31);
+  buf[0] = (header >> 8) & 0xff;
+  buf[1] = header & 0xff;
+  pdf_out_str(p, buf, 2);
+  length += 2;
+
+  *filtered_length = 0;
+  while (pos < total || head) {
+    /* Keep the threads busy */
+    while (pos < total && num_bands < p->workers.max_pending) {
+      band = NEW(1, struct stream_band);
+      memset(band, 0, sizeof(struct stream_band));
+      band->data  = job->data;
+      band->parms = job->parms;
+      band->level = job->level;
+      band->first = pos;
+      band->count = MIN(band_size, total - pos);
+      band->last  = (pos + band->count == total);
+      band->state = PENDING_QUEUED;
+      pos += band->count;
+
+      pthread_mutex_lock(&p->workers.mutex);
+      if (tail)
+        tail->next = band;
+      else
+        head = band;
+      tail = band;
+      if (!p->workers.next_band)
+        p->workers.next_band = band;
+      pthread_cond_signal(&p->workers.work_cond);
+      pthread_mutex_unlock(&p->workers.mutex);
+      num_bands++;
     }
-    switch (object->type) {
-    case PDF_BOOLEAN:
-      release_boolean(object->data);
-      break;
-    case PDF_NULL:
-      break;
-    case PDF_NUMBER:
-      release_number(object->data);
-      break;
-    case PDF_STRING:
-      release_string(object->data);
-      break;
-    case PDF_NAME:
-      release_name(object->data);
-      break;
-    case PDF_ARRAY:
-      release_array(object->data);
-      break;
-    case PDF_DICT:
-      release_dict(object->data);
-      break;
-    case PDF_STREAM:
-      release_stream(object->data);
-      break;
-    case PDF_INDIRECT:
-      release_indirect(object->data);
-      break;
+
+    /* Write out the first band, compressing it here if no thread has
+     * started on it yet.
+     */
+    pthread_mutex_lock(&p->workers.mutex);
+    band = head;
+    if (p->workers.next_band == band)
+      p->workers.next_band = band->next;
+    if (band->state == PENDING_QUEUED) {
+      band->state = PENDING_RUNNING;
+      pthread_mutex_unlock(&p->workers.mutex);
+      band_run(band);
+      pthread_mutex_lock(&p->workers.mutex);
+      band->state = PENDING_DONE;
     }
-    /* This might help detect freeing already freed objects */
-    object->type = -1;
-    object->data = NULL;
-    RELEASE(object);
+    while (band->state != PENDING_DONE)
+      pthread_cond_wait(&p->workers.done_cond, &p->workers.mutex);
+    head = band->next;
+    if (!head)
+      tail = NULL;
+    pthread_mutex_unlock(&p->workers.mutex);
+    num_bands--;
+
+    if (band->error)
+      ERROR("Zlib error");
+    pdf_out_str(p, band->output, band->output_length);
+    length           += band->output_length;
+    *filtered_length += band->filtered_length;
+    adler = adler32_combine(adler, band->adler, band->filtered_length);
+
+    if (band->scratch[0].data)
+      RELEASE(band->scratch[0].data);
+    if (band->scratch[1].data)
+      RELEASE(band->scratch[1].data);
+    RELEASE(band);
   }
+
+  buf[0] = (adler >> 24) & 0xff;
+  buf[1] = (adler >> 16) & 0xff;
+  buf[2] = (adler >>  8) & 0xff;
+  buf[3] = adler & 0xff;
+  pdf_out_str(p, buf, 4);
+  length += 4;
+
+  return length;
 }
+#endif /* PDFOBJ_USE_THREADS */
 
-/* Reading external PDF files
- *
- */
-static int
-backup_line (FILE *pdf_input_file)
+static void
+release_stream (pdf_stream *stream)
 {
-  int ch = -1;
+  pdf_release_obj(stream->dict);
+  stream->dict = NULL;
 
-  /*
-   * Note: this code should work even if \r\n is eol. It could fail on a
-   * machine where \n is eol and there is a \r in the stream --- Highly
-   * unlikely in the last few bytes where this is likely to be used.
-   */
-  if (tell_position(pdf_input_file) > 1)
-    do {
-      seek_relative (pdf_input_file, -2);
-    } while (tell_position(pdf_input_file) > 0 &&
-	     (ch = fgetc(pdf_input_file)) >= 0 &&
-	     (ch != '\n' && ch != '\r' ));
-  if (ch < 0) {
-    return 0;
+  if (stream->stream) {
+    RELEASE(stream->stream);
+    stream->stream = NULL;
   }
 
-  return 1;
+  if (stream->objstm_data) {
+    RELEASE(stream->objstm_data);
+    stream->objstm_data = NULL;
+  }
+
+#ifdef HAVE_ZLIB
+  if (stream->deflate) {
+    deflateEnd(stream->deflate);
+    RELEASE(stream->deflate);
+    stream->deflate = NULL;
+  }
+#endif
+
+  RELEASE(stream);
 }
 
-static int
-find_xref (FILE *pdf_input_file)
+pdf_obj *
+pdf_stream_dict (pdf_obj *stream)
 {
-  size_t  len, xref_pos = 0;
-  int     tries = 10;
+  pdf_stream *data;
 
-  do {
-    size_t currentpos;
+  TYPECHECK(stream, PDF_STREAM);
 
-    if (!backup_line(pdf_input_file)) {
-      tries = 0;
-      break;
-    }
-    currentpos = tell_position(pdf_input_file);
-    fread(work_buffer, sizeof(char), strlen("startxref"), pdf_input_file);
-    seek_absolute(pdf_input_file, currentpos);
-    tries--;
-  } while (tries > 0 &&
-	   strncmp(work_buffer, "startxref", strlen("startxref")));
-  if (tries <= 0)
-    return 0;
+  data = stream->data;
 
-  /* Skip rest of this line */
-  mfgets(work_buffer, WORK_BUFFER_SIZE, pdf_input_file);
-  /* Next line of input file should contain actual xref location */
-  len = mfreadln(work_buffer, WORK_BUFFER_SIZE, pdf_input_file);
-  if (len <= 0)
-   WARN("Reading xref location data failed... Not a PDF file?");
-  else {
-    const char *start, *end;
-    char *number;
-
-    start = work_buffer;
-    end   = start + len;
-    skip_white(&start, end);
-    number   = parse_number(&start, end);
-    xref_pos = (int) atof(number);
-    RELEASE(number);
-  }
-
-  return xref_pos;
+  return data->dict;
 }
 
-/*
- * This routine must be called with the file pointer located
- * at the start of the trailer.
- */
-static pdf_obj *
-parse_trailer (pdf_file *pf)
+const void *
+pdf_stream_dataptr (pdf_obj *stream)
 {
-  pdf_obj *result;
-  /*
-   * Fill work_buffer and hope trailer fits. This should
-   * be made a bit more robust sometime.
-   */
-  if (fread(work_buffer, sizeof(char),
-	    WORK_BUFFER_SIZE, pf->file) == 0 ||
-      strncmp(work_buffer, "trailer", strlen("trailer"))) {
-    WARN("No trailer.  Are you sure this is a PDF file?");
-    WARN("buffer:\n->%s<-\n", work_buffer);
-    result = NULL;
-  } else {
-    const char *p = work_buffer + strlen("trailer");
-    skip_white(&p, work_buffer + WORK_BUFFER_SIZE);
-    result = parse_pdf_dict(&p, work_buffer + WORK_BUFFER_SIZE, pf);
-  }
-
-  return result;
-}
+  pdf_stream *data;
 
-/*
- * This routine tries to estimate an upper bound for character position
- * of the end of the object, so it knows how big the buffer must be.
- * The parsing routines require that the entire object be read into
- * memory. It would be a major pain to rewrite them.  The worst case
- * is that an object before an xref table will grab the whole table
- * :-(
- */
-static int
-next_object_offset (pdf_file *pf, uint32_t obj_num)
-{
-  uint32_t next = pf->file_size;  /* Worst case */
-  size_t   i;
-  uint32_t curr;
+  TYPECHECK(stream, PDF_STREAM);
 
-  curr = pf->xref_table[obj_num].field2;
-  /* Check all other type 1 objects to find next one */
-  for (i = 0; i < pf->num_obj; i++) {
-    if (pf->xref_table[i].type == 1 &&
-        pf->xref_table[i].field2 > curr &&
-        pf->xref_table[i].field2 < next)
-      next = pf->xref_table[i].field2;
-  }
+  data = stream->data;
+#ifdef HAVE_ZLIB
+  ASSERT(!data->deflate);
+#endif
 
-  return  next;
+  return (const void *) data->stream;
 }
 
-#define checklabel(pf, n, g) ((n) > 0 && (n) < (pf)->num_obj && ( \
-  ((pf)->xref_table[(n)].type == 1 && (pf)->xref_table[(n)].field3 == (g)) || \
-  ((pf)->xref_table[(n)].type == 2 && !(g))))
-
-pdf_obj *
-pdf_new_indirect (pdf_file *pf, uint32_t obj_num, uint16_t obj_gen)
+int
+pdf_stream_length (pdf_obj *stream)
 {
-  pdf_obj      *result;
-  pdf_indirect *indirect;
+  pdf_stream *data;
 
-  indirect = NEW(1, pdf_indirect);
-  indirect->pf         = pf;
-  indirect->obj        = NULL;
-  indirect->label      = obj_num;
-  indirect->generation = obj_gen;
+  TYPECHECK(stream, PDF_STREAM);
 
-  result   = pdf_new_obj(PDF_INDIRECT);
-  result->data = indirect;
+  data = stream->data;
+#ifdef HAVE_ZLIB
+  /* Amount of data added so far */
+  if (data->deflate)
+    return (int) data->deflate->total_in;
+#endif
 
-  return result;
+  return (int) data->stream_length;
 }
 
-static pdf_obj *
-pdf_read_object (uint32_t obj_num, uint16_t obj_gen, pdf_file *pf, size_t offset, size_t limit)
-{
-  pdf_obj    *result = NULL; 
-  size_t      length;
-  char       *buffer;
-  const char *p, *endptr;
-
-  length = limit - offset;
-
-  if (length <= 0)
-    return NULL;
-
-  buffer = NEW(length + 1, char);
-
-  seek_absolute(pf->file, offset);
-  fread(buffer, sizeof(char), length, pf->file);
+static void
+set_objstm_data (pdf_obj *objstm, int *data) {
+  TYPECHECK(objstm, PDF_STREAM);
 
-  p      = buffer;
-  endptr = p + length;
+  ((pdf_stream *) objstm->data)->objstm_data = data;
+}
 
-  /* Check for obj_num and obj_gen */
-  {
-    const char   *q = p; /* <== p */
-    char         *sp;
-    uint32_t      n, g;
+static int *
+get_objstm_data (pdf_obj *objstm) {
+  TYPECHECK(objstm, PDF_STREAM);
 
-    skip_white(&q, endptr);
-    sp = parse_unsigned(&q, endptr);
-    if (!sp) {
-      RELEASE(buffer);
-      return NULL;
-    }
-    n = strtoul(sp, NULL, 10);
-    RELEASE(sp);
+  return ((pdf_stream *) objstm->data)->objstm_data;
+}
 
-    skip_white(&q, endptr);
-    sp = parse_unsigned(&q, endptr);
-    if (!sp) {
-      RELEASE(buffer);
-      return NULL;
-    }
-    g = strtoul(sp, NULL, 10);
-    RELEASE(sp);
+void
+pdf_add_stream (pdf_obj *stream, const void *stream_data, int length)
+{
+  pdf_stream *data;
 
-    if (obj_num && (n != obj_num || g != obj_gen)) {
-      RELEASE(buffer);
-      return NULL;
-    }
+  TYPECHECK(stream, PDF_STREAM);
 
-    p = q; /* ==> p */
+  if (length < 1)
+    return;
+  data = stream->data;
+#ifdef HAVE_ZLIB
+  if (data->deflate) {
+    stream_deflate(data, stream_data, length, Z_NO_FLUSH);
+    return;
   }
+#endif
+  stream_grow(data, length);
+  memcpy(data->stream + data->stream_length, stream_data, length);
+  data->stream_length += length;
+}
 
+/* Make room for LENGTH more bytes of stream data so that adding them
+ * does not need to reallocate the stream buffer.
+ */
+void
+pdf_stream_reserve (pdf_obj *stream, size_t length)
+{
+  pdf_stream *data;
 
-  skip_white(&p, endptr);
-  if (memcmp(p, "obj", strlen("obj"))) {
-    WARN("Didn't find \"obj\".");
-    RELEASE(buffer);
-    return NULL;
-  }
-  p += strlen("obj");
-
-  result = parse_pdf_object(&p, endptr, pf);
+  TYPECHECK(stream, PDF_STREAM);
 
-  skip_white(&p, endptr);
-  if (memcmp(p, "endobj", strlen("endobj"))) {
-    WARN("Didn't find \"endobj\".");
-    if (result)
-      pdf_release_obj(result);
-    result = NULL;
+  data = stream->data;
+#ifdef HAVE_ZLIB
+  if (data->deflate)
+    return;
+#endif
+  if (data->stream_length + length > data->max_length) {
+    data->max_length = data->stream_length + length;
+    data->stream     = RENEW(data->stream, data->max_length, unsigned char);
   }
-  RELEASE(buffer);
-
-  return result;
 }
 
-static pdf_obj *
-read_objstm (pdf_file *pf, uint32_t num)
+#if HAVE_ZLIB
+#define WBUF_SIZE 4096
+
+static int
+filter_get_DecodeParms_FlateDecode (struct decode_parms *parms, pdf_obj *dict)
 {
-  size_t      offset = pf->xref_table[num].field2;
-  uint16_t    gen    = pf->xref_table[num].field3;
-  size_t      limit  = next_object_offset(pf, num);
-  int         n, first, *header = NULL;
-  char       *data = NULL, *q;
-  const char *p, *endptr;
-  int         i;
-  pdf_obj    *objstm, *dict, *type, *n_obj, *first_obj;
+  pdf_obj *tmp;
 
-  objstm = pdf_read_object(num, gen, pf, offset, limit);
+  ASSERT(dict && parms);
+  ASSERT(PDF_OBJ_DICTTYPE(dict));
 
-  if (!PDF_OBJ_STREAMTYPE(objstm))
-    goto error;
+  /* Fill with default values */
+  parms->predictor = 1;
+  parms->colors    = 1;
+  parms->bits_per_component = 8;
+  parms->columns   = 1;
 
-  {
-    pdf_obj *tmp = pdf_stream_uncompress(objstm);
-    if (!tmp)
-      goto error;
-    pdf_release_obj(objstm);
-    objstm = tmp;
+  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Predictor"));
+  if (tmp) {
+    parms->predictor = pdf_number_value(tmp);
+    pdf_release_obj(tmp);
+  }
+  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Colors"));
+  if (tmp) {
+    parms->colors = pdf_number_value(tmp);
+    pdf_release_obj(tmp);
+  }
+  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "BitsPerComponent"));
+  if (tmp) {
+    parms->bits_per_component = pdf_number_value(tmp);
+    pdf_release_obj(tmp);
   }
+  tmp = pdf_deref_obj(pdf_lookup_dict(dict, "Columns"));
+  if (tmp) {
+    parms->columns = pdf_number_value(tmp);
+    pdf_release_obj(tmp);
+  }
+  if (parms->bits_per_component != 1 &&
+      parms->bits_per_component != 2 &&
+      parms->bits_per_component != 4 &&
+      parms->bits_per_component != 8 &&
+      parms->bits_per_component != 16) {
+      WARN("Invalid BPC value in DecodeParms: %d", parms->bits_per_component);
+      return -1;
+  } else if (parms->predictor <= 0 || parms->colors <= 0 ||
+             parms->columns <= 0)
+    return -1;
+  return 0;
+}
 
-  dict = pdf_stream_dict(objstm);
+/* From Xpdf version 3.04
+ * I'm not sure if I properly ported... Untested.
+ */
+static int
+filter_row_TIFF2 (unsigned char *dst, const unsigned char *src,
+                  struct decode_parms *parms)
+{
+  const unsigned char *p = src;
+  unsigned char *col;
+  /* bits_per_component < 8 here */
+  int  mask = (1 << parms->bits_per_component) - 1;
+  int  inbuf, outbuf; /* 2 bytes buffer */
+  int  i, ci, j, k, inbits, outbits;
 
-  type = pdf_lookup_dict(dict, "Type");
+  col = NEW(parms->colors, unsigned char);
+  memset(col, 0, parms->colors);
+  inbuf = outbuf = 0; inbits = outbits = 0;
+  j = k = 0;
+  for (i = 0; i < parms->columns; i++) {
+    /* expanding each color component into an 8-bits bytes array */
+    for (ci = 0; ci < parms->colors; ci++) {
+      if (inbits < parms->bits_per_component) {
+         /* need more byte */
+         inbuf   = (inbuf << 8) | p[j++];
+         inbits += 8;
+      }
+      /* predict current color component */
+      col[ci]  = (unsigned char) ((col[ci] +
+                 (inbuf >> (inbits - parms->bits_per_component))) & mask);
+      inbits  -= parms->bits_per_component; /* consumed bpc bits */
+      /* append newly predicted color component value */
+      outbuf   = (outbuf << parms->bits_per_component) | col[ci];
+      outbits += parms->bits_per_component;
+      if (outbits >= 8) { /* flush */
+        dst[k++] = (unsigned char) (outbuf >> (outbits - 8));
+        outbits -= 8;
+      }
+    }
+  }
+  if (outbits > 0) {
+    dst[k] = (unsigned char) (outbuf << (8 - outbits));
+  }
+  RELEASE(col);
+
+  return 0;
+}
+
+/* This routine is inefficient. Length is typically 4 for Xref streams.
+ * Especially, calling pdf_add_stream() for each 4 bytes append is highly
+ * inefficient.
+ */
+static pdf_obj *
+filter_stream_decode_Predictor (const void *src, size_t srclen, struct decode_parms *parms)
+{
+  pdf_obj             *dst;
+  const unsigned char *p = (const unsigned char *) src;
+  const unsigned char *endptr = p + srclen;
+  unsigned char       *prev, *buf;
+  int                  bits_per_pixel  = parms->colors * parms->bits_per_component;
+  int                  bytes_per_pixel = (bits_per_pixel + 7) / 8;
+  int                  length = (parms->columns * bits_per_pixel + 7) / 8;
+  int                  i, error = 0;
+
+  dst  = pdf_new_stream(0);
+
+  prev = NEW(length, unsigned char);
+  buf  = NEW(length, unsigned char);
+
+  memset(prev, 0, length);
+  switch (parms->predictor) {
+  case 1 : /* No prediction */
+    pdf_add_stream(dst, src, srclen); /* Just copy */
+    break;
+  case 2: /* TIFF Predictor 2 */
+    {
+      if (parms->bits_per_component == 8) {
+        while (p + length < endptr) {
+          /* Same as PNG Sub */
+          for (i = 0; i < length; i++) {
+            int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
+            buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
+          }
+          pdf_add_stream(dst, buf, length);
+          p += length;
+        }
+      } else if (parms->bits_per_component == 16) {
+        while (p + length < endptr) {
+          for (i = 0; i < length; i += 2) {
+            int  b  = i - bytes_per_pixel;
+            char hi = b >= 0 ? buf[b] : 0;
+            char lo = b >= 0 ? buf[b + 1] : 0;
+            int  pv = (hi << 8) | lo;
+            int  cv = (p[i] << 8) | p[i + 1];
+            int  c  = pv + cv;
+            buf[i]     = (unsigned char) (c >> 8);
+            buf[i + 1] = (unsigned char) (c & 0xff);
+          }
+          pdf_add_stream(dst, buf, length);
+          p += length;
+        }
+      } else { /* bits per component 1, 2, 4 */
+        while (!error && p + length < endptr) {
+          error = filter_row_TIFF2(buf, p, parms);
+          if (!error) {
+            pdf_add_stream(dst, buf, length);
+            p += length;
+          }
+        }
+      }
+    }
+    break;
+  /* PNG predictors: first byte of each rows is predictor type */
+  case 10: /* PNG None */
+  case 11: /* PNG Sub on all rows */
+  case 12: /* PNG UP on all rows */
+  case 13: /* PNG Average on all rows */
+  case 14: /* PNG Paeth on all rows */
+  case 15: /* PNG optimun: prediction algorithm can change from line to line. */
+    {
+      int type = parms->predictor - 10;
+
+      while (!error && p + length < endptr) {
+        if (parms->predictor == 15)
+          type = *p;
+        else if (*p != type) {
+          WARN("Mismatched Predictor type in data stream.");
+          error = -1;
+        }
+        p++;
+        switch (type) {
+        case 0: /* Do nothing just skip first byte */
+          memcpy(buf, p, length);
+          break;
+        case 1:
+          for (i = 0; i < length; i++) {
+            int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
+            buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
+          }
+          break;
+        case 2:
+          for (i = 0; i < length; i++) {
+            buf[i] = (unsigned char)(((int) p[i] + (int) prev[i]) & 0xff);
+          }
+          break;
+        case 3:
+          for (i = 0; i < length; i++) {
+            int up   = prev[i];
+            int left = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
+            int tmp  = floor((up + left) / 2);
+            buf[i] = (unsigned char)((p[i] + tmp) & 0xff);
+          }
+          break;
+        case 4:
+          for (i = 0; i < length; i++) {
+            int a = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0; /* left */
+            int b = prev[i]; /* above */
+            int c = i - bytes_per_pixel >= 0 ? prev[i - bytes_per_pixel] : 0; /* upper left */
+            int q = a + b - c;
+            int qa = q - a, qb = q - b, qc = q - c;
+            qa = qa < 0 ? -qa : qa;
+            qb = qb < 0 ? -qb : qb;
+            qc = qc < 0 ? -qc : qc;
+            if (qa <= qb && qa <= qc)
+              buf[i] = (unsigned char) (((int) p[i] + a) & 0xff);
+            else if (qb <= qc)
+              buf[i] = (unsigned char) (((int) p[i] + b) & 0xff);
+            else
+              buf[i] = (unsigned char) (((int) p[i] + c) & 0xff);
+          }
+          break;
+        default:
+          WARN("Unknown PNG predictor type: %d", type);
+          error = -1;
+        }
+        if (!error) {
+          pdf_add_stream(dst, buf, length); /* highly inefficient */
+          memcpy(prev, buf, length);
+          p += length;
+        }
+      }
+    }
+    break;
+  default:
+    WARN("Unknown Predictor type value :%d", parms->predictor);
+    error = -1;
+  }
+
+  RELEASE(prev);
+  RELEASE(buf);
+
+  if (error) {
+    pdf_release_obj(dst);
+    dst = NULL;
+  }
+
+  return dst;
+}
+
+static pdf_obj *
+filter_stream_decode_FlateDecode (const void *data, size_t len, struct decode_parms *parms)
+{
+  pdf_obj  *dst;
+  pdf_obj  *tmp;
+  z_stream  z;
+  Bytef     wbuf[WBUF_SIZE];
+
+  z.zalloc = Z_NULL; z.zfree = Z_NULL; z.opaque = Z_NULL;
+
+  z.next_in  = (z_const Bytef *) data; z.avail_in  = len;
+  z.next_out = (Bytef *) wbuf; z.avail_out = WBUF_SIZE;
+
+  if (inflateInit(&z) != Z_OK) {
+    WARN("inflateInit() failed.");
+    return NULL;
+  }
+
+  tmp = pdf_new_stream(0);
+  for (;;) {
+    int status;
+    status = inflate(&z, Z_NO_FLUSH);
+    if (status == Z_STREAM_END) {
+      break;
+    } else if (status == Z_DATA_ERROR && z.avail_in == 0) {
+      WARN("Ignoring zlib error: status=%d, message=\"%s\"", status, z.msg);
+      break;
+    } else if (status != Z_OK) {
+      WARN("inflate() failed. Broken PDF file?");
+      inflateEnd(&z);
+      pdf_release_obj(tmp);
+      return NULL;
+    }
+
+    if (z.avail_out == 0) {
+      pdf_add_stream(tmp, wbuf, WBUF_SIZE);
+      z.next_out  = wbuf;
+      z.avail_out = WBUF_SIZE;
+    }
+  }
+
+  if (WBUF_SIZE - z.avail_out > 0)
+    pdf_add_stream(tmp, wbuf, WBUF_SIZE - z.avail_out);
+
+  if (inflateEnd(&z) == Z_OK) {
+    if (parms) { 
+      dst = filter_stream_decode_Predictor(pdf_stream_dataptr(tmp), pdf_stream_length(tmp), parms);
+    } else {
+      dst = pdf_link_obj(tmp);
+    }
+  } else {
+    dst = NULL;
+  }
+  pdf_release_obj(tmp);
+
+  return dst;
+}
+#endif
+
+static pdf_obj *
+filter_stream_decode_ASCIIHexDecode (const void *data, size_t len)
+{
+  pdf_obj       *dst;
+  int            eod, error;
+  const char    *p = (const char *) data;
+  const char    *endptr = p + len;
+  unsigned char *buf, ch;
+  size_t         pos, n;
+
+  buf = NEW((len+1)/2, unsigned char);
+  skip_white(&p, endptr);
+  ch = 0; n = 0; pos = 0; eod = 0; error = 0;
+  while (p < endptr && !error && !eod) {
+    char c1, val;
+    c1 = p[0];
+    if (c1 >= 'A' && c1 <= 'F') {
+      val = c1 - 'A' + 10;
+    } else if (c1 >= 'a' && c1 <= 'f') {
+      val = c1 - 'a' + 10;
+    } else if (c1 >= '0' && c1 <= '9') {
+      val = c1 - '0';
+    } else if (c1 == '>') {
+      val = 0;
+      eod = 1;
+      if ((pos % 2) == 0)
+        break;
+    } else {
+      error = -1;
+      break;
+    }
+    if (pos % 2) {
+      buf[n] = ch + val;
+      n++;
+      ch = 0;
+    } else {
+      ch = val << 4;
+    }
+    pos++; p++;
+    skip_white(&p, endptr);
+  }
+  if (error || !eod) {
+    WARN("Invalid ASCIIHex data seen: %s", error ? "Invalid character" : "No EOD marker");
+    dst = NULL;
+  } else {
+    dst = pdf_new_stream(0);
+    pdf_add_stream(dst, buf, n);
+  }
+  RELEASE(buf);
+
+  return dst;
+}
+
+/* Percent sign is not start of comment here.
+ * We need this for reading Ascii85 encoded data.
+ */
+#define is_space(c) ((c) == ' '  || (c) == '\t' || (c) == '\f' || \
+		     (c) == '\r' || (c) == '\n' || (c) == '\0')
+static void
+skip_white_a85 (const char **p, const char *endptr)
+{
+  while (*p < endptr && (is_space(**p))) {
+    (*p)++;
+  } 
+}
+
+static pdf_obj *
+filter_stream_decode_ASCII85Decode (const void *data, size_t len)
+{
+  pdf_obj       *dst;
+  int            eod, error;
+  const char    *p = (const char *) data;
+  const char    *endptr = p + len;
+  unsigned char *buf;
+  size_t         n;
+
+  buf = NEW(((len+4)/5)*4, unsigned char);
+  skip_white_a85(&p, endptr);
+  n = 0; eod = 0; error = 0;
+  while (p < endptr && !error && !eod) {
+    char q[5] = {'u', 'u', 'u', 'u', 'u'};
+    int  m;
+    char ch;
+
+    ch = p[0];
+    p++;
+    skip_white_a85(&p, endptr);
+    if (ch == 'z') {
+      memset(buf+n, 0, 4);
+      n += 4;
+      continue;
+    } else if (ch == '~') {
+      if (p < endptr && p[0] == '>') {
+        eod = 1;
+        p++;
+      } else {
+        error = -1;
+      }
+      break;
+    }
+    q[0] = ch;
+    for (m = 1; m < 5 && p < endptr; m++) {
+      ch = p[0];
+      p++;
+      skip_white_a85(&p, endptr);
+      if (ch == '~') {
+        if (p < endptr && p[0] == '>') {
+          eod = 1;
+          p++;
+        } else {
+          error = -1;
+        }
+        break;
+      } else if (ch < '!' || ch > 'u') {
+        error = -1;
+        break;
+      } else {
+        q[m] = ch;
+      }
+    }
+    if (!error) {
+      uint32_t val = 0;
+      int      i;
+      if (m <= 1) {
+        error = -1;
+        break;
+      }
+      val = 85*85*85*(q[0] - '!') + 85*85*(q[1] - '!')
+              + 85*(q[2] - '!') + (q[3] - '!');
+      /* Check overflow */
+      if (val > UINT32_MAX / 85) {
+        error = -1;
+        break;
+      } else {
+        val = 85 * val;
+        if (val > UINT32_MAX - (q[4] - '!')) {
+          error = -1;
+          break;
+        }
+        val += (q[4] - '!');
+      }
+      if (!error) {
+        for (i = 3; i >= 0; i--) {
+          buf[n + i] = val & 0xff;
+          val /= 256;
+        }
+        n += m - 1;
+      }
+    }
+  }
+
+  if (error) {
+    WARN("Error in reading ASCII85 data.");
+    dst = NULL;
+  } else if (!eod) {
+    WARN("Error in reading ASCII85 data: No EOD");
+    dst = NULL;
+  } else {
+    dst = pdf_new_stream(0);
+    pdf_add_stream(dst, buf, n);
+  }
+  RELEASE(buf);
+
+  return dst;
+}
+
+static pdf_obj *
+filter_stream_decode (const char *filter_name, pdf_obj *src, pdf_obj *parm)
+{
+  pdf_obj    *dec;
+  const char *stream_data;
+  size_t      stream_length;
+
+  if (!filter_name)
+    return pdf_link_obj(src);
+
+  stream_data   = pdf_stream_dataptr(src);
+  stream_length = pdf_stream_length(src);
+
+  if (!strcmp(filter_name, "ASCIIHexDecode")) {
+    dec = filter_stream_decode_ASCIIHexDecode(stream_data, stream_length);
+  } else if (!strcmp(filter_name, "ASCII85Decode")) {
+    dec = filter_stream_decode_ASCII85Decode(stream_data, stream_length);
+#if HAVE_ZLIB
+  } else if (!strcmp(filter_name, "FlateDecode")) {
+    struct decode_parms decode_parm;
+    if (parm)
+      filter_get_DecodeParms_FlateDecode(&decode_parm, parm);
+    dec = filter_stream_decode_FlateDecode(stream_data, stream_length, parm ? &decode_parm : NULL);
+#endif /* HAVE_ZLIB */
+  } else {
+    WARN("DecodeFilter \"%s\" not supported.", filter_name);
+    dec = NULL;
+  }
+
+  return dec;
+}
+
+int
+pdf_concat_stream (pdf_obj *dst, pdf_obj *src)
+{
+  pdf_obj *filtered;
+  pdf_obj *stream_dict;
+  pdf_obj *filter, *parms;
+  int      error = 0;
+
+  if (!PDF_OBJ_STREAMTYPE(dst) || !PDF_OBJ_STREAMTYPE(src)) {
+    WARN("Passed invalid type in pdf_concat_stream().");
+    return -1;
+  }
+
+  stream_dict = pdf_stream_dict(src);
+
+  filter = pdf_lookup_dict(stream_dict, "Filter");
+  if (!filter) {
+    pdf_add_stream(dst, pdf_stream_dataptr(src), pdf_stream_length(src));
+    return 0;
+  }
+  if (pdf_lookup_dict(stream_dict, "DecodeParms")) {
+    /* Dictionary or array */
+    parms = pdf_deref_obj(pdf_lookup_dict(stream_dict, "DecodeParms"));
+    if (!parms) {
+      WARN("Failed to deref DeocdeParms...");
+      return -1;
+    } else if (!PDF_OBJ_ARRAYTYPE(parms) && !PDF_OBJ_DICTTYPE(parms)) {
+      WARN("PDF dict or array expected for DecodeParms...");
+      pdf_release_obj(parms);
+      return -1;
+    }
+  } else {
+    parms = NULL;
+  }
+  if (PDF_OBJ_ARRAYTYPE(filter)) {
+    int      i, num;
+    pdf_obj *prev = NULL;
+
+    num = pdf_array_length(filter);
+    if (parms) {
+      if (!PDF_OBJ_ARRAYTYPE(parms) || pdf_array_length(parms) != num) {
+        WARN("Invalid DecodeParam object found.");
+        pdf_release_obj(parms);
+        return -1;
+      }
+    }
+    if (num == 0) {
+      filtered = pdf_link_obj(src);
+    } else {
+      filtered = NULL;
+      prev = pdf_link_obj(src);
+      for (i = 0; i < num && prev != NULL; i++) {
+        pdf_obj *tmp1, *tmp2;
+
+        tmp1 = pdf_deref_obj(pdf_get_array(filter, i));
+        if (parms) {
+          tmp2 = pdf_deref_obj(pdf_get_array(parms, i));
+        } else {
+          tmp2 = NULL;
+        }
+        if (PDF_OBJ_NAMETYPE(tmp1)) {
+          filtered = filter_stream_decode(pdf_name_value(tmp1), prev, tmp2);
+        } else if (PDF_OBJ_NULLTYPE(tmp1)) {
+          filtered = pdf_link_obj(prev);
+        } else {
+          WARN("Unexpected object found for /Filter...");
+          filtered = NULL;
+        }
+        if (prev)
+          pdf_release_obj(prev);
+        if (tmp1)
+          pdf_release_obj(tmp1);
+        if (tmp2)
+          pdf_release_obj(tmp2);
+        prev = filtered;      
+      }
+    }
+  } else if (PDF_OBJ_NAMETYPE(filter)) {
+    filtered = filter_stream_decode(pdf_name_value(filter), src, parms);
+  } else {
+    WARN("Invalid value for /Filter found.");
+    filtered = NULL;
+  }
+  if (parms)
+    pdf_release_obj(parms);
+  if (filtered) {
+    pdf_add_stream(dst, pdf_stream_dataptr(filtered), pdf_stream_length(filtered));
+    pdf_release_obj(filtered);
+    error = 0;
+  } else {
+    error = -1;
+  }
+
+  return error;
+}
+
+static pdf_obj *
+pdf_stream_uncompress (pdf_obj *src) {
+  pdf_obj *dst = pdf_new_stream(0);
+
+  TYPECHECK(src, PDF_STREAM);
+
+  pdf_merge_dict(pdf_stream_dict(dst), pdf_stream_dict(src));
+  pdf_remove_dict(pdf_stream_dict(dst), "Length");
+  pdf_concat_stream(dst, src);
+
+  return dst;
+}
+
+#if 0
+void
+pdf_stream_set_flags (pdf_obj *stream, int flags)
+{
+  pdf_stream *data;
+
+  TYPECHECK(stream, PDF_STREAM);
+
+  data = stream->data;
+  data->_flags = flags;
+}
+
+int
+pdf_stream_get_flags (pdf_obj *stream)
+{
+  pdf_stream *data;
+
+  TYPECHECK(stream, PDF_STREAM);
+
+  data = stream->data;
+
+  return data->_flags;
+}
+#endif
+
+static void
+pdf_write_obj (pdf_out *p, pdf_obj *object)
+{
+  ASSERT(p);
+
+  if (object == NULL) {
+    write_null(p);
+    return;
+  }
+
+  if (INVALIDOBJ(object) || PDF_OBJ_UNDEFINED(object))
+    ERROR("pdf_write_obj: Invalid object, type = %d\n", object->type);
+
+  if (error_out)
+    fprintf(stderr, "{%d}", object->refcount);
+
+  switch (object->type) {
+  case PDF_BOOLEAN:
+    write_boolean(p, object->data);
+    break;
+  case PDF_NUMBER:
+    write_number (p, object->data);
+    break;
+  case PDF_STRING:
+    write_string (p, object->data);
+    break;
+  case PDF_NAME:
+    write_name(p, object->data);
+    break;
+  case PDF_ARRAY:
+    write_array(p, object->data);
+    break;
+  case PDF_DICT:
+    write_dict (p, object->data);
+    break;
+  case PDF_STREAM:
+    write_stream(p, object->data);
+    break;
+  case PDF_NULL:
+    write_null(p);
+    break;
+  case PDF_INDIRECT:
+    write_indirect(p, object->data);
+    break;
+  }
+}
+
+/* Write the object to the file */ 
+static void
+pdf_flush_obj (pdf_out *p, pdf_obj *object)
+{
+  size_t length;
+  char   buf[64];
+
+#if defined(PDFOBJ_USE_THREADS)
+  /* Large streams are written piecewise by the main thread. */
+  if (p->workers.num_threads > 0 && PDF_OBJ_STREAMTYPE(object) &&
+      pdf_stream_length(object) < STREAM_DEFLATE_MIN) {
+    defer_stream(p, object);
+    return;
+  }
+#endif
+
+  /*
+   * Record file position
+   */
+  add_xref_entry(p, object->label, 1,
+                 p->output.file_position, object->generation);
+  length = sprintf(buf, "%u %hu obj\n", object->label, object->generation);
+  p->state.enc_mode =
+    (p->options.enable_encrypt && !(object->flags & OBJ_NO_ENCRYPT)) ? 1 : 0;
+  if (p->state.enc_mode) {
+    pdf_enc_set_label(p->sec_data, object->label);
+    pdf_enc_set_generation(p->sec_data, object->generation);
+  }
+  pdf_out_str(p, buf, length);
+  pdf_write_obj(p, object);
+  pdf_out_str(p, "\nendobj\n", 8);
+
+  if (p->stream_length) {
+    pdf_obj *length_obj = p->stream_length;
+
+    p->stream_length = NULL;
+    pdf_release_obj(length_obj);
+  }
+}
+
+static int
+pdf_add_objstm (pdf_out *p, pdf_obj *objstm, pdf_obj *object)
+{
+  int *data, pos;
+
+  TYPECHECK(objstm, PDF_STREAM);
+  ASSERT(p);
+
+  data = get_objstm_data(objstm);
+  pos = ++data[0];
+
+  data[2*pos]   = object->label;
+  data[2*pos+1] = pdf_stream_length(objstm);
+
+  /* redirect output into objstm */
+  p->output_stream  = objstm;
+  p->state.enc_mode = 0;
+  pdf_write_obj(p, object);
+  pdf_out_char(p, '\n');
+  p->output_stream = NULL;
+
+  return pos;
+}
+
+/* Move the objects of the object stream SRC, which has not been written
+ * yet, to the end of DST. Neither of them is labeled at this point.
+ */
+static void
+merge_objstm (pdf_obj *dst, pdf_obj *src)
+{
+  int   *dst_data = get_objstm_data(dst);
+  int   *src_data = get_objstm_data(src);
+  size_t base     = pdf_stream_length(dst);
+  int    i;
+
+  for (i = 1; i <= src_data[0]; i++) {
+    int pos = ++dst_data[0];
+
+    dst_data[2*pos]   = src_data[2*i];
+    dst_data[2*pos+1] = src_data[2*i+1] + base;
+  }
+  pdf_add_stream(dst, pdf_stream_dataptr(src), pdf_stream_length(src));
+
+  pdf_release_obj(src);
+}
+
+static int
+objstm_kind (pdf_obj *object)
+{
+  pdf_obj *type;
+
+  if (!PDF_OBJ_DICTTYPE(object))
+    return OBJSTM_KIND_OTHER;
+
+  type = pdf_lookup_dict(object, "Type");
+  if (PDF_OBJ_NAMETYPE(type)) {
+    const char *name = pdf_name_value(type);
+
+    if (!strcmp(name, "Page") || !strcmp(name, "Pages") ||
+        !strcmp(name, "Annot"))
+      return OBJSTM_KIND_PAGE;
+    else if (!strcmp(name, "Font") || !strcmp(name, "FontDescriptor") ||
+             !strcmp(name, "Encoding"))
+      return OBJSTM_KIND_FONT;
+    else if (!strcmp(name, "Outlines"))
+      return OBJSTM_KIND_OUTLINE;
+  } else if (pdf_lookup_dict(object, "Rect") &&
+             pdf_lookup_dict(object, "Subtype")) {
+    return OBJSTM_KIND_PAGE; /* /Type is optional for annotations */
+  } else if (pdf_lookup_dict(object, "Title") &&
+             pdf_lookup_dict(object, "Parent")) {
+    return OBJSTM_KIND_OUTLINE;
+  } else if (pdf_lookup_dict(object, "Limits") ||
+             pdf_lookup_dict(object, "Names") ||
+             pdf_lookup_dict(object, "Nums")) {
+    return OBJSTM_KIND_NAMES;
+  }
+
+  return OBJSTM_KIND_OTHER;
+}
+
+/* An object stream is labeled only here, when it is written out, so that
+ * streams merged by merge_objstm() don't leave unused labels behind.
+ */
+static void
+release_objstm (pdf_out *p, pdf_obj *objstm)
+{
+  int *data = get_objstm_data(objstm);
+  int pos = data[0];
+  pdf_obj *dict;
+  pdf_stream *stream;
+  unsigned char *old_buf;
+  size_t         old_length;
+  stream = (pdf_stream *) objstm->data;
+
+  pdf_label_obj(p, objstm);
+  {
+    int i;
+    for (i = 1; i <= pos; i++)
+      add_xref_entry(p, data[2*i], 2, objstm->label, i-1);
+  }
+
+  /* Precede stream data by offset table */
+  old_buf = stream->stream;
+  old_length = stream->stream_length;
+  /* Reserve 22 bytes for each entry (two 10 digit numbers plus two spaces) */
+  stream->stream = NEW(old_length + 22*pos, unsigned char);
+  stream->stream_length = 0;
+
+  {
+    int i = 2*pos, *val = data+2;
+    while (i--) {
+      char buf[32];
+      size_t length = sprintf(buf, "%d ", *(val++));
+      pdf_add_stream(objstm, buf, length);
+    }
+  }
+
+  dict = pdf_stream_dict(objstm);
+  pdf_add_dict(dict, pdf_new_name("Type"), pdf_new_name("ObjStm"));
+  pdf_add_dict(dict, pdf_new_name("N"), pdf_new_number(pos));
+  pdf_add_dict(dict, pdf_new_name("First"), pdf_new_number(stream->stream_length));
+  
+  pdf_add_stream(objstm, old_buf, old_length);
+  RELEASE(old_buf);
+  pdf_release_obj(objstm);
+}
+
+/* Digests are uniformly distributed, so any part of them is a good hash. */
+#define dedup_hash(d) (((size_t)(d)[0] << 24) | ((d)[1] << 16) | ((d)[2] << 8) | (d)[3])
+
+static void
+dedup_table_grow (pdf_out *p)
+{
+  struct dedup_entry *old = p->dedup.table;
+  size_t              old_size = p->dedup.size, i, j, mask;
+
+  p->dedup.size  = old_size * 2;
+  p->dedup.table = NEW(p->dedup.size, struct dedup_entry);
+  memset(p->dedup.table, 0, p->dedup.size * sizeof(struct dedup_entry));
+  mask = p->dedup.size - 1;
+  for (i = 0; i < old_size; i++) {
+    if (!old[i].label)
+      continue;
+    j = dedup_hash(old[i].digest) & mask;
+    while (p->dedup.table[j].label)
+      j = (j + 1) & mask;
+    p->dedup.table[j] = old[i];
+  }
+  RELEASE(old);
+}
+
+/* Check if OBJECT, which is about to be written, is identical to an
+ * object written before. If so, the label of OBJECT becomes an alias for
+ * the earlier one, so that references to it written from now on refer to
+ * the first copy, and 1 is returned. Objects to which a reference has
+ * been written already, and objects which must not be shared, are left
+ * alone. Objects are compared by a SHA-256 digest of their serialization
+ * (with aliases already resolved) and, for streams, of their unfiltered
+ * data and the flags determining how it is filtered.
+ */
+static int
+dedup_obj (pdf_out *p, pdf_obj *object)
+{
+  SHA256_CONTEXT sha;
+  unsigned char  digest[32];
+  pdf_obj       *dict = NULL, *saved_output;
+  pdf_stream    *buffer, *stream = NULL;
+  uint32_t       label = object->label;
+  size_t         i, mask, length;
+  int            saved_enc_mode;
+
+  if (object->generation || (object->flags & OBJ_NO_ENCRYPT) ||
+      label_set_has(&p->dedup.referenced, label))
+    return 0;
+
+  switch (object->type) {
+  case PDF_STREAM:
+    stream = object->data;
+    dict   = stream->dict;
+    if (stream->objstm_data)
+      return 0;
+#ifdef HAVE_ZLIB
+    if (stream->deflate)
+      return 0;
+#endif
+    break;
+  case PDF_DICT:
+    dict = object;
+    break;
+  case PDF_ARRAY:
+    break;
+  default:
+    return 0;
+  }
+  /* Pages, annotations, form fields, optional content groups and
+   * structure elements are known by their identity: two equal ones
+   * must stay distinct objects.
+   */
+  if (dict) {
+    static const char *distinct_types[] = {
+      "Page", "Pages", "Annot", "Catalog", "OCG", "OCMD", "StructElem", NULL
+    };
+    pdf_obj *type = pdf_lookup_dict(dict, "Type");
+
+    if (pdf_lookup_dict(dict, "Rect") ||
+        pdf_lookup_dict(dict, "FT")   || pdf_lookup_dict(dict, "T"))
+      return 0;
+    if (PDF_OBJ_NAMETYPE(type)) {
+      for (i = 0; distinct_types[i]; i++) {
+        if (!strcmp(pdf_name_value(type), distinct_types[i]))
+          return 0;
+      }
+    }
+  }
+
+  if (!p->dedup.buffer)
+    p->dedup.buffer = pdf_new_stream(0);
+  buffer = p->dedup.buffer->data;
+  buffer->stream_length = 0;
+
+  saved_output      = p->output_stream;
+  saved_enc_mode    = p->state.enc_mode;
+  p->output_stream  = p->dedup.buffer;
+  p->state.enc_mode = 0;
+  pdf_write_obj(p, dict ? dict : object);
+  p->output_stream  = saved_output;
+  p->state.enc_mode = saved_enc_mode;
+
+  SHA256_init(&sha);
+  SHA256_write(&sha, (const unsigned char *) &object->type, sizeof(int));
+  SHA256_write(&sha, buffer->stream, buffer->stream_length);
+  length = buffer->stream_length;
+  if (stream) {
+    SHA256_write(&sha, (const unsigned char *) &stream->_flags,
+                 sizeof(stream->_flags));
+    {
+      int32_t parms[4];
+
+      parms[0] = stream->decodeparms.predictor;
+      parms[1] = stream->decodeparms.colors;
+      parms[2] = stream->decodeparms.bits_per_component;
+      parms[3] = stream->decodeparms.columns;
+      SHA256_write(&sha, (const unsigned char *) parms, sizeof(parms));
+    }
+    for (i = 0; i < stream->stream_length; i += 1 << 30) {
+      SHA256_write(&sha, stream->stream + i,
+                   MIN(stream->stream_length - i, 1 << 30));
+    }
+    length += stream->stream_length;
+  }
+  SHA256_final(digest, &sha);
+
+  if (2 * (p->dedup.count + 1) > p->dedup.size)
+    dedup_table_grow(p);
+  mask = p->dedup.size - 1;
+  for (i = dedup_hash(digest) & mask; p->dedup.table[i].label;
+       i = (i + 1) & mask) {
+    if (!memcmp(p->dedup.table[i].digest, digest, 32))
+      break;
+  }
+  if (!p->dedup.table[i].label) {
+    memcpy(p->dedup.table[i].digest, digest, 32);
+    p->dedup.table[i].label = label;
+    p->dedup.count++;
+    return 0;
+  }
+
+  if (label >= p->dedup.max_alias) {
+    uint32_t max_alias = (label/IND_OBJECTS_ALLOC_SIZE+1)*IND_OBJECTS_ALLOC_SIZE;
+
+    p->dedup.alias = RENEW(p->dedup.alias, max_alias, uint32_t);
+    memset(p->dedup.alias + p->dedup.max_alias, 0,
+           (max_alias - p->dedup.max_alias) * sizeof(uint32_t));
+    p->dedup.max_alias = max_alias;
+  }
+  p->dedup.alias[label] = p->dedup.table[i].label;
+  /* The label is left free, with the generation it would be reused with. */
+  add_xref_entry(p, label, 0, 0, 1);
+  p->dedup.merged++;
+  p->dedup.saved += length;
+
+  return 1;
+}
+
+void
+pdf_release_obj (pdf_obj *object)
+{
+  pdf_out *p = current_output();
+
+  if (object == NULL)
+    return;
+  if (INVALIDOBJ(object) || object->refcount <= 0) {
+    MESG("\npdf_release_obj: object=%p, type=%d, refcount=%d\n",
+         object, object->type, object->refcount);
+    error_out = 1;
+    pdf_write_obj(p, object);
+    ERROR("pdf_release_obj:  Called with invalid object.");
+    error_out = 0;
+  }
+  object->refcount -= 1;
+  if (object->refcount == 0) {
+#if defined(PDFOBJ_DEBUG)
+  bucket[object->obj_id] = NULL;
+#endif
+    /*
+     * Nothing is using this object so it's okay to remove it.
+     * Nonzero "label" means object needs to be written before it's destroyed.
+     */
+    if (object->label) {
+      label_set_add(&p->free_list, object->label);
+      if (p->output.file != NULL &&
+          !(p->dedup.table && dedup_obj(p, object))) {
+        if (!p->options.use_objstm || object->flags & OBJ_NO_OBJSTM ||
+            (p->options.enable_encrypt && (object->flags & OBJ_NO_ENCRYPT)) ||
+            object->generation) {
+          pdf_flush_obj(p, object);
+        } else {
+          int kind = objstm_kind(object);
+
+          if (!p->current_objstm[kind]) {
+            int *data = NEW(2*OBJSTM_MAX_OBJS+2, int);
+            data[0] = data[1] = 0;
+            p->current_objstm[kind] = pdf_new_stream(STREAM_COMPRESS);
+            set_objstm_data(p->current_objstm[kind], data);
+          }
+          if (pdf_add_objstm(p, p->current_objstm[kind], object) == OBJSTM_MAX_OBJS ||
+              pdf_stream_length(p->current_objstm[kind]) >= OBJSTM_MAX_BYTES) {
+            release_objstm(p, p->current_objstm[kind]);
+            p->current_objstm[kind] = NULL;
+          }
+        }
+      }
+    }
+    switch (object->type) {
+    case PDF_BOOLEAN:
+      release_boolean(object->data);
+      break;
+    case PDF_NULL:
+      break;
+    case PDF_NUMBER:
+      release_number(object->data);
+      break;
+    case PDF_STRING:
+      release_string(object->data);
+      break;
+    case PDF_NAME:
+      release_name(object->data);
+      break;
+    case PDF_ARRAY:
+      release_array(object->data);
+      break;
+    case PDF_DICT:
+      release_dict(object->data);
+      break;
+    case PDF_STREAM:
+      release_stream(object->data);
+      break;
+    case PDF_INDIRECT:
+      release_indirect(object->data);
+      break;
+    }
+    /* This might help detect freeing already freed objects */
+    object->type = -1;
+    object->data = NULL;
+    POOL_RELEASE(object);
+  }
+}
+
+/* Reading external PDF files
+ *
+ */
+static int
+backup_line (FILE *pdf_input_file)
+{
+  int ch = -1;
+
+  /*
+   * Note: this code should work even if \r\n is eol. It could fail on a
+   * machine where \n is eol and there is a \r in the stream --- Highly
+   * unlikely in the last few bytes where this is likely to be used.
+   */
+  if (tell_position(pdf_input_file) > 1)
+    do {
+      seek_relative (pdf_input_file, -2);
+    } while (tell_position(pdf_input_file) > 0 &&
+	     (ch = fgetc(pdf_input_file)) >= 0 &&
+	     (ch != '\n' && ch != '\r' ));
+  if (ch < 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
+static int
+find_xref (FILE *pdf_input_file)
+{
+  size_t  len, xref_pos = 0;
+  int     tries = 10;
+
+  do {
+    size_t currentpos;
+
+    if (!backup_line(pdf_input_file)) {
+      tries = 0;
+      break;
+    }
+    currentpos = tell_position(pdf_input_file);
+    fread(work_buffer, sizeof(char), strlen("startxref"), pdf_input_file);
+    seek_absolute(pdf_input_file, currentpos);
+    tries--;
+  } while (tries > 0 &&
+	   strncmp(work_buffer, "startxref", strlen("startxref")));
+  if (tries <= 0)
+    return 0;
+
+  /* Skip rest of this line */
+  mfgets(work_buffer, WORK_BUFFER_SIZE, pdf_input_file);
+  /* Next line of input file should contain actual xref location */
+  len = mfreadln(work_buffer, WORK_BUFFER_SIZE, pdf_input_file);
+  if (len <= 0)
+   WARN("Reading xref location data failed... Not a PDF file?");
+  else {
+    const char *start, *end;
+    char *number;
+
+    start = work_buffer;
+    end   = start + len;
+    skip_white(&start, end);
+    number   = parse_number(&start, end);
+    xref_pos = (int) atof(number);
+    RELEASE(number);
+  }
+
+  return xref_pos;
+}
+
+/*
+ * This routine must be called with the file pointer located
+ * at the start of the trailer.
+ */
+static pdf_obj *
+parse_trailer (pdf_file *pf)
+{
+  pdf_obj *result;
+  /*
+   * Fill work_buffer and hope trailer fits. This should
+   * be made a bit more robust sometime.
+   */
+  if (fread(work_buffer, sizeof(char),
+	    WORK_BUFFER_SIZE, pf->file) == 0 ||
+      strncmp(work_buffer, "trailer", strlen("trailer"))) {
+    WARN("No trailer.  Are you sure this is a PDF file?");
+    WARN("buffer:\n->%s<-\n", work_buffer);
+    result = NULL;
+  } else {
+    const char *p = work_buffer + strlen("trailer");
+    skip_white(&p, work_buffer + WORK_BUFFER_SIZE);
+    result = parse_pdf_dict(&p, work_buffer + WORK_BUFFER_SIZE, pf);
+  }
+
+  return result;
+}
+
+/*
+ * This routine tries to estimate an upper bound for character position
+ * of the end of the object, so it knows how big the buffer must be.
+ * The parsing routines require that the entire object be read into
+ * memory. It would be a major pain to rewrite them.  The worst case
+ * is that an object before an xref table will grab the whole table
+ * :-(
+ */
+static int
+next_object_offset (pdf_file *pf, uint32_t obj_num)
+{
+  uint32_t next = pf->file_size;  /* Worst case */
+  size_t   i;
+  uint32_t curr;
+
+  curr = pf->xref_table[obj_num].field2;
+  /* Check all other type 1 objects to find next one */
+  for (i = 0; i < pf->num_obj; i++) {
+    if (pf->xref_table[i].type == 1 &&
+        pf->xref_table[i].field2 > curr &&
+        pf->xref_table[i].field2 < next)
+      next = pf->xref_table[i].field2;
+  }
+
+  return  next;
+}
+
+#define checklabel(pf, n, g) ((n) > 0 && (n) < (pf)->num_obj && ( \
+  ((pf)->xref_table[(n)].type == 1 && (pf)->xref_table[(n)].field3 == (g)) || \
+  ((pf)->xref_table[(n)].type == 2 && !(g))))
+
+pdf_obj *
+pdf_new_indirect (pdf_file *pf, uint32_t obj_num, uint16_t obj_gen)
+{
+  pdf_obj      *result;
+  pdf_indirect *indirect;
+
+  indirect = POOL_NEW(pdf_indirect);
+  indirect->pf         = pf;
+  indirect->obj        = NULL;
+  indirect->label      = obj_num;
+  indirect->generation = obj_gen;
+
+  result   = pdf_new_obj(PDF_INDIRECT);
+  result->data = indirect;
+
+  return result;
+}
+
+int
+pdf_indirect_label (pdf_obj *ref, uint32_t *label, uint16_t *generation)
+{
+  pdf_indirect *data;
+
+  if (!PDF_OBJ_INDIRECTTYPE(ref))
+    return -1;
+  data = ref->data;
+  if (!data->pf)
+    return -1;
+  *label      = data->label;
+  *generation = data->generation;
+
+  return 0;
+}
+
+static pdf_obj *
+pdf_read_object (uint32_t obj_num, uint16_t obj_gen, pdf_file *pf, size_t offset, size_t limit)
+{
+  pdf_obj    *result = NULL; 
+  size_t      length;
+  char       *buffer = NULL;
+  const char *p, *endptr;
+
+  if (limit > (size_t) pf->file_size)
+    limit = pf->file_size;
+  if (offset >= limit)
+    return NULL;
+  length = limit - offset;
+
+  if (pf->map) {
+    p = pf->map + offset;
+  } else {
+    buffer = NEW(length + 1, char);
+
+    seek_absolute(pf->file, offset);
+    length = fread(buffer, sizeof(char), length, pf->file);
+    p      = buffer;
+  }
+  endptr = p + length;
+
+  /* Check for obj_num and obj_gen */
+  {
+    const char   *q = p; /* <== p */
+    char         *sp;
+    uint32_t      n, g;
+
+    skip_white(&q, endptr);
+    sp = parse_unsigned(&q, endptr);
+    if (!sp) {
+      if (buffer)
+        RELEASE(buffer);
+      return NULL;
+    }
+    n = strtoul(sp, NULL, 10);
+    RELEASE(sp);
+
+    skip_white(&q, endptr);
+    sp = parse_unsigned(&q, endptr);
+    if (!sp) {
+      if (buffer)
+        RELEASE(buffer);
+      return NULL;
+    }
+    g = strtoul(sp, NULL, 10);
+    RELEASE(sp);
+
+    if (obj_num && (n != obj_num || g != obj_gen)) {
+      if (buffer)
+        RELEASE(buffer);
+      return NULL;
+    }
+
+    p = q; /* ==> p */
+  }
+
+
+  skip_white(&p, endptr);
+  if (p + strlen("obj") > endptr || memcmp(p, "obj", strlen("obj"))) {
+    WARN("Didn't find \"obj\".");
+    if (buffer)
+      RELEASE(buffer);
+    return NULL;
+  }
+  p += strlen("obj");
+
+  result = parse_pdf_object(&p, endptr, pf);
+
+  skip_white(&p, endptr);
+  if (p + strlen("endobj") > endptr ||
+      memcmp(p, "endobj", strlen("endobj"))) {
+    WARN("Didn't find \"endobj\".");
+    if (result)
+      pdf_release_obj(result);
+    result = NULL;
+  }
+  if (buffer)
+    RELEASE(buffer);
+
+  return result;
+}
+
+static pdf_obj *
+read_objstm (pdf_file *pf, uint32_t num)
+{
+  size_t      offset = pf->xref_table[num].field2;
+  uint16_t    gen    = pf->xref_table[num].field3;
+  size_t      limit  = next_object_offset(pf, num);
+  int         n, first, *header = NULL;
+  const char *p, *endptr;
+  int         i;
+  pdf_obj    *objstm, *dict, *type, *n_obj, *first_obj;
+
+  objstm = pdf_read_object(num, gen, pf, offset, limit);
+
+  if (!PDF_OBJ_STREAMTYPE(objstm))
+    goto error;
+
+  {
+    pdf_obj *tmp = pdf_stream_uncompress(objstm);
+    if (!tmp)
+      goto error;
+    pdf_release_obj(objstm);
+    objstm = tmp;
+  }
+
+  dict = pdf_stream_dict(objstm);
+
+  type = pdf_lookup_dict(dict, "Type");
   if (!PDF_OBJ_NAMETYPE(type) ||
       strcmp(pdf_name_value(type), "ObjStm"))
     goto error;
 
-  n_obj = pdf_lookup_dict(dict, "N");
-  if (!PDF_OBJ_NUMBERTYPE(n_obj))
+  n_obj = pdf_lookup_dict(dict, "N");
+  if (!PDF_OBJ_NUMBERTYPE(n_obj))
+    goto error;
+  n = (int) pdf_number_value(n_obj);
+
+  first_obj = pdf_lookup_dict(dict, "First");
+  if (!PDF_OBJ_NUMBERTYPE(first_obj))
+    goto error;
+  first = (int) pdf_number_value(first_obj);
+  /* reject object streams without object data */
+  if (first >= pdf_stream_length(objstm))
+    goto error;
+
+  header = NEW(2*(n+1), int);
+  set_objstm_data(objstm, header);
+  *(header++) = n;
+  *(header++) = first;
+
+  /* avoid parsing beyond offset table */
+  p      = pdf_stream_dataptr(objstm);
+  endptr = p + first;
+  i = 2*n;
+  while (i--) {
+    unsigned long value = 0;
+
+    skip_white(&p, endptr);
+    if (p == endptr || !isdigit((unsigned char) *p))
+      goto error;
+    for (; p < endptr && isdigit((unsigned char) *p); p++)
+      value = value * 10 + (*p - '0');
+    *(header++) = value;
+  }
+
+  /* Any garbage after last entry? */
+  skip_white(&p, endptr);
+  if (p != endptr)
+    goto error;
+  
+  return pf->xref_table[num].direct = objstm;
+
+ error:
+  WARN("Cannot parse object stream.");
+  if (objstm)
+    pdf_release_obj(objstm);
+  return NULL;
+}
+
+/* Label without corresponding object definition are replaced by the
+ * null object, as required by the PDF spec. This is important to parse
+ * several cross-reference sections.
+ */ 
+static pdf_obj *
+pdf_get_object (pdf_file *pf, uint32_t obj_num, uint16_t obj_gen)
+{
+  pdf_obj *result;
+
+  if (!checklabel(pf, obj_num, obj_gen)) {
+    WARN("Trying to read nonexistent or deleted object: %lu %u",
+         obj_num, obj_gen);
+    return pdf_new_null();
+  }
+
+  if ((result = pf->xref_table[obj_num].direct)) {
+    return pdf_link_obj(result);
+  }
+
+  if (pf->xref_table[obj_num].type == 1) {
+    /* type == 1 */
+    uint32_t offset;
+    size_t   limit;
+    offset = pf->xref_table[obj_num].field2;
+    limit  = next_object_offset(pf, obj_num);
+    result = pdf_read_object(obj_num, obj_gen, pf, offset, limit);
+  } else {
+    /* type == 2 */
+    uint32_t    objstm_num = pf->xref_table[obj_num].field2;
+    uint16_t    index = pf->xref_table[obj_num].field3;
+    pdf_obj    *objstm;
+    int        *data, n, first, length;
+    const char *p, *q;
+
+    if (objstm_num >= pf->num_obj ||
+        pf->xref_table[objstm_num].type != 1 ||
+        !((objstm = pf->xref_table[objstm_num].direct) ||
+          (objstm = read_objstm(pf, objstm_num))))
+      goto error;
+
+    data  = get_objstm_data(objstm);
+    n     = *(data++);
+    first = *(data++);
+
+    if (index >= n || data[2*index] != obj_num)
+      goto error;
+
+    length = pdf_stream_length(objstm);
+    q = (const char *) pdf_stream_dataptr(objstm);
+    p = q + first + data[2*index+1];
+    q = q + (index == n-1 ? length : first+data[2*index+3]);
+    result = parse_pdf_object(&p, q, pf);
+    if (!result)
+      goto error;
+  }
+
+  /* Make sure the caller doesn't free this object */
+  pf->xref_table[obj_num].direct = pdf_link_obj(result);
+
+  return result;
+
+ error:
+  WARN("Could not read object from object stream.");
+  return pdf_new_null();
+}
+
+#define OBJ_FILE(o) (((pdf_indirect *)((o)->data))->pf)
+#define OBJ_OBJ(o)  (((pdf_indirect *)((o)->data))->obj)
+#define OBJ_NUM(o)  (((pdf_indirect *)((o)->data))->label)
+#define OBJ_GEN(o)  (((pdf_indirect *)((o)->data))->generation)
+
+static pdf_obj *
+pdf_new_ref (pdf_out *p, pdf_obj *object)
+{
+  pdf_obj *result;
+
+  ASSERT(p);
+
+  if (object->label == 0) {
+    pdf_label_obj(p, object);
+  }
+  result = pdf_new_indirect(NULL, object->label, object->generation);
+  OBJ_OBJ(result) = object;
+  return result;
+}
+
+/* pdf_deref_obj always returns a link instead of the original   */
+/* It never return the null object, but the NULL pointer instead */
+pdf_obj *
+pdf_deref_obj (pdf_obj *obj)
+{
+  int count = PDF_OBJ_MAX_DEPTH;
+
+  if (obj)
+    obj = pdf_link_obj(obj);
+
+  while (PDF_OBJ_INDIRECTTYPE(obj) && --count) {
+    pdf_file *pf = OBJ_FILE(obj);
+    if (pf) {
+      uint32_t obj_num = OBJ_NUM(obj);
+      uint16_t obj_gen = OBJ_GEN(obj);
+      pdf_release_obj(obj);
+      obj = pdf_get_object(pf, obj_num, obj_gen);
+    } else {
+      pdf_out      *p    = current_output();
+      pdf_indirect *data = obj->data;
+
+      if (label_set_has(&p->free_list, data->label)) {
+        pdf_release_obj(obj);
+        return NULL;
+      } else {
+        pdf_obj *next_obj = OBJ_OBJ(obj);
+        if (!next_obj) {
+          ERROR("Undefined object reference"); 
+        }
+        pdf_release_obj(obj);
+        obj = pdf_link_obj(next_obj);
+      }
+    }
+  }
+
+  if (!count)
+    ERROR("Loop in object hierarchy detected. Broken PDF file?");
+
+  if (PDF_OBJ_NULLTYPE(obj)) {
+    pdf_release_obj(obj);
+    return NULL;
+  } else
+    return obj;
+}
+
+static void
+extend_xref (pdf_file *pf, size_t new_size) 
+{
+  size_t  i;
+
+  pf->xref_table = RENEW(pf->xref_table, new_size, xref_entry);
+  for (i = pf->num_obj; i < new_size; i++) {
+    pf->xref_table[i].direct   = NULL;
+    pf->xref_table[i].indirect = NULL;
+    pf->xref_table[i].type     = 0;
+    pf->xref_table[i].field3 = 0;
+    pf->xref_table[i].field2 = 0L;
+  }
+  pf->num_obj = new_size;
+}
+
+/* Returns < 0 for error, 1 for success, and 0 when xref stream found. */
+static int
+parse_xref_table (pdf_file *pf, size_t xref_pos)
+{
+  FILE       *pdf_input_file = pf->file;
+  const char *p, *endptr;
+  char        buf[256]; /* See, PDF ref. v.1.7, p.91 for "255+1" here. */
+  size_t      len;
+
+  /*
+   * This routine reads one xref segment. It may be called multiple times
+   * on the same file.  xref tables sometimes come in pieces.
+   */
+  seek_absolute(pf->file, xref_pos);
+  len = mfreadln(buf, 255, pdf_input_file);
+  /* We should have already checked that "startxref" section exists.
+   * So, EOF here (len = -1) is impossible.  We don't treat too long line
+   * case seriously.
+   */
+  if (len < 0) {
+    WARN("Something went wrong while reading xref table...giving up.");
+    return -1;
+  }
+  p      = buf;
+  endptr = buf + len;
+  /* No skip_white() here. There should not be any white-spaces here. */
+  if (memcmp(p, "xref", strlen("xref"))) {
+    /* Might be an xref stream and not an xref table */
+    return 0;
+  }
+  p += strlen("xref");
+  skip_white(&p, endptr);
+  if (p != endptr) {
+    WARN("Garbage after \"xref\" keyword found.");
+    return -1;
+  }
+
+  /* Next line in file has first item and size of table */
+  for (;;) {
+    char      flag;
+    size_t    current_pos, size, offset;
+    int       i;
+    uint32_t  first, obj_gen;
+
+    current_pos = tell_position(pdf_input_file);
+    len = mfreadln(buf, 255, pdf_input_file);
+    if (len == 0) /* empty line... just skip. */
+      continue;
+    else if (len < 0) {
+      WARN("Reading a line failed in xref table.");
+      return -1;
+    }
+
+    p      = buf;
+    endptr = buf + len;
+    skip_white(&p, endptr);
+    if (p == endptr) { /* Only white-spaces and/or comment found. */
+      continue;
+    } else if (!strncmp(p, "trailer", strlen ("trailer"))) {
+      /*
+       * Backup... This is ugly, but it seems like the safest thing to
+       * do.  It is possible the trailer dictionary starts on the same
+       * logical line as the word trailer.  In that case, the mfgets
+       * call might have started to read the trailer dictionary and
+       * parse_trailer would fail.
+       */
+      current_pos += p - buf; /* Jump to the beginning of "trailer" keyword. */
+      seek_absolute(pdf_input_file, current_pos);
+      break;
+    }
+    /* Line containing something other than white-space characters found.
+     *
+     * Start reading xref subsection
+     *
+     * This section just reads two nusigned integers, namely, the object number
+     * of first object and the size of the xref subsection. PDF reference says
+     * that only "a space" is allowed between those two numbers but we allow
+     * more white-space characters.
+     */
+    {
+      char *q;
+
+      /* Object number of the first object whithin this xref subsection. */
+      q = parse_unsigned(&p, endptr);
+      if (!q) {
+        WARN("An unsigned integer expected but could not find. (xref)");
+        return -1;
+      }
+      first = atoi(q);
+      RELEASE(q);
+      skip_white(&p, endptr);
+
+      /* Nnumber of objects in this xref subsection. */
+      q = parse_unsigned(&p, endptr);
+      if (!q) {
+        WARN("An unsigned integer expected but could not find. (xref)");
+        return -1;
+      }
+      size = atoi(q);
+      RELEASE(q);
+      skip_white(&p, endptr);
+
+      /* Check for unrecognized tokens */
+      if (p != endptr) {
+        WARN("Unexpected token found in xref table.");
+        return -1;
+      }
+    }
+
+    /* The first line of a xref subsection OK. */
+    if (pf->num_obj < first + size) {
+      extend_xref(pf, first + size);
+    }
+
+    /* Start parsing xref subsection body... */
+    for (i = first; i < first + size; ) {
+     /* PDF spec. requires each xref subsection lines being exactly 20 bytes
+      * long [including end-of-line marker(s)], offset 10 decimal digits,
+      * generation number being 5 decimal digits, and each entries delimitted
+      * by "a single space". However, we don't srtictly follow this rule:
+      * More than one "white-spaces" allowed, can be ended with a comment,
+      * and so on.
+      */
+      len = mfreadln(buf, 255, pdf_input_file);
+      if (len == 0) /* empty line...just skip. */
+        continue;
+      else if (len < 0) {
+        WARN("Something went wrong while reading xref subsection...");
+        return -1;
+      }
+      p      = buf;
+      endptr = buf + len;
+      skip_white(&p, endptr);
+      if (p == endptr) /* Only white-spaces and/or comment. */
+        continue;
+
+      /*
+       * Don't overwrite positions that have already been set by a
+       * modified xref table.  We are working our way backwards
+       * through the reference table, so we only set "position" 
+       * if it hasn't been set yet.
+       */
+      offset = 0UL; obj_gen = 0; flag = 0;
+      {
+        char *q;
+
+        /* Offset value -- 10 digits (0 padded) */
+        q = parse_unsigned(&p, endptr);
+        if (!q) {
+          WARN("An unsigned integer expected but could not find. (xref)");
+          return -1;
+        } else if (strlen(q) != 10) { /* exactly 10 digits */
+          WARN(("Offset must be a 10 digits number. (xref)"));
+          RELEASE(q);
+          return -1;
+        }
+        /* FIXME: Possible overflow here. Consider using strtoll(). */
+        offset = atoi(q);
+        RELEASE(q);
+        skip_white(&p, endptr);
+
+        /* Generation number -- 5 digits (0 padded) */
+        q = parse_unsigned(&p, endptr);
+        if (!q) {
+          WARN("An unsigned integer expected but could not find. (xref)");
+          return -1;
+        } else if (strlen(q) != 5) { /* exactly 5 digits */
+          WARN(("Expecting a 5 digits number. (xref)"));
+          RELEASE(q);
+          return -1;
+        }
+        obj_gen = atoi(q);
+        RELEASE(q);
+        skip_white(&p, endptr);
+      }
+      if (p == endptr) {
+        WARN("Unexpected EOL reached while reading a xref subsection entry.");
+        return -1;
+      }
+
+      /* Flag -- a char */
+      flag = *p; p++;
+      skip_white(&p, endptr);
+      if (p < endptr) {
+        WARN("Garbage in xref subsection entry found...");
+        return -1;
+      } else if (((flag != 'n' && flag != 'f') ||
+                  (flag == 'n' &&
+                  (offset >= pf->file_size || (offset > 0 && offset < 4))))) {
+        WARN("Invalid xref table entry [%lu]. PDF file is corrupt...", i);
+        return -1;
+      }
+
+      /* Everything seems to be OK. */
+      if (!pf->xref_table[i].field2) {
+        pf->xref_table[i].type   = (flag == 'n');
+        pf->xref_table[i].field2 = offset;
+        pf->xref_table[i].field3 = obj_gen;
+      }
+      i++;
+    }
+  }
+
+  return  1;
+}
+
+static uint32_t
+parse_xrefstm_field (const char **p, size_t length, uint32_t def)
+{
+  uint32_t val = 0;
+
+  if (!length)
+    return def;
+
+  while (length--) {
+    val <<= 8;
+    val |= (unsigned char) *((*p)++);
+  }
+
+  return val;
+}
+
+static int
+parse_xrefstm_subsec (pdf_file *pf,
+                      const char **p, size_t *length,
+                      int *W, int wsum, int first, int size)
+{
+  xref_entry *e;
+
+  if ((*length -= wsum*size) < 0)
+    return -1;
+
+  if (pf->num_obj < first+size)
+    extend_xref(pf, first+size);  /* TODO: change! why? */
+
+  e = pf->xref_table + first;
+  while (size--) {
+    uint8_t  type;
+    uint32_t field2;
+    uint16_t field3;
+
+    type = (unsigned char) parse_xrefstm_field(p, W[0], 1);
+    if (type > 2)
+      WARN("Unknown cross-reference stream entry type.");
+#if 0
+    /* Not sure */
+    else if (!W[1] || (type != 1 && !W[2]))
+      return -1;
+#endif
+
+    field2 = (uint32_t) parse_xrefstm_field(p, W[1], 0);
+    field3 = (uint16_t) parse_xrefstm_field(p, W[2], 0);
+
+    if (!e->field2) {
+      e->type   = type;
+      e->field2 = field2;
+      e->field3 = field3;	
+      }
+    e++;
+  }
+
+  return 0;
+}
+
+static int
+parse_xref_stream (pdf_file *pf, size_t xref_pos, pdf_obj **trailer)
+{
+  pdf_obj    *xrefstm, *size_obj, *W_obj, *index_obj;
+  uint32_t    size;
+  size_t      length;
+  int         W[3], i, wsum = 0;
+  const char *p;
+
+  xrefstm = pdf_read_object(0, 0, pf, xref_pos, pf->file_size);
+  if (!PDF_OBJ_STREAMTYPE(xrefstm))
+    goto error;
+
+  {
+    pdf_obj *tmp = pdf_stream_uncompress(xrefstm);
+    if (!tmp)
+      goto error;
+    pdf_release_obj(xrefstm);
+    xrefstm = tmp;
+  }
+
+  *trailer = pdf_link_obj(pdf_stream_dict(xrefstm));
+
+  size_obj = pdf_lookup_dict(*trailer, "Size");
+  if (!PDF_OBJ_NUMBERTYPE(size_obj))
     goto error;
-  n = (int) pdf_number_value(n_obj);
+  size = (uint32_t) pdf_number_value(size_obj);
 
-  first_obj = pdf_lookup_dict(dict, "First");
-  if (!PDF_OBJ_NUMBERTYPE(first_obj))
+  length = pdf_stream_length(xrefstm);
+
+  W_obj = pdf_lookup_dict(*trailer, "W");
+  if (!PDF_OBJ_ARRAYTYPE(W_obj) || pdf_array_length(W_obj) != 3)
     goto error;
-  first = (int) pdf_number_value(first_obj);
-  /* reject object streams without object data */
-  if (first >= pdf_stream_length(objstm))
+
+  for (i = 0; i < 3; i++) {
+    pdf_obj *tmp = pdf_get_array(W_obj, i);
+    if (!PDF_OBJ_NUMBERTYPE(tmp))
+      goto error;
+    wsum += (W[i] = (int) pdf_number_value(tmp));
+  }
+
+  p = pdf_stream_dataptr(xrefstm);
+
+  index_obj = pdf_lookup_dict(*trailer, "Index");
+  if (index_obj) {
+    size_t index_len;
+    if (!PDF_OBJ_ARRAYTYPE(index_obj) ||
+        ((index_len = pdf_array_length(index_obj)) % 2 ))
+      goto error;
+
+    i = 0;
+    while (i < index_len) {
+      pdf_obj *first = pdf_get_array(index_obj, i++);
+      size_obj  = pdf_get_array(index_obj, i++);
+      if (!PDF_OBJ_NUMBERTYPE(first) || !PDF_OBJ_NUMBERTYPE(size_obj) ||
+          parse_xrefstm_subsec(pf, &p, &length, W, wsum,
+            (int) pdf_number_value(first), (int) pdf_number_value(size_obj)))
+        goto error;
+    }
+  } else if (parse_xrefstm_subsec(pf, &p, &length, W, wsum, 0, size))
+      goto error;
+
+  if (length)
+    WARN("Garbage in xref stream.");
+
+  pdf_release_obj(xrefstm);
+
+  return 1;
+
+ error:
+  WARN("Cannot parse cross-reference stream.");
+  if (xrefstm)
+    pdf_release_obj(xrefstm);
+  if (*trailer) {
+    pdf_release_obj(*trailer);
+    *trailer = NULL;
+  }
+  return 0;
+}
+
+/* TODO: parse Version entry */
+static pdf_obj *
+read_xref (pdf_file *pf)
+{
+  pdf_obj *trailer = NULL, *main_trailer = NULL;
+  size_t   xref_pos;
+
+  if (!(xref_pos = find_xref(pf->file)))
     goto error;
 
-  header = NEW(2*(n+1), int);
-  set_objstm_data(objstm, header);
-  *(header++) = n;
-  *(header++) = first;
+  while (xref_pos) {
+    pdf_obj *prev;
 
-  /* avoid parsing beyond offset table */
-  data = NEW(first + 1, char);
-  memcpy(data, pdf_stream_dataptr(objstm), first);
-  data[first] = 0;
+    int res = parse_xref_table(pf, xref_pos);
+    if (res > 0) {
+      /* cross-reference table */
+      pdf_obj *xrefstm;
+      size_t   trailer_pos = tell_position(pf->file);
 
-  p      = data;
-  endptr = p + first;
-  i = 2*n;
-  while (i--) {
-    *(header++) = strtoul(p, &q, 10);
-    if (q == p)
+      if (!(trailer = parse_trailer(pf)))
+        goto error;
+
+      if (!main_trailer) {
+        main_trailer = pdf_link_obj(trailer);
+        pf->trailer_type = PDF_TRAILER_TABLE;
+        pf->trailer_pos  = trailer_pos;
+      }
+
+      if ((xrefstm = pdf_lookup_dict(trailer, "XRefStm"))) {
+        pdf_obj *new_trailer = NULL;
+        if (PDF_OBJ_NUMBERTYPE(xrefstm) &&
+            parse_xref_stream(pf, (int) pdf_number_value(xrefstm),
+			      &new_trailer))
+          pdf_release_obj(new_trailer);
+        else
+          WARN("Skipping hybrid reference section.");
+	      /* Many PDF 1.5 xref streams use DecodeParms, which we cannot
+	       * parse. This way we can use at least xref tables in hybrid
+	       * documents. Or should we better stop parsing the file?
+	       */
+      }
+
+    } else if (!res && parse_xref_stream(pf, xref_pos, &trailer)) {
+      /* cross-reference stream */
+      if (!main_trailer) {
+        main_trailer = pdf_link_obj(trailer);
+        pf->trailer_type = PDF_TRAILER_STREAM;
+        pf->trailer_pos  = xref_pos;
+      }
+    } else
       goto error;
-    p = q;
+
+    if ((prev = pdf_lookup_dict(trailer, "Prev"))) {
+      if (PDF_OBJ_NUMBERTYPE(prev))
+        xref_pos = (size_t) pdf_number_value(prev);
+      else
+        goto error;
+    } else
+      xref_pos = 0;
+
+    pdf_release_obj(trailer);
   }
 
-  /* Any garbage after last entry? */
-  skip_white(&p, endptr);
-  if (p != endptr)
-    goto error;
-  RELEASE(data);
-  
-  return pf->xref_table[num].direct = objstm;
+#if 0
+  if (!pdf_lookup_dict(main_trailer, "Root")) {
+      WARN("Trailer doesn't have catalog. Is this a correct PDF file?");
+      goto error;
+    }
+#endif
+
+  return main_trailer;
 
  error:
-  WARN("Cannot parse object stream.");
-  if (data)
-    RELEASE(data);
-  if (objstm)
-    pdf_release_obj(objstm);
+  WARN("Error while parsing PDF file.");
+  if (trailer)
+    pdf_release_obj(trailer);
+  if (main_trailer)
+    pdf_release_obj(main_trailer);
   return NULL;
 }
 
-/* Label without corresponding object definition are replaced by the
- * null object, as required by the PDF spec. This is important to parse
- * several cross-reference sections.
- */ 
-static pdf_obj *
-pdf_get_object (pdf_file *pf, uint32_t obj_num, uint16_t obj_gen)
+/* Cache of the cross-reference tables of input PDF files and of the
+ * pages found in them, so that a file does not need to be parsed again
+ * by each run including it. Cache files are kept in the same place as
+ * converted images and live as long as they do (see the -I option).
+ * They are tied to the size, modification time and a digest of the first
+ * and last PDF_CACHE_SAMPLE bytes of the file, where the header and the
+ * final cross-reference section live.
+ *
+ * Entries are written as they are in memory. The header starts with a
+ * format version and a byte order mark so that a cache file written by
+ * another build or on another machine is not taken for a valid one.
+ */
+#define PDF_CACHE_MAGIC      "dvipdfmx xref cache\n"
+#define PDF_CACHE_VERSION    3
+#define PDF_CACHE_BYTE_ORDER 0x01020304u
+#define PDF_CACHE_SAMPLE     65536
+
+struct pdf_cache_header
+{
+  char          magic[sizeof(PDF_CACHE_MAGIC)];
+  uint32_t      version;
+  uint32_t      byte_order;
+  uint32_t      page_info_size; /* sizeof(pdf_page_info) */
+  uint64_t      file_size;
+  int64_t       mtime;
+  unsigned char digest[16];
+  uint32_t      num_obj;
+  uint32_t      num_pages;
+  int32_t       page_count;
+  int32_t       trailer_type;
+  uint64_t      trailer_pos;
+};
+
+/* Fill in the part of the header identifying the file of PF. This must be
+ * done while the file is open, as it is closed between uses.
+ */
+static int
+pdf_cache_header_init (pdf_file *pf, struct pdf_cache_header *header)
 {
-  pdf_obj *result;
+  struct stat sb;
+  MD5_CONTEXT md5;
+  size_t      head, tail;
 
-  if (!checklabel(pf, obj_num, obj_gen)) {
-    WARN("Trying to read nonexistent or deleted object: %lu %u",
-         obj_num, obj_gen);
-    return pdf_new_null();
-  }
+  if (fstat(fileno(pf->file), &sb) != 0)
+    return -1;
 
-  if ((result = pf->xref_table[obj_num].direct)) {
-    return pdf_link_obj(result);
+  memset(header, 0, sizeof(struct pdf_cache_header));
+  memcpy(header->magic, PDF_CACHE_MAGIC, sizeof(PDF_CACHE_MAGIC));
+  header->version        = PDF_CACHE_VERSION;
+  header->byte_order     = PDF_CACHE_BYTE_ORDER;
+  header->page_info_size = sizeof(pdf_page_info);
+  header->file_size    = pf->file_size;
+  header->mtime        = sb.st_mtime;
+
+  head = MIN((size_t) pf->file_size, PDF_CACHE_SAMPLE);
+  tail = MIN((size_t) pf->file_size - head, PDF_CACHE_SAMPLE);
+  MD5_init(&md5);
+  if (pf->map) {
+    MD5_write(&md5, (const unsigned char *) pf->map, head);
+    MD5_write(&md5, (const unsigned char *) pf->map + pf->file_size - tail,
+              tail);
+  } else {
+    unsigned char *buf = NEW(PDF_CACHE_SAMPLE, unsigned char);
+    int            ok;
+
+    seek_absolute(pf->file, 0);
+    ok = fread(buf, 1, head, pf->file) == head;
+    if (ok)
+      MD5_write(&md5, buf, head);
+    seek_absolute(pf->file, pf->file_size - tail);
+    ok = ok && fread(buf, 1, tail, pf->file) == tail;
+    if (ok)
+      MD5_write(&md5, buf, tail);
+    RELEASE(buf);
+    if (!ok)
+      return -1;
   }
+  MD5_final(header->digest, &md5);
 
-  if (pf->xref_table[obj_num].type == 1) {
-    /* type == 1 */
-    uint32_t offset;
-    size_t   limit;
-    offset = pf->xref_table[obj_num].field2;
-    limit  = next_object_offset(pf, obj_num);
-    result = pdf_read_object(obj_num, obj_gen, pf, offset, limit);
-  } else {
-    /* type == 2 */
-    uint32_t    objstm_num = pf->xref_table[obj_num].field2;
-    uint16_t    index = pf->xref_table[obj_num].field3;
-    pdf_obj    *objstm;
-    int        *data, n, first, length;
-    const char *p, *q;
+  return 0;
+}
 
-    if (objstm_num >= pf->num_obj ||
-        pf->xref_table[objstm_num].type != 1 ||
-        !((objstm = pf->xref_table[objstm_num].direct) ||
-          (objstm = read_objstm(pf, objstm_num))))
-      goto error;
+/* Check the counts read from the cache file against the trailer read
+ * from the PDF file itself: the number of objects against its /Size and
+ * the pages against the /Count of the page tree. Returns 0 if they
+ * disagree.
+ */
+static int
+pdf_cache_check_trailer (pdf_obj *trailer,
+                         const struct pdf_cache_header *header)
+{
+  pdf_obj *size, *catalog = NULL, *pages = NULL, *count = NULL;
+  int      ok;
+
+  size = pdf_lookup_dict(trailer, "Size");
+  ok   = PDF_OBJ_NUMBERTYPE(size) &&
+         pdf_number_value(size) == (double) header->num_obj;
+  if (ok)
+    catalog = pdf_deref_obj(pdf_lookup_dict(trailer, "Root"));
+  if (PDF_OBJ_DICTTYPE(catalog))
+    pages = pdf_deref_obj(pdf_lookup_dict(catalog, "Pages"));
+  if (PDF_OBJ_DICTTYPE(pages))
+    count = pdf_deref_obj(pdf_lookup_dict(pages, "Count"));
+  if (ok && PDF_OBJ_NUMBERTYPE(count)) {
+    int n = (int) pdf_number_value(count);
+
+    ok = header->num_pages <= (uint32_t) MAX(n, 0) &&
+         (header->page_count <= 0 || header->page_count == n);
+  } else if (ok) {
+    ok = header->num_pages == 0 && header->page_count <= 0;
+  }
+  if (count)
+    pdf_release_obj(count);
+  if (pages)
+    pdf_release_obj(pages);
+  if (catalog)
+    pdf_release_obj(catalog);
 
-    data  = get_objstm_data(objstm);
-    n     = *(data++);
-    first = *(data++);
+  return ok;
+}
 
-    if (index >= n || data[2*index] != obj_num)
-      goto error;
+/* Read the cross-reference table of PF from its cache file and return
+ * the trailer. Returns NULL if there is no usable cache file.
+ */
+static pdf_obj *
+pdf_file_load_cache (pdf_file *pf, const char *ident)
+{
+  struct pdf_cache_header header, *current;
+  pdf_obj *trailer = NULL;
+  char    *key;
+  FILE    *fp;
+  int      ok;
+  size_t   i;
 
-    length = pdf_stream_length(objstm);
-    p = (const char *) pdf_stream_dataptr(objstm) + first + data[2*index+1];
-    q = p + (index == n-1 ? length : first+data[2*index+3]);
-    result = parse_pdf_object(&p, q, pf);
-    if (!result)
-      goto error;
+  key = NEW(strlen(ident) + strlen(".xref") + 1, char);
+  sprintf(key, "%s.xref", ident);
+  pf->cache_name = dpx_create_fix_temp_file(key);
+  RELEASE(key);
+  if (!pf->cache_name)
+    return NULL;
+  current = pf->cache_key = NEW(1, struct pdf_cache_header);
+  if (pdf_cache_header_init(pf, current) < 0) {
+    RELEASE(pf->cache_name);
+    RELEASE(pf->cache_key);
+    pf->cache_name = NULL;
+    return NULL;
   }
 
-  /* Make sure the caller doesn't free this object */
-  pf->xref_table[obj_num].direct = pdf_link_obj(result);
-
-  return result;
+  fp = MFOPEN(pf->cache_name, FOPEN_RBIN_MODE);
+  if (!fp)
+    return NULL;
+  ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+       !memcmp(header.magic, current->magic, sizeof(header.magic)) &&
+       header.version        == current->version &&
+       header.byte_order     == current->byte_order &&
+       header.page_info_size == current->page_info_size &&
+       header.file_size == current->file_size &&
+       header.mtime     == current->mtime &&
+       !memcmp(header.digest, current->digest, sizeof(header.digest)) &&
+       header.num_obj > 0;
+  if (ok) {
+    extend_xref(pf, header.num_obj);
+    for (i = 0; ok && i < header.num_obj; i++) {
+      xref_entry *e = &pf->xref_table[i];
+
+      ok = fread(&e->type,   sizeof(e->type),   1, fp) == 1 &&
+           fread(&e->field2, sizeof(e->field2), 1, fp) == 1 &&
+           fread(&e->field3, sizeof(e->field3), 1, fp) == 1;
+    }
+  }
+  if (ok && header.num_pages > 0) {
+    pf->pages     = NEW(header.num_pages, pdf_page_info);
+    pf->num_pages = header.num_pages;
+    ok = fread(pf->pages, sizeof(pdf_page_info),
+               header.num_pages, fp) == header.num_pages;
+  }
+  MFCLOSE(fp);
+
+  if (ok) {
+    pf->page_count   = header.page_count;
+    pf->trailer_type = header.trailer_type;
+    pf->trailer_pos  = header.trailer_pos;
+    if (pf->trailer_type == PDF_TRAILER_TABLE) {
+      seek_absolute(pf->file, pf->trailer_pos);
+      trailer = parse_trailer(pf);
+    } else if (pf->trailer_type == PDF_TRAILER_STREAM) {
+      pdf_obj *xrefstm = pdf_read_object(0, 0, pf, pf->trailer_pos,
+                                         pf->file_size);
+      if (PDF_OBJ_STREAMTYPE(xrefstm))
+        trailer = pdf_link_obj(pdf_stream_dict(xrefstm));
+      if (xrefstm)
+        pdf_release_obj(xrefstm);
+    }
+  }
+  if (trailer && !pdf_cache_check_trailer(trailer, &header)) {
+    pdf_release_obj(trailer);
+    trailer = NULL;
+  }
+  if (!trailer) {
+    /* Start over */
+    for (i = 0; i < pf->num_obj; i++) {
+      if (pf->xref_table[i].direct)
+        pdf_release_obj(pf->xref_table[i].direct);
+      if (pf->xref_table[i].indirect)
+        pdf_release_obj(pf->xref_table[i].indirect);
+    }
+    if (pf->xref_table)
+      RELEASE(pf->xref_table);
+    if (pf->pages)
+      RELEASE(pf->pages);
+    pf->xref_table = NULL;
+    pf->num_obj    = 0;
+    pf->pages      = NULL;
+    pf->num_pages  = 0;
+    pf->page_count = 0;
+  } else if (dpx_conf.verbose_level > 0) {
+    MESG("(cached xref)");
+  }
 
- error:
-  WARN("Could not read object from object stream.");
-  return pdf_new_null();
+  return trailer;
 }
 
-#define OBJ_FILE(o) (((pdf_indirect *)((o)->data))->pf)
-#define OBJ_OBJ(o)  (((pdf_indirect *)((o)->data))->obj)
-#define OBJ_NUM(o)  (((pdf_indirect *)((o)->data))->label)
-#define OBJ_GEN(o)  (((pdf_indirect *)((o)->data))->generation)
-
-static pdf_obj *
-pdf_new_ref (pdf_out *p, pdf_obj *object)
+static void
+pdf_file_save_cache (pdf_file *pf)
 {
-  pdf_obj *result;
+  struct pdf_cache_header header;
+  char  *tmp;
+  FILE  *fp;
+  int    ok;
+  size_t i;
 
-  ASSERT(p);
+  header = *pf->cache_key;
+  header.num_obj      = pf->num_obj;
+  header.num_pages    = pf->num_pages;
+  header.page_count   = pf->page_count;
+  header.trailer_type = pf->trailer_type;
+  header.trailer_pos  = pf->trailer_pos;
+  /* Written under another name first as other runs may read it. */
+  tmp = dpx_create_temp_file();
+  if (!tmp)
+    return;
+  fp = MFOPEN(tmp, FOPEN_WBIN_MODE);
+  if (!fp) {
+    dpx_delete_temp_file(tmp, true);
+    return;
+  }
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (i = 0; ok && i < pf->num_obj; i++) {
+    xref_entry *e = &pf->xref_table[i];
 
-  if (object->label == 0) {
-    pdf_label_obj(p, object);
+    ok = fwrite(&e->type,   sizeof(e->type),   1, fp) == 1 &&
+         fwrite(&e->field2, sizeof(e->field2), 1, fp) == 1 &&
+         fwrite(&e->field3, sizeof(e->field3), 1, fp) == 1;
   }
-  result = pdf_new_indirect(NULL, object->label, object->generation);
-  OBJ_OBJ(result) = object;
-  return result;
+  if (ok && pf->num_pages > 0)
+    ok = fwrite(pf->pages, sizeof(pdf_page_info),
+                pf->num_pages, fp) == (size_t) pf->num_pages;
+  if (MFCLOSE(fp) != 0)
+    ok = 0;
+  if (ok && rename(tmp, pf->cache_name) == 0)
+    RELEASE(tmp);
+  else
+    dpx_delete_temp_file(tmp, true);
 }
 
-/* pdf_deref_obj always returns a link instead of the original   */
-/* It never return the null object, but the NULL pointer instead */
-pdf_obj *
-pdf_deref_obj (pdf_obj *obj)
+int
+pdf_file_get_page_info (pdf_file *pf, int page_no, pdf_page_info *info)
 {
-  int count = PDF_OBJ_MAX_DEPTH;
+  ASSERT(pf && info);
 
-  if (obj)
-    obj = pdf_link_obj(obj);
+  if (page_no <= 0 || page_no > pf->num_pages ||
+      pf->pages[page_no - 1].page_label == 0)
+    return -1;
+  *info = pf->pages[page_no - 1];
 
-  while (PDF_OBJ_INDIRECTTYPE(obj) && --count) {
-    pdf_file *pf = OBJ_FILE(obj);
-    if (pf) {
-      uint32_t obj_num = OBJ_NUM(obj);
-      uint16_t obj_gen = OBJ_GEN(obj);
-      pdf_release_obj(obj);
-      obj = pdf_get_object(pf, obj_num, obj_gen);
-    } else {
-      pdf_out      *p    = current_output();
-      pdf_indirect *data = obj->data;
+  return 0;
+}
 
-      if ((p->free_list[data->label/8] & (1 << (7-((data->label) % 8))))) {
-        pdf_release_obj(obj);
-        return NULL;
-      } else {
-        pdf_obj *next_obj = OBJ_OBJ(obj);
-        if (!next_obj) {
-          ERROR("Undefined object reference"); 
-        }
-        pdf_release_obj(obj);
-        obj = pdf_link_obj(next_obj);
-      }
-    }
+void
+pdf_file_set_page_info (pdf_file *pf, int page_no, const pdf_page_info *info)
+{
+  ASSERT(pf && info && page_no > 0);
+
+  if (page_no > pf->num_pages) {
+    pf->pages = RENEW(pf->pages, page_no, pdf_page_info);
+    memset(pf->pages + pf->num_pages, 0,
+           (page_no - pf->num_pages) * sizeof(pdf_page_info));
+    pf->num_pages = page_no;
   }
+  pf->pages[page_no - 1] = *info;
+  pf->cache_dirty = 1;
+}
 
-  if (!count)
-    ERROR("Loop in object hierarchy detected. Broken PDF file?");
+int
+pdf_file_get_page_count (pdf_file *pf)
+{
+  ASSERT(pf);
 
-  if (PDF_OBJ_NULLTYPE(obj)) {
-    pdf_release_obj(obj);
-    return NULL;
-  } else
-    return obj;
+  return pf->page_count;
 }
 
-static void
-extend_xref (pdf_file *pf, size_t new_size) 
+/* Mark the pages of PF as indexed. A negative COUNT means that the page
+ * tree could not be indexed, and any pages recorded so far are dropped.
+ */
+void
+pdf_file_set_page_count (pdf_file *pf, int count)
 {
-  size_t  i;
+  ASSERT(pf);
 
-  pf->xref_table = RENEW(pf->xref_table, new_size, xref_entry);
-  for (i = pf->num_obj; i < new_size; i++) {
-    pf->xref_table[i].direct   = NULL;
-    pf->xref_table[i].indirect = NULL;
-    pf->xref_table[i].type     = 0;
-    pf->xref_table[i].field3 = 0;
-    pf->xref_table[i].field2 = 0L;
+  if (count < 0 && pf->pages) {
+    RELEASE(pf->pages);
+    pf->pages     = NULL;
+    pf->num_pages = 0;
   }
-  pf->num_obj = new_size;
+  pf->page_count  = count;
+  pf->cache_dirty = 1;
 }
 
-/* Returns < 0 for error, 1 for success, and 0 when xref stream found. */
-static int
-parse_xref_table (pdf_file *pf, size_t xref_pos)
+static struct ht_table *pdf_files = NULL;
+
+static pdf_file *
+pdf_file_new (FILE *file)
 {
-  FILE       *pdf_input_file = pf->file;
-  const char *p, *endptr;
-  char        buf[256]; /* See, PDF ref. v.1.7, p.91 for "255+1" here. */
-  size_t      len;
+  pdf_file *pf;
+  ASSERT(file);
+  pf = NEW(1, pdf_file);
+  pf->file    = file;
+  pf->map     = NULL;
+  pf->trailer = NULL;
+  pf->xref_table = NULL;
+  pf->catalog = NULL;
+  pf->num_obj = 0;
+  pf->version = 0;
+  pf->trailer_type = 0;
+  pf->trailer_pos  = 0;
+  pf->pages       = NULL;
+  pf->num_pages   = 0;
+  pf->page_count  = 0;
+  pf->cache_name  = NULL;
+  pf->cache_key   = NULL;
+  pf->cache_dirty = 0;
+
+  seek_end(file);
+  pf->file_size = tell_position(file);
 
-  /*
-   * This routine reads one xref segment. It may be called multiple times
-   * on the same file.  xref tables sometimes come in pieces.
-   */
-  seek_absolute(pf->file, xref_pos);
-  len = mfreadln(buf, 255, pdf_input_file);
-  /* We should have already checked that "startxref" section exists.
-   * So, EOF here (len = -1) is impossible.  We don't treat too long line
-   * case seriously.
+#if defined(PDFOBJ_USE_MMAP)
+  /* Objects are parsed directly from the mapped file. The mapping stays
+   * valid after the file is closed, which is done after each inclusion.
+   * Files which can't be mapped, like pipes, are read as before.
    */
-  if (len < 0) {
-    WARN("Something went wrong while reading xref table...giving up.");
-    return -1;
-  }
-  p      = buf;
-  endptr = buf + len;
-  /* No skip_white() here. There should not be any white-spaces here. */
-  if (memcmp(p, "xref", strlen("xref"))) {
-    /* Might be an xref stream and not an xref table */
-    return 0;
+  if (pf->file_size > 0) {
+    void *map = mmap(NULL, pf->file_size, PROT_READ, MAP_PRIVATE,
+                     fileno(file), 0);
+    if (map != MAP_FAILED)
+      pf->map = map;
   }
-  p += strlen("xref");
-  skip_white(&p, endptr);
-  if (p != endptr) {
-    WARN("Garbage after \"xref\" keyword found.");
-    return -1;
+#endif
+
+  return pf;
+}
+
+static void
+pdf_file_free (pdf_file *pf)
+{
+  size_t i;
+
+  if (!pf) {
+    return;
   }
 
-  /* Next line in file has first item and size of table */
-  for (;;) {
-    char      flag;
-    size_t    current_pos, size, offset;
-    int       i;
-    uint32_t  first, obj_gen;
+  if (pf->cache_name) {
+    if (pf->cache_dirty)
+      pdf_file_save_cache(pf);
+    RELEASE(pf->cache_name);
+    RELEASE(pf->cache_key);
+  }
+  if (pf->pages)
+    RELEASE(pf->pages);
 
-    current_pos = tell_position(pdf_input_file);
-    len = mfreadln(buf, 255, pdf_input_file);
-    if (len == 0) /* empty line... just skip. */
-      continue;
-    else if (len < 0) {
-      WARN("Reading a line failed in xref table.");
-      return -1;
-    }
+  for (i = 0; i < pf->num_obj; i++) {
+    if (pf->xref_table[i].direct)
+      pdf_release_obj(pf->xref_table[i].direct);
+    if (pf->xref_table[i].indirect)
+      pdf_release_obj(pf->xref_table[i].indirect);
+  }
 
-    p      = buf;
-    endptr = buf + len;
-    skip_white(&p, endptr);
-    if (p == endptr) { /* Only white-spaces and/or comment found. */
-      continue;
-    } else if (!strncmp(p, "trailer", strlen ("trailer"))) {
-      /*
-       * Backup... This is ugly, but it seems like the safest thing to
-       * do.  It is possible the trailer dictionary starts on the same
-       * logical line as the word trailer.  In that case, the mfgets
-       * call might have started to read the trailer dictionary and
-       * parse_trailer would fail.
-       */
-      current_pos += p - buf; /* Jump to the beginning of "trailer" keyword. */
-      seek_absolute(pdf_input_file, current_pos);
-      break;
-    }
-    /* Line containing something other than white-space characters found.
-     *
-     * Start reading xref subsection
-     *
-     * This section just reads two nusigned integers, namely, the object number
-     * of first object and the size of the xref subsection. PDF reference says
-     * that only "a space" is allowed between those two numbers but we allow
-     * more white-space characters.
-     */
-    {
-      char *q;
+  RELEASE(pf->xref_table);
+#if defined(PDFOBJ_USE_MMAP)
+  if (pf->map)
+    munmap((void *) pf->map, pf->file_size);
+#endif
+  if (pf->trailer)
+    pdf_release_obj(pf->trailer);
+  if (pf->catalog)
+    pdf_release_obj(pf->catalog);
 
-      /* Object number of the first object whithin this xref subsection. */
-      q = parse_unsigned(&p, endptr);
-      if (!q) {
-        WARN("An unsigned integer expected but could not find. (xref)");
-        return -1;
-      }
-      first = atoi(q);
-      RELEASE(q);
-      skip_white(&p, endptr);
+  RELEASE(pf);  
+}
 
-      /* Nnumber of objects in this xref subsection. */
-      q = parse_unsigned(&p, endptr);
-      if (!q) {
-        WARN("An unsigned integer expected but could not find. (xref)");
-        return -1;
-      }
-      size = atoi(q);
-      RELEASE(q);
-      skip_white(&p, endptr);
+void
+pdf_files_init (void)
+{
+  pdf_files = NEW(1, struct ht_table);
+  ht_init_table(pdf_files, (void (*)(void *)) pdf_file_free);
+}
 
-      /* Check for unrecognized tokens */
-      if (p != endptr) {
-        WARN("Unexpected token found in xref table.");
-        return -1;
-      }
-    }
+int
+pdf_file_get_version (pdf_file *pf)
+{
+  ASSERT(pf);
+  return pf->version;
+}
 
-    /* The first line of a xref subsection OK. */
-    if (pf->num_obj < first + size) {
-      extend_xref(pf, first + size);
-    }
+pdf_obj *
+pdf_file_get_trailer (pdf_file *pf)
+{
+  ASSERT(pf);
+  return pdf_link_obj(pf->trailer);
+}
 
-    /* Start parsing xref subsection body... */
-    for (i = first; i < first + size; ) {
-     /* PDF spec. requires each xref subsection lines being exactly 20 bytes
-      * long [including end-of-line marker(s)], offset 10 decimal digits,
-      * generation number being 5 decimal digits, and each entries delimitted
-      * by "a single space". However, we don't srtictly follow this rule:
-      * More than one "white-spaces" allowed, can be ended with a comment,
-      * and so on.
-      */
-      len = mfreadln(buf, 255, pdf_input_file);
-      if (len == 0) /* empty line...just skip. */
-        continue;
-      else if (len < 0) {
-        WARN("Something went wrong while reading xref subsection...");
-        return -1;
-      }
-      p      = buf;
-      endptr = buf + len;
-      skip_white(&p, endptr);
-      if (p == endptr) /* Only white-spaces and/or comment. */
-        continue;
+/* FIXME:
+ * pdf_file_get_trailer() does pdf_link_obj() but
+ * pdf_file_get_catalog() does not. Why?
+ */
+pdf_obj *
+pdf_file_get_catalog (pdf_file *pf)
+{
+  ASSERT(pf);
+  return pf->catalog;
+}
 
-      /*
-       * Don't overwrite positions that have already been set by a
-       * modified xref table.  We are working our way backwards
-       * through the reference table, so we only set "position" 
-       * if it hasn't been set yet.
-       */
-      offset = 0UL; obj_gen = 0; flag = 0;
-      {
-        char *q;
+pdf_file *
+pdf_open (const char *ident, FILE *file)
+{
+  pdf_out  *p  = current_output();
+  pdf_file *pf = NULL;
 
-        /* Offset value -- 10 digits (0 padded) */
-        q = parse_unsigned(&p, endptr);
-        if (!q) {
-          WARN("An unsigned integer expected but could not find. (xref)");
-          return -1;
-        } else if (strlen(q) != 10) { /* exactly 10 digits */
-          WARN(("Offset must be a 10 digits number. (xref)"));
-          RELEASE(q);
-          return -1;
-        }
-        /* FIXME: Possible overflow here. Consider using strtoll(). */
-        offset = atoi(q);
-        RELEASE(q);
-        skip_white(&p, endptr);
+  ASSERT(pdf_files);
 
-        /* Generation number -- 5 digits (0 padded) */
-        q = parse_unsigned(&p, endptr);
-        if (!q) {
-          WARN("An unsigned integer expected but could not find. (xref)");
-          return -1;
-        } else if (strlen(q) != 5) { /* exactly 5 digits */
-          WARN(("Expecting a 5 digits number. (xref)"));
-          RELEASE(q);
-          return -1;
-        }
-        obj_gen = atoi(q);
-        RELEASE(q);
-        skip_white(&p, endptr);
-      }
-      if (p == endptr) {
-        WARN("Unexpected EOL reached while reading a xref subsection entry.");
-        return -1;
-      }
+  if (ident)
+    pf = (pdf_file *) ht_lookup_table(pdf_files, ident, strlen(ident));
 
-      /* Flag -- a char */
-      flag = *p; p++;
-      skip_white(&p, endptr);
-      if (p < endptr) {
-        WARN("Garbage in xref subsection entry found...");
-        return -1;
-      } else if (((flag != 'n' && flag != 'f') ||
-                  (flag == 'n' &&
-                  (offset >= pf->file_size || (offset > 0 && offset < 4))))) {
-        WARN("Invalid xref table entry [%lu]. PDF file is corrupt...", i);
-        return -1;
-      }
+  if (pf) {
+    pf->file = file;
+  } else {
+    pdf_obj *new_version;
+    int version = check_for_pdf_version(file);
 
-      /* Everything seems to be OK. */
-      if (!pf->xref_table[i].field2) {
-        pf->xref_table[i].type   = (flag == 'n');
-        pf->xref_table[i].field2 = offset;
-        pf->xref_table[i].field3 = obj_gen;
-      }
-      i++;
-    }
-  }
+    if (!dpx_conf.is_xbb) {
+      int ver_major, ver_minor;
 
-  return  1;
-}
+      ver_major = version / 10;
+      ver_minor = version % 10;
 
-static uint32_t
-parse_xrefstm_field (const char **p, size_t length, uint32_t def)
-{
-  uint32_t val = 0;
+      if (version < 10)
+        WARN("Unrecognized PDF version specified for input PDF file: %d.%d",
+             ver_major, ver_minor);
+      else if (pdf_check_version(ver_major, ver_minor) < 0) {
+        WARN("Trying to include PDF file with version (%d.%d), which is " \
+             "newer than current output PDF setting (%d.%d).",
+             ver_major, ver_minor, p->version.major, p->version.minor);
+      }
+    }
+    pf = pdf_file_new(file);
+    pf->version = version;
 
-  if (!length)
-    return def;
+    if (ident && dpx_conf.file.keep_cache == 1)
+      pf->trailer = pdf_file_load_cache(pf, ident);
+    if (!pf->trailer) {
+      if (!(pf->trailer = read_xref(pf)))
+        goto error;
+      pf->cache_dirty = 1;
+    }
 
-  while (length--) {
-    val <<= 8;
-    val |= (unsigned char) *((*p)++);
-  }
+    if (pdf_lookup_dict(pf->trailer, "Encrypt")) {
+      WARN("PDF document is encrypted.");
+      goto error;
+    }
 
-  return val;
-}
+    pf->catalog = pdf_deref_obj(pdf_lookup_dict(pf->trailer, "Root"));
+    if (!PDF_OBJ_DICTTYPE(pf->catalog)) {
+      WARN("Cannot read PDF document catalog. Broken PDF file?");
+      goto error;
+    }
 
-static int
-parse_xrefstm_subsec (pdf_file *pf,
-                      const char **p, size_t *length,
-                      int *W, int wsum, int first, int size)
-{
-  xref_entry *e;
+    new_version = pdf_deref_obj(pdf_lookup_dict(pf->catalog, "Version"));
+    if (new_version) {
+      unsigned int major, minor;
 
-  if ((*length -= wsum*size) < 0)
-    return -1;
+      if (!PDF_OBJ_NAMETYPE(new_version) ||
+          sscanf(pdf_name_value(new_version), "%u.%u", &major, &minor) != 2) {
+        pdf_release_obj(new_version);
+        WARN("Illegal Version entry in document catalog. Broken PDF file?");
+        goto error;
+      }
 
-  if (pf->num_obj < first+size)
-    extend_xref(pf, first+size);  /* TODO: change! why? */
+      if (pf->version < major*10+minor)
+        pf->version = major*10+minor;
 
-  e = pf->xref_table + first;
-  while (size--) {
-    uint8_t  type;
-    uint32_t field2;
-    uint16_t field3;
+      pdf_release_obj(new_version);
+    }
 
-    type = (unsigned char) parse_xrefstm_field(p, W[0], 1);
-    if (type > 2)
-      WARN("Unknown cross-reference stream entry type.");
-#if 0
-    /* Not sure */
-    else if (!W[1] || (type != 1 && !W[2]))
-      return -1;
-#endif
+    if (ident)
+      ht_append_table(pdf_files, ident, strlen(ident), pf);
+  }
 
-    field2 = (uint32_t) parse_xrefstm_field(p, W[1], 0);
-    field3 = (uint16_t) parse_xrefstm_field(p, W[2], 0);
+  return pf;
 
-    if (!e->field2) {
-      e->type   = type;
-      e->field2 = field2;
-      e->field3 = field3;	
-      }
-    e++;
+ error:
+  if (pf && pf->cache_name) {
+    RELEASE(pf->cache_name);
+    RELEASE(pf->cache_key);
+    pf->cache_name = NULL;
   }
+  pdf_file_free(pf);
+  return NULL;
+}
 
-  return 0;
+void
+pdf_close (pdf_file *pf)
+{
+  if (pf)
+    pf->file = NULL;
 }
 
-static int
-parse_xref_stream (pdf_file *pf, size_t xref_pos, pdf_obj **trailer)
+void
+pdf_files_close (void)
 {
-  pdf_obj    *xrefstm, *size_obj, *W_obj, *index_obj;
-  uint32_t    size;
-  size_t      length;
-  int         W[3], i, wsum = 0;
-  const char *p;
+  ASSERT(pdf_files);
+  ht_clear_table(pdf_files);
+  RELEASE(pdf_files);
+}
 
-  xrefstm = pdf_read_object(0, 0, pf, xref_pos, pf->file_size);
-  if (!PDF_OBJ_STREAMTYPE(xrefstm))
-    goto error;
+/* Linearized output
+ *
+ * Objects are written out as soon as they are released, so the order
+ * required for a linearized file (PDF Reference, Annex F) is known only
+ * when the document is complete. The document is written to a temporary
+ * file first, which is then read back and written out again in the order
+ *
+ *   header, linearization parameter dictionary, first-page cross-reference
+ *   table and trailer, document catalog, primary hint stream, first-page
+ *   section, remaining pages, shared objects, other objects, main
+ *   cross-reference table and trailer.
+ *
+ * Objects from the linearization dictionary to the end of the first-page
+ * section get the highest object numbers, so that they are covered by a
+ * single subsection of the first-page cross-reference table. Object
+ * streams are not used since the hint tables locate objects by their
+ * offsets. Objects not referred to at all are dropped.
+ */
 
-  {
-    pdf_obj *tmp = pdf_stream_uncompress(xrefstm);
-    if (!tmp)
-      goto error;
-    pdf_release_obj(xrefstm);
-    xrefstm = tmp;
-  }
+#define LIN_UNUSED (-3) /* not referred to */
+#define LIN_OTHER  (-2) /* not used by any page */
+#define LIN_SHARED (-1) /* used by several pages, but not by the first */
 
-  *trailer = pdf_link_obj(pdf_stream_dict(xrefstm));
+struct lin_labels
+{
+  uint32_t *data;
+  size_t    size;
+  size_t    max;
+};
 
-  size_obj = pdf_lookup_dict(*trailer, "Size");
-  if (!PDF_OBJ_NUMBERTYPE(size_obj))
-    goto error;
-  size = (uint32_t) pdf_number_value(size_obj);
+struct lin_object
+{
+  int       owner;     /* first page using the object, or LIN_XXX */
+  int       is_page;
+  uint32_t  visited;   /* number of the last walk reaching the object */
+  size_t    refs;      /* start of its references in lin_state.refs */
+  uint32_t  num_refs;  /* references not made through /Parent */
+  uint32_t  num_all;   /* all references */
+  uint32_t  shared;    /* entry in the shared object hint table */
+};
 
-  length = pdf_stream_length(xrefstm);
+struct lin_state
+{
+  pdf_file          *pf;
+  struct lin_object *objects;  /* indexed by labels of the input */
+  struct lin_labels  refs;
+  struct lin_labels  parent_refs;
+  struct lin_labels  pages;
+  uint32_t           catalog;
+  uint32_t          *stack;
+  uint32_t           walk;
+};
 
-  W_obj = pdf_lookup_dict(*trailer, "W");
-  if (!PDF_OBJ_ARRAYTYPE(W_obj) || pdf_array_length(W_obj) != 3)
-    goto error;
+/* Attributes of page objects which may be inherited from the page tree.
+ * Linearized files must not rely on inheritance.
+ */
+static const char *lin_inherited[] = {
+  "Resources", "MediaBox", "CropBox", "Rotate"
+};
+#define LIN_INHERITED 4
 
-  for (i = 0; i < 3; i++) {
-    pdf_obj *tmp = pdf_get_array(W_obj, i);
-    if (!PDF_OBJ_NUMBERTYPE(tmp))
-      goto error;
-    wsum += (W[i] = (int) pdf_number_value(tmp));
+static void
+lin_labels_add (struct lin_labels *list, uint32_t label)
+{
+  if (list->size == list->max) {
+    list->max  = list->max ? list->max * 2 : 1024;
+    list->data = RENEW(list->data, list->max, uint32_t);
   }
+  list->data[list->size++] = label;
+}
 
-  p = pdf_stream_dataptr(xrefstm);
-
-  index_obj = pdf_lookup_dict(*trailer, "Index");
-  if (index_obj) {
-    size_t index_len;
-    if (!PDF_OBJ_ARRAYTYPE(index_obj) ||
-        ((index_len = pdf_array_length(index_obj)) % 2 ))
-      goto error;
-
-    i = 0;
-    while (i < index_len) {
-      pdf_obj *first = pdf_get_array(index_obj, i++);
-      size_obj  = pdf_get_array(index_obj, i++);
-      if (!PDF_OBJ_NUMBERTYPE(first) || !PDF_OBJ_NUMBERTYPE(size_obj) ||
-          parse_xrefstm_subsec(pf, &p, &length, W, wsum,
-            (int) pdf_number_value(first), (int) pdf_number_value(size_obj)))
-        goto error;
-    }
-  } else if (parse_xrefstm_subsec(pf, &p, &length, W, wsum, 0, size))
-      goto error;
+static pdf_obj *
+lin_get_object (struct lin_state *st, uint32_t label)
+{
+  xref_entry *e = &st->pf->xref_table[label];
+  pdf_obj    *object;
 
-  if (length)
-    WARN("Garbage in xref stream.");
+  object = pdf_get_object(st->pf, label, e->type == 1 ? e->field3 : 0);
+  /* Streams are copied as they are. */
+  if (PDF_OBJ_STREAMTYPE(object))
+    ((pdf_stream *) object->data)->_flags &= ~STREAM_COMPRESS;
 
-  pdf_release_obj(xrefstm);
+  return object;
+}
 
-  return 1;
+/* Objects are read again when written. Page objects, which may have
+ * been given inherited attributes, are kept.
+ */
+static void
+lin_drop_object (struct lin_state *st, uint32_t label)
+{
+  xref_entry *e = &st->pf->xref_table[label];
 
- error:
-  WARN("Cannot parse cross-reference stream.");
-  if (xrefstm)
-    pdf_release_obj(xrefstm);
-  if (*trailer) {
-    pdf_release_obj(*trailer);
-    *trailer = NULL;
+  if (e->direct && !st->objects[label].is_page) {
+    pdf_release_obj(e->direct);
+    e->direct = NULL;
   }
-  return 0;
 }
 
-/* TODO: parse Version entry */
-static pdf_obj *
-read_xref (pdf_file *pf)
+static void
+lin_collect_refs (struct lin_state *st, pdf_obj *object, int parent)
 {
-  pdf_obj *trailer = NULL, *main_trailer = NULL;
-  size_t   xref_pos;
+  switch (object->type) {
+  case PDF_INDIRECT:
+    {
+      pdf_indirect *data = object->data;
 
-  if (!(xref_pos = find_xref(pf->file)))
-    goto error;
+      if (data->pf == st->pf && data->label < (uint32_t) st->pf->num_obj &&
+          st->pf->xref_table[data->label].type != 0)
+        lin_labels_add(parent ? &st->parent_refs : &st->refs, data->label);
+    }
+    break;
+  case PDF_ARRAY:
+    {
+      pdf_array *data = object->data;
+      size_t     i;
 
-  while (xref_pos) {
-    pdf_obj *prev;
+      for (i = 0; i < data->size; i++)
+        lin_collect_refs(st, data->values[i], parent);
+    }
+    break;
+  case PDF_DICT:
+    {
+      pdf_dict_node *node;
 
-    int res = parse_xref_table(pf, xref_pos);
-    if (res > 0) {
-      /* cross-reference table */
-      pdf_obj *xrefstm;
+      for (node = ((pdf_dict *) object->data)->first; node; node = node->next)
+        lin_collect_refs(st, node->value,
+                         parent || !strcmp(pdf_name_value(node->key), "Parent"));
+    }
+    break;
+  case PDF_STREAM:
+    {
+      pdf_dict_node *node;
+
+      /* /Length is replaced by a direct number when written. */
+      node = ((pdf_dict *) pdf_stream_dict(object)->data)->first;
+      for ( ; node; node = node->next) {
+        if (strcmp(pdf_name_value(node->key), "Length"))
+          lin_collect_refs(st, node->value,
+                           parent || !strcmp(pdf_name_value(node->key), "Parent"));
+      }
+    }
+    break;
+  }
+}
 
-      if (!(trailer = parse_trailer(pf)))
-        goto error;
+/* Collect page objects in order, giving them the attributes they
+ * inherit from the page tree nodes.
+ */
+static int
+lin_walk_pages (struct lin_state *st, pdf_obj *ref, pdf_obj **inherited,
+                int depth)
+{
+  pdf_obj  *node, *kids;
+  uint32_t  label;
+  uint16_t  gen;
+  int       i, error = 0;
 
-      if (!main_trailer)
-        main_trailer = pdf_link_obj(trailer);
+  if (depth > PDF_OBJ_MAX_DEPTH ||
+      pdf_indirect_label(ref, &label, &gen) < 0 ||
+      label >= (uint32_t) st->pf->num_obj ||
+      st->pf->xref_table[label].type == 0 || st->objects[label].visited)
+    return -1;
+  st->objects[label].visited = 1;
 
-      if ((xrefstm = pdf_lookup_dict(trailer, "XRefStm"))) {
-        pdf_obj *new_trailer = NULL;
-        if (PDF_OBJ_NUMBERTYPE(xrefstm) &&
-            parse_xref_stream(pf, (int) pdf_number_value(xrefstm),
-			      &new_trailer))
-          pdf_release_obj(new_trailer);
-        else
-          WARN("Skipping hybrid reference section.");
-	      /* Many PDF 1.5 xref streams use DecodeParms, which we cannot
-	       * parse. This way we can use at least xref tables in hybrid
-	       * documents. Or should we better stop parsing the file?
-	       */
-      }
+  node = lin_get_object(st, label);
+  if (!PDF_OBJ_DICTTYPE(node)) {
+    pdf_release_obj(node);
+    return -1;
+  }
+  kids = pdf_deref_obj(pdf_lookup_dict(node, "Kids"));
+  if (kids) {
+    pdf_obj *attrs[LIN_INHERITED];
+
+    for (i = 0; i < LIN_INHERITED; i++) {
+      attrs[i] = pdf_lookup_dict(node, lin_inherited[i]);
+      if (!attrs[i])
+        attrs[i] = inherited[i];
+    }
+    if (!PDF_OBJ_ARRAYTYPE(kids))
+      error = -1;
+    for (i = 0; !error && i < pdf_array_length(kids); i++)
+      error = lin_walk_pages(st, pdf_get_array(kids, i), attrs, depth + 1);
+    pdf_release_obj(kids);
+  } else {
+    for (i = 0; i < LIN_INHERITED; i++) {
+      if (inherited[i] && !pdf_lookup_dict(node, lin_inherited[i]))
+        pdf_add_dict(node, pdf_new_name(lin_inherited[i]),
+                     pdf_link_obj(inherited[i]));
+    }
+    st->objects[label].is_page = 1;
+    lin_labels_add(&st->pages, label);
+  }
+  pdf_release_obj(node);
 
-    } else if (!res && parse_xref_stream(pf, xref_pos, &trailer)) {
-      /* cross-reference stream */
-      if (!main_trailer)
-        main_trailer = pdf_link_obj(trailer);
-    } else
-      goto error;
+  return error;
+}
 
-    if ((prev = pdf_lookup_dict(trailer, "Prev"))) {
-      if (PDF_OBJ_NUMBERTYPE(prev))
-        xref_pos = (size_t) pdf_number_value(prev);
-      else
-        goto error;
-    } else
-      xref_pos = 0;
+/* Find the objects used by page PAGE, without entering other pages or
+ * the catalog and without following /Parent. Labels of the objects are
+ * appended to LIST in the order they are found, the page object first.
+ */
+static void
+lin_walk_page (struct lin_state *st, int page, struct lin_labels *list)
+{
+  uint32_t n = 0;
 
-    pdf_release_obj(trailer);
-  }
+  st->walk++;
+  st->stack[n++] = st->pages.data[page];
+  st->objects[st->pages.data[page]].visited = st->walk;
+  lin_labels_add(list, st->pages.data[page]);
+  while (n > 0) {
+    struct lin_object *o = &st->objects[st->stack[--n]];
+    uint32_t           i;
 
-#if 0
-  if (!pdf_lookup_dict(main_trailer, "Root")) {
-      WARN("Trailer doesn't have catalog. Is this a correct PDF file?");
-      goto error;
+    for (i = 0; i < o->num_refs; i++) {
+      uint32_t           label = st->refs.data[o->refs + i];
+      struct lin_object *r     = &st->objects[label];
+
+      if (r->visited == st->walk || r->is_page || label == st->catalog)
+        continue;
+      r->visited = st->walk;
+      lin_labels_add(list, label);
+      st->stack[n++] = label;
     }
-#endif
+  }
+}
 
-  return main_trailer;
+/* Mark all objects reachable from those in SEEDS which are not used by
+ * any page as LIN_OTHER, appending them to LIST. Objects are marked when
+ * they are taken off the stack, so the same object may be pushed once for
+ * every reference to it: the stack grows as needed.
+ */
+static void
+lin_walk_others (struct lin_state *st, struct lin_labels *seeds,
+                 struct lin_labels *list)
+{
+  struct lin_labels stack;
+  size_t            k;
+
+  memset(&stack, 0, sizeof(stack));
+  st->walk++;
+  for (k = 0; k < seeds->size; k++) {
+    lin_labels_add(&stack, seeds->data[k]);
+    while (stack.size > 0) {
+      uint32_t           label = stack.data[--stack.size];
+      struct lin_object *o     = &st->objects[label];
+      uint32_t           i;
+
+      if (o->visited == st->walk)
+        continue;
+      o->visited = st->walk;
+      if (o->owner == LIN_UNUSED) {
+        o->owner = LIN_OTHER;
+        lin_labels_add(list, label);
+      }
+      /* In reverse, so that objects are found in the order of references */
+      for (i = o->num_all; i-- > 0; ) {
+        uint32_t ref = st->refs.data[o->refs + i];
 
- error:
-  WARN("Error while parsing PDF file.");
-  if (trailer)
-    pdf_release_obj(trailer);
-  if (main_trailer)
-    pdf_release_obj(main_trailer);
-  return NULL;
+        if (st->objects[ref].visited != st->walk)
+          lin_labels_add(&stack, ref);
+      }
+    }
+  }
+  if (stack.data)
+    RELEASE(stack.data);
 }
 
-static struct ht_table *pdf_files = NULL;
+static int
+lin_bits (uint32_t value)
+{
+  int n = 0;
 
-static pdf_file *
-pdf_file_new (FILE *file)
+  while (value) {
+    n++;
+    value >>= 1;
+  }
+
+  return n;
+}
+
+struct lin_bit_writer
 {
-  pdf_file *pf;
-  ASSERT(file);
-  pf = NEW(1, pdf_file);
-  pf->file    = file;
-  pf->trailer = NULL;
-  pf->xref_table = NULL;
-  pf->catalog = NULL;
-  pf->num_obj = 0;
-  pf->version = 0;
+  pdf_obj  *stream;
+  uint32_t  byte;
+  int       count;
+};
 
-  seek_end(file);
-  pf->file_size = tell_position(file);
+static void
+lin_put_bits (struct lin_bit_writer *w, uint32_t value, int nbits)
+{
+  while (nbits-- > 0) {
+    w->byte = (w->byte << 1) | ((value >> nbits) & 1);
+    if (++w->count == 8) {
+      unsigned char c = (unsigned char) w->byte;
 
-  return pf;
+      pdf_add_stream(w->stream, &c, 1);
+      w->byte  = 0;
+      w->count = 0;
+    }
+  }
 }
 
+/* Items of hint tables start at byte boundaries. */
 static void
-pdf_file_free (pdf_file *pf)
+lin_align_bits (struct lin_bit_writer *w)
 {
-  size_t i;
+  if (w->count > 0)
+    lin_put_bits(w, 0, 8 - w->count);
+}
 
-  if (!pf) {
-    return;
+/* Layout of the rearranged objects. OFFSET holds the positions of the
+ * objects in ORDER in the body written to a temporary file, which
+ * contains everything from the catalog to the last object. The catalog
+ * comes first, then NUM_FIRST objects of the first-page section.
+ */
+struct lin_layout
+{
+  uint32_t *order;       /* labels of the input */
+  size_t   *offset;      /* num_order + 1 entries */
+  uint32_t  num_order;
+  uint32_t  num_first;
+  uint32_t  num_pages;
+  uint32_t *page_start;  /* index in ORDER of the page object */
+  uint32_t *page_nobjs;
+  uint32_t  first_shared;  /* index in ORDER, num_order if none */
+  uint32_t  num_shared;
+};
+
+/* Build the primary hint stream, containing the page offset hint table
+ * and the shared object hint table. Offsets are given as if the hint
+ * stream were not present, so that they are computed from the position
+ * of the body PREFIX.
+ */
+static pdf_obj *
+lin_hint_stream (pdf_out *p, struct lin_state *st, struct lin_layout *lo,
+                 size_t prefix)
+{
+  pdf_obj              *hint;
+  struct lin_bit_writer w;
+  struct lin_labels     found, ids;
+  uint32_t             *nshared, *lengths;
+  uint32_t              min_nobjs = 0xffffffff, max_nobjs = 0;
+  uint32_t              min_length = 0xffffffff, max_length = 0;
+  uint32_t              max_nshared = 0, max_id = 0;
+  uint32_t              i, k, num_groups;
+  int                   bits_nobjs, bits_length, bits_nshared, bits_id;
+  size_t               *id_start;
+
+  memset(&found, 0, sizeof(found));
+  memset(&ids,   0, sizeof(ids));
+  nshared  = NEW(lo->num_pages, uint32_t);
+  lengths  = NEW(lo->num_pages, uint32_t);
+  id_start = NEW(lo->num_pages + 1, size_t);
+
+  for (i = 0; i < lo->num_pages; i++) {
+    uint32_t start = lo->page_start[i];
+
+    lengths[i] = lo->offset[start + lo->page_nobjs[i]] - lo->offset[start];
+    min_nobjs  = MIN(min_nobjs,  lo->page_nobjs[i]);
+    max_nobjs  = MAX(max_nobjs,  lo->page_nobjs[i]);
+    min_length = MIN(min_length, lengths[i]);
+    max_length = MAX(max_length, lengths[i]);
+
+    /* The first page has all its objects in the first-page section */
+    id_start[i] = ids.size;
+    if (i > 0) {
+      found.size = 0;
+      lin_walk_page(st, i, &found);
+      for (k = 0; k < found.size; k++) {
+        struct lin_object *o = &st->objects[found.data[k]];
+
+        if (o->owner == 0 || o->owner == LIN_SHARED) {
+          lin_labels_add(&ids, o->shared);
+          max_id = MAX(max_id, o->shared);
+        }
+      }
+    }
+    nshared[i]  = ids.size - id_start[i];
+    max_nshared = MAX(max_nshared, nshared[i]);
   }
+  id_start[lo->num_pages] = ids.size;
+
+  bits_nobjs   = lin_bits(max_nobjs - min_nobjs);
+  bits_length  = lin_bits(max_length - min_length);
+  bits_nshared = lin_bits(max_nshared);
+  bits_id      = lin_bits(max_id);
+
+  hint = pdf_new_stream(STREAM_COMPRESS);
+  w.stream = hint;
+  w.byte   = 0;
+  w.count  = 0;
+
+  /* Page offset hint table: header */
+  lin_put_bits(&w, min_nobjs, 32);
+  lin_put_bits(&w, prefix + lo->offset[lo->page_start[0]], 32);
+  lin_put_bits(&w, bits_nobjs, 16);
+  lin_put_bits(&w, min_length, 32);
+  lin_put_bits(&w, bits_length, 16);
+  lin_put_bits(&w, 0, 32);           /* least offset to content stream */
+  lin_put_bits(&w, 0, 16);
+  lin_put_bits(&w, min_length, 32);  /* content stream lengths are    */
+  lin_put_bits(&w, bits_length, 16); /* approximated by page lengths  */
+  lin_put_bits(&w, bits_nshared, 16);
+  lin_put_bits(&w, bits_id, 16);
+  lin_put_bits(&w, 0, 16);           /* numerator of fractional position */
+  lin_put_bits(&w, 1, 16);           /* denominator */
+
+  /* Page offset hint table: per-page entries, item by item */
+  for (i = 0; i < lo->num_pages; i++)
+    lin_put_bits(&w, lo->page_nobjs[i] - min_nobjs, bits_nobjs);
+  lin_align_bits(&w);
+  for (i = 0; i < lo->num_pages; i++)
+    lin_put_bits(&w, lengths[i] - min_length, bits_length);
+  lin_align_bits(&w);
+  for (i = 0; i < lo->num_pages; i++)
+    lin_put_bits(&w, nshared[i], bits_nshared);
+  lin_align_bits(&w);
+  for (i = 0; i < lo->num_pages; i++) {
+    for (k = id_start[i]; k < id_start[i+1]; k++)
+      lin_put_bits(&w, ids.data[k], bits_id);
+  }
+  lin_align_bits(&w);
+  for (i = 0; i < lo->num_pages; i++)
+    lin_put_bits(&w, lengths[i] - min_length, bits_length);
+  lin_align_bits(&w);
 
-  for (i = 0; i < pf->num_obj; i++) {
-    if (pf->xref_table[i].direct)
-      pdf_release_obj(pf->xref_table[i].direct);
-    if (pf->xref_table[i].indirect)
-      pdf_release_obj(pf->xref_table[i].indirect);
+  pdf_add_dict(pdf_stream_dict(hint),
+               pdf_new_name("S"), pdf_new_number(pdf_stream_length(hint)));
+
+  /* Shared object hint table: objects of the first-page section followed
+   * by the shared objects section, one object per group.
+   */
+  num_groups = lo->num_first + lo->num_shared;
+  min_length = 0xffffffff;
+  max_length = 0;
+  for (k = 0; k < num_groups; k++) {
+    uint32_t j = k < lo->num_first ? 1 + k : lo->first_shared + k - lo->num_first;
+    uint32_t length = lo->offset[j+1] - lo->offset[j];
+
+    min_length = MIN(min_length, length);
+    max_length = MAX(max_length, length);
   }
+  bits_length = lin_bits(max_length - min_length);
 
-  RELEASE(pf->xref_table);
-  if (pf->trailer)
-    pdf_release_obj(pf->trailer);
-  if (pf->catalog)
-    pdf_release_obj(pf->catalog);
+  if (lo->num_shared > 0) {
+    lin_put_bits(&w, p->linear.labels[lo->order[lo->first_shared]], 32);
+    lin_put_bits(&w, prefix + lo->offset[lo->first_shared], 32);
+  } else {
+    lin_put_bits(&w, 0, 32);
+    lin_put_bits(&w, 0, 32);
+  }
+  lin_put_bits(&w, lo->num_first, 32);
+  lin_put_bits(&w, num_groups, 32);
+  lin_put_bits(&w, 0, 16);           /* one object per group */
+  lin_put_bits(&w, min_length, 32);
+  lin_put_bits(&w, bits_length, 16);
+  for (k = 0; k < num_groups; k++) {
+    uint32_t j = k < lo->num_first ? 1 + k : lo->first_shared + k - lo->num_first;
+
+    lin_put_bits(&w, lo->offset[j+1] - lo->offset[j] - min_length, bits_length);
+  }
+  lin_align_bits(&w);
+  for (k = 0; k < num_groups; k++)
+    lin_put_bits(&w, 0, 1);          /* no MD5 signature */
+  lin_align_bits(&w);
+
+  if (found.data)
+    RELEASE(found.data);
+  if (ids.data)
+    RELEASE(ids.data);
+  RELEASE(nshared);
+  RELEASE(lengths);
+  RELEASE(id_start);
+
+  return hint;
+}
+
+/* Values of the linearization dictionary, see lin_write_prefix() */
+struct lin_params
+{
+  size_t   file_length;      /* /L */
+  size_t   hint_offset;      /* /H */
+  size_t   hint_length;
+  size_t   first_page_end;   /* /E */
+  size_t   main_xref_entry;  /* /T */
+  size_t   main_xref;        /* /Prev of the first-page trailer */
+};
 
-  RELEASE(pf);  
-}
+/* Write everything up to the catalog: the header, the linearization
+ * dictionary and the first-page cross-reference table covering labels
+ * from FIRST_LABEL up to SIZE. Numbers are written with fixed widths,
+ * so the length of the output doesn't depend on the values in LP and
+ * OFFSETS, the positions of objects indexed by their new labels.
+ */
+static void
+lin_write_prefix (pdf_out *p, struct lin_state *st,
+                  const struct lin_params *lp, const size_t *offsets,
+                  uint32_t first_label, uint32_t size, size_t *xref_pos)
+{
+  char     buf[256];
+  int      length;
+  uint32_t label;
+  size_t   lin_dict;
+  pdf_obj *tmp;
 
-void
-pdf_files_init (void)
-{
-  pdf_files = NEW(1, struct ht_table);
-  ht_init_table(pdf_files, (void (*)(void *)) pdf_file_free);
-}
+  length = sprintf(buf, "%%PDF-%d.%d\n", p->version.major, p->version.minor);
+  pdf_out_str(p, buf, length);
+  pdf_out_str(p, BINARY_MARKER, strlen(BINARY_MARKER));
 
-int
-pdf_file_get_version (pdf_file *pf)
-{
-  ASSERT(pf);
-  return pf->version;
+  lin_dict = pdf_stream_length(p->output_stream);
+  length = sprintf(buf, "%u 0 obj\n<< /Linearized 1 /L %10lu /H [ %10lu %10lu ]"
+                   " /O %u /E %10lu /N %u /T %10lu >>\nendobj\n",
+                   first_label, (unsigned long) lp->file_length,
+                   (unsigned long) lp->hint_offset,
+                   (unsigned long) lp->hint_length,
+                   p->linear.labels[st->pages.data[0]],
+                   (unsigned long) lp->first_page_end,
+                   (unsigned) st->pages.size,
+                   (unsigned long) lp->main_xref_entry);
+  pdf_out_str(p, buf, length);
+
+  *xref_pos = pdf_stream_length(p->output_stream);
+  length = sprintf(buf, "xref\n%u %u\n", first_label, size - first_label);
+  pdf_out_str(p, buf, length);
+  for (label = first_label; label < size; label++) {
+    length = sprintf(buf, "%010lu 00000 n \n", (unsigned long)
+                     (label == first_label ? lin_dict : offsets[label]));
+    pdf_out_str(p, buf, length);
+  }
+
+  length = sprintf(buf, "trailer\n<< /Size %u /Root ", size);
+  pdf_out_str(p, buf, length);
+  pdf_write_obj(p, pdf_lookup_dict(st->pf->trailer, "Root"));
+  if ((tmp = pdf_lookup_dict(st->pf->trailer, "Info"))) {
+    pdf_out_str(p, " /Info ", 7);
+    pdf_write_obj(p, tmp);
+  }
+  if ((tmp = pdf_lookup_dict(st->pf->trailer, "ID"))) {
+    pdf_out_str(p, " /ID ", 5);
+    pdf_write_obj(p, tmp);
+  }
+  length = sprintf(buf, " /Prev %10lu >>\nstartxref\n0\n%%%%EOF\n",
+                   (unsigned long) lp->main_xref);
+  pdf_out_str(p, buf, length);
 }
 
-pdf_obj *
-pdf_file_get_trailer (pdf_file *pf)
+/* Write the main cross-reference table, which covers the labels below
+ * FIRST_LABEL, and the trailer.
+ */
+static void
+lin_write_tail (pdf_out *p, const size_t *offsets, uint32_t first_label,
+                size_t xref_pos)
 {
-  ASSERT(pf);
-  return pdf_link_obj(pf->trailer);
+  char     buf[64];
+  int      length;
+  uint32_t label;
+
+  length = sprintf(buf, "xref\n0 %u\n", first_label);
+  pdf_out_str(p, buf, length);
+  pdf_out_str(p, "0000000000 65535 f \n", 20);
+  for (label = 1; label < first_label; label++) {
+    length = sprintf(buf, "%010lu 00000 n \n", (unsigned long) offsets[label]);
+    pdf_out_str(p, buf, length);
+  }
+  length = sprintf(buf, "trailer\n<< /Size %u >>\nstartxref\n%lu\n%%%%EOF\n",
+                   first_label, (unsigned long) xref_pos);
+  pdf_out_str(p, buf, length);
 }
 
-/* FIXME:
- * pdf_file_get_trailer() does pdf_link_obj() but
- * pdf_file_get_catalog() does not. Why?
+/* Output is collected in a stream object while a part of the file is
+ * composed.
  */
-pdf_obj *
-pdf_file_get_catalog (pdf_file *pf)
+static pdf_obj *
+lin_capture (pdf_out *p)
 {
-  ASSERT(pf);
-  return pf->catalog;
+  p->output_stream = pdf_new_stream(0);
+  return p->output_stream;
 }
 
-pdf_file *
-pdf_open (const char *ident, FILE *file)
+static void
+lin_copy (pdf_out *p, FILE *src, size_t length)
 {
-  pdf_out  *p  = current_output();
-  pdf_file *pf = NULL;
+  char buf[8192];
 
-  ASSERT(pdf_files);
+  while (length > 0) {
+    size_t n = fread(buf, 1, MIN(length, sizeof(buf)), src);
 
-  if (ident)
-    pf = (pdf_file *) ht_lookup_table(pdf_files, ident, strlen(ident));
+    if (n == 0)
+      ERROR("Reading temporary file failed.");
+    pdf_out_str(p, buf, n);
+    length -= n;
+  }
+}
 
-  if (pf) {
-    pf->file = file;
-  } else {
-    pdf_obj *new_version;
-    int version = check_for_pdf_version(file);
+/* Decide the order of the objects of PF. Returns -1 if the document
+ * can't be linearized.
+ */
+static int
+lin_arrange (pdf_out *p, struct lin_state *st, struct lin_layout *lo)
+{
+  pdf_file          *pf = st->pf;
+  pdf_obj           *inherited[LIN_INHERITED] = {NULL, NULL, NULL, NULL};
+  struct lin_labels  found, seeds, pages, shared, others;
+  uint16_t           gen;
+  uint32_t           label, i, k;
+  int                page;
+
+  if (pdf_indirect_label(pdf_lookup_dict(pf->trailer, "Root"),
+                         &st->catalog, &gen) < 0 ||
+      st->catalog >= (uint32_t) pf->num_obj ||
+      !PDF_OBJ_DICTTYPE(pf->catalog) ||
+      lin_walk_pages(st, pdf_lookup_dict(pf->catalog, "Pages"),
+                     inherited, 0) < 0 ||
+      st->pages.size == 0)
+    return -1;
 
-    if (!dpx_conf.is_xbb) {
-      int ver_major, ver_minor;
+  /* Collect references of all objects */
+  for (label = 1; label < (uint32_t) pf->num_obj; label++) {
+    struct lin_object *o = &st->objects[label];
+    pdf_obj           *object;
 
-      ver_major = version / 10;
-      ver_minor = version % 10;
+    o->visited = 0;
+    o->refs    = st->refs.size;
+    if (pf->xref_table[label].type == 0)
+      continue;
+    object = lin_get_object(st, label);
+    lin_collect_refs(st, object, 0);
+    o->num_refs = st->refs.size - o->refs;
+    for (k = 0; k < st->parent_refs.size; k++)
+      lin_labels_add(&st->refs, st->parent_refs.data[k]);
+    st->parent_refs.size = 0;
+    o->num_all = st->refs.size - o->refs;
+    pdf_release_obj(object);
+    lin_drop_object(st, label);
+  }
 
-      if (version < 10)
-        WARN("Unrecognized PDF version specified for input PDF file: %d.%d",
-             ver_major, ver_minor);
-      else if (pdf_check_version(ver_major, ver_minor) < 0) {
-        WARN("Trying to include PDF file with version (%d.%d), which is " \
-             "newer than current output PDF setting (%d.%d).",
-             ver_major, ver_minor, p->version.major, p->version.minor);
-      }
+  /* Objects used by pages, in the order they are found */
+  memset(&found,  0, sizeof(found));
+  memset(&seeds,  0, sizeof(seeds));
+  memset(&pages,  0, sizeof(pages));
+  memset(&shared, 0, sizeof(shared));
+  memset(&others, 0, sizeof(others));
+  st->objects[st->catalog].owner = LIN_OTHER;
+  for (page = 0; page < (int) st->pages.size; page++) {
+    found.size = 0;
+    lin_walk_page(st, page, &found);
+    for (k = 0; k < found.size; k++) {
+      struct lin_object *o = &st->objects[found.data[k]];
+
+      if (o->owner == LIN_UNUSED) {
+        o->owner = page;
+        lin_labels_add(&pages, found.data[k]);
+      } else if (o->owner != page && o->owner != 0)
+        o->owner = LIN_SHARED;
     }
-    pf = pdf_file_new(file);
-    pf->version = version;
-
-    if (!(pf->trailer = read_xref(pf)))
-      goto error;
+  }
 
-    if (pdf_lookup_dict(pf->trailer, "Encrypt")) {
-      WARN("PDF document is encrypted.");
-      goto error;
+  /* Everything else still referred to */
+  lin_labels_add(&seeds, st->catalog);
+  if (pdf_indirect_label(pdf_lookup_dict(pf->trailer, "Info"), &label, &gen) == 0 &&
+      label < (uint32_t) pf->num_obj && pf->xref_table[label].type != 0)
+    lin_labels_add(&seeds, label);
+  for (k = 0; k < pages.size; k++)
+    lin_labels_add(&seeds, pages.data[k]);
+  lin_walk_others(st, &seeds, &others);
+
+  /* Catalog, first page, other pages, shared objects, the rest */
+  lo->num_pages  = st->pages.size;
+  lo->page_start = NEW(lo->num_pages, uint32_t);
+  lo->page_nobjs = NEW(lo->num_pages, uint32_t);
+  memset(lo->page_nobjs, 0, lo->num_pages * sizeof(uint32_t));
+  lo->order      = NEW(1 + pages.size + others.size, uint32_t);
+  lo->num_order  = 0;
+  lo->order[lo->num_order++] = st->catalog;
+  for (k = 0; k < pages.size; k++) {
+    if (st->objects[pages.data[k]].owner == 0) {
+      st->objects[pages.data[k]].shared = lo->num_order - 1;
+      lo->order[lo->num_order++] = pages.data[k];
     }
+  }
+  lo->num_first = lo->num_order - 1;
+  for (k = 0; k < pages.size; k++) {
+    page = st->objects[pages.data[k]].owner;
+    if (page > 0) {
+      if (lo->page_nobjs[page]++ == 0)
+        lo->page_start[page] = lo->num_order;
+      lo->order[lo->num_order++] = pages.data[k];
+    } else if (page == LIN_SHARED)
+      lin_labels_add(&shared, pages.data[k]);
+  }
+  lo->page_start[0] = 1;
+  lo->page_nobjs[0] = lo->num_first;
+  lo->first_shared  = lo->num_order;
+  lo->num_shared    = shared.size;
+  for (k = 0; k < shared.size; k++) {
+    st->objects[shared.data[k]].shared = lo->num_first + k;
+    lo->order[lo->num_order++] = shared.data[k];
+  }
+  for (k = 0; k < others.size; k++)
+    lo->order[lo->num_order++] = others.data[k];
 
-    pf->catalog = pdf_deref_obj(pdf_lookup_dict(pf->trailer, "Root"));
-    if (!PDF_OBJ_DICTTYPE(pf->catalog)) {
-      WARN("Cannot read PDF document catalog. Broken PDF file?");
-      goto error;
-    }
+  /* New labels: the rest of the document first, numbered from 1, then
+   * the linearization dictionary, the catalog, the hint stream and the
+   * first-page section.
+   */
+  p->linear.num_labels = pf->num_obj;
+  p->linear.labels     = NEW(pf->num_obj, uint32_t);
+  memset(p->linear.labels, 0, pf->num_obj * sizeof(uint32_t));
+  for (i = 1 + lo->num_first; i < lo->num_order; i++)
+    p->linear.labels[lo->order[i]] = i - lo->num_first;
+  label = lo->num_order - lo->num_first;
+  p->linear.labels[st->catalog] = label + 1;
+  for (i = 1; i <= lo->num_first; i++)
+    p->linear.labels[lo->order[i]] = label + 2 + i;
+
+  if (found.data)  RELEASE(found.data);
+  if (seeds.data)  RELEASE(seeds.data);
+  if (pages.data)  RELEASE(pages.data);
+  if (shared.data) RELEASE(shared.data);
+  if (others.data) RELEASE(others.data);
 
-    new_version = pdf_deref_obj(pdf_lookup_dict(pf->catalog, "Version"));
-    if (new_version) {
-      unsigned int major, minor;
+  return 0;
+}
 
-      if (!PDF_OBJ_NAMETYPE(new_version) ||
-          sscanf(pdf_name_value(new_version), "%u.%u", &major, &minor) != 2) {
-        pdf_release_obj(new_version);
-        WARN("Illegal Version entry in document catalog. Broken PDF file?");
-        goto error;
-      }
+/* Write the objects in the order decided by lin_arrange() to BODY,
+ * recording their positions.
+ */
+static void
+lin_write_body (pdf_out *p, struct lin_state *st, struct lin_layout *lo,
+                FILE *body)
+{
+  uint32_t i;
 
-      if (pf->version < major*10+minor)
-        pf->version = major*10+minor;
+  p->output.file          = body;
+  p->output.file_position = 0;
+  p->state.enc_mode       = 0;
+  lo->offset = NEW(lo->num_order + 1, size_t);
+  for (i = 0; i < lo->num_order; i++) {
+    uint32_t label = lo->order[i];
+    pdf_obj *object;
+    char     buf[64];
+    int      length;
+
+    lo->offset[i] = p->output.file_position;
+    object = lin_get_object(st, label);
+    length = sprintf(buf, "%u 0 obj\n", p->linear.labels[label]);
+    pdf_out_str(p, buf, length);
+    pdf_write_obj(p, object);
+    pdf_out_str(p, "\nendobj\n", 8);
+    pdf_release_obj(object);
+    lin_drop_object(st, label);
+  }
+  lo->offset[lo->num_order] = p->output.file_position;
+  pdf_out_flush_buffer(p);
+  p->output.file = NULL;
+}
 
-      pdf_release_obj(new_version);
-    }
+static int
+lin_rearrange (pdf_out *p, pdf_file *pf, FILE *body)
+{
+  struct lin_state  st;
+  struct lin_layout lo;
+  struct lin_params lp;
+  pdf_obj          *hint, *prefix, *hint_obj, *tail;
+  size_t           *offsets, prefix_length, xref_pos, main_xref;
+  uint32_t          first_label, size, i;
+  char              buf[64];
+  int               length;
+
+  memset(&st, 0, sizeof(st));
+  memset(&lo, 0, sizeof(lo));
+  st.pf      = pf;
+  st.objects = NEW(pf->num_obj, struct lin_object);
+  st.stack   = NEW(pf->num_obj, uint32_t);
+  for (i = 0; i < (uint32_t) pf->num_obj; i++) {
+    memset(&st.objects[i], 0, sizeof(struct lin_object));
+    st.objects[i].owner = LIN_UNUSED;
+  }
+  if (lin_arrange(p, &st, &lo) < 0) {
+    RELEASE(st.objects);
+    RELEASE(st.stack);
+    if (st.refs.data)        RELEASE(st.refs.data);
+    if (st.parent_refs.data) RELEASE(st.parent_refs.data);
+    if (st.pages.data)       RELEASE(st.pages.data);
+    return -1;
+  }
+  lin_write_body(p, &st, &lo, body);
 
-    if (ident)
-      ht_append_table(pdf_files, ident, strlen(ident), pf);
+  first_label = lo.num_order - lo.num_first;
+  size        = first_label + 3 + lo.num_first;
+  offsets     = NEW(size, size_t);
+  memset(offsets, 0, size * sizeof(size_t));
+  memset(&lp, 0, sizeof(lp));
+
+  /* The length of everything before the catalog doesn't depend on the
+   * actual values, so it is measured with dummies first.
+   */
+  prefix = lin_capture(p);
+  lin_write_prefix(p, &st, &lp, offsets, first_label, size, &xref_pos);
+  p->output_stream = NULL;
+  prefix_length = pdf_stream_length(prefix);
+  pdf_release_obj(prefix);
+
+  hint = lin_hint_stream(p, &st, &lo, prefix_length);
+  hint_obj = lin_capture(p);
+  length = sprintf(buf, "%u 0 obj\n", first_label + 2);
+  pdf_out_str(p, buf, length);
+  pdf_write_obj(p, hint);
+  pdf_out_str(p, "\nendobj\n", 8);
+  p->output_stream = NULL;
+  pdf_release_obj(hint);
+
+  /* Positions in the final file */
+  lp.hint_offset = prefix_length + lo.offset[1];
+  lp.hint_length = pdf_stream_length(hint_obj);
+  for (i = 0; i < lo.num_order; i++) {
+    offsets[p->linear.labels[lo.order[i]]] = prefix_length + lo.offset[i] +
+                                             (i > 0 ? lp.hint_length : 0);
   }
+  offsets[first_label + 2] = lp.hint_offset;
+  lp.first_page_end = prefix_length + lp.hint_length +
+                      lo.offset[1 + lo.num_first];
+  main_xref = prefix_length + lp.hint_length + lo.offset[lo.num_order];
 
-  return pf;
+  tail = lin_capture(p);
+  lin_write_tail(p, offsets, first_label, xref_pos);
+  p->output_stream = NULL;
 
- error:
-  pdf_file_free(pf);
-  return NULL;
-}
+  lp.main_xref       = main_xref;
+  lp.main_xref_entry = main_xref + sprintf(buf, "xref\n0 %u", first_label);
+  lp.file_length     = main_xref + pdf_stream_length(tail);
 
-void
-pdf_close (pdf_file *pf)
-{
-  if (pf)
-    pf->file = NULL;
+  prefix = lin_capture(p);
+  lin_write_prefix(p, &st, &lp, offsets, first_label, size, &xref_pos);
+  p->output_stream = NULL;
+  ASSERT(pdf_stream_length(prefix) == prefix_length);
+
+  /* Now everything is put together */
+  p->output.file = MFOPEN(p->linear.filename, FOPEN_WBIN_MODE);
+  if (!p->output.file) {
+    if (strlen(p->linear.filename) < 128)
+      ERROR("Unable to open \"%s\".", p->linear.filename);
+    else
+      ERROR("Unable to open file.");
+  }
+  p->output.file_position = 0;
+  rewind(body);
+  pdf_out_str(p, pdf_stream_dataptr(prefix), pdf_stream_length(prefix));
+  lin_copy(p, body, lo.offset[1]);
+  pdf_out_str(p, pdf_stream_dataptr(hint_obj), pdf_stream_length(hint_obj));
+  lin_copy(p, body, lo.offset[lo.num_order] - lo.offset[1]);
+  pdf_out_str(p, pdf_stream_dataptr(tail), pdf_stream_length(tail));
+  pdf_out_flush_buffer(p);
+  MFCLOSE(p->output.file);
+  p->output.file = NULL;
+
+  if (dpx_conf.verbose_level > 0) {
+    MESG("\nLinearized: %u objects in the first-page section, %u shared\n",
+         lo.num_first, lo.num_shared);
+  }
+
+  pdf_release_obj(prefix);
+  pdf_release_obj(hint_obj);
+  pdf_release_obj(tail);
+  RELEASE(offsets);
+  RELEASE(lo.order);
+  RELEASE(lo.offset);
+  RELEASE(lo.page_start);
+  RELEASE(lo.page_nobjs);
+  RELEASE(st.objects);
+  RELEASE(st.stack);
+  if (st.refs.data)        RELEASE(st.refs.data);
+  if (st.parent_refs.data) RELEASE(st.parent_refs.data);
+  if (st.pages.data)       RELEASE(st.pages.data);
+
+  return 0;
 }
 
-void
-pdf_files_close (void)
+/* Rewrite the document written to the temporary file as linearized
+ * file. If that isn't possible, the document is copied as it is.
+ */
+static void
+pdf_out_linearize (pdf_out *p)
 {
-  ASSERT(pdf_files);
-  ht_clear_table(pdf_files);
-  RELEASE(pdf_files);
+  pdf_file *pf   = NULL;
+  FILE     *fp, *body = NULL;
+  char     *body_name;
+  size_t    length;
+  int       version, error = -1;
+
+  /* Merged objects have already been replaced in the temporary file */
+  if (p->dedup.table) {
+    RELEASE(p->dedup.table);
+    p->dedup.table = NULL;
+  }
+
+  fp = MFOPEN(p->linear.tmpname, FOPEN_RBIN_MODE);
+  if (!fp)
+    ERROR("Could not open temporary file \"%s\".", p->linear.tmpname);
+  body_name = dpx_create_temp_file();
+  if (body_name)
+    body = MFOPEN(body_name, FOPEN_WBIN_MODE "+");
+
+  version = check_for_pdf_version(fp);
+  pf = pdf_file_new(fp);
+  pf->version = version;
+  if (body && (pf->trailer = read_xref(pf)) != NULL) {
+    pf->catalog = pdf_deref_obj(pdf_lookup_dict(pf->trailer, "Root"));
+    error = lin_rearrange(p, pf, body);
+  }
+  pdf_file_free(pf);
+
+  if (error < 0) {
+    WARN("Could not linearize PDF output.");
+    p->output.file = MFOPEN(p->linear.filename, FOPEN_WBIN_MODE);
+    if (!p->output.file)
+      ERROR("Unable to open \"%s\".", p->linear.filename);
+    p->output.file_position = 0;
+    seek_end(fp);
+    length = tell_position(fp);
+    rewind(fp);
+    lin_copy(p, fp, length);
+    pdf_out_flush_buffer(p);
+    MFCLOSE(p->output.file);
+    p->output.file = NULL;
+  }
+
+  MFCLOSE(fp);
+  if (body)
+    MFCLOSE(body);
+  dpx_delete_temp_file(body_name, true);
+  dpx_delete_temp_file(p->linear.tmpname, true);
+  p->linear.tmpname = NULL;
 }
 
 static int
@@ -4556,7 +8229,8 @@ pdf_compare_object (pdf_obj *obj1, pdf_obj *obj2)
     }
     break;
   case PDF_NAME:
-    r = strcmp(pdf_name_value(obj1), pdf_name_value(obj2));
+    r = obj1->data == obj2->data ?
+          0 : strcmp(pdf_name_value(obj1), pdf_name_value(obj2));
     break;
   case PDF_NULL:
     /* Always same */
@@ -44,6 +44,10 @@ typedef struct pdf_out pdf_out;
 
 #define STREAM_COMPRESS (1 << 0)
 #define STREAM_USE_PREDICTOR   (1 << 1)
+/* Compress data as it is added. Used together with STREAM_COMPRESS.
+ * The stream data can only be appended to and not be read back.
+ */
+#define STREAM_COMPRESS_INCREMENTAL (1 << 2)
 
 /* A deeper object hierarchy will be considered as (illegal) loop. */
 #define PDF_OBJ_MAX_DEPTH  30
@@ -61,7 +65,11 @@ extern pdf_out *pdf_out_init (const char *filename,
                               int compression_level,
                               int enable_encrypt,
                               int enable_objstm,
-                              int enable_predictor);
+                              int enable_predictor,
+                              int num_threads,
+                              int enable_dedup,
+                              int enable_linearize);
+extern int      pdf_out_set_compression_policy (const char *spec);
 extern void     pdf_out_set_encrypt (int keybits, int32_t permission,
                                      const char *opasswd, const char *upasswd,
                                      int use_aes, int encrypt_metadata);
@@ -107,7 +115,10 @@ extern void      pdf_set_string    (pdf_obj *object, unsigned char *str, unsigne
 extern void     *pdf_string_value  (pdf_obj *object);
 extern unsigned  pdf_string_length (pdf_obj *object);
 
-/* Name does not include the / */
+/* Name does not include the /
+ * The string returned by pdf_name_value() is shared by all name objects
+ * with the same value and must not be modified.
+ */
 extern pdf_obj *pdf_new_name   (const char *name);
 extern char    *pdf_name_value (pdf_obj *object);
 
@@ -159,6 +170,7 @@ extern pdf_obj    *pdf_new_stream        (int flags);
 extern void        pdf_add_stream        (pdf_obj *stream,
                                           const void *stream_data_ptr,
                                           int stream_data_len);
+extern void        pdf_stream_reserve    (pdf_obj *stream, size_t length);
 
 extern int         pdf_concat_stream     (pdf_obj *dst, pdf_obj *src);
 extern pdf_obj    *pdf_stream_dict       (pdf_obj *stream);
@@ -193,12 +205,48 @@ extern pdf_obj  *pdf_file_get_trailer (pdf_file *pf);
 extern pdf_obj  *pdf_file_get_catalog (pdf_file *pf);
 extern int       pdf_file_get_version (pdf_file *pf);
 
+/* A page of an input PDF file and the attributes it inherits from the
+ * page tree, as found by pdf_doc_get_page(). These are kept together with
+ * the cross-reference table in a cache file if image caching is enabled.
+ */
+#define PDF_PAGE_MEDIABOX  0
+#define PDF_PAGE_CROPBOX   1
+#define PDF_PAGE_ARTBOX    2
+#define PDF_PAGE_TRIMBOX   3
+#define PDF_PAGE_BLEEDBOX  4
+#define PDF_PAGE_BOXES     5
+
+typedef struct
+{
+  uint32_t page_label;      /* page object */
+  uint16_t page_generation;
+  uint32_t res_label;       /* page tree node holding the /Resources */
+  uint16_t res_generation;
+  int      boxes;           /* bit (1 << PDF_PAGE_XXX) set if box present */
+  double   box[PDF_PAGE_BOXES][4];
+  int      has_rotate;
+  double   rotate;
+} pdf_page_info;
+
+extern int       pdf_file_get_page_info (pdf_file *pf, int page_no,
+                                         pdf_page_info *info);
+extern void      pdf_file_set_page_info (pdf_file *pf, int page_no,
+                                         const pdf_page_info *info);
+/* Number of pages once all of them have been recorded, see pdfdoc.c. */
+extern int       pdf_file_get_page_count (pdf_file *pf);
+extern void      pdf_file_set_page_count (pdf_file *pf, int count);
+
 extern pdf_obj *pdf_deref_obj     (pdf_obj *object);
 extern pdf_obj *pdf_import_object (pdf_obj *object);
 
 extern int      pdfobj_escape_str (char *buffer, int size, const unsigned char *s, int len);
 
 extern pdf_obj *pdf_new_indirect  (pdf_file *pf, uint32_t label, uint16_t generation);
+/* Object number of an indirect reference to an object of an input file.
+ * Returns -1 if REF is not such a reference.
+ */
+extern int      pdf_indirect_label (pdf_obj *ref,
+                                    uint32_t *label, uint16_t *generation);
 
 extern int pdf_check_version (int major, int minor);
 
@@ -470,6 +470,7 @@ create_pk_CharProc_stream (struct pk_header_ *pkh,
     len = sprintf (work_buffer, "BI\n/W %u\n/H %u\n/IM true\n/BPC 1\nID ", pkh->bm_wd, pkh->bm_ht);
     pdf_add_stream(stream, work_buffer, len);
     /* Add bitmap data */
+    pdf_stream_reserve(stream, ((pkh->bm_wd + 7) / 8) * pkh->bm_ht + 16);
     if (pkh->dyn_f == 14) /* bitmap */
               pk_decode_bitmap(stream,
                                pkh->bm_wd, pkh->bm_ht,
@@ -59,6 +59,9 @@
 #define PNG_NO_PROGRESSIVE_READ
 
 #include <png.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
 #include "pngimage.h"
 
 #include "pdfximage.h"
@@ -122,6 +125,10 @@ static pdf_obj *strip_soft_mask    (png_structp png_ptr, png_infop info_ptr,
 static void read_image_data (png_structp png_ptr,
                              png_bytep dest_ptr,
                              png_uint_32 height, png_uint_32 rowbytes);
+#ifdef HAVE_ZLIB
+/* Compressed image body */
+static png_bytep read_idat_data (FILE *png_file, size_t *length);
+#endif /* HAVE_ZLIB */
 
 int
 check_for_png (FILE *png_file)
@@ -149,7 +156,9 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
   pdf_obj  *stream_dict;
   pdf_obj  *colorspace, *mask, *intent;
   png_bytep stream_data_ptr;
+  size_t    stream_length = 0;
   int       trans_type;
+  int       copy_idat;
   ximage_info info;
   /* Libpng stuff */
   png_structp png_ptr;
@@ -188,12 +197,20 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
   height     = png_get_image_height(png_ptr, png_info_ptr);
   bpc        = png_get_bit_depth   (png_ptr, png_info_ptr);
 
+  /* The compressed image data can be copied as it is unless libpng has to
+   * transform the image. Interlaced images can not be described by the
+   * PNG predictors of PDF.
+   */
+  copy_idat  =
+    png_get_interlace_type(png_ptr, png_info_ptr) == PNG_INTERLACE_NONE;
+
   /* Ask libpng to convert down to 8-bpc. */
   if (bpc > 8) {
     if (pdf_check_version(1, 5) < 0) {
       WARN("%s: 16-bpc PNG requires PDF version 1.5.", PNG_DEBUG_STR);
     png_set_strip_16(png_ptr);
     bpc = 8;
+    copy_idat = 0;
   }
   }
   /* Ask libpng to gamma-correct.
@@ -207,9 +224,19 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
     double G = 1.0;
     png_get_gAMA (png_ptr, png_info_ptr, &G);
     png_set_gamma(png_ptr, 2.2, G);
+    copy_idat = 0;
   }
 
   trans_type = check_transparency(png_ptr, png_info_ptr);
+  /* Alpha channels are split off from the image data and transparency
+   * which can't be represented is composited with the background.
+   */
+  if (trans_type == PDF_TRANS_TYPE_ALPHA ||
+      (trans_type == PDF_TRANS_TYPE_NONE &&
+       png_get_valid(png_ptr, png_info_ptr, PNG_INFO_tRNS)))
+    copy_idat = 0;
+  if (color_type & PNG_COLOR_MASK_ALPHA)
+    copy_idat = 0;
   /* check_transparency() does not do updata_info() */
   png_read_update_info(png_ptr, png_info_ptr);
   rowbytes = png_get_rowbytes(png_ptr, png_info_ptr);
@@ -232,11 +259,33 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
       info.ydensity = 72.0 / 0.0254 / yppm;
   }
 
-  stream      = pdf_new_stream (STREAM_COMPRESS);
-  stream_dict = pdf_stream_dict(stream);
+  stream_data_ptr = NULL;
+#ifdef HAVE_ZLIB
+  if (copy_idat)
+    stream_data_ptr = read_idat_data(png_file, &stream_length);
+#endif /* HAVE_ZLIB */
+  if (stream_data_ptr) {
+    pdf_obj *parms;
+
+    stream      = pdf_new_stream(0);
+    stream_dict = pdf_stream_dict(stream);
+    pdf_add_dict(stream_dict,
+                 pdf_new_name("Filter"), pdf_new_name("FlateDecode"));
+    parms = pdf_new_dict();
+    pdf_add_dict(parms, pdf_new_name("Predictor"), pdf_new_number(15));
+    pdf_add_dict(parms, pdf_new_name("Colors"),
+                 pdf_new_number(png_get_channels(png_ptr, png_info_ptr)));
+    pdf_add_dict(parms, pdf_new_name("BitsPerComponent"), pdf_new_number(bpc));
+    pdf_add_dict(parms, pdf_new_name("Columns"), pdf_new_number(width));
+    pdf_add_dict(stream_dict, pdf_new_name("DecodeParms"), parms);
+  } else {
+    copy_idat   = 0;
+    stream      = pdf_new_stream (STREAM_COMPRESS);
+    stream_dict = pdf_stream_dict(stream);
 
-  stream_data_ptr = (png_bytep) NEW(rowbytes*height, png_byte);
-  read_image_data(png_ptr, stream_data_ptr, height, rowbytes);
+    stream_data_ptr = (png_bytep) NEW(rowbytes*height, png_byte);
+    read_image_data(png_ptr, stream_data_ptr, height, rowbytes);
+  }
 
   /* Non-NULL intent means there is valid sRGB chunk. */
   intent = get_rendering_intent(png_ptr, png_info_ptr);
@@ -326,7 +375,9 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
   }
   pdf_add_dict(stream_dict, pdf_new_name("ColorSpace"), colorspace);
 
-  pdf_add_stream(stream, stream_data_ptr, rowbytes*height);
+  if (!copy_idat)
+    stream_length = rowbytes*height;
+  pdf_add_stream(stream, stream_data_ptr, stream_length);
   RELEASE(stream_data_ptr);
 
   if (mask) {
@@ -393,14 +444,17 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
   }
 #endif /* PNG_LIBPNG_VER */
 
-  png_read_end(png_ptr, NULL);
+  /* The remaining chunks were checked by read_idat_data() already. */
+  if (!copy_idat)
+    png_read_end(png_ptr, NULL);
 
   /* Cleanup */
   if (png_info_ptr)
     png_destroy_info_struct(png_ptr, &png_info_ptr);
   if (png_ptr)
     png_destroy_read_struct(&png_ptr, NULL, NULL);
-  if (color_type != PNG_COLOR_TYPE_PALETTE &&
+  if (!copy_idat &&
+      color_type != PNG_COLOR_TYPE_PALETTE &&
       info.bits_per_component >= 8 &&
       info.height > 64) {
     pdf_stream_set_predictor(stream, 15, info.width,
@@ -1088,6 +1142,11 @@ read_image_data (png_structp png_ptr, png_bytep dest_ptr,
   png_bytepp  rows_p;
   png_uint_32 i;
 
+  /* libpng leaves the padding bits at the end of rows with less than
+   * 8 bits per pixel untouched. Clear them so that the output does not
+   * depend on the previous contents of the buffer.
+   */
+  memset(dest_ptr, 0, rowbytes * height);
   rows_p = (png_bytepp) NEW (height, png_bytep);
   for (i=0; i< height; i++)
     rows_p[i] = dest_ptr + (rowbytes * i);
@@ -1095,6 +1154,84 @@ read_image_data (png_structp png_ptr, png_bytep dest_ptr,
   RELEASE(rows_p);
 }
 
+#ifdef HAVE_ZLIB
+/* Collect the data of the IDAT chunks, a zlib stream of PNG predicted rows
+ * which can be used as it is for a FlateDecode stream with /Predictor 15.
+ * Returns NULL if the chunks are broken or if an iTXt chunk, possibly XMP
+ * Metadata, follows the image data. The file position is restored then so
+ * that the image can still be read by libpng.
+ */
+static png_bytep
+read_idat_data (FILE *png_file, size_t *length)
+{
+  png_bytep     data = NULL;
+  size_t        len = 0, max = 0;
+  long          pos;
+  unsigned char buf[8];
+  int           state = 0; /* 0: before, 1: in, 2: after IDAT chunks */
+  int           done  = 0;
+
+  pos = ftell(png_file);
+  if (fseek(png_file, 8, SEEK_SET) != 0)
+    return NULL;
+
+  while (!done && fread(buf, 1, 8, png_file) == 8) {
+    png_uint_32 chunk_len = png_get_uint_32(buf);
+
+    if (chunk_len > PNG_UINT_31_MAX)
+      break;
+    if (!memcmp(buf + 4, "IDAT", 4)) {
+      unsigned char crc[4];
+
+      if (state == 2)
+        break;
+      state = 1;
+      if (len + chunk_len > max) {
+        max  = len + chunk_len + max / 2;
+        data = RENEW(data, max, png_byte);
+      }
+      if (fread(data + len, 1, chunk_len, png_file) != chunk_len ||
+          fread(crc, 1, 4, png_file) != 4 ||
+          crc32(crc32(0, buf + 4, 4), data + len, chunk_len) !=
+            png_get_uint_32(crc))
+        break;
+      len += chunk_len;
+    } else {
+      if (state == 1)
+        state = 2;
+      if (!memcmp(buf + 4, "IEND", 4))
+        done = (state == 2);
+      else if ((state == 2 && !memcmp(buf + 4, "iTXt", 4)) ||
+               fseek(png_file, (long) chunk_len + 4, SEEK_CUR) != 0)
+        break;
+    }
+  }
+  /* zlib header without preset dictionary */
+  if (done &&
+      (len < 2 || (data[0] & 0x0f) != 8 || (data[1] & 0x20) ||
+       (data[0] * 256 + data[1]) % 31 != 0))
+    done = 0;
+  if (!done) {
+    if (data)
+      RELEASE(data);
+    fseek(png_file, pos, SEEK_SET);
+    return NULL;
+  }
+
+  /* Some encoders write a window size smaller than the one actually used,
+   * which libpng tolerates but PDF readers may not. Declare the largest.
+   */
+  if ((data[0] >> 4) < 7) {
+    data[0]  = 0x78;
+    data[1] &= 0xe0;
+    data[1] += (31 - (0x78 * 256 + data[1]) % 31) % 31;
+  }
+  *length = len;
+
+  return data;
+}
+#endif /* HAVE_ZLIB */
+
 int
 png_get_bbox (FILE *png_file, uint32_t *width, uint32_t *height,
 	       double *xdensity, double *ydensity)
@@ -785,13 +785,29 @@ print_error (const char *name, struct spc_env *spe, struct spc_arg *ap)
   }
 }
 
+/* Index into known_specials[] of the module taking the special, or -1.
+ * Callers keep the result so that spc_exec_special() does not have to
+ * ask every module again.
+ */
 int
-spc_exec_special (const char *buffer, int32_t size,
+spc_classify_special (const char *buffer, int32_t size)
+{
+  int  i;
+
+  for (i = 0; known_specials[i].key != NULL; i++) {
+    if (known_specials[i].check_func(buffer, size))
+      return i;
+  }
+
+  return -1;
+}
+
+int
+spc_exec_special (const char *buffer, int32_t size, int kind,
                   double x_user, double y_user, double mag,
                   int *is_drawable, pdf_rect *rect)
 {
   int    error = -1;
-  int    i, found;
   struct spc_env     spe;
   struct spc_arg     args;
   struct spc_handler special;
@@ -803,28 +819,24 @@ spc_exec_special (const char *buffer, int32_t size,
 
   init_special(&special, &spe, &args, buffer, size, x_user, y_user, mag);
 
-  for (i = 0; known_specials[i].key != NULL; i++) {
-    found = known_specials[i].check_func(buffer, size);
-    if (found) {
-      error = known_specials[i].setup_func(&special, &spe, &args);
-      if (!error) {
-        error = special.exec(&spe, &args);
-      }
-      if (error) {
-        print_error(known_specials[i].key, &spe, &args);
-      } else {
-        if (is_drawable)
-          *is_drawable = spe.info.is_drawable;
-        if (rect) {
-          rect->llx    = spe.info.rect.llx;
-          rect->lly    = spe.info.rect.lly;
-          rect->urx    = spe.info.rect.urx;
-          rect->ury    = spe.info.rect.ury;
-        }
+  if (kind >= 0) {
+    error = known_specials[kind].setup_func(&special, &spe, &args);
+    if (!error) {
+      error = special.exec(&spe, &args);
+    }
+    if (error) {
+      print_error(known_specials[kind].key, &spe, &args);
+    } else {
+      if (is_drawable)
+        *is_drawable = spe.info.is_drawable;
+      if (rect) {
+        rect->llx    = spe.info.rect.llx;
+        rect->lly    = spe.info.rect.lly;
+        rect->urx    = spe.info.rect.urx;
+        rect->ury    = spe.info.rect.ury;
       }
-      break;
     }
-  } 
+  }
 
   check_garbage(&args);
 
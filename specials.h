@@ -98,6 +98,7 @@ extern int      spc_exec_at_end_page       (void);
 extern int      spc_exec_at_begin_document (void);
 extern int      spc_exec_at_end_document   (void);
 
-extern int      spc_exec_special (const char *p, int32_t size, double x_user, double y_user, double mag, int *is_drawable, pdf_rect *rect);
+extern int      spc_classify_special (const char *p, int32_t size);
+extern int      spc_exec_special (const char *p, int32_t size, int kind, double x_user, double y_user, double mag, int *is_drawable, pdf_rect *rect);
 
 #endif /* _SPECIALS_H_ */
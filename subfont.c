@@ -441,6 +441,13 @@ sfd_load_record (const char *sfd_name, const char *subfont_id)
 }
 
 
+/* Non-zero if REC_ID can be passed to lookup_sfd_record(). */
+int
+sfd_has_record (int rec_id)
+{
+  return sfd_record && rec_id >= 0 && rec_id < num_sfd_records;
+}
+
 /* Lookup mapping table */
 unsigned short
 lookup_sfd_record (int rec_id, unsigned char c)
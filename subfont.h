@@ -24,6 +24,7 @@
 extern void   release_sfd_record  (void);
 
 extern unsigned short lookup_sfd_record(int rec_id, unsigned char code);
+extern int    sfd_has_record      (int rec_id);
 
 extern int    sfd_load_record     (const char *sfd_name, const char *subfont_id);
 extern char **sfd_get_subfont_ids (const char *sfd_name, int *num_subfonts);
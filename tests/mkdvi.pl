@@ -0,0 +1,80 @@
+#!/usr/bin/env perl
+# $Id$
+# You may freely use, modify and/or distribute this file.
+#
+# Write the DVI files pages.dvi, badchar.dvi and dedup.dvi used by
+# xdvipdfm-par.test and xdvipdfm-dup.test into the current directory.
+#
+# Each page uses cmr10 at 10pt.  Lines of text start 20pt from the left
+# edge; the first one is 200pt from the top and the others follow at
+# 140pt intervals.  Specials come before the first line of a page.
+
+use strict;
+use warnings;
+
+my $font = "cmr10";
+
+sub fnt_def {
+  return pack("CCNNNCC", 243, 0, 0, 655360, 655360, 0, length $font) . $font;
+}
+
+# Write file $name with the pages given as references to hashes with the
+# keys `specials' and `lines'.
+sub write_dvi {
+  my ($name, @pages) = @_;
+  my $dvi = pack("CCNNNC", 247, 2, 25400000, 473628672, 1000, 5) . "tests";
+  my $prev = -1;
+
+  for my $i (0 .. $#pages) {
+    my $bop = length $dvi;
+    $dvi .= pack("C", 139) . pack("N", $i + 1) . pack("N", 0) x 9
+      . pack("l>", $prev);
+    $dvi .= pack("Cl>", 160, 13107200) . fnt_def() . pack("C", 171);
+    $dvi .= pack("CN", 242, length $_) . $_
+      for @{$pages[$i]->{specials} || []};
+    for (@{$pages[$i]->{lines} || []}) {
+      $dvi .= pack("Cl>", 146, 1310720) . $_
+        . pack("Cl>", 160, 9175040) . pack("Cl>", 146, -1310720);
+    }
+    $dvi .= pack("C", 140);
+    $prev = $bop;
+  }
+
+  my $post = length $dvi;
+  $dvi .= pack("CNNNNNNnn", 248, $prev, 25400000, 473628672, 1000,
+               0, 0, 10, scalar @pages) . fnt_def();
+  $dvi .= pack("CNC", 249, $post, 2);
+  $dvi .= "\xdf" x (4 + (4 - length($dvi) % 4) % 4);
+
+  open(my $fh, ">", $name) or die "$name: $!\n";
+  binmode $fh;
+  print $fh $dvi;
+  close $fh;
+}
+
+# pages.dvi: 400 pages, more than the largest batch of pages interpreted
+# at once with -C 0x0200, and enough for intermediate page tree nodes.
+write_dvi("pages.dvi",
+          map { { lines => [ map { "Page text $_." } 0 .. 5 ] } } 1 .. 400);
+
+# badchar.dvi: the sixth page sets character 200, which cmr10 lacks.
+write_dvi("badchar.dvi",
+          map { { lines => [ $_ == 5 ? "\x80\xc8ge 5." : "Page $_." ] } }
+          0 .. 7);
+
+# dedup.dvi: pairs of identical objects and streams, which may be merged,
+# and of identical optional content groups, which must not be.
+my $data = join(" ", map { sprintf("(%03d)", $_) } 0 .. 199);
+write_dvi("dedup.dvi",
+          { specials => [ "pdf:obj \@d1 << /Foo [1 2 3] /Bar (same) >>",
+                          "pdf:obj \@d2 << /Foo [1 2 3] /Bar (same) >>",
+                          "pdf:stream \@s1 ($data)",
+                          "pdf:stream \@s2 ($data)",
+                          "pdf:obj \@oc1 << /Type /OCG /Name (Layer) >>",
+                          "pdf:obj \@oc2 << /Type /OCG /Name (Layer) >>",
+                          "pdf:put \@catalog << /OCProperties << "
+                          . "/OCGs [\@oc1 \@oc2] /D << /ON [\@oc1 \@oc2] "
+                          . "/Order [\@oc1 \@oc2] >> >> >>",
+                          "pdf:put \@catalog << /Dup [\@d1 \@d2 \@s1 \@s2] >>" ],
+            lines    => [ "Duplicated objects." ] },
+          { lines    => [ "Second page." ] });
@@ -972,6 +972,29 @@ tfm_close_all (void)
     ERROR("TFM: Invalid TFM ID: %d", (n));\
 } while (0)
 
+/* Non-zero if CH can be passed to tfm_get_fw_width() and friends
+ * without raising an error.
+ */
+int
+tfm_has_char (int font_id, int32_t ch)
+{
+  struct font_metric *fm;
+
+  CHECK_ID(font_id);
+
+  fm = &(fms[font_id]);
+  if (ch < fm->firstchar || ch > fm->lastchar)
+    return 0;
+  switch (fm->charmap.type) {
+  case MAPTYPE_CHAR:
+    return lookup_char(fm->charmap.data, ch) >= 0;
+  case MAPTYPE_RANGE:
+    return lookup_range(fm->charmap.data, ch) >= 0;
+  }
+
+  return 1;
+}
+
 fixword
 tfm_get_fw_width (int font_id, int32_t ch)
 {
@@ -34,6 +34,7 @@ extern double tfm_get_height (int font_id, int32_t ch);
 extern double tfm_get_depth  (int font_id, int32_t ch);
 #endif
 
+extern int     tfm_has_char      (int font_id, int32_t ch);
 extern fixword tfm_get_fw_width  (int font_id, int32_t ch);
 extern fixword tfm_get_fw_height (int font_id, int32_t ch);
 extern fixword tfm_get_fw_depth  (int font_id, int32_t ch);